@@ -1,97 +1,2663 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "assembler.h"
+#include "object.h"
+#include "diag.h"
 
 #include "tokenizer.c"
+#include "symtab.c"
 #include "parser.c"
 #include "encoder.c"
+#include "cycles.c"
+#include "optimizer.c"
+#include "lineindex.c"
+#include "filecache.c"
+#include "linemap.c"
 
 #define LINE_LEN_MAX 256
 #define LINE_ONE_BITS_DECLARATION "bits 16\n"
+#define OPT_WINDOW 32 // lines held back by -O while waiting to learn whether the flags are live
+#define MACRO_DEPTH_MAX 64 // nested expansions, stops a macro that invokes itself
+#define REPEAT_MAX 0x100000 // bytes a single times or %rep may emit, the whole 8086 address space
+#define INCLUDE_DEPTH_MAX 32 // nested %include, stops a file that includes itself
+#define ALIGN_MAX 0x10000 // the largest boundary for align
+#define BRANCH_ALIGN 0xFF // Branch.mnem of an align directive
 
-int assemble_file(const char *in_name, const char *out_name)
+typedef struct
 {
-    FILE *input = fopen(in_name, "r");
-    if (!input)
+    Instruction inst;
+    bool has_inst; // false for blank and comment-only lines, kept for the listing order
+    size_t lineno;
+    uint16_t file; // the window may still hold lines of an %include that has ended
+    char line[LINE_LEN_MAX];
+} PendingLine;
+
+// a symbol reference whose value was not known yet when its instruction was encoded
+typedef struct
+{
+    uint32_t offset; // of the value in the output buffer
+    uint32_t symbol_id;
+    uint32_t lineno;
+    int16_t addend; // the number written next to the symbol, e.g. the 4 in [bx + table + 4]
+    uint16_t file;  // in file_names, 0 for the main file
+    uint8_t size;   // 1 or 2 bytes
+} Fixup;
+
+// A relative branch: placed short at first, relax_branches grows it if its target is out of reach.
+// An align directive is kept in the same list (mnem BRANCH_ALIGN, target is the boundary, cond
+// the fill byte if near is set) since its padding also depends on the final addresses.
+typedef struct
+{
+    uint32_t offset;    // before relaxation, like every other address recorded during the pass
+    uint32_t symbol_id; // SYMBOL_NONE for a numeric target
+    uint32_t lineno;
+    int32_t target; // the numeric target address, or the addend written next to the symbol
+    uint16_t file;  // in file_names
+    uint8_t mnem;   // MnemonicType
+    uint8_t cond;
+    bool near;
+} Branch;
+
+// a message collected by --keep-going, sorted by file and line before it is printed
+typedef struct
+{
+    size_t start, len; // in error_text
+    uint32_t lineno;
+    uint16_t file;
+} Diagnostic;
+
+typedef struct
+{
+    size_t branches;  // relative branches, calls included
+    size_t grown;     // branches that ended up in their near form
+    size_t passes;    // relaxation passes, the last one changes nothing
+    long bytes_saved; // compared with encoding every branch near
+} RelaxStats;
+
+// the listing is written at the end, once every fixup has been patched into the bytes
+typedef struct
+{
+    size_t addr;
+    size_t size; // 0 for lines without an instruction
+    CycleCount cycles;
+    bool has_cycles; // false for the copies of a %rep block, listed on its %endrep line
+    size_t text; // offset of the NUL-terminated source line in listing_text
+} ListingLine;
+
+// a %macro, its body lines are lexed once at definition and replayed by expand_macro
+typedef struct
+{
+    uint32_t params;
+    uint32_t first_line; // in macro_lines
+    uint32_t line_count;
+    size_t lineno;
+} Macro;
+
+// a recorded line of a %macro or %rep body
+typedef struct
+{
+    uint32_t first_token; // in macro_tokens
+    uint32_t token_count;
+    size_t lineno;
+    size_t text; // offset of the NUL-terminated source line in macro_text, for the listing
+} MacroLine;
+
+// the %rep block being recorded, its lines go to the end of macro_lines
+typedef struct
+{
+    bool active;
+    int64_t count;
+    size_t first_line;
+    size_t depth; // nested %rep blocks, recorded as plain lines
+    size_t lineno;
+} RepBlock;
+
+// an open %if: its lines are assembled while the innermost block is COND_ACTIVE
+typedef enum
+{
+    COND_ACTIVE,  // in the branch that was taken
+    COND_SEEKING, // no branch taken yet, a later %elif or %else may be
+    COND_DONE     // a branch was taken already, or the whole block is inside a skipped one
+} CondState;
+
+typedef struct
+{
+    uint8_t state; // CondState
+    bool has_else;
+    size_t lineno;
+} CondBlock;
+
+// a file being read: the main file at the bottom, each %include pushes one
+typedef struct
+{
+    const CachedFile *file;
+    size_t lineno; // of the line read last, also the index of the next one in file->lines
+    uint32_t name; // in file_names
+    size_t conds;  // open %if blocks when the file was entered, its own must end inside it
+} SourceFrame;
+
+typedef struct
+{
+    size_t defined;
+    size_t expansions;
+    size_t lines;        // body lines replayed
+    clock_t replay_time; // building the replayed token arrays, only measured with --stats
+} MacroStats;
+
+typedef struct
+{
+    const AssembleOptions *opts;
+    FILE *output;
+    FILE *listing;
+    uint8_t *code; // the whole output, written with a single fwrite at the end
+    size_t code_cap;
+    size_t addr; // also the number of bytes in code, plus zero_tail
+    size_t zero_tail; // bytes of resb/resw at the end of the output, not written into code yet
+    size_t instructions;
+    unsigned long total_cycles;
+    SymbolTable symbols;
+    Fixup *fixups;
+    size_t fixup_count, fixup_cap;
+    Branch *branches;
+    size_t branch_count, branch_cap;
+    int32_t *growth; // growth[i]: bytes added by relaxing branches 0 .. i-1, aligns can take some back
+    RelaxStats relax;
+    ListingLine *listing_lines;
+    size_t listing_count, listing_cap;
+    char *listing_text;
+    size_t listing_text_len, listing_text_cap;
+    OptimizerStats opt_stats;
+    PendingLine window[OPT_WINDOW];
+    size_t window_count;
+    SymbolTable macro_names; // symbol value is the index in macros
+    Macro *macros;
+    size_t macro_count, macro_cap;
+    MacroLine *macro_lines;
+    size_t macro_line_count, macro_line_cap;
+    Token *macro_tokens; // the bodies, lexemes owned here
+    size_t macro_token_count, macro_token_cap;
+    char *macro_text;
+    size_t macro_text_len, macro_text_cap;
+    Macro *recording; // the macro whose body is being read, NULL outside %macro … %endmacro
+    RepBlock rep;
+    size_t definitions; // equ, %define and %macro lines so far, a %rep block with one is never copied
+    size_t macro_depth;
+    MacroStats macro_stats;
+    CondBlock *conds; // open %if blocks, innermost last
+    size_t cond_count, cond_cap;
+    size_t skipped_lines; // inside false %if branches
+    FileCache *cache; // opts->cache, or own_cache
+    FileCache own_cache;
+    SourceFrame *sources; // the %include chain, innermost last
+    size_t source_count, source_cap;
+    SymbolTable file_names; // as found by %include, the id is the file of Fixup and Branch
+    uint16_t file;          // of the line being assembled
+    size_t lines_read;      // from all files
+    size_t rep_depth;       // %rep blocks running
+    LineTable *lines;       // opts->lines, or own_lines for a line map
+    LineTable own_lines;
+    FILE *errors;           // --keep-going: DIAG while assembling, a memstream over error_text
+    char *error_text;
+    size_t error_text_len, error_mark; // error_mark: the end of the last recorded message
+    Diagnostic *diagnostics;
+    size_t diagnostic_count, diagnostic_cap;
+    ObjReloc *relocs; // -c: symbol is an id in symbols until write_object numbers them
+    size_t reloc_count, reloc_cap;
+    uint32_t max_align; // the largest align boundary so far
+} Assembler;
+
+static int assemble_tokens(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int define_label(Assembler *as, const Token *name, size_t lineno);
+static int define_macro(Assembler *as, const Token *tokens, size_t token_count, size_t lineno);
+static int record_macro_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int expand_macro(Assembler *as, const Macro *m, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int store_body_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int replay_line(Assembler *as, const MacroLine *ml, const Token *args, const size_t *arg_start, const size_t *arg_count, size_t expansion, Token **arr_out, size_t *count_out);
+static int replay_token(Assembler *as, const Token *src, Token **arr, size_t *count, size_t *cap);
+static int record_rep_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int run_rep(Assembler *as, const RepBlock *blk, const char *end_line);
+static int assemble_times(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line);
+static int emit_repeated(Assembler *as, Instruction *inst, size_t count, size_t lineno, const char *line);
+static int repeat_bytes(Assembler *as, size_t size, size_t count, size_t lineno);
+static int emit_data(Assembler *as, const Token *tokens, size_t token_count, size_t count, size_t lineno, const char *line);
+static int encode_data(Assembler *as, const Token *tokens, size_t token_count, size_t lineno);
+static int encode_data_value(Assembler *as, const Token *tokens, size_t token_count, size_t width, size_t lineno);
+static int assemble_data_text(Assembler *as, const char *line, size_t lineno, bool *handled);
+static inline int check_data_value(int64_t value, size_t width, size_t lineno);
+static inline size_t data_width(const char *s, size_t len);
+static inline size_t name_length(const char *s);
+static int fill_reserved(Assembler *as);
+static int repeat_reserved(Assembler *as, size_t size, size_t count, size_t lineno);
+static void free_macros(Assembler *as);
+static int assemble_directive(Assembler *as, Token *tokens, size_t token_count, size_t lineno);
+static int assemble_condition(Assembler *as, const Token *tokens, size_t token_count, size_t lineno);
+static inline bool is_condition_directive(const char *dir);
+static inline bool is_condition_line(const char *line);
+static inline bool skipping(const Assembler *as);
+static int define_constant(SymbolTable *symbols, const Token *tokens, size_t token_count, size_t lineno);
+static int include_file(Assembler *as, const Token *tokens, size_t token_count, size_t lineno);
+static int push_source(Assembler *as, const CachedFile *file, const char *name, size_t lineno);
+static int record_missing(Assembler *as, const char *path);
+static int read_line(Assembler *as, char *line, size_t *lineno_out, bool *got_line);
+static void print_include_chain(const Assembler *as);
+static int record_error(Assembler *as, size_t lineno, uint16_t file);
+static void report_errors(Assembler *as, FILE *out);
+static int compare_diagnostics(const void *a, const void *b);
+static void print_file_note(const Assembler *as, uint16_t file);
+static int write_zero_tail(FILE *output, size_t size, size_t tail);
+static inline bool is_directive_line(const Token *tokens, size_t token_count);
+static inline bool is_name_token(const Token *tok);
+static int emit_line(Assembler *as, Instruction *inst, size_t lineno, const char *line);
+static int record_span(Assembler *as, size_t addr, size_t size, size_t lineno, bool patchable);
+static int emit_branch(Assembler *as, const Instruction *inst, size_t lineno);
+static int emit_align(Assembler *as, const Token *tokens, size_t token_count, size_t lineno, const char *line);
+static inline size_t placed_size(const Branch *b);
+static inline size_t final_size(const Branch *b, size_t addr);
+static int reference_symbols(Assembler *as, const Instruction *inst, size_t out_size, size_t lineno);
+static int relax_branches(Assembler *as);
+static int assemble(const char *in_name, const char *out_name, const AssembleOptions *opts);
+static int branch_target(const Assembler *as, const Branch *b, int32_t *target_out);
+static inline size_t final_address(const Assembler *as, size_t addr);
+static int layout_output(Assembler *as);
+static int patch_fixup(Assembler *as, const Fixup *f);
+static inline bool is_external(const Assembler *as, uint32_t id);
+static int add_relocation(Assembler *as, uint32_t offset, uint32_t symbol_id, int32_t addend, ObjRelocType type);
+static int declare_symbols(Assembler *as, const Token *tokens, size_t token_count, size_t lineno);
+static int write_object(Assembler *as, FILE *output, const char *out_name, size_t tail);
+static inline bool write_part(const void *data, size_t size, size_t count, FILE *output);
+static int record_listing_line(Assembler *as, size_t size, const CycleCount *cycles, const char *line);
+static int queue_line(Assembler *as, Instruction *inst, size_t lineno, const char *line);
+static int flush_window(Assembler *as, bool flags_live);
+static inline bool writes_all_flags(const Instruction *inst);
+static inline bool leaves_flags(const Instruction *inst);
+static void write_listing_line(FILE *listing, size_t addr, const uint8_t *bytes, size_t size, const CycleCount *cycles, const char *line);
+static int reserve(void **buf, size_t *cap, size_t need, size_t elem_size);
+
+int assemble_file(const char *in_name, const char *out_name, const AssembleOptions *opts)
+{
+    static const AssembleOptions default_opts = {0};
+    if (!opts)
+        opts = &default_opts;
+
+    // the tokenizer and parser report through DIAG, which follows this thread's diag_stream
+    FILE *saved = diag_stream;
+    if (opts->diag)
+        diag_stream = opts->diag;
+    int status = assemble(in_name, out_name, opts);
+    diag_stream = saved;
+    return status;
+}
+
+void filelist_free(FileList *files)
+{
+    for (size_t i = 0; i < files->missing_count; i++)
+        free(files->missing[i]);
+    free(files->missing);
+    free(files->files);
+    *files = (FileList){0};
+}
+
+static int assemble(const char *in_name, const char *out_name, const AssembleOptions *opts)
+{
+    // the -O window makes this too big for the stack
+    Assembler *as = calloc(1, sizeof *as);
+    if (!as)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (assemble_file)\n");
+        return 1;
+    }
+    as->opts = opts;
+    as->cache = opts->cache ? opts->cache : &as->own_cache;
+    if ((!opts->cache && filecache_init(&as->own_cache) != 0) || symtab_init(&as->file_names) != 0)
+    {
+        if (!opts->cache)
+            filecache_free(&as->own_cache);
+        free(as);
+        return 1;
+    }
+
+    // the main file is read through the cache like every %include, unless the caller has its text
+    const CachedFile *input = NULL;
+    CachedFile source = {.path = (char *)in_name, .data = opts->source, .size = opts->source_len};
+    if (opts->source)
+        input = &source;
+    else if (filecache_open(as->cache, in_name, &input) != 0)
     {
-        fprintf(stderr, "Error with input file '%s': %s\n", in_name, strerror(errno));
+        fprintf(DIAG, "Error with input file '%s': %s\n", in_name, strerror(errno));
+        if (!opts->cache)
+            filecache_free(&as->own_cache);
+        symtab_free(&as->file_names);
+        free(as);
         return 1;
     }
 
-    FILE *output = fopen(out_name, "wb");
+    FILE *output = opts->output ? opts->output : fopen(out_name, "wb");
     if (!output)
     {
-        fprintf(stderr, "Error with output file '%s': %s\n", out_name, strerror(errno));
-        fclose(input);
+        fprintf(DIAG, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        if (!opts->cache)
+            filecache_free(&as->own_cache);
+        symtab_free(&as->file_names);
+        free(as);
         return 1;
     }
 
+    FILE *listing = NULL;
+    if (opts->listing_name)
+    {
+        listing = fopen(opts->listing_name, "w");
+        if (!listing)
+        {
+            fprintf(DIAG, "Error with listing file '%s': %s\n", opts->listing_name, strerror(errno));
+            if (!opts->output)
+                fclose(output);
+            if (!opts->cache)
+                filecache_free(&as->own_cache);
+            symtab_free(&as->file_names);
+            free(as);
+            return 1;
+        }
+    }
+
+    FILE *linemap = NULL;
+    if (opts->linemap_name)
+    {
+        linemap = fopen(opts->linemap_name, "wb");
+        if (!linemap)
+        {
+            fprintf(DIAG, "Error with line map file '%s': %s\n", opts->linemap_name, strerror(errno));
+            if (listing)
+                fclose(listing);
+            if (!opts->output)
+                fclose(output);
+            if (!opts->cache)
+                filecache_free(&as->own_cache);
+            symtab_free(&as->file_names);
+            free(as);
+            return 1;
+        }
+    }
+
+    as->output = output;
+    as->listing = listing;
+    as->lines = opts->lines ? opts->lines : linemap ? &as->own_lines : NULL;
+    if (opts->files)
+    {
+        for (size_t i = 0; i < opts->files->missing_count; i++)
+            free(opts->files->missing[i]);
+        opts->files->count = 0;
+        opts->files->missing_count = 0;
+    }
+    if (as->lines)
+        as->lines->count = 0;
+    int status = 1;
+
+    // --keep-going: every message goes to a buffer, and out the caller's stream once sorted
+    FILE *report = DIAG;
+    if (opts->keep_going)
+    {
+        as->errors = open_memstream(&as->error_text, &as->error_text_len);
+        if (!as->errors)
+        {
+            fprintf(DIAG, "Error: memory allocation failed (assemble_file)\n");
+            goto done;
+        }
+        diag_stream = as->errors;
+    }
+
+    if (opts->source && index_lines(source.data, source.size, &source.lines, &source.line_count) != 0)
+    {
+        fprintf(DIAG, "Error with input file '%s': %s\n", in_name, strerror(errno));
+        goto done;
+    }
+    if (symtab_init(&as->symbols) != 0 || symtab_init(&as->macro_names) != 0 || push_source(as, input, in_name, 0) != 0)
+        goto done;
+
     char line[LINE_LEN_MAX];
     size_t lineno = 0;
-    while (fgets(line, sizeof(line), input))
+    while (true)
     {
-        lineno++;
+        bool got_line = false;
+        if (read_line(as, line, &lineno, &got_line) != 0)
+            goto done;
+        if (!got_line)
+            break;
 
-        if (lineno == 1)
+        if (lineno == 1 && as->source_count == 1)
         {
             if (strlen(line) != strlen(LINE_ONE_BITS_DECLARATION) || strcmp(line, LINE_ONE_BITS_DECLARATION) != 0)
             {
-                fprintf(stderr, "Error: expected declaration 'bits 16' on line 1\n");
-                fclose(input);
-                fclose(output);
-                return 1;
+                fprintf(DIAG, "Error: expected declaration 'bits 16' on line 1\n");
+                goto done;
             }
+            if (listing && record_listing_line(as, 0, NULL, line) != 0)
+                goto done;
             continue;
         }
 
-        if (!strchr(line, '\n') && !feof(input))
+        // inactive lines are only scanned for the %if/%elif/%else/%endif that may end them
+        if (!as->recording && !as->rep.active && skipping(as) && !is_condition_line(line))
         {
-            fprintf(stderr, "Error: line %zu too long (max %d characters)\n", lineno, LINE_LEN_MAX - 2);
-            fclose(input);
-            fclose(output);
-            return 1;
+            as->skipped_lines++;
+            if (as->listing && queue_line(as, NULL, lineno, line) != 0)
+                goto done;
+            continue;
+        }
+
+        // with --keep-going a line that fails is left out and the next one is read
+        if (!as->recording && !as->rep.active)
+        {
+            // the common instruction shapes need neither the tokenizer nor parse_tokens
+            Instruction inst;
+            if (parse_canonical(line, &inst))
+            {
+                if (queue_line(as, &inst, lineno, line) != 0 && (!as->errors || record_error(as, lineno, as->file) != 0))
+                    goto done;
+                continue;
+            }
+
+            bool handled = false;
+            if (assemble_data_text(as, line, lineno, &handled) != 0)
+            {
+                if (!as->errors || record_error(as, lineno, as->file) != 0)
+                    goto done;
+                continue;
+            }
+            if (handled)
+                continue;
         }
 
+        // macro bodies are kept as written, constants are substituted when they are replayed
         Token *tokens = NULL;
         size_t token_count = 0;
-        int result = tokenize_line(line, lineno, &tokens, &token_count);
-        if (result != 0)
+        if (tokenize_line(line, lineno, (as->recording || as->rep.active) ? NULL : &as->symbols, &tokens, &token_count) != 0 ||
+            assemble_tokens(as, tokens, token_count, lineno, line) != 0)
         {
-            fclose(input);
-            fclose(output);
-            return 1;
+            if (!as->errors || record_error(as, lineno, as->file) != 0)
+                goto done;
         }
-        if (token_count == 0)
+    }
+
+    if (as->recording)
+    {
+        fprintf(DIAG, "Error on line %zu: '%%macro' without '%%endmacro'\n", as->recording->lineno);
+        goto done;
+    }
+    if (as->rep.active)
+    {
+        fprintf(DIAG, "Error on line %zu: '%%rep' without '%%endrep'\n", as->rep.lineno);
+        goto done;
+    }
+
+    if (flush_window(as, true) != 0)
+        goto done;
+
+    // resb/resw at the very end never reach the buffer, the file is extended over them instead
+    size_t tail = as->zero_tail;
+    as->addr -= tail;
+
+    // relax_branches and the fixups stop at the first undefined symbol, --keep-going wants them all
+    for (size_t i = 0; as->errors && i < as->branch_count; i++)
+    {
+        const Branch *b = &as->branches[i];
+        if (b->mnem == BRANCH_ALIGN || b->symbol_id == SYMBOL_NONE || as->symbols.symbols[b->symbol_id].kind != SYM_UNDEFINED ||
+            is_external(as, b->symbol_id))
             continue;
+        fprintf(DIAG, "Error on line %u: undefined symbol '%s'\n", b->lineno, as->symbols.symbols[b->symbol_id].name);
+        print_file_note(as, b->file);
+        if (record_error(as, b->lineno, b->file) != 0)
+            goto done;
+    }
+    for (size_t i = 0; as->errors && i < as->fixup_count; i++)
+    {
+        // patch_fixup checks this before it writes anything
+        const Fixup *f = &as->fixups[i];
+        if (as->symbols.symbols[f->symbol_id].kind == SYM_UNDEFINED && !is_external(as, f->symbol_id) &&
+            patch_fixup(as, f) != 0 && record_error(as, f->lineno, f->file) != 0)
+            goto done;
+    }
+    // the lines that failed left holes, the output would be wrong
+    if (as->diagnostic_count > 0)
+        goto done;
+
+    // label addresses are only final once the branches have their sizes
+    if (relax_branches(as) != 0 || layout_output(as) != 0)
+        goto done;
+
+    for (size_t i = 0; i < as->fixup_count; i++)
+    {
+        const Fixup *f = &as->fixups[i];
+        if (patch_fixup(as, f) != 0 && (!as->errors || record_error(as, f->lineno, f->file) != 0))
+            goto done;
+    }
+    if (as->diagnostic_count > 0)
+        goto done;
+
+    for (size_t i = 0; as->lines && i < as->lines->count; i++)
+    {
+        LineSpan *s = &as->lines->spans[i];
+        size_t addr = final_address(as, s->addr);
+        s->size = (uint32_t)(final_address(as, (size_t)s->addr + s->size) - addr);
+        s->addr = (uint32_t)addr;
+    }
+
+    if (opts->object)
+    {
+        if (write_object(as, output, out_name, tail) != 0)
+            goto done;
+    }
+    else if (as->addr && fwrite(as->code, 1, as->addr, output) != as->addr)
+    {
+        fprintf(DIAG, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        goto done;
+    }
+    else if (tail > 0 && write_zero_tail(output, as->addr, tail) != 0)
+    {
+        fprintf(DIAG, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        goto done;
+    }
+
+    if (listing)
+    {
+        for (size_t i = 0; i < as->listing_count; i++)
+        {
+            const ListingLine *l = &as->listing_lines[i];
+            size_t addr = final_address(as, l->addr);
+            size_t size = final_address(as, l->addr + l->size) - addr;
+            write_listing_line(listing, addr, as->code + addr, size, l->has_cycles ? &l->cycles : NULL, as->listing_text + l->text);
+        }
+        fprintf(listing, "\n; %zu lines, %zu instructions, %zu bytes, %lu cycles\n", as->lines_read, as->instructions, as->addr + tail, as->total_cycles);
+    }
+
+    if (linemap)
+    {
+        // encoded in one buffer of the exact size and written at once
+        uint8_t *map = NULL;
+        size_t map_len = 0;
+        bool failed = linemap_encode(as->lines->spans, as->lines->count, &as->file_names, &map, &map_len) != 0 ||
+                      fwrite(map, 1, map_len, linemap) != map_len || fflush(linemap) != 0;
+        free(map);
+        if (failed)
+        {
+            fprintf(DIAG, "Error with line map file '%s': %s\n", opts->linemap_name, strerror(errno));
+            goto done;
+        }
+    }
+
+    if (opts->stats)
+    {
+        printf("branches: %zu, %zu relaxed to near in %zu passes, %ld bytes saved over always-near\n",
+               as->relax.branches, as->relax.grown, as->relax.passes, as->relax.bytes_saved);
+        printf("macros: %zu defined, %zu expansions, %zu lines replayed in %.3f ms\n",
+               as->macro_stats.defined, as->macro_stats.expansions, as->macro_stats.lines,
+               as->macro_stats.replay_time * 1000.0 / CLOCKS_PER_SEC);
+        printf("conditionals: %zu lines skipped\n", as->skipped_lines);
+        printf("files: %zu mapped, %zu cache hits\n", as->cache->misses, as->cache->hits);
+    }
+
+    // a caller that takes the result may be one of several assemblies sharing stdout
+    if (opts->optimize && !opts->result)
+        printf("optimizer: %zu rewritten, %zu removed, %ld bytes and %ld cycles saved\n",
+               as->opt_stats.rewrites, as->opt_stats.removed, as->opt_stats.bytes_saved, as->opt_stats.cycles_saved);
+    if (opts->result)
+        *opts->result = (AssembleResult){.lines = as->lines_read, .bytes = as->addr + tail, .opt = as->opt_stats};
+    status = 0;
+
+done:
+    if (status != 0)
+        print_include_chain(as);
+    if (as->errors)
+    {
+        report_errors(as, report);
+        fclose(as->errors);
+        free(as->error_text);
+        free(as->diagnostics);
+    }
+    free(source.lines);
+    symtab_free(&as->symbols);
+    free_macros(as);
+    free(as->conds);
+    free(as->sources);
+    symtab_free(&as->file_names);
+    if (!opts->cache)
+        filecache_free(&as->own_cache);
+    free(as->code);
+    free(as->fixups);
+    free(as->branches);
+    free(as->growth);
+    free(as->listing_lines);
+    free(as->listing_text);
+    free(as->own_lines.spans);
+    free(as->relocs);
+    free(as);
+    if (!opts->output)
+        fclose(output);
+    if (listing)
+        fclose(listing);
+    if (linemap)
+        fclose(linemap);
+    return status;
+}
+
+// Assembles one tokenized line and takes ownership of the tokens: a label, a directive, a macro
+// invocation or an instruction. Macro expansions come back here for every replayed line.
+static int assemble_tokens(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    if (as->recording)
+        return record_macro_line(as, tokens, token_count, lineno, line);
+    if (as->rep.active)
+        return record_rep_line(as, tokens, token_count, lineno, line);
+
+    if (token_count > 0 && tokens[0].type == T_DIRECTIVE && is_condition_directive(tokens[0].lexeme))
+    {
+        int result = assemble_condition(as, tokens, token_count, lineno);
+        free_tokens(tokens, token_count);
+        if (result != 0)
+            return 1;
+        return queue_line(as, NULL, lineno, line);
+    }
+    // replayed macro lines get here without the scan in assemble_file
+    if (skipping(as))
+    {
+        free_tokens(tokens, token_count);
+        as->skipped_lines++;
+        return as->listing ? queue_line(as, NULL, lineno, line) : 0;
+    }
 
-        Instruction inst;
-        result = parse_tokens(tokens, token_count, lineno, &inst);
+    // "name:" at the start of the line defines a label, an instruction may follow it
+    if (token_count >= 2 && is_name_token(&tokens[0]) && tokens[1].type == T_COLON)
+    {
+        int result = define_label(as, &tokens[0], lineno);
+        free(tokens[0].lexeme);
+        free(tokens[1].lexeme);
+        token_count -= 2;
+        memmove(tokens, tokens + 2, token_count * sizeof *tokens);
         if (result != 0)
         {
-            fclose(input);
-            fclose(output);
+            free_tokens(tokens, token_count);
             return 1;
         }
-        // note: parse_tokens frees the tokens on both success and failure,
-        // so I nullify the pointer here to avoid confusion or accidental reuse
-        tokens = NULL;
+    }
 
-        uint8_t buffer[6]; // max instruction size for 8086 is 6 bytes
-        size_t out_size = 0;
-        result = encode_instruction(&inst, buffer, &out_size, lineno);
+    if (token_count == 0)
+    {
+        free(tokens);
+        return queue_line(as, NULL, lineno, line);
+    }
+
+    if (tokens[0].type == T_DIRECTIVE && strcmp(tokens[0].lexeme, "times") == 0)
+        return assemble_times(as, tokens, token_count, lineno, line);
+
+    if (tokens[0].type == T_DIRECTIVE && strcmp(tokens[0].lexeme, "align") == 0)
+    {
+        int result = emit_align(as, tokens, token_count, lineno, line);
+        free_tokens(tokens, token_count);
+        return result;
+    }
+
+    // "db 1, 2" or "name db 1, 2", the name is a label even without a colon
+    size_t d = (token_count > 1 && tokens[0].type != T_DIRECTIVE) ? 1 : 0;
+    if (tokens[d].type == T_DIRECTIVE && data_width(tokens[d].lexeme, strlen(tokens[d].lexeme)) > 0)
+    {
+        int result = 1;
+        if (d == 1 && !is_name_token(&tokens[0]))
+            fprintf(DIAG, "Error on line %zu: '%s' cannot come before '%s'\n", lineno, tokens[0].lexeme, tokens[1].lexeme);
+        else if (d == 0 || define_label(as, &tokens[0], lineno) == 0)
+            result = emit_data(as, tokens + d, token_count - d, 1, lineno, line);
+        free_tokens(tokens, token_count);
+        return result;
+    }
+
+    if (is_directive_line(tokens, token_count))
+    {
+        int result = assemble_directive(as, tokens, token_count, lineno);
+        free_tokens(tokens, token_count);
         if (result != 0)
+            return 1;
+        return queue_line(as, NULL, lineno, line);
+    }
+
+    if (tokens[0].type == T_IDENT && as->macro_count > 0)
+    {
+        uint32_t id = symtab_find(&as->macro_names, tokens[0].lexeme, strlen(tokens[0].lexeme));
+        if (id != SYMBOL_NONE)
+            return expand_macro(as, &as->macros[as->macro_names.symbols[id].value], tokens, token_count, lineno, line);
+    }
+
+    Instruction inst;
+    // parse_tokens frees the tokens on both success and failure
+    if (parse_tokens(tokens, token_count, lineno, &as->symbols, &inst) != 0)
+        return 1;
+    return queue_line(as, &inst, lineno, line);
+}
+
+static int define_label(Assembler *as, const Token *name, size_t lineno)
+{
+    // lines held back by -O come before the label, and a jump to it may read any flag
+    if (flush_window(as, true) != 0)
+        return 1;
+
+    uint32_t id;
+    if (symtab_intern(&as->symbols, name->lexeme, strlen(name->lexeme), lineno, &id) != 0)
+        return 1;
+
+    Symbol *sym = &as->symbols.symbols[id];
+    if (sym->kind != SYM_UNDEFINED)
+    {
+        fprintf(DIAG, "Error on line %zu: label '%s' already defined on line %zu\n", lineno, sym->name, sym->lineno);
+        return 1;
+    }
+    if (sym->flags & SYMBOL_EXTERN)
+    {
+        fprintf(DIAG, "Error on line %zu: label '%s' is declared extern on line %zu\n", lineno, sym->name, sym->lineno);
+        return 1;
+    }
+    sym->kind = SYM_LABEL;
+    sym->value = (int32_t)as->addr;
+    sym->lineno = lineno;
+    return 0;
+}
+
+static int assemble_directive(Assembler *as, Token *tokens, size_t token_count, size_t lineno)
+{
+    const Token *dir = (tokens[0].type == T_DIRECTIVE) ? &tokens[0] : &tokens[1];
+    as->definitions++;
+    if (strcmp(dir->lexeme, "equ") == 0 || strcmp(dir->lexeme, "%define") == 0)
+        return define_constant(&as->symbols, tokens, token_count, lineno);
+    if (strcmp(dir->lexeme, "%macro") == 0 && dir == &tokens[0])
+        return define_macro(as, tokens, token_count, lineno);
+    as->definitions--;
+
+    if (strcmp(dir->lexeme, "%rep") == 0 && dir == &tokens[0])
+    {
+        // the block runs when its %endrep is read
+        int64_t count = 0;
+        if (eval_tokens(tokens + 1, token_count - 1, lineno, &count) != 0)
+            return 1;
+        if (count < 0)
+        {
+            fprintf(DIAG, "Error on line %zu: '%%rep' count must not be negative\n", lineno);
+            return 1;
+        }
+        as->rep = (RepBlock){.active = true, .count = count, .first_line = as->macro_line_count, .lineno = lineno};
+        return 0;
+    }
+    if (strcmp(dir->lexeme, "%include") == 0 && dir == &tokens[0])
+        return include_file(as, tokens, token_count, lineno);
+    if ((strcmp(dir->lexeme, "global") == 0 || strcmp(dir->lexeme, "extern") == 0) && dir == &tokens[0])
+        return declare_symbols(as, tokens, token_count, lineno);
+    if (strcmp(dir->lexeme, "%endmacro") == 0 || strcmp(dir->lexeme, "%endrep") == 0)
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' without '%s'\n", lineno, dir->lexeme, dir->lexeme[4] == 'm' ? "%macro" : "%rep");
+        return 1;
+    }
+
+    fprintf(DIAG, "Error on line %zu: unknown directive '%s'\n", lineno, dir->lexeme);
+    return 1;
+}
+
+// "global a, b" or "extern a, b". They only matter to an object (-c): global labels go into its
+// symbol table, an extern name may stay undefined for the linker to resolve.
+static int declare_symbols(Assembler *as, const Token *tokens, size_t token_count, size_t lineno)
+{
+    bool global = tokens[0].lexeme[0] == 'g';
+    if (token_count < 2 || token_count % 2 != 0)
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' expects names separated by ','\n", lineno, tokens[0].lexeme);
+        return 1;
+    }
+
+    for (size_t i = 1; i < token_count; i += 2)
+    {
+        if (!is_name_token(&tokens[i]) || (i + 1 < token_count && tokens[i + 1].type != T_COMMA))
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' expects names separated by ','\n", lineno, tokens[0].lexeme);
+            return 1;
+        }
+
+        uint32_t id;
+        if (symtab_intern(&as->symbols, tokens[i].lexeme, strlen(tokens[i].lexeme), lineno, &id) != 0)
+            return 1;
+        Symbol *sym = &as->symbols.symbols[id];
+        if (!global && sym->kind != SYM_UNDEFINED)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' is defined on line %zu and cannot be extern\n", lineno, sym->name, sym->lineno);
+            return 1;
+        }
+        sym->flags |= global ? SYMBOL_GLOBAL : SYMBOL_EXTERN;
+        if ((sym->flags & SYMBOL_GLOBAL) && (sym->flags & SYMBOL_EXTERN))
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' cannot be both global and extern\n", lineno, sym->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// %if expr, %ifdef/%ifndef name, %elif expr, %else and %endif. Inside a skipped block the
+// conditions are not evaluated, a nested %if only has to find its %endif.
+static int assemble_condition(Assembler *as, const Token *tokens, size_t token_count, size_t lineno)
+{
+    const char *dir = tokens[0].lexeme;
+    // the blocks an including file opened are not this file's to close
+    size_t own = as->sources[as->source_count - 1].conds;
+    CondBlock *top = as->cond_count > own ? &as->conds[as->cond_count - 1] : NULL;
+    bool opens = strncmp(dir, "%if", 3) == 0;
+    if (!opens && !top)
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' without '%%if'\n", lineno, dir);
+        return 1;
+    }
+    if (strcmp(dir, "%endif") == 0 || strcmp(dir, "%else") == 0)
+    {
+        if (token_count > 1)
         {
-            fclose(input);
-            fclose(output);
+            fprintf(DIAG, "Error on line %zu: unexpected '%s' after '%s'\n", lineno, tokens[1].lexeme, dir);
             return 1;
         }
+        if (dir[2] == 'n')
+        {
+            as->cond_count--;
+            return 0;
+        }
+    }
+    if (!opens && top->has_else)
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' after '%%else' (line %zu opened the block)\n", lineno, dir, top->lineno);
+        return 1;
+    }
+
+    // the condition only matters if no branch of this block has been taken yet
+    bool evaluate = opens ? !skipping(as) : top->state == COND_SEEKING;
+    bool value = false, failed = false;
+    if (evaluate && (strcmp(dir, "%ifdef") == 0 || strcmp(dir, "%ifndef") == 0))
+    {
+        if (token_count != 2 || !is_name_token(&tokens[1]))
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' must be followed by a single name\n", lineno, dir);
+            failed = true;
+        }
+        // the tokenizer already replaced the name if it is a constant
+        value = !failed && (tokens[1].type == T_NUMBER) == (dir[3] == 'd');
+    }
+    else if (evaluate && strcmp(dir, "%else") == 0)
+        value = true;
+    else if (evaluate)
+    {
+        int64_t v = 0;
+        failed = eval_tokens(tokens + 1, token_count - 1, lineno, &v) != 0;
+        value = v != 0;
+    }
+
+    // a condition that fails skips the rest of its block, so --keep-going still pairs its
+    // %else and %endif and assembles neither branch
+    CondState state = failed ? COND_DONE : value ? COND_ACTIVE : evaluate ? COND_SEEKING : COND_DONE;
+    if (opens)
+    {
+        if (reserve((void **)&as->conds, &as->cond_cap, as->cond_count + 1, sizeof *as->conds) != 0)
+            return 1;
+        as->conds[as->cond_count++] = (CondBlock){.state = (uint8_t)state, .lineno = lineno};
+        return failed ? 1 : 0;
+    }
+    top->state = (uint8_t)(top->state == COND_ACTIVE ? COND_DONE : state);
+    top->has_else = dir[3] == 's';
+    return failed ? 1 : 0;
+}
 
-        fwrite(buffer, 1, out_size, output);
+static inline bool is_condition_directive(const char *dir)
+{
+    return strcmp(dir, "%if") == 0 || strcmp(dir, "%ifdef") == 0 || strcmp(dir, "%ifndef") == 0 ||
+           strcmp(dir, "%elif") == 0 || strcmp(dir, "%else") == 0 || strcmp(dir, "%endif") == 0;
+}
+
+// The scan of skipped lines: only a line starting with %if, %el or %endif is tokenized,
+// anything else is dropped after looking at its first character.
+static inline bool is_condition_line(const char *line)
+{
+    const char *p = line + strspn(line, " \t");
+    if (*p != '%')
+        return false;
+    char c1 = (char)tolower((unsigned char)p[1]), c2 = (char)tolower((unsigned char)p[2]);
+    return (c1 == 'i' && c2 == 'f') || (c1 == 'e' && (c2 == 'l' || c2 == 'n'));
+}
+
+static inline bool skipping(const Assembler *as)
+{
+    return as->cond_count > 0 && as->conds[as->cond_count - 1].state != COND_ACTIVE;
+}
+
+// "NAME equ expr" or "%define NAME [expr]", a %define without a value is 1. The tokenizer
+// substitutes the value for every later use of NAME; uses before the definition were parsed
+// as symbols and get patched like label references. Only %define may redefine a constant.
+static int define_constant(SymbolTable *symbols, const Token *tokens, size_t token_count, size_t lineno)
+{
+    bool is_define = tokens[0].type == T_DIRECTIVE && strcmp(tokens[0].lexeme, "%define") == 0;
+    const Token *name = is_define ? &tokens[1] : &tokens[0];
+    if (is_define && (token_count < 2 || !is_name_token(name)))
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' must be followed by a name\n", lineno, tokens[0].lexeme);
+        return 1;
+    }
+    if (!is_define && (!is_name_token(name) || strcmp(tokens[1].lexeme, "equ") != 0))
+    {
+        fprintf(DIAG, "Error on line %zu: 'equ' must follow the name of the constant\n", lineno);
+        return 1;
+    }
+
+    int64_t value = 1;
+    if ((!is_define || token_count > 2) && eval_tokens(tokens + 2, token_count - 2, lineno, &value) != 0)
+        return 1;
+
+    uint32_t id;
+    if (symtab_intern(symbols, name->lexeme, strlen(name->lexeme), lineno, &id) != 0)
+        return 1;
+
+    Symbol *sym = &symbols->symbols[id];
+    if (sym->kind == SYM_LABEL || (sym->kind == SYM_CONSTANT && !is_define))
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' already defined on line %zu\n", lineno, sym->name, sym->lineno);
+        return 1;
+    }
+    sym->kind = SYM_CONSTANT;
+    sym->value = value;
+    sym->lineno = lineno;
+    return 0;
+}
+
+// %include "file": the file is read next, before the rest of the current one. A relative name
+// is looked up next to the including file first, then from the working directory.
+static int include_file(Assembler *as, const Token *tokens, size_t token_count, size_t lineno)
+{
+    const char *quoted = token_count == 2 ? tokens[1].lexeme : "";
+    if (token_count != 2 || tokens[1].type != T_NUMBER || (quoted[0] != '"' && quoted[0] != '\''))
+    {
+        fprintf(DIAG, "Error on line %zu: '%%include' must be followed by a quoted file name\n", lineno);
+        return 1;
+    }
+    // the lines of a macro or %rep are replayed before assemble_file reads the next line
+    if (as->macro_depth > 0 || as->rep_depth > 0)
+    {
+        fprintf(DIAG, "Error on line %zu: '%%include' cannot be used inside a macro or '%%rep' block\n", lineno);
+        return 1;
+    }
+    if (as->source_count == INCLUDE_DEPTH_MAX)
+    {
+        fprintf(DIAG, "Error on line %zu: '%%include' nested deeper than %d levels\n", lineno, INCLUDE_DEPTH_MAX);
+        return 1;
     }
 
-    fclose(input);
-    fclose(output);
+    char name[LINE_LEN_MAX];
+    snprintf(name, sizeof(name), "%.*s", (int)(strlen(quoted) - 2), quoted + 1);
+    const char *from = as->file_names.symbols[as->sources[as->source_count - 1].name].name;
+    const char *slash = strrchr(from, '/');
+
+    char path[2 * LINE_LEN_MAX + 4096];
+    const CachedFile *file = NULL;
+    int result = 1;
+    if (name[0] != '/' && slash)
+    {
+        snprintf(path, sizeof(path), "%.*s%s", (int)(slash + 1 - from), from, name);
+        result = filecache_open(as->cache, path, &file);
+        if (result != 0 && record_missing(as, path) != 0)
+            return 1;
+    }
+    if (result != 0)
+    {
+        snprintf(path, sizeof(path), "%s", name);
+        result = filecache_open(as->cache, path, &file);
+    }
+    if (result != 0)
+    {
+        fprintf(DIAG, "Error on line %zu: cannot include '%s': %s\n", lineno, name, strerror(errno));
+        return 1;
+    }
+    return push_source(as, file, path, lineno);
+}
+
+static int push_source(Assembler *as, const CachedFile *file, const char *name, size_t lineno)
+{
+    uint32_t id;
+    if (reserve((void **)&as->sources, &as->source_cap, as->source_count + 1, sizeof *as->sources) != 0 ||
+        symtab_intern(&as->file_names, name, strlen(name), lineno, &id) != 0)
+        return 1;
+    if (id > UINT16_MAX)
+    {
+        fprintf(DIAG, "Error on line %zu: more than %d different files included\n", lineno, UINT16_MAX);
+        return 1;
+    }
+    as->sources[as->source_count++] = (SourceFrame){.file = file, .name = id, .conds = as->cond_count};
+
+    // what a build cache hashes; a file included twice is listed once
+    FileList *files = as->opts->files;
+    if (!files || (as->source_count == 1 && as->opts->source))
+        return 0;
+    for (size_t i = 0; i < files->count; i++)
+    {
+        if (files->files[i] == file)
+            return 0;
+    }
+    if (reserve((void **)&files->files, &files->cap, files->count + 1, sizeof *files->files) != 0)
+        return 1;
+    files->files[files->count++] = file;
+    return 0;
+}
+
+// a path an %include tried first: a build cache must notice when it appears
+static int record_missing(Assembler *as, const char *path)
+{
+    FileList *files = as->opts->files;
+    if (!files)
+        return 0;
+    for (size_t i = 0; i < files->missing_count; i++)
+    {
+        if (strcmp(files->missing[i], path) == 0)
+            return 0;
+    }
+    if (reserve((void **)&files->missing, &files->missing_cap, files->missing_count + 1, sizeof *files->missing) != 0)
+        return 1;
+    size_t len = strlen(path) + 1;
+    char *copy = malloc(len);
+    if (!copy)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (record_missing)\n");
+        return 1;
+    }
+    files->missing[files->missing_count++] = memcpy(copy, path, len);
+    return 0;
+}
+
+// Copies the next line of the innermost file into line (NUL-terminated, the '\n' kept like
+// fgets does) and drops the files that have ended. Lines come from the file's index, blank
+// and comment lines that would do nothing are stepped over without a copy. *got_line is false at the end of the main file.
+static int read_line(Assembler *as, char *line, size_t *lineno_out, bool *got_line)
+{
+    *got_line = false;
+    while (as->source_count > 0)
+    {
+        SourceFrame *f = &as->sources[as->source_count - 1];
+        if (f->lineno == f->file->line_count)
+        {
+            if (as->cond_count > f->conds)
+            {
+                fprintf(DIAG, "Error on line %zu: '%%if' without '%%endif'\n", as->conds[as->cond_count - 1].lineno);
+                return 1;
+            }
+            // the main file stays, it is where the remaining errors come from
+            if (as->source_count == 1)
+                return 0;
+            as->source_count--;
+            continue;
+        }
+
+        const SourceLine *sl = &f->file->lines[f->lineno++];
+        size_t len = sl->len;
+        as->lines_read++;
+        as->file = (uint16_t)f->name;
+        if (len > LINE_LEN_MAX - 1)
+        {
+            fprintf(DIAG, "Error: line %zu too long (max %d characters)\n", f->lineno, LINE_LEN_MAX - 2);
+            return 1;
+        }
+
+        // a blank or comment line only matters to the listing, the -O window and a recorded
+        // block, and line 1 has to be 'bits 16'; otherwise it is not even copied
+        if (sl->kind <= SOURCE_COMMENT && !as->listing && !as->opts->optimize && !as->recording && !as->rep.active &&
+            (as->source_count > 1 || f->lineno > 1))
+        {
+            as->skipped_lines += skipping(as);
+            continue;
+        }
+
+        memcpy(line, f->file->data + sl->offset, len);
+        line[len] = '\0';
+        *lineno_out = f->lineno;
+        *got_line = true;
+        return 0;
+    }
+    return 0;
+}
+
+// after an error in an included file: "  in 'a.inc', included from 'main.asm' line 3"
+static void print_include_chain(const Assembler *as)
+{
+    if (as->source_count < 2)
+        return;
+    fprintf(DIAG, "  in '%s'", as->file_names.symbols[as->sources[as->source_count - 1].name].name);
+    for (size_t i = as->source_count - 1; i-- > 0;)
+        fprintf(DIAG, ", included from '%s' line %zu", as->file_names.symbols[as->sources[i].name].name, as->sources[i].lineno);
+    fputc('\n', DIAG);
+}
+
+// --keep-going: the messages printed since the last call belong to lineno, kept for report_errors
+static int record_error(Assembler *as, size_t lineno, uint16_t file)
+{
+    // messages about a line of the file being read get its chain, the others name their file already
+    if (as->source_count > 0 && as->sources[as->source_count - 1].name == file)
+        print_include_chain(as);
+    fflush(as->errors);
+    if (reserve((void **)&as->diagnostics, &as->diagnostic_cap, as->diagnostic_count + 1, sizeof *as->diagnostics) != 0)
+        return 1;
+    as->diagnostics[as->diagnostic_count++] = (Diagnostic){
+        .start = as->error_mark,
+        .len = as->error_text_len - as->error_mark,
+        .lineno = (uint32_t)lineno,
+        .file = file,
+    };
+    as->error_mark = as->error_text_len;
+    return 0;
+}
+
+// the recorded messages by file and line, then whatever stopped the assembly, at most max_errors
+static void report_errors(Assembler *as, FILE *out)
+{
+    fflush(as->errors);
+    if (as->error_mark < as->error_text_len &&
+        reserve((void **)&as->diagnostics, &as->diagnostic_cap, as->diagnostic_count + 1, sizeof *as->diagnostics) == 0)
+    {
+        as->diagnostics[as->diagnostic_count++] = (Diagnostic){
+            .start = as->error_mark,
+            .len = as->error_text_len - as->error_mark,
+            .lineno = UINT32_MAX,
+            .file = UINT16_MAX,
+        };
+    }
+
+    if (as->diagnostic_count == 0)
+        return;
+    qsort(as->diagnostics, as->diagnostic_count, sizeof *as->diagnostics, compare_diagnostics);
+    size_t max = as->opts->max_errors ? as->opts->max_errors : KEEP_GOING_MAX_ERRORS;
+    for (size_t i = 0; i < as->diagnostic_count && i < max; i++)
+        fwrite(as->error_text + as->diagnostics[i].start, 1, as->diagnostics[i].len, out);
+    if (as->diagnostic_count > max)
+        fprintf(out, "Error: %zu more errors not shown\n", as->diagnostic_count - max);
+}
+
+// the main file first, then the includes; a line with several messages keeps their order
+static int compare_diagnostics(const void *a, const void *b)
+{
+    const Diagnostic *x = a, *y = b;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    if (x->lineno != y->lineno)
+        return x->lineno < y->lineno ? -1 : 1;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+// the same for errors found after the last line, when only the file is known
+static void print_file_note(const Assembler *as, uint16_t file)
+{
+    if (file != 0)
+        fprintf(DIAG, "  in '%s'\n", as->file_names.symbols[file].name);
+}
+
+// "%macro name params": the following lines up to %endmacro are recorded, not assembled
+static int define_macro(Assembler *as, const Token *tokens, size_t token_count, size_t lineno)
+{
+    if (token_count < 2 || !is_name_token(&tokens[1]))
+    {
+        fprintf(DIAG, "Error on line %zu: '%%macro' must be followed by a name\n", lineno);
+        return 1;
+    }
+
+    int64_t params = 0;
+    if (eval_tokens(tokens + 2, token_count - 2, lineno, &params) != 0)
+        return 1;
+    if (params < 0 || params > 255)
+    {
+        fprintf(DIAG, "Error on line %zu: macro parameter count must be between 0 and 255\n", lineno);
+        return 1;
+    }
+
+    uint32_t id;
+    if (symtab_intern(&as->macro_names, tokens[1].lexeme, strlen(tokens[1].lexeme), lineno, &id) != 0)
+        return 1;
+
+    Symbol *sym = &as->macro_names.symbols[id];
+    if (sym->kind != SYM_UNDEFINED)
+    {
+        fprintf(DIAG, "Error on line %zu: macro '%s' already defined on line %zu\n", lineno, sym->name, sym->lineno);
+        return 1;
+    }
+    if (reserve((void **)&as->macros, &as->macro_cap, as->macro_count + 1, sizeof *as->macros) != 0)
+        return 1;
+
+    sym->kind = SYM_CONSTANT;
+    sym->value = (int64_t)as->macro_count;
+    Macro *m = &as->macros[as->macro_count++];
+    m->params = (uint32_t)params;
+    m->first_line = (uint32_t)as->macro_line_count;
+    m->line_count = 0;
+    m->lineno = lineno;
+    as->recording = m;
+    as->macro_stats.defined++;
+    return 0;
+}
+
+// appends one body line to the macro being recorded, or ends it on %endmacro
+static int record_macro_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    Macro *m = as->recording;
+    if (token_count > 0 && tokens[0].type == T_DIRECTIVE &&
+        (strcmp(tokens[0].lexeme, "%endmacro") == 0 || strcmp(tokens[0].lexeme, "%macro") == 0))
+    {
+        int result = 0;
+        if (strcmp(tokens[0].lexeme, "%macro") == 0)
+        {
+            fprintf(DIAG, "Error on line %zu: '%%macro' inside the definition of another macro\n", lineno);
+            result = 1;
+        }
+        else
+        {
+            as->recording = NULL;
+            if (as->listing)
+                result = record_listing_line(as, 0, NULL, line);
+        }
+        free_tokens(tokens, token_count);
+        return result;
+    }
+
+    for (size_t i = 0; i < token_count; i++)
+    {
+        if (tokens[i].type == T_MACRO_ARG && (tokens[i].value < 1 || tokens[i].value > m->params))
+        {
+            fprintf(DIAG, "Error on line %zu: macro parameter '%s' out of range, the macro takes %u\n", lineno, tokens[i].lexeme, m->params);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+    }
+
+    // the body stays in the listing where it was written, its bytes appear at each invocation
+    if (as->listing && record_listing_line(as, 0, NULL, line) != 0)
+    {
+        free_tokens(tokens, token_count);
+        return 1;
+    }
+    if (store_body_line(as, tokens, token_count, lineno, line) != 0)
+        return 1;
+    if (token_count > 0)
+        m->line_count++;
+    return 0;
+}
+
+// moves a non-empty line to the end of macro_lines, lexemes included, and frees the array
+static int store_body_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    if (token_count == 0)
+    {
+        free(tokens);
+        return 0;
+    }
+
+    // a %rep inside a replayed block records lines that live in macro_text themselves
+    bool inside = as->macro_text && line >= as->macro_text && line < as->macro_text + as->macro_text_len;
+    size_t offset = inside ? (size_t)(line - as->macro_text) : 0;
+    size_t len = strcspn(line, "\r\n");
+    if (reserve((void **)&as->macro_tokens, &as->macro_token_cap, as->macro_token_count + token_count, sizeof *as->macro_tokens) != 0 ||
+        reserve((void **)&as->macro_lines, &as->macro_line_cap, as->macro_line_count + 1, sizeof *as->macro_lines) != 0 ||
+        reserve((void **)&as->macro_text, &as->macro_text_cap, as->macro_text_len + len + 1, 1) != 0)
+    {
+        free_tokens(tokens, token_count);
+        return 1;
+    }
+    if (inside)
+        line = as->macro_text + offset;
+
+    MacroLine *ml = &as->macro_lines[as->macro_line_count++];
+    ml->first_token = (uint32_t)as->macro_token_count;
+    ml->token_count = (uint32_t)token_count;
+    ml->lineno = lineno;
+    ml->text = as->macro_text_len;
+    memcpy(as->macro_text + as->macro_text_len, line, len);
+    as->macro_text[as->macro_text_len + len] = '\0';
+    as->macro_text_len += len + 1;
+
+    memcpy(as->macro_tokens + as->macro_token_count, tokens, token_count * sizeof *tokens);
+    as->macro_token_count += token_count;
+    free(tokens);
+    return 0;
+}
+
+// Replays the body of m with the invocation's comma separated arguments in place of %1…,
+// each line goes through assemble_tokens as if it had been written there.
+static int expand_macro(Assembler *as, const Macro *m, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    int status = 1;
+    size_t arg_start[256], arg_count[256]; // a macro takes at most 255 parameters
+    size_t args = 0;
+    for (size_t i = 1; i < token_count; i++)
+    {
+        if (i == 1 || tokens[i - 1].type == T_COMMA)
+        {
+            if (args == m->params)
+            {
+                args++;
+                break;
+            }
+            arg_start[args] = i;
+            arg_count[args++] = 0;
+        }
+        if (tokens[i].type != T_COMMA)
+            arg_count[args - 1]++;
+    }
+
+    if (args != m->params)
+    {
+        fprintf(DIAG, "Error on line %zu: wrong number of arguments for macro '%s' (expected %u)\n", lineno, tokens[0].lexeme, m->params);
+        goto done;
+    }
+    for (size_t a = 0; a < args; a++)
+    {
+        if (arg_count[a] == 0)
+        {
+            fprintf(DIAG, "Error on line %zu: macro argument %zu is empty\n", lineno, a + 1);
+            goto done;
+        }
+    }
+    if (as->macro_depth == MACRO_DEPTH_MAX)
+    {
+        fprintf(DIAG, "Error on line %zu: macro expansion nested deeper than %d levels\n", lineno, MACRO_DEPTH_MAX);
+        goto done;
+    }
+
+    // the invocation itself has no bytes, the replayed lines follow it in the listing
+    if (queue_line(as, NULL, lineno, line) != 0)
+        goto done;
+
+    size_t expansion = ++as->macro_stats.expansions;
+    as->macro_depth++;
+    for (uint32_t l = 0; l < m->line_count; l++)
+    {
+        const MacroLine *ml = &as->macro_lines[m->first_line + l];
+        // clock() is a system call on most platforms, far slower than replaying a line
+        clock_t t0 = as->opts->stats ? clock() : 0;
+
+        Token *arr = NULL;
+        size_t count = 0;
+        int result = replay_line(as, ml, tokens, arg_start, arg_count, expansion, &arr, &count);
+        if (as->opts->stats)
+            as->macro_stats.replay_time += clock() - t0;
+        as->macro_stats.lines++;
+
+        if (result != 0 || assemble_tokens(as, arr, count, lineno, as->macro_text + ml->text) != 0)
+        {
+            as->macro_depth--;
+            goto done;
+        }
+    }
+    as->macro_depth--;
+    status = 0;
+
+done:
+    free_tokens(tokens, token_count);
+    return status;
+}
+
+// Builds the tokens of a recorded line: %1… become copies of the arguments (args is NULL
+// outside a macro) and "%%name" becomes "..@<expansion>.name", which no source can spell.
+static int replay_line(Assembler *as, const MacroLine *ml, const Token *args, const size_t *arg_start, const size_t *arg_count, size_t expansion, Token **arr_out, size_t *count_out)
+{
+    Token *arr = NULL;
+    size_t count = 0, cap = 0;
+    int result = 0;
+    for (uint32_t t = 0; t < ml->token_count && result == 0; t++)
+    {
+        const Token *src = &as->macro_tokens[ml->first_token + t];
+        if (src->type == T_MACRO_ARG && args)
+        {
+            size_t a = (size_t)src->value - 1;
+            for (size_t k = 0; k < arg_count[a] && result == 0; k++)
+                result = replay_token(as, &args[arg_start[a] + k], &arr, &count, &cap);
+        }
+        else if (src->type == T_IDENT && src->lexeme[0] == '%' && args)
+        {
+            char name[LINE_LEN_MAX + 24];
+            snprintf(name, sizeof(name), "..@%zu.%s", expansion, src->lexeme + 2);
+            Token local = *src;
+            local.lexeme = name;
+            result = replay_token(as, &local, &arr, &count, &cap);
+        }
+        else
+        {
+            result = replay_token(as, src, &arr, &count, &cap);
+        }
+    }
+
+    if (result != 0)
+    {
+        free_tokens(arr, count);
+        return 1;
+    }
+    *arr_out = arr;
+    *count_out = count;
+    return 0;
+}
+
+// appends a copy of src, resolving the names of constants like tokenize_line does
+static int replay_token(Assembler *as, const Token *src, Token **arr, size_t *count, size_t *cap)
+{
+    if (reserve((void **)arr, cap, *count + 1, sizeof **arr) != 0)
+        return 1;
+
+    size_t len = strlen(src->lexeme);
+    Token *t = &(*arr)[*count];
+    *t = *src;
+    t->lexeme = malloc(len + 1);
+    if (!t->lexeme)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (replay_token)\n");
+        return 1;
+    }
+    memcpy(t->lexeme, src->lexeme, len + 1);
+    (*count)++;
+
+    if (t->type == T_IDENT)
+    {
+        uint32_t id = symtab_find(&as->symbols, t->lexeme, len);
+        if (id != SYMBOL_NONE && as->symbols.symbols[id].kind == SYM_CONSTANT)
+        {
+            t->type = T_NUMBER;
+            t->value = as->symbols.symbols[id].value;
+        }
+    }
+    return 0;
+}
+
+// records a %rep body up to its matching %endrep, then runs it
+static int record_rep_line(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    RepBlock *blk = &as->rep;
+    if (token_count > 0 && tokens[0].type == T_DIRECTIVE)
+    {
+        const char *dir = tokens[0].lexeme;
+        if (strcmp(dir, "%macro") == 0)
+        {
+            fprintf(DIAG, "Error on line %zu: '%%macro' inside a '%%rep' block\n", lineno);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+        if (strcmp(dir, "%rep") == 0)
+            blk->depth++;
+        else if (strcmp(dir, "%endrep") == 0 && blk->depth > 0)
+            blk->depth--;
+        else if (strcmp(dir, "%endrep") == 0)
+        {
+            free_tokens(tokens, token_count);
+            RepBlock done = *blk;
+            blk->active = false;
+            return run_rep(as, &done, line);
+        }
+    }
+    return store_body_line(as, tokens, token_count, lineno, line);
+}
+
+// Runs a recorded %rep block. If the first iteration only produced plain bytes (no branches,
+// symbol references, labels or definitions) the other iterations are copies of it, otherwise
+// every iteration replays the recorded tokens.
+static int run_rep(Assembler *as, const RepBlock *blk, const char *end_line)
+{
+    size_t line_count = as->macro_line_count - blk->first_line;
+    int status = 1;
+
+    // a nested %endrep line lives in macro_text, which the iterations below may move
+    char end_text[LINE_LEN_MAX];
+    snprintf(end_text, sizeof(end_text), "%s", end_line);
+
+    // the -O window holds lines back, the first iteration must be in the output before it is copied
+    as->rep_depth++;
+    if (flush_window(as, true) != 0)
+        goto done;
+
+    size_t start = as->addr, instructions = as->instructions;
+    unsigned long cycles = as->total_cycles;
+    size_t branches = as->branch_count, fixups = as->fixup_count, symbols = as->symbols.count, definitions = as->definitions;
+    for (int64_t i = 0; i < blk->count; i++)
+    {
+        for (size_t l = 0; l < line_count; l++)
+        {
+            // nested blocks append to macro_lines, so the line is looked up again each time
+            const MacroLine *ml = &as->macro_lines[blk->first_line + l];
+            Token *arr = NULL;
+            size_t count = 0;
+            if (replay_line(as, ml, NULL, NULL, NULL, 0, &arr, &count) != 0 ||
+                assemble_tokens(as, arr, count, ml->lineno, as->macro_text + ml->text) != 0)
+                goto done;
+        }
+
+        if (i == 0 && blk->count > 1 && flush_window(as, true) == 0 &&
+            as->branch_count == branches && as->fixup_count == fixups &&
+            as->symbols.count == symbols && as->definitions == definitions)
+        {
+            size_t size = as->addr - start, copies = (size_t)(blk->count - 1);
+            size_t end = as->addr;
+            // a block of resb/resw at the end of the output stays reserved
+            bool reserved = as->zero_tail >= size;
+            if (reserved ? repeat_reserved(as, size, copies, blk->lineno) != 0
+                         : fill_reserved(as) != 0 || repeat_bytes(as, size, copies, blk->lineno) != 0)
+                goto done;
+            as->instructions += (as->instructions - instructions) * copies;
+            as->total_cycles += (as->total_cycles - cycles) * copies;
+
+            // the copies are listed as one run of bytes on the %endrep line
+            if (as->listing)
+            {
+                if (record_listing_line(as, reserved ? 0 : as->addr - end, NULL, end_text) != 0)
+                    goto done;
+                as->listing_lines[as->listing_count - 1].addr = end;
+            }
+            if (as->lines && !reserved && record_span(as, end, as->addr - end, blk->lineno, false) != 0)
+                goto done;
+            status = 0;
+            goto done;
+        }
+    }
+    status = queue_line(as, NULL, blk->lineno, end_text);
+
+done:
+    as->rep_depth--;
+    // the block is not needed anymore, nested blocks have already dropped theirs
+    for (size_t i = as->macro_lines[blk->first_line].first_token; line_count > 0 && i < as->macro_token_count; i++)
+        free(as->macro_tokens[i].lexeme);
+    if (line_count > 0)
+    {
+        as->macro_token_count = as->macro_lines[blk->first_line].first_token;
+        as->macro_text_len = as->macro_lines[blk->first_line].text;
+        as->macro_line_count = blk->first_line;
+    }
+    return status;
+}
+
+// "times N instruction": the instruction is encoded once and copied N - 1 times
+static int assemble_times(Assembler *as, Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    size_t k = 1;
+    while (k < token_count && tokens[k].type != T_MNEMONIC && tokens[k].type != T_DIRECTIVE)
+        k++;
+
+    int64_t count = 0;
+    int result = 1;
+    if (k == 1 || k == token_count)
+        fprintf(DIAG, "Error on line %zu: 'times' must be followed by a count and an instruction\n", lineno);
+    else if (tokens[k].type == T_DIRECTIVE && data_width(tokens[k].lexeme, strlen(tokens[k].lexeme)) == 0)
+        fprintf(DIAG, "Error on line %zu: 'times' cannot repeat '%s'\n", lineno, tokens[k].lexeme);
+    else if (eval_tokens(tokens + 1, k - 1, lineno, &count) != 0)
+        ;
+    else if (count < 0)
+        fprintf(DIAG, "Error on line %zu: 'times' count must not be negative\n", lineno);
+    else
+        result = 0;
+
+    if (result != 0 || tokens[k].type == T_DIRECTIVE)
+    {
+        if (result == 0)
+            result = emit_data(as, tokens + k, token_count - k, (size_t)count, lineno, line);
+        free_tokens(tokens, token_count);
+        return result;
+    }
+
+    for (size_t i = 0; i < k; i++)
+        free(tokens[i].lexeme);
+    token_count -= k;
+    memmove(tokens, tokens + k, token_count * sizeof *tokens);
+
+    Instruction inst;
+    if (parse_tokens(tokens, token_count, lineno, &as->symbols, &inst) != 0)
+        return 1;
+    return emit_repeated(as, &inst, (size_t)count, lineno, line);
+}
+
+static int emit_repeated(Assembler *as, Instruction *inst, size_t count, size_t lineno, const char *line)
+{
+    // the copies must land after the lines -O is still holding back
+    if (flush_window(as, true) != 0)
+        return 1;
+    if (count == 0)
+        return emit_line(as, NULL, lineno, line);
+
+    // a branch or symbol operand needs a branch record or fixup of its own in every copy
+    if (is_relative_branch(inst) || inst->op1.has_symbol || inst->op2.has_symbol)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (emit_line(as, inst, lineno, line) != 0)
+                return 1;
+        }
+        return 0;
+    }
+
+    size_t start = as->addr;
+    unsigned long cycles = as->total_cycles;
+    if (emit_line(as, inst, lineno, line) != 0 || repeat_bytes(as, as->addr - start, count - 1, lineno) != 0)
+        return 1;
+    as->instructions += count - 1;
+    as->total_cycles += (as->total_cycles - cycles) * (count - 1);
+    if (as->listing)
+        as->listing_lines[as->listing_count - 1].size = as->addr - start;
+    if (as->lines)
+    {
+        as->lines->spans[as->lines->count - 1].size = (uint32_t)(as->addr - start);
+        as->lines->spans[as->lines->count - 1].patchable = false;
+    }
+    return 0;
+}
+
+// appends count more copies of the last size bytes of the output: memset for a single byte,
+// otherwise memcpy from the start of the run, doubling the copied span each time
+static int repeat_bytes(Assembler *as, size_t size, size_t count, size_t lineno)
+{
+    if (size == 0 || count == 0)
+        return 0;
+    if (count > REPEAT_MAX / size)
+    {
+        fprintf(DIAG, "Error on line %zu: repetition would emit more than %d bytes\n", lineno, REPEAT_MAX);
+        return 1;
+    }
+
+    size_t total = size * count;
+    size_t start = as->addr - size;
+    if (reserve((void **)&as->code, &as->code_cap, as->addr + total, 1) != 0)
+        return 1;
+
+    uint8_t *run = as->code + start;
+    if (size == 1)
+        memset(run + 1, run[0], total);
+    else
+    {
+        size_t have = size;
+        while (have < size + total)
+        {
+            size_t chunk = (have < size + total - have) ? have : size + total - have;
+            memcpy(run + have, run, chunk);
+            have += chunk;
+        }
+    }
+    as->addr += total;
+    return 0;
+}
+
+// "db/dw values" or "resb/resw count", count times in a row. Without symbol references the
+// first copy is repeated with repeat_bytes; resb/resw only move the address.
+static int emit_data(Assembler *as, const Token *tokens, size_t token_count, size_t count, size_t lineno, const char *line)
+{
+    // data goes after the lines -O is still holding back
+    if (flush_window(as, true) != 0)
+        return 1;
+
+    bool reserved = tokens[0].lexeme[0] == 'r';
+    size_t start = as->addr, tail = as->zero_tail, fixups = as->fixup_count;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (encode_data(as, tokens, token_count, lineno) != 0)
+            return 1;
+        if (as->fixup_count != fixups)
+            continue;
+
+        // the first copy is all there is to know, the rest are the same bytes
+        size_t size = reserved ? as->zero_tail - tail : as->addr - start;
+        if (reserved ? repeat_reserved(as, size, count - 1, lineno) != 0 : repeat_bytes(as, size, count - 1, lineno) != 0)
+            return 1;
+        break;
+    }
+
+    // reserved bytes at the end are not in the output, those before code are zeros of no line
+    if (as->lines && !reserved && record_span(as, start, as->addr - start, lineno, false) != 0)
+        return 1;
+    if (!as->listing)
+        return 0;
+    if (record_listing_line(as, reserved ? 0 : as->addr - start, NULL, line) != 0)
+        return 1;
+    as->listing_lines[as->listing_count - 1].addr = start;
+    return 0;
+}
+
+// one copy of the list after tokens[0], the directive
+static int encode_data(Assembler *as, const Token *tokens, size_t token_count, size_t lineno)
+{
+    const char *dir = tokens[0].lexeme;
+    size_t width = data_width(dir, strlen(dir));
+    if (dir[0] == 'r')
+    {
+        int64_t n = 0;
+        if (eval_tokens(tokens + 1, token_count - 1, lineno, &n) != 0)
+            return 1;
+        if (n < 0 || n > REPEAT_MAX / (int64_t)width)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' count must be between 0 and %zu\n", lineno, dir, REPEAT_MAX / width);
+            return 1;
+        }
+        as->zero_tail += (size_t)n * width;
+        as->addr += (size_t)n * width;
+        return 0;
+    }
+
+    if (token_count == 1)
+    {
+        fprintf(DIAG, "Error on line %zu: '%s' must be followed by a list of values\n", lineno, dir);
+        return 1;
+    }
+    if (fill_reserved(as) != 0)
+        return 1;
+
+    size_t i = 1;
+    while (true)
+    {
+        size_t end = i;
+        while (end < token_count && tokens[end].type != T_COMMA)
+            end++;
+        if (end == i)
+        {
+            fprintf(DIAG, "Error on line %zu: empty value in '%s' list\n", lineno, dir);
+            return 1;
+        }
+        if (encode_data_value(as, tokens + i, end - i, width, lineno) != 0)
+            return 1;
+        if (end == token_count)
+            return 0;
+        i = end + 1;
+    }
+}
+
+// a string, a label with an optional addend, or a constant expression
+static int encode_data_value(Assembler *as, const Token *tokens, size_t token_count, size_t width, size_t lineno)
+{
+    const Token *t = &tokens[0];
+    if (token_count == 1 && t->type == T_NUMBER && (t->lexeme[0] == '\'' || t->lexeme[0] == '"'))
+    {
+        // the characters in order, dw pads the string to whole words like NASM
+        size_t len = strlen(t->lexeme) - 2;
+        size_t size = len + (width == 2 ? len % 2 : 0);
+        if (reserve((void **)&as->code, &as->code_cap, as->addr + size, 1) != 0)
+            return 1;
+        memcpy(as->code + as->addr, t->lexeme + 1, len);
+        if (size > len)
+            as->code[as->addr + len] = 0;
+        as->addr += size;
+        return 0;
+    }
+
+    if (reserve((void **)&as->code, &as->code_cap, as->addr + width, 1) != 0)
+        return 1;
+
+    int64_t value = 0;
+    if (t->type == T_IDENT && (token_count == 1 || tokens[1].type == T_PLUS || tokens[1].type == T_MINUS))
+    {
+        // "label" or "label + n": patched at the end like a symbol operand
+        Fixup f = {.offset = (uint32_t)as->addr, .lineno = (uint32_t)lineno, .file = as->file, .size = (uint8_t)width};
+        if (token_count > 1 && eval_tokens(tokens + 1, token_count - 1, lineno, &value) != 0)
+            return 1;
+        f.addend = (int16_t)value;
+        if (symtab_intern(&as->symbols, t->lexeme, strlen(t->lexeme), lineno, &f.symbol_id) != 0 ||
+            reserve((void **)&as->fixups, &as->fixup_cap, as->fixup_count + 1, sizeof *as->fixups) != 0)
+            return 1;
+        as->fixups[as->fixup_count++] = f;
+        value = 0;
+    }
+    else if (eval_tokens(tokens, token_count, lineno, &value) != 0 || check_data_value(value, width, lineno) != 0)
+        return 1;
+
+    as->code[as->addr++] = (uint8_t)value;
+    if (width == 2)
+        as->code[as->addr++] = (uint8_t)(value >> 8);
+    return 0;
+}
+
+// Lines like "table: db 1, 2, 0x30, 'text'" are converted from the text straight into the
+// output: data tables run to hundreds of thousands of values and a Token per number would cost
+// more than the rest of the line. Anything else (names, expressions, resb) leaves *handled
+// false and goes through the tokenizer.
+static int assemble_data_text(Assembler *as, const char *line, size_t lineno, bool *handled)
+{
+    *handled = false;
+    const char *name = line + strspn(line, " \t");
+    size_t name_len = name_length(name);
+    const char *p = name + name_len;
+    size_t width = name_len == 2 ? data_width(name, name_len) : 0;
+    if (width > 0)
+        name = NULL;
+    else if (name_len > 0)
+    {
+        // "name:" or "name" in front of the directive, keywords are left to the tokenizer
+        char lower[8];
+        for (size_t i = 0; i < name_len && i < sizeof(lower) - 1; i++)
+            lower[i] = (char)tolower((unsigned char)name[i]);
+        lower[name_len < sizeof(lower) - 1 ? name_len : sizeof(lower) - 1] = '\0';
+        if (name_len < sizeof(lower) && classify_identifier(lower) != T_IDENT)
+            return 0;
+
+        p += strspn(p, " \t");
+        p += *p == ':';
+        p += strspn(p, " \t");
+        size_t len = name_length(p);
+        width = len == 2 ? data_width(p, len) : 0;
+        p += len;
+    }
+    if (width == 0 || (*p != ' ' && *p != '\t'))
+        return 0;
+
+    // the bytes are written past the end of the output and only kept once the whole line parsed
+    if (flush_window(as, true) != 0 || fill_reserved(as) != 0 ||
+        reserve((void **)&as->code, &as->code_cap, as->addr + 2 * LINE_LEN_MAX, 1) != 0)
+        return 1;
+
+    uint8_t *out = as->code + as->addr;
+    size_t size = 0;
+    while (true)
+    {
+        p += strspn(p, " \t");
+        if (*p == '\'' || *p == '"')
+        {
+            size_t len = strcspn(p + 1, *p == '"' ? "\"\r\n" : "'\r\n");
+            if (p[1 + len] != *p)
+                return 0;
+            memcpy(out + size, p + 1, len);
+            size += len;
+            if (width == 2 && len % 2)
+                out[size++] = 0;
+            p += len + 2;
+        }
+        else
+        {
+            bool negative = *p == '-';
+            const char *digits = p + negative;
+            if (!isdigit((unsigned char)*digits))
+                return 0;
+            p = digits;
+            while (isalnum((unsigned char)*p) || *p == '_')
+                p++;
+
+            int64_t value;
+            if (!number_value(digits, (size_t)(p - digits), &value))
+                return 0;
+            if (negative)
+                value = -value;
+            if (check_data_value(value, width, lineno) != 0)
+                return 1;
+            out[size++] = (uint8_t)value;
+            if (width == 2)
+                out[size++] = (uint8_t)(value >> 8);
+        }
+
+        p += strspn(p, " \t");
+        if (*p == ',')
+            p++;
+        else if (*p == '\0' || *p == ';' || *p == '\r' || *p == '\n')
+            break;
+        else
+            return 0;
+    }
+
+    *handled = true;
+    if (name)
+    {
+        char buf[LINE_LEN_MAX];
+        memcpy(buf, name, name_len);
+        buf[name_len] = '\0';
+        Token label = {.type = T_IDENT, .lexeme = buf, .line_n = lineno};
+        if (define_label(as, &label, lineno) != 0)
+            return 1;
+    }
+    if (as->listing && record_listing_line(as, size, NULL, line) != 0)
+        return 1;
+    if (as->lines && record_span(as, as->addr, size, lineno, false) != 0)
+        return 1;
+    as->addr += size;
+    return 0;
+}
+
+static inline int check_data_value(int64_t value, size_t width, size_t lineno)
+{
+    if (width == 1 && (value < -128 || value > 255))
+    {
+        fprintf(DIAG, "Error on line %zu: 'db' value %lld does not fit in a byte\n", lineno, (long long)value);
+        return 1;
+    }
+    if (width == 2 && (value < -32768 || value > 65535))
+    {
+        fprintf(DIAG, "Error on line %zu: 'dw' value %lld does not fit in a word\n", lineno, (long long)value);
+        return 1;
+    }
+    return 0;
+}
+
+// 1 for db and resb, 2 for dw and resw, 0 for anything else; any case
+static inline size_t data_width(const char *s, size_t len)
+{
+    char c;
+    if (len == 2 && tolower((unsigned char)s[0]) == 'd')
+        c = (char)tolower((unsigned char)s[1]);
+    else if (len == 4 && tolower((unsigned char)s[0]) == 'r' && tolower((unsigned char)s[1]) == 'e' && tolower((unsigned char)s[2]) == 's')
+        c = (char)tolower((unsigned char)s[3]);
+    else
+        return 0;
+    return c == 'b' ? 1 : c == 'w' ? 2 : 0;
+}
+
+// length of the identifier at s, 0 if there is none
+static inline size_t name_length(const char *s)
+{
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_' && s[0] != '.')
+        return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_' || s[len] == '.')
+        len++;
+    return len;
+}
+
+// The reserved bytes at the very end: a hole made by ftruncate, or written zeros where the
+// output cannot be truncated (a pipe, /dev/null).
+static int write_zero_tail(FILE *output, size_t size, size_t tail)
+{
+    if (fflush(output) == 0 && ftruncate(fileno(output), (off_t)(size + tail)) == 0)
+        return 0;
+
+    static const uint8_t zeros[4096];
+    while (tail > 0)
+    {
+        size_t n = tail < sizeof(zeros) ? tail : sizeof(zeros);
+        if (fwrite(zeros, 1, n, output) != n)
+            return 1;
+        tail -= n;
+    }
+    return 0;
+}
+
+// -c: the module as an object (object.h). Global labels come first in its symbol table, then the
+// labels and externs the relocations refer to; the relocations get their numbers in place.
+static int write_object(Assembler *as, FILE *output, const char *out_name, size_t tail)
+{
+    static const uint8_t zeros[4];
+    uint32_t *index = malloc(((size_t)as->symbols.count + 1) * sizeof *index);
+    if (!index)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (write_object)\n");
+        return 1;
+    }
+
+    uint32_t count = 0;
+    size_t strings_size = 0;
+    for (uint32_t id = 0; id < as->symbols.count; id++)
+    {
+        const Symbol *sym = &as->symbols.symbols[id];
+        index[id] = SYMBOL_NONE;
+        if (!(sym->flags & SYMBOL_GLOBAL))
+            continue;
+        if (sym->kind != SYM_LABEL)
+        {
+            fprintf(DIAG, "Error on line %zu: global '%s' %s\n", sym->lineno, sym->name,
+                    sym->kind == SYM_UNDEFINED ? "is never defined" : "is a constant, not a label");
+            free(index);
+            return 1;
+        }
+        index[id] = count++;
+        strings_size += sym->len + 1;
+    }
+    for (size_t i = 0; i < as->reloc_count; i++)
+    {
+        uint32_t id = as->relocs[i].symbol;
+        if (index[id] == SYMBOL_NONE)
+        {
+            index[id] = count++;
+            strings_size += as->symbols.symbols[id].len + 1;
+        }
+        as->relocs[i].symbol = index[id];
+    }
+
+    ObjSymbol *symbols = malloc((size_t)count * sizeof *symbols + 1);
+    char *strings = malloc(strings_size + 1);
+    int status = 1;
+    if (!symbols || !strings)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (write_object)\n");
+        goto done;
+    }
+    size_t name = 0;
+    for (uint32_t id = 0; id < as->symbols.count; id++)
+    {
+        const Symbol *sym = &as->symbols.symbols[id];
+        if (index[id] == SYMBOL_NONE)
+            continue;
+        symbols[index[id]] = (ObjSymbol){
+            .name = (uint32_t)name,
+            .value = sym->kind == SYM_LABEL ? (uint32_t)sym->value : 0,
+            .binding = (sym->flags & SYMBOL_GLOBAL) ? OBJ_GLOBAL : sym->kind == SYM_LABEL ? OBJ_LOCAL : OBJ_EXTERN,
+        };
+        memcpy(strings + name, sym->name, sym->len + 1);
+        name += sym->len + 1;
+    }
+
+    ObjHeader header = {
+        .magic = OBJECT_MAGIC,
+        .version = OBJECT_VERSION,
+        .text_size = (uint32_t)as->addr,
+        .bss_size = (uint32_t)tail,
+        .align = as->max_align ? as->max_align : 1,
+        .symbol_count = count,
+        .reloc_count = (uint32_t)as->reloc_count,
+        .strings_size = (uint32_t)strings_size,
+    };
+    size_t pad = -as->addr & 3;
+    if (!write_part(&header, sizeof header, 1, output) || !write_part(as->code, 1, as->addr, output) ||
+        !write_part(zeros, 1, pad, output) || !write_part(symbols, sizeof *symbols, count, output) ||
+        !write_part(as->relocs, sizeof *as->relocs, as->reloc_count, output) || !write_part(strings, 1, strings_size, output))
+    {
+        fprintf(DIAG, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        goto done;
+    }
+    status = 0;
+
+done:
+    free(index);
+    free(symbols);
+    free(strings);
+    return status;
+}
+
+// an empty part may have no buffer at all, and fwrite must not be handed NULL
+static inline bool write_part(const void *data, size_t size, size_t count, FILE *output)
+{
+    return count == 0 || fwrite(data, size, count, output) == count;
+}
+
+// turns the reserved bytes at the end of the output into real zeros once something follows them
+static int fill_reserved(Assembler *as)
+{
+    if (as->zero_tail == 0)
+        return 0;
+    if (reserve((void **)&as->code, &as->code_cap, as->addr, 1) != 0)
+        return 1;
+    memset(as->code + as->addr - as->zero_tail, 0, as->zero_tail);
+    as->zero_tail = 0;
+    return 0;
+}
+
+// like repeat_bytes for the reserved bytes at the end of the output, which stay unwritten
+static int repeat_reserved(Assembler *as, size_t size, size_t count, size_t lineno)
+{
+    if (size > 0 && count > REPEAT_MAX / size)
+    {
+        fprintf(DIAG, "Error on line %zu: repetition would emit more than %d bytes\n", lineno, REPEAT_MAX);
+        return 1;
+    }
+    as->zero_tail += size * count;
+    as->addr += size * count;
+    return 0;
+}
+
+static void free_macros(Assembler *as)
+{
+    for (size_t i = 0; i < as->macro_token_count; i++)
+        free(as->macro_tokens[i].lexeme);
+    free(as->macro_tokens);
+    free(as->macro_lines);
+    free(as->macro_text);
+    free(as->macros);
+    symtab_free(&as->macro_names);
+}
+
+static inline bool is_directive_line(const Token *tokens, size_t token_count)
+{
+    return tokens[0].type == T_DIRECTIVE || (token_count > 1 && tokens[1].type == T_DIRECTIVE);
+}
+
+// a name, also after the tokenizer replaced it with the value of a constant
+static inline bool is_name_token(const Token *tok)
+{
+    char c = tok->lexeme[0];
+    return tok->type == T_IDENT || (tok->type == T_NUMBER && (isalpha((unsigned char)c) || c == '_' || c == '.'));
+}
+
+// encodes one line into the output buffer, inst is NULL for lines without an instruction
+static int emit_line(Assembler *as, Instruction *inst, size_t lineno, const char *line)
+{
+    if (!inst)
+        return as->listing ? record_listing_line(as, 0, NULL, line) : 0;
+
+    if (fill_reserved(as) != 0)
+        return 1;
+
+    size_t out_size = 0;
+    size_t fixups = as->fixup_count;
+    if (is_relative_branch(inst))
+    {
+        // room for the short form, layout_output writes the bytes once the distance is known
+        out_size = branch_size(inst->mnem, false);
+        if (reserve((void **)&as->code, &as->code_cap, as->addr + out_size, 1) != 0)
+            return 1;
+        memset(as->code + as->addr, 0, out_size);
+
+        if (emit_branch(as, inst, lineno) != 0)
+            return 1;
+    }
+    else
+    {
+        uint8_t buffer[6]; // max instruction size for 8086 is 6 bytes
+        int result = encode_instruction(inst, buffer, &out_size, lineno);
+        if (result != 0)
+            return 1;
+
+        if (reserve((void **)&as->code, &as->code_cap, as->addr + out_size, 1) != 0)
+            return 1;
+        memcpy(as->code + as->addr, buffer, out_size);
+
+        if (reference_symbols(as, inst, out_size, lineno) != 0)
+            return 1;
+    }
+
+    if (as->listing)
+    {
+        CycleCount cycles;
+        as->total_cycles += estimate_cycles(inst, &cycles);
+        if (record_listing_line(as, out_size, &cycles, line) != 0)
+            return 1;
+    }
+    if (as->lines && record_span(as, as->addr, out_size, lineno, !is_relative_branch(inst) && as->fixup_count == fixups) != 0)
+        return 1;
+    as->addr += out_size;
+    as->instructions++;
+    return 0;
+}
+
+// Spans of lines the watcher may re-encode alone: not replayed, not rewritten by -O, and with no
+// branch or symbol whose bytes depend on where other lines are.
+static int record_span(Assembler *as, size_t addr, size_t size, size_t lineno, bool patchable)
+{
+    LineTable *t = as->lines;
+    if (reserve((void **)&t->spans, &t->cap, t->count + 1, sizeof *t->spans) != 0)
+        return 1;
+    t->spans[t->count++] = (LineSpan){
+        .addr = (uint32_t)addr,
+        .size = (uint32_t)size,
+        .lineno = (uint32_t)lineno,
+        .file = as->file,
+        .patchable = patchable && as->file == 0 && as->macro_depth == 0 && as->rep_depth == 0 && !as->opts->optimize,
+    };
+    return 0;
+}
+
+// Records a fixup for each symbol operand of the instruction just copied to as->addr, they
+// are patched at the end since relaxation can still move every label. Symbol values are always
+// encoded full width, so their position follows from the instruction length: the imm is last,
+// the displacement sits right after opcode and ModR/M (after the opcode for mov acc, [x]).
+static int reference_symbols(Assembler *as, const Instruction *inst, size_t out_size, size_t lineno)
+{
+    const Operand *ops[2] = {&inst->op1, &inst->op2};
+    for (int i = 0; i < 2; i++)
+    {
+        const Operand *op = ops[i];
+        if (!op->has_symbol)
+            continue;
+
+        Fixup f = {.symbol_id = op->symbol_id, .lineno = (uint32_t)lineno, .file = as->file};
+        if (op->opType == OP_IMM)
+        {
+            f.size = op->size == SZ_BYTE ? 1 : 2;
+            f.offset = (uint32_t)(as->addr + out_size - f.size);
+            f.addend = (int16_t)op->imm.value;
+        }
+        else
+        {
+            f.size = 2;
+            f.offset = (uint32_t)(as->addr + (inst->op2.opType == OP_IMM ? 2 : out_size - 2));
+            f.addend = op->mem.disp_value;
+        }
+
+        if (reserve((void **)&as->fixups, &as->fixup_cap, as->fixup_count + 1, sizeof *as->fixups) != 0)
+            return 1;
+        as->fixups[as->fixup_count++] = f;
+    }
+    return 0;
+}
+
+static int emit_branch(Assembler *as, const Instruction *inst, size_t lineno)
+{
+    if (reserve((void **)&as->branches, &as->branch_cap, as->branch_count + 1, sizeof *as->branches) != 0)
+        return 1;
+
+    Branch *b = &as->branches[as->branch_count++];
+    b->offset = (uint32_t)as->addr;
+    b->symbol_id = inst->op1.has_symbol ? inst->op1.symbol_id : SYMBOL_NONE;
+    b->lineno = (uint32_t)lineno;
+    b->file = as->file;
+    b->target = inst->op1.imm.value;
+    b->mnem = (uint8_t)inst->mnem;
+    b->cond = inst->cond;
+    b->near = false;
+    return 0;
+}
+
+// "align N[, fill]": pads to the next multiple of N, with the filler of encode_padding unless a
+// fill byte is given. N - 1 bytes are held here, relax_branches settles how many of them stay.
+static int emit_align(Assembler *as, const Token *tokens, size_t token_count, size_t lineno, const char *line)
+{
+    size_t comma = 1;
+    while (comma < token_count && tokens[comma].type != T_COMMA)
+        comma++;
+
+    int64_t boundary = 0, fill = 0;
+    if (eval_tokens(tokens + 1, comma - 1, lineno, &boundary) != 0 ||
+        (comma < token_count && eval_tokens(tokens + comma + 1, token_count - comma - 1, lineno, &fill) != 0))
+        return 1;
+    if (boundary < 1 || boundary > ALIGN_MAX || (boundary & (boundary - 1)) != 0)
+    {
+        fprintf(DIAG, "Error on line %zu: 'align' boundary must be a power of two up to %d\n", lineno, ALIGN_MAX);
+        return 1;
+    }
+    if (fill < -128 || fill > 255)
+    {
+        fprintf(DIAG, "Error on line %zu: 'align' fill %lld does not fit in a byte\n", lineno, (long long)fill);
+        return 1;
+    }
+
+    // the padding goes after the lines -O is holding back, and after reserved bytes
+    if (flush_window(as, true) != 0 || fill_reserved(as) != 0 ||
+        reserve((void **)&as->code, &as->code_cap, as->addr + (size_t)boundary - 1, 1) != 0 ||
+        reserve((void **)&as->branches, &as->branch_cap, as->branch_count + 1, sizeof *as->branches) != 0)
+        return 1;
+
+    if ((uint32_t)boundary > as->max_align)
+        as->max_align = (uint32_t)boundary;
+    Branch *b = &as->branches[as->branch_count++];
+    *b = (Branch){.offset = (uint32_t)as->addr, .symbol_id = SYMBOL_NONE, .lineno = (uint32_t)lineno, .file = as->file,
+                  .target = (int32_t)boundary, .mnem = BRANCH_ALIGN, .cond = (uint8_t)fill, .near = comma < token_count};
+    if (as->listing && record_listing_line(as, placed_size(b), NULL, line) != 0)
+        return 1;
+    as->addr += placed_size(b);
+    return 0;
+}
+
+// bytes a branch or align takes before relaxation
+static inline size_t placed_size(const Branch *b)
+{
+    return b->mnem == BRANCH_ALIGN ? (size_t)b->target - 1 : branch_size(b->mnem, false);
+}
+
+// and once placed at its final address
+static inline size_t final_size(const Branch *b, size_t addr)
+{
+    if (b->mnem == BRANCH_ALIGN)
+        return (size_t)(-addr & (size_t)(b->target - 1));
+    return branch_size(b->mnem, b->near);
+}
+
+// Every branch starts short. A pass takes the growth of the branches so far as a prefix sum,
+// which gives each branch and label its current address without re-encoding anything, and
+// grows the branches whose target is out of rel8 range. No branch ever shrinks back, so the
+// loop stops after a pass that grows nothing. Aligns only shorten their padding when code
+// before them grows; a branch that ends up closer to its target than needed stays near.
+static int relax_branches(Assembler *as)
+{
+    size_t n = as->branch_count;
+    as->growth = calloc(n + 1, sizeof *as->growth);
+    if (!as->growth)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (relax_branches)\n");
+        return 1;
+    }
+
+    // nothing here knows how far away a symbol of another module will be
+    for (size_t i = 0; i < n; i++)
+    {
+        Branch *b = &as->branches[i];
+        if (b->mnem != BRANCH_ALIGN && b->symbol_id != SYMBOL_NONE && is_external(as, b->symbol_id))
+            b->near = true;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        as->relax.passes++;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            const Branch *b = &as->branches[i];
+            size_t at = (size_t)((int64_t)b->offset + as->growth[i]);
+            as->growth[i + 1] = as->growth[i] + (int32_t)final_size(b, at) - (int32_t)placed_size(b);
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            Branch *b = &as->branches[i];
+            if (b->mnem == BRANCH_ALIGN || b->near || branch_size(b->mnem, false) == branch_size(b->mnem, true))
+                continue;
+
+            int32_t target;
+            if (branch_target(as, b, &target) != 0)
+                return 1;
+
+            int32_t end = (int32_t)(b->offset + as->growth[i] + branch_size(b->mnem, false));
+            int32_t rel = target - end;
+            if (rel < -128 || rel > 127)
+            {
+                b->near = true;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const Branch *b = &as->branches[i];
+        if (b->mnem == BRANCH_ALIGN)
+            continue;
+        as->relax.branches++;
+        as->relax.grown += b->near && b->mnem != T_CALL;
+        as->relax.bytes_saved += (long)(branch_size(b->mnem, true) - branch_size(b->mnem, b->near));
+    }
+    return 0;
+}
+
+// the address a branch jumps to, with the growth of the current pass applied to labels
+static int branch_target(const Assembler *as, const Branch *b, int32_t *target_out)
+{
+    if (b->symbol_id == SYMBOL_NONE)
+    {
+        *target_out = b->target;
+        return 0;
+    }
+
+    const Symbol *sym = &as->symbols.symbols[b->symbol_id];
+    if (sym->kind == SYM_UNDEFINED)
+    {
+        fprintf(DIAG, "Error on line %u: undefined symbol '%s'\n", b->lineno, sym->name);
+        print_file_note(as, b->file);
+        return 1;
+    }
+    if (sym->kind == SYM_CONSTANT)
+        *target_out = (int32_t)sym->value + b->target;
+    else
+        *target_out = (int32_t)final_address(as, (size_t)sym->value) + b->target;
+    return 0;
+}
+
+// maps an address recorded before relaxation: everything moves by the growth of the
+// branches that start before it (a label on the same address as a branch comes first)
+static inline size_t final_address(const Assembler *as, size_t addr)
+{
+    size_t lo = 0, hi = as->branch_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (as->branches[mid].offset < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (size_t)((int64_t)addr + as->growth[lo]);
+}
+
+// Writes every branch in its final form into a new buffer, moving the code between them,
+// then moves the labels and fixups along so patch_fixup works on final addresses.
+static int layout_output(Assembler *as)
+{
+    size_t n = as->branch_count;
+    if (n == 0)
+        return 0;
+
+    size_t size = (size_t)((int64_t)as->addr + as->growth[n]);
+    uint8_t *code = malloc(size);
+    if (!code)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (layout_output)\n");
+        return 1;
+    }
+
+    size_t from = 0, to = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const Branch *b = &as->branches[i];
+        memcpy(code + to, as->code + from, b->offset - from);
+        to += b->offset - from;
+        from = b->offset + placed_size(b);
+
+        if (b->mnem == BRANCH_ALIGN)
+        {
+            size_t pad = final_size(b, to);
+            if (b->near)
+                memset(code + to, b->cond, pad);
+            else
+                encode_padding(code + to, pad);
+            to += pad;
+            continue;
+        }
+
+        int32_t target;
+        if (b->symbol_id != SYMBOL_NONE && is_external(as, b->symbol_id))
+        {
+            // every near form ends in the rel16, which the linker fills in
+            target = (int32_t)(to + branch_size(b->mnem, true));
+            if (add_relocation(as, (uint32_t)(target - 2), b->symbol_id, b->target, OBJ_REL16) != 0)
+            {
+                free(code);
+                return 1;
+            }
+        }
+        else if (branch_target(as, b, &target) != 0)
+        {
+            free(code);
+            return 1;
+        }
+
+        size_t len = 0;
+        int32_t rel = target - (int32_t)(to + branch_size(b->mnem, b->near));
+        encode_branch(b->mnem, b->cond, b->near, rel, code + to, &len);
+        to += len;
+    }
+    memcpy(code + to, as->code + from, as->addr - from);
+
+    for (uint32_t id = 0; id < as->symbols.count; id++)
+    {
+        Symbol *sym = &as->symbols.symbols[id];
+        if (sym->kind == SYM_LABEL)
+            sym->value = (int32_t)final_address(as, (size_t)sym->value);
+    }
+    for (size_t i = 0; i < as->fixup_count; i++)
+        as->fixups[i].offset = (uint32_t)final_address(as, as->fixups[i].offset);
+
+    free(as->code);
+    as->code = code;
+    as->code_cap = size;
+    as->addr = size;
+    return 0;
+}
+
+static int patch_fixup(Assembler *as, const Fixup *f)
+{
+    const Symbol *sym = &as->symbols.symbols[f->symbol_id];
+    if (is_external(as, f->symbol_id))
+        return add_relocation(as, f->offset, f->symbol_id, f->addend, f->size == 1 ? OBJ_ABS8 : OBJ_ABS16);
+    if (sym->kind == SYM_UNDEFINED)
+    {
+        fprintf(DIAG, "Error on line %u: undefined symbol '%s'\n", f->lineno, sym->name);
+        print_file_note(as, f->file);
+        return 1;
+    }
+
+    int64_t value = sym->value + f->addend;
+    if (f->size == 1 && (value < -128 || value > 255))
+    {
+        fprintf(DIAG, "Error on line %u: value of '%s' does not fit in a byte\n", f->lineno, sym->name);
+        print_file_note(as, f->file);
+        return 1;
+    }
+    if (value < -65536 || value > 65535)
+    {
+        fprintf(DIAG, "Error on line %u: value of '%s' does not fit in a word\n", f->lineno, sym->name);
+        print_file_note(as, f->file);
+        return 1;
+    }
+
+    as->code[f->offset] = (uint8_t)value;
+    if (f->size == 2)
+        as->code[f->offset + 1] = (uint8_t)(value >> 8);
+
+    // a label moves with its module, the linker adds the address the module ends up at
+    if (as->opts->object && sym->kind == SYM_LABEL)
+        return add_relocation(as, f->offset, f->symbol_id, f->addend, f->size == 1 ? OBJ_ABS8 : OBJ_ABS16);
+    return 0;
+}
+
+// a symbol left to the linker: declared extern and not defined here, only when writing an object
+static inline bool is_external(const Assembler *as, uint32_t id)
+{
+    const Symbol *sym = &as->symbols.symbols[id];
+    return as->opts->object && sym->kind == SYM_UNDEFINED && (sym->flags & SYMBOL_EXTERN);
+}
+
+static int add_relocation(Assembler *as, uint32_t offset, uint32_t symbol_id, int32_t addend, ObjRelocType type)
+{
+    if (reserve((void **)&as->relocs, &as->reloc_cap, as->reloc_count + 1, sizeof *as->relocs) != 0)
+        return 1;
+    as->relocs[as->reloc_count++] = (ObjReloc){.offset = offset, .symbol = symbol_id, .addend = addend, .type = type};
+    return 0;
+}
+
+static int record_listing_line(Assembler *as, size_t size, const CycleCount *cycles, const char *line)
+{
+    size_t len = strcspn(line, "\r\n");
+    if (reserve((void **)&as->listing_lines, &as->listing_cap, as->listing_count + 1, sizeof *as->listing_lines) != 0 ||
+        reserve((void **)&as->listing_text, &as->listing_text_cap, as->listing_text_len + len + 1, 1) != 0)
+        return 1;
+
+    ListingLine *l = &as->listing_lines[as->listing_count++];
+    l->addr = as->addr;
+    l->size = size;
+    l->has_cycles = cycles != NULL;
+    if (cycles)
+        l->cycles = *cycles;
+    l->text = as->listing_text_len;
+
+    memcpy(as->listing_text + as->listing_text_len, line, len);
+    as->listing_text[as->listing_text_len + len] = '\0';
+    as->listing_text_len += len + 1;
+    return 0;
+}
+
+// Without -O lines are emitted right away. With -O they wait in a small window until the
+// next instruction shows whether their flags are observable: an instruction that overwrites
+// all arithmetic flags makes them dead, anything else but mov forces a conservative flush.
+static int queue_line(Assembler *as, Instruction *inst, size_t lineno, const char *line)
+{
+    if (!as->opts->optimize)
+        return emit_line(as, inst, lineno, line);
+
+    if (inst && writes_all_flags(inst))
+    {
+        if (flush_window(as, false) != 0)
+            return 1;
+    }
+    else if (inst && !leaves_flags(inst))
+    {
+        if (flush_window(as, true) != 0)
+            return 1;
+    }
+
+    if (as->window_count == OPT_WINDOW && flush_window(as, true) != 0)
+        return 1;
+
+    PendingLine *p = &as->window[as->window_count++];
+    p->has_inst = inst != NULL;
+    if (inst)
+        p->inst = *inst;
+    p->lineno = lineno;
+    p->file = as->file;
+    snprintf(p->line, sizeof(p->line), "%s", line);
+    return 0;
+}
+
+static int flush_window(Assembler *as, bool flags_live)
+{
+    uint16_t file = as->file;
+    for (size_t i = 0; i < as->window_count; i++)
+    {
+        PendingLine *p = &as->window[i];
+        bool drop = p->has_inst && optimize_instruction(&p->inst, flags_live, &as->opt_stats);
+
+        as->file = p->file;
+        if (emit_line(as, (p->has_inst && !drop) ? &p->inst : NULL, p->lineno, p->line) != 0)
+        {
+            // a line of an %include that has ended since
+            if (p->file != file)
+                print_file_note(as, p->file);
+            if (!as->errors || record_error(as, p->lineno, p->file) != 0)
+            {
+                as->file = file;
+                return 1;
+            }
+        }
+    }
+    as->file = file;
+    as->window_count = 0;
+    return 0;
+}
+
+// add/sub/cmp/xor/neg set OF, SF, ZF, AF, PF and CF without reading any of them
+static inline bool writes_all_flags(const Instruction *inst)
+{
+    return inst->mnem == T_ADD || inst->mnem == T_SUB || inst->mnem == T_CMP || inst->mnem == T_XOR || inst->mnem == T_NEG;
+}
+
+// mov/not/push/pop/xchg neither read nor write a flag, the window stays open across them
+static inline bool leaves_flags(const Instruction *inst)
+{
+    return inst->mnem == T_MOV || inst->mnem == T_NOT || inst->mnem == T_PUSH || inst->mnem == T_POP || inst->mnem == T_XCHG;
+}
+
+// "addr  bytes  cycles (base+ea+penalty)  source", lines without an instruction only carry the source
+static void write_listing_line(FILE *listing, size_t addr, const uint8_t *bytes, size_t size, const CycleCount *cycles, const char *line)
+{
+    size_t len = strcspn(line, "\r\n");
+
+    if (size == 0)
+    {
+        fprintf(listing, "%-35s%.*s\n", "", (int)len, line);
+        return;
+    }
+
+    // the longest instruction is loop near, 7 bytes; times and %rep runs are cut short
+    char hex[7 * 2 + 1] = {0};
+    size_t shown = size > 7 ? 5 : size;
+    for (size_t i = 0; i < shown; i++)
+        sprintf(hex + i * 2, "%02X", bytes[i]);
+    if (shown < size)
+        strcpy(hex + shown * 2, "..");
+
+    if (!cycles)
+    {
+        fprintf(listing, "%04zX  %-12s  %3s %-10s %.*s\n", addr, hex, "", "", (int)len, line);
+        return;
+    }
+
+    char detail[24] = {0};
+    if (cycles->penalty)
+        snprintf(detail, sizeof(detail), "(%u+%u+%u)", cycles->base, cycles->ea, cycles->penalty);
+    else if (cycles->ea)
+        snprintf(detail, sizeof(detail), "(%u+%u)", cycles->base, cycles->ea);
+
+    unsigned total = cycles->base + cycles->ea + cycles->penalty;
+    fprintf(listing, "%04zX  %-12s  %3u %-10s %.*s\n", addr, hex, total, detail, (int)len, line);
+}
+
+// grows *buf (doubling) so that it holds at least need elements
+static int reserve(void **buf, size_t *cap, size_t need, size_t elem_size)
+{
+    if (need <= *cap)
+        return 0;
+
+    size_t newcap = *cap ? *cap : 64;
+    while (newcap < need)
+        newcap *= 2;
+
+    void *tmp = realloc(*buf, newcap * elem_size);
+    if (!tmp)
+    {
+        fprintf(DIAG, "Error: memory allocation failed while growing a buffer (assemble_file)\n");
+        return 1;
+    }
+    *buf = tmp;
+    *cap = newcap;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,74 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
-int assemble_file(const char *in_name, const char *out_name);
+#include <stdio.h>   // for FILE
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint32_t, uint16_t
+#include <stdbool.h> // for bool
 
-#endif
\ No newline at end of file
+#include "filecache.h" // for FileCache
+#include "optimizer.h" // for OptimizerStats
+
+// what assemble_file did, for callers reporting throughput
+typedef struct
+{
+    size_t lines;       // source lines read, includes and macro bodies counted once
+    size_t bytes;       // output size
+    OptimizerStats opt; // what -O saved
+} AssembleResult;
+
+// where the bytes of one instruction or data line ended up, after branch relaxation
+typedef struct
+{
+    uint32_t addr;
+    uint32_t size;
+    uint32_t lineno;
+    uint16_t file;   // 0 is the main file, then in the order %include first reached them
+    bool patchable;  // a main-file line whose bytes depend on nothing but its own text
+} LineSpan;
+
+// in output order, a line replayed by a macro or %rep has a span per copy
+typedef struct
+{
+    LineSpan *spans;
+    size_t count, cap;
+} LineTable;
+
+// every file an assembly read: the main file first, then each %include once, and the paths an
+// %include looked for before the one it found
+typedef struct
+{
+    const CachedFile **files; // stay valid for as long as opts->cache keeps them mapped
+    size_t count, cap;
+    char **missing; // owned, free with filelist_free
+    size_t missing_count, missing_cap;
+} FileList;
+
+typedef struct
+{
+    const char *listing_name; // if set, write an address/bytes/cycles/source listing to this file
+    bool optimize;            // -O: peephole pass between parse_tokens and encode_instruction
+    bool stats;               // --stats: print branch relaxation statistics
+    bool object;              // -c: write a relocatable object (object.h) in place of the flat binary
+    FileCache *cache;         // source files kept mapped between calls, NULL for a private cache
+    const char *source;       // if set, assembled in place of the contents of in_name
+    size_t source_len;
+    FILE *output;             // if set, the binary goes here and out_name only names it in messages
+    FILE *diag;               // error messages, NULL for stderr
+    AssembleResult *result;   // if set, filled in on success, and -O leaves reporting its figures to the caller
+    LineTable *lines;         // if set, refilled with a span per instruction and data line; the caller frees spans
+    const char *linemap_name; // if set, write the spans to this file as a line map, see linemap.h
+    FileList *files;          // if set, refilled with the files read; needs a cache, the main file is missing with source
+    bool keep_going;          // --keep-going: skip a line that fails, report every error at the end, write no output
+    size_t max_errors;        // errors shown by keep_going, 0 for KEEP_GOING_MAX_ERRORS
+} AssembleOptions;
+
+#define KEEP_GOING_MAX_ERRORS 100
+
+// opts may be NULL for the defaults. Assemblies share no state, so separate threads may run
+// them at once as long as each has its own FileCache.
+int assemble_file(const char *in_name, const char *out_name, const AssembleOptions *opts);
+
+void filelist_free(FileList *files);
+
+#endif
@@ -0,0 +1,83 @@
+#define _XOPEN_SOURCE 700 // mkdtemp, open_memstream, and realpath for the file cache
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.c"
+
+static char dir[] = "/tmp/assembler_test.XXXXXX";
+
+static void write_file(const char *name, const char *text)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    assert(f);
+    fputs(text, f);
+    fclose(f);
+}
+
+static void remove_file(const char *name)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    remove(path);
+}
+
+// assembles dir/main.asm, the messages are returned in *diag_out and the output is dropped
+static int assemble_main(char **diag_out)
+{
+    char in_name[256];
+    snprintf(in_name, sizeof(in_name), "%s/main.asm", dir);
+    char *code = NULL, *diag = NULL;
+    size_t code_len = 0, diag_len = 0;
+    FILE *output = open_memstream(&code, &code_len);
+    FILE *diag_stream = open_memstream(&diag, &diag_len);
+    assert(output && diag_stream);
+    AssembleOptions opts = {.output = output, .diag = diag_stream};
+    int status = assemble_file(in_name, "main.bin", &opts);
+    fclose(output);
+    fclose(diag_stream);
+    free(code);
+    *diag_out = diag;
+    return status;
+}
+
+static void expect_include_error(const char *include, const char *want_msg)
+{
+    write_file("part.inc", include);
+    char *diag;
+    assert(assemble_main(&diag) != 0);
+    if (!strstr(diag, want_msg))
+        fprintf(stderr, "got [%s] want [%s]\n", diag, want_msg);
+    assert(strstr(diag, want_msg) != NULL);
+    free(diag);
+}
+
+// an included file may only close the %if blocks it opened itself
+static void test_include_conditionals(void)
+{
+    write_file("main.asm", "bits 16\n%if 1\n%include \"part.inc\"\nmov cx, 3\n%else\nmov dx, 4\n%endif\n");
+    expect_include_error("%endif\nmov bx, 2\n", "Error on line 1: '%endif' without '%if'");
+    expect_include_error("%else\n", "Error on line 1: '%else' without '%if'");
+    expect_include_error("%elif 0\n", "Error on line 1: '%elif' without '%if'");
+    expect_include_error("%if 1\nmov bx, 2\n", "Error on line 1: '%if' without '%endif'");
+
+    char *diag;
+    write_file("part.inc", "%if 0\nmov ax, 1\n%else\nmov ax, 2\n%endif\n");
+    assert(assemble_main(&diag) == 0);
+    free(diag);
+}
+
+int main(void)
+{
+    printf("Running assembler tests...\n");
+    assert(mkdtemp(dir));
+    test_include_conditionals();
+    remove_file("main.asm");
+    remove_file("part.inc");
+    remove(dir);
+    printf("All assembler tests passed!\n");
+    return 0;
+}
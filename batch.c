@@ -0,0 +1,342 @@
+#include <stdio.h>    // for fprintf, printf, open_memstream
+#include <stdlib.h>   // for malloc, calloc, realloc, free, qsort
+#include <string.h>   // for strchr, strspn, strcspn, strerror
+#include <stdbool.h>  // for bool
+#include <errno.h>    // for errno
+#include <time.h>     // for clock_gettime
+#include <pthread.h>  // for pthread_create, pthread_join, pthread_mutex_*
+#include <sys/stat.h> // for stat
+
+#include "batch.h"
+
+// One per input file. Workers only write their own job, the report is printed after they join.
+typedef struct
+{
+    const BatchFile *file;
+    int status;
+    bool cached; // copied from the build cache, result.lines is 0
+    double seconds;
+    AssembleResult result;
+    char *diag; // the file's error messages, from open_memstream
+    size_t diag_len;
+} BatchJob;
+
+// Each worker owns a queue of job indices, largest input first. It takes from the head; a
+// worker that runs out steals from the tail of another queue, where the smallest jobs are,
+// so one large file never leaves the others waiting on a long tail of work.
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head, tail;
+} WorkQueue;
+
+typedef struct
+{
+    BatchJob *jobs;
+    WorkQueue *queues;
+    int queue_count;
+    const AssembleOptions *opts;
+    const BuildCache *build_cache;
+} BatchPool;
+
+typedef struct
+{
+    BatchPool *pool;
+    int id;
+    size_t stolen;
+} BatchWorker;
+
+typedef struct
+{
+    size_t size;
+    size_t index;
+} JobSize;
+
+static void *batch_worker(void *arg);
+static bool take_job(BatchPool *pool, BatchWorker *w, size_t *job_out);
+static void run_job(BatchJob *job, AssembleOptions *opts, const BuildCache *build_cache);
+static void print_job(const BatchJob *job, bool optimize);
+static int compare_size(const void *a, const void *b);
+static double batch_now(void);
+
+int read_manifest(const char *name, BatchFile **files_out, size_t *count_out, char **text_out)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error with manifest file '%s': %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    size_t cap = 4096, len = 0;
+    char *text = malloc(cap + 1);
+    while (text)
+    {
+        len += fread(text + len, 1, cap - len, f);
+        if (len < cap)
+            break;
+        cap *= 2;
+        char *tmp = realloc(text, cap + 1);
+        if (!tmp)
+            free(text);
+        text = tmp;
+    }
+    fclose(f);
+    if (!text)
+    {
+        fprintf(stderr, "Error: memory allocation failed (read_manifest)\n");
+        return 1;
+    }
+    text[len] = '\0';
+
+    BatchFile *files = NULL;
+    size_t count = 0, files_cap = 0, lineno = 0;
+    for (char *line = text; line < text + len; )
+    {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+        char *next = end ? end + 1 : text + len;
+        lineno++;
+
+        // two whitespace separated names, split in place
+        char *names[3] = {NULL};
+        size_t n = 0;
+        char *p = line;
+        while (n < 3)
+        {
+            p += strspn(p, " \t\r");
+            if (*p == '\0' || *p == '#')
+                break;
+            names[n++] = p;
+            p += strcspn(p, " \t\r");
+            if (*p != '\0')
+                *p++ = '\0';
+        }
+        line = next;
+        if (n == 0)
+            continue;
+        if (n != 2)
+        {
+            fprintf(stderr, "Error on line %zu of manifest '%s': expected 'input.asm output'\n", lineno, name);
+            free(files);
+            free(text);
+            return 1;
+        }
+
+        if (count == files_cap)
+        {
+            files_cap = files_cap ? files_cap * 2 : 64;
+            BatchFile *tmp = realloc(files, files_cap * sizeof *tmp);
+            if (!tmp)
+            {
+                fprintf(stderr, "Error: memory allocation failed (read_manifest)\n");
+                free(files);
+                free(text);
+                return 1;
+            }
+            files = tmp;
+        }
+        files[count++] = (BatchFile){.in_name = names[0], .out_name = names[1]};
+    }
+
+    *files_out = files;
+    *count_out = count;
+    *text_out = text;
+    return 0;
+}
+
+int assemble_batch(const BatchFile *files, size_t count, const AssembleOptions *opts, const BuildCache *build_cache, int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > count)
+        threads = count ? (int)count : 1;
+
+    BatchJob *jobs = calloc(count ? count : 1, sizeof *jobs);
+    JobSize *sizes = malloc((count ? count : 1) * sizeof *sizes);
+    WorkQueue *queues = calloc((size_t)threads, sizeof *queues);
+    BatchWorker *workers = calloc((size_t)threads, sizeof *workers);
+    pthread_t *tids = calloc((size_t)threads, sizeof *tids);
+    size_t per_queue = (count + (size_t)threads - 1) / (size_t)threads;
+    size_t *order = malloc((per_queue ? per_queue : 1) * (size_t)threads * sizeof *order);
+    if (!jobs || !sizes || !queues || !workers || !tids || !order)
+    {
+        fprintf(stderr, "Error: memory allocation failed (assemble_batch)\n");
+        free(jobs);
+        free(sizes);
+        free(queues);
+        free(workers);
+        free(tids);
+        free(order);
+        return 1;
+    }
+
+    // largest first, dealt round-robin: every queue starts with its share of the big files
+    for (size_t i = 0; i < count; i++)
+    {
+        struct stat st;
+        jobs[i].file = &files[i];
+        sizes[i] = (JobSize){.size = stat(files[i].in_name, &st) == 0 ? (size_t)st.st_size : 0, .index = i};
+    }
+    qsort(sizes, count, sizeof *sizes, compare_size);
+
+    for (int q = 0; q < threads; q++)
+    {
+        pthread_mutex_init(&queues[q].lock, NULL);
+        queues[q].jobs = order + (size_t)q * per_queue;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        WorkQueue *q = &queues[i % (size_t)threads];
+        q->jobs[q->tail++] = sizes[i].index;
+    }
+    free(sizes);
+
+    BatchPool pool = {.jobs = jobs, .queues = queues, .queue_count = threads, .opts = opts, .build_cache = build_cache};
+    double t0 = batch_now();
+    int started = 1;
+    for (int i = 0; i < threads; i++)
+        workers[i] = (BatchWorker){.pool = &pool, .id = i};
+    for (int i = 1; i < threads; i++, started++)
+    {
+        if (pthread_create(&tids[i], NULL, batch_worker, &workers[i]) != 0)
+            break; // the threads that did start steal the jobs of the missing ones
+    }
+    batch_worker(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = batch_now() - t0;
+
+    size_t failed = 0, lines = 0, bytes = 0, stolen = 0, cached = 0;
+    double busy = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        print_job(&jobs[i], opts->optimize);
+        failed += jobs[i].status != 0;
+        cached += jobs[i].cached;
+        lines += jobs[i].result.lines;
+        bytes += jobs[i].result.bytes;
+        busy += jobs[i].seconds;
+        free(jobs[i].diag);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        stolen += workers[i].stolen;
+        pthread_mutex_destroy(&queues[i].lock);
+    }
+
+    printf("%zu files, %zu failed, %zu lines, %zu bytes in %.3f s on %d threads  ⇒  %.0f lines/s\n",
+           count, failed, lines, bytes, elapsed, started, elapsed > 0 ? lines / elapsed : 0.0);
+    printf("%.3f s spent assembling, %zu jobs stolen\n", busy, stolen);
+    if (build_cache)
+        printf("%zu of %zu files from the build cache\n", cached, count);
+
+    free(jobs);
+    free(queues);
+    free(workers);
+    free(tids);
+    free(order);
+    return failed ? 1 : 0;
+}
+
+// every worker keeps its own file cache, so an include shared by its files is mapped once
+static void *batch_worker(void *arg)
+{
+    BatchWorker *w = arg;
+    FileCache cache;
+    bool have_cache = filecache_init(&cache) == 0;
+
+    AssembleOptions opts = *w->pool->opts;
+    opts.cache = have_cache ? &cache : NULL;
+
+    size_t job;
+    while (take_job(w->pool, w, &job))
+        run_job(&w->pool->jobs[job], &opts, w->pool->build_cache);
+
+    if (have_cache)
+        filecache_free(&cache);
+    return NULL;
+}
+
+static bool take_job(BatchPool *pool, BatchWorker *w, size_t *job_out)
+{
+    for (int k = 0; k < pool->queue_count; k++)
+    {
+        WorkQueue *q = &pool->queues[(w->id + k) % pool->queue_count];
+        bool found = false;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
+        {
+            *job_out = k == 0 ? q->jobs[q->head++] : q->jobs[--q->tail];
+            found = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (found)
+        {
+            w->stolen += k != 0;
+            return true;
+        }
+    }
+    return false; // no job is ever added, so empty queues stay empty
+}
+
+static void run_job(BatchJob *job, AssembleOptions *opts, const BuildCache *build_cache)
+{
+    FILE *diag = open_memstream(&job->diag, &job->diag_len);
+    opts->diag = diag;
+    opts->result = &job->result;
+
+    double t0 = batch_now();
+    if (build_cache)
+        job->status = buildcache_assemble(build_cache, job->file->in_name, job->file->out_name, opts, &job->cached);
+    else
+        job->status = assemble_file(job->file->in_name, job->file->out_name, opts);
+    job->seconds = batch_now() - t0;
+
+    if (diag)
+        fclose(diag);
+    opts->diag = NULL;
+    opts->result = NULL;
+}
+
+// a file's messages prefixed with its name, so a failure reads the same at any thread count
+static void print_job(const BatchJob *job, bool optimize)
+{
+    const char *p = job->diag;
+    while (p && *p)
+    {
+        size_t n = strcspn(p, "\n");
+        fprintf(stderr, "%s: %.*s\n", job->file->in_name, (int)n, p);
+        p += n + (p[n] == '\n');
+    }
+
+    if (job->status != 0)
+        fprintf(stderr, "%s: failed\n", job->file->in_name);
+    else if (job->cached)
+        printf("%s: %zu bytes from the build cache in %.3f ms\n", job->file->in_name, job->result.bytes, job->seconds * 1000.0);
+    else
+        printf("%s: %zu lines, %zu bytes in %.3f ms  ⇒  %.0f lines/s\n", job->file->in_name, job->result.lines,
+               job->result.bytes, job->seconds * 1000.0, job->seconds > 0 ? job->result.lines / job->seconds : 0.0);
+
+    const OptimizerStats *o = &job->result.opt;
+    if (job->status == 0 && !job->cached && optimize)
+        printf("%s: optimizer: %zu rewritten, %zu removed, %ld bytes and %ld cycles saved\n", job->file->in_name,
+               o->rewrites, o->removed, o->bytes_saved, o->cycles_saved);
+}
+
+static int compare_size(const void *a, const void *b)
+{
+    const JobSize *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static double batch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
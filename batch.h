@@ -0,0 +1,23 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h> // for size_t
+
+#include "assembler.h"  // for AssembleOptions
+#include "buildcache.h" // for BuildCache
+
+typedef struct
+{
+    const char *in_name;
+    const char *out_name;
+} BatchFile;
+
+// Reads "input.asm output" pairs, one per line, skipping blank lines and '#' comments.
+// The names point into *text_out; the caller frees it along with *files_out.
+int read_manifest(const char *name, BatchFile **files_out, size_t *count_out, char **text_out);
+
+// Assembles every file on up to `threads` workers, then prints a line per file and the totals.
+// With build_cache, a file whose output is cached is copied instead. Returns 1 if any file failed.
+int assemble_batch(const BatchFile *files, size_t count, const AssembleOptions *opts, const BuildCache *build_cache, int threads);
+
+#endif
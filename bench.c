@@ -1,9 +1,18 @@
-#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700 // clock_gettime, and realpath for the file cache
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "assembler.c"
+#include "protocol.c"
+
+#define LATENCY_RUNS 200
+#define BENCH_CHUNKS 4 // split points shown for this many threads
+
+extern char **environ;
 
 static double sec_now(void)
 {
@@ -12,31 +21,235 @@ static double sec_now(void)
     return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *what, double *times, int runs)
+{
+    qsort(times, (size_t)runs, sizeof *times, compare_double);
+    double sum = 0;
+    for (int i = 0; i < runs; i++)
+        sum += times[i];
+    printf("%-8s median %.3f ms, mean %.3f ms, p95 %.3f ms\n", what, times[runs / 2] * 1000.0,
+           sum / runs * 1000.0, times[runs * 95 / 100] * 1000.0);
+}
+
+// one process per file, the way a build runs the CLI: args[0] is the program
+static int time_process(char **args, double *times, int runs)
+{
+    for (int i = 0; i < runs; i++)
+    {
+        double t0 = sec_now();
+        pid_t pid;
+        int status = 0;
+        if (posix_spawn(&pid, args[0], NULL, NULL, args, environ) != 0 || waitpid(pid, &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "Error: '%s' failed\n", args[0]);
+            return 1;
+        }
+        times[i] = sec_now() - t0;
+    }
+    return 0;
+}
+
+// --latency: the same file through a fresh CLI process each time, then through a running
+// server, connecting once per request like the client does. With a client binary also that
+// client, which is what a build would actually spawn in place of the CLI.
+static int bench_latency(const char *cli, const char *socket_path, const char *asm_name, const char *client)
+{
+    char path[4096];
+    if (!realpath(asm_name, path))
+    {
+        perror(asm_name);
+        return 1;
+    }
+
+    static double times[LATENCY_RUNS];
+    char *cli_args[] = {(char *)cli, path, "/dev/null", NULL};
+    if (time_process(cli_args, times, LATENCY_RUNS) != 0)
+        return 1;
+    print_latency("cold", times, LATENCY_RUNS);
+
+    for (int i = 0; i < LATENCY_RUNS; i++)
+    {
+        double t0 = sec_now();
+        int fd = server_connect(socket_path);
+        ServerResult result;
+        if (fd < 0 || server_assemble(fd, 0, path, NULL, 0, &result) != 0)
+            return 1;
+        close(fd);
+        free(result.output);
+        free(result.diag);
+        if (result.status != 0)
+        {
+            fprintf(stderr, "Error: the server could not assemble '%s'\n", asm_name);
+            return 1;
+        }
+        times[i] = sec_now() - t0;
+    }
+    print_latency("warm", times, LATENCY_RUNS);
+
+    if (client)
+    {
+        char *client_args[] = {(char *)client, "-s", (char *)socket_path, path, "/dev/null", NULL};
+        if (time_process(client_args, times, LATENCY_RUNS) != 0)
+            return 1;
+        print_latency("client", times, LATENCY_RUNS);
+    }
+    return 0;
+}
+
+// Every code line through tokenize_line and parse_tokens, then again with parse_canonical tried
+// first, the way assemble_file reads them. Lines that only make sense in context, labels and
+// directives, fail here in both passes alike; their messages go nowhere.
+static void bench_parse(const CachedFile *file, const SourceLine *index, size_t count)
+{
+    SymbolTable symbols;
+    FILE *null = fopen("/dev/null", "w");
+    if (!null || symtab_init(&symbols) != 0)
+    {
+        if (null)
+            fclose(null);
+        return;
+    }
+    diag_stream = null;
+
+    double times[2];
+    size_t code = 0, canonical = 0;
+    char line[LINE_LEN_MAX];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        double t0 = sec_now();
+        for (size_t i = 0; i < count; i++)
+        {
+            if (index[i].kind != SOURCE_CODE || index[i].len >= LINE_LEN_MAX)
+                continue;
+            memcpy(line, file->data + index[i].offset, index[i].len);
+            line[index[i].len] = '\0';
+            code += pass == 0;
+
+            Instruction inst;
+            if (pass == 1 && parse_canonical(line, &inst))
+            {
+                canonical++;
+                continue;
+            }
+            Token *tokens = NULL;
+            size_t token_count = 0;
+            if (tokenize_line(line, i + 1, NULL, &tokens, &token_count) != 0)
+                continue;
+            if (token_count == 0)
+                free(tokens);
+            else
+                parse_tokens(tokens, token_count, i + 1, &symbols, &inst);
+        }
+        times[pass] = sec_now() - t0;
+    }
+
+    diag_stream = NULL;
+    fclose(null);
+    symtab_free(&symbols);
+    printf("parse: %zu code lines, %.0f lines/s with tokenize_line + parse_tokens, %.0f lines/s with parse_canonical first (%.1f%% taken)\n",
+           code, code / times[0], code / times[1], code ? canonical * 100.0 / code : 0.0);
+}
+
+// the file assembled again with a line map, which is then loaded the way a debugger would
+static void bench_line_map(const char *asm_name, FileCache *cache)
+{
+    char map_name[] = "/tmp/bench-map-XXXXXX";
+    int fd = mkstemp(map_name);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+
+    AssembleOptions opts = {.cache = cache, .linemap_name = map_name};
+    uint8_t *data = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    if (assemble_file(asm_name, "/dev/null", &opts) == 0 && (f = fopen(map_name, "rb")) != NULL &&
+        fseek(f, 0, SEEK_END) == 0 && (len = (size_t)ftell(f)) > 0 && (data = malloc(len)) != NULL)
+    {
+        rewind(f);
+        if (fread(data, 1, len, f) == len)
+        {
+            LineMap map;
+            double t0 = sec_now();
+            int result = linemap_load(data, len, &map);
+            double t1 = sec_now();
+            if (result == 0)
+                printf("line map: %zu bytes for %zu lines (%.2f bytes each), loaded in %.3f ms\n",
+                       len, map.count, map.count ? (double)len / map.count : 0.0, (t1 - t0) * 1000.0);
+            linemap_free(&map);
+        }
+    }
+    if (f)
+        fclose(f);
+    free(data);
+    unlink(map_name);
+}
+
 int main(int argc, char **argv)
 {
+    if (argc >= 5 && argc <= 6 && strcmp(argv[1], "--latency") == 0)
+        return bench_latency(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : NULL);
     if (argc != 2)
     {
         fprintf(stderr, "usage: %s foo.asm\n", argv[0]);
+        fprintf(stderr, "       %s --latency my-assembler socket foo.asm [my-assembler-client]\n", argv[0]);
         exit(1);
     }
 
-    FILE *f = fopen(argv[1], "r");
-    if (!f)
+    // the cache maps and indexes the file, assemble_file below finds it there
+    FileCache cache;
+    const CachedFile *file = NULL;
+    if (filecache_init(&cache) != 0)
+        exit(1);
+    if (filecache_open(&cache, argv[1], &file) != 0)
     {
         perror(argv[1]);
         exit(1);
     }
-    size_t lines = 0;
-    int ch;
-    while ((ch = fgetc(f)) != EOF)
-        if (ch == '\n')
-            ++lines;
-    fclose(f);
 
+    // the prepass alone, on the mapping that is already in memory
+    SourceLine *index = NULL;
+    size_t lines = 0;
     double t0 = sec_now();
-    assemble_file(argv[1], "/dev/null");
+    if (index_lines(file->data, file->size, &index, &lines) != 0)
+    {
+        perror(argv[1]);
+        exit(1);
+    }
     double t1 = sec_now();
 
+    size_t kinds[4] = {0};
+    for (size_t i = 0; i < lines; i++)
+        kinds[index[i].kind]++;
+    size_t starts[BENCH_CHUNKS];
+    split_lines(index, lines, BENCH_CHUNKS, starts);
+    printf("index: %zu lines (%zu blank, %zu comment, %zu directive, %zu code) in %.3f ms  ⇒  %.2f GB/s\n",
+           lines, kinds[SOURCE_BLANK], kinds[SOURCE_COMMENT], kinds[SOURCE_DIRECTIVE], kinds[SOURCE_CODE],
+           (t1 - t0) * 1000.0, file->size / (t1 - t0) / 1e9);
+    printf("chunks for %d threads start on lines", BENCH_CHUNKS);
+    for (int i = 0; i < BENCH_CHUNKS; i++)
+        printf(" %zu", starts[i] + 1);
+    printf("\n");
+    bench_parse(file, index, lines);
+    free(index);
+
+    AssembleOptions opts = {.cache = &cache};
+    t0 = sec_now();
+    assemble_file(argv[1], "/dev/null", &opts);
+    t1 = sec_now();
+
     printf("%.0f lines, %.3f s  ⇒  %.0f lines/s\n",
            (double)lines, t1 - t0, lines / (t1 - t0));
+    bench_line_map(argv[1], &cache);
+    filecache_free(&cache);
 }
@@ -0,0 +1,333 @@
+#include <stdio.h>    // for fopen, fread, fwrite, fprintf, snprintf, sscanf, rename
+#include <stdlib.h>   // for free, mkstemp
+#include <string.h>   // for memcpy, strlen, strchr, strerror
+#include <inttypes.h> // for PRIx64, SCNx64
+#include <errno.h>    // for errno, EEXIST
+#include <fcntl.h>    // for open, O_RDONLY
+#include <unistd.h>   // for access, close, getcwd, unlink
+#include <limits.h>   // for PATH_MAX
+#include <sys/mman.h> // for mmap, munmap
+#include <sys/stat.h> // for mkdir, fstat
+
+#include "buildcache.h"
+
+#define BUILDCACHE_VERSION 2 // bumped whenever what goes into a key changes
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r);
+static inline uint64_t xxh_round(uint64_t acc, uint64_t lane);
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t lane);
+static inline uint64_t xxh_read64(const uint8_t *p);
+static inline uint32_t xxh_read32(const uint8_t *p);
+static inline uint64_t chain(uint64_t h, uint64_t next);
+static uint64_t hash_executable(void);
+static uint64_t main_key(const BuildCache *bc, const CachedFile *input, const AssembleOptions *opts);
+static bool lookup(const BuildCache *bc, FileCache *cache, uint64_t key, uint64_t *result_out);
+static bool fetch(const BuildCache *bc, uint64_t result, const char *out_name, size_t *size_out);
+static void store(const BuildCache *bc, const FileList *files, const AssembleOptions *opts, const char *out_name);
+static FILE *begin_entry(const BuildCache *bc, char *tmp, size_t tmp_size);
+static bool end_entry(FILE *f, const char *tmp, const char *name, bool ok);
+static bool copy_stream(FILE *from, FILE *to, size_t *size_out);
+
+// XXH64 as published, reading lanes in host byte order
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h;
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2, v2 = seed + XXH_PRIME2, v3 = seed, v4 = seed - XXH_PRIME1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else
+        h = seed + XXH_PRIME5;
+    h += len;
+
+    for (; end - p >= 8; p += 8)
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (end - p >= 4)
+    {
+        h = xxh_rotl(h ^ xxh_read32(p) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = xxh_rotl(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+int buildcache_init(BuildCache *bc, const char *dir)
+{
+    char cwd[PATH_MAX];
+    if ((mkdir(dir, 0777) != 0 && errno != EEXIST) || !getcwd(cwd, sizeof cwd))
+    {
+        fprintf(stderr, "Error with cache directory '%s': %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    // relative %include names fall back to the working directory
+    bc->dir = dir;
+    bc->base = chain(chain(BUILDCACHE_VERSION, hash_executable()), xxh64(cwd, strlen(cwd), 0));
+    return 0;
+}
+
+int buildcache_assemble(const BuildCache *bc, const char *in_name, const char *out_name, const AssembleOptions *opts, bool *hit_out)
+{
+    *hit_out = false;
+    AssembleOptions o = *opts;
+    FileList files = {0};
+    FileCache own;
+    o.files = &files;
+    if (!o.cache)
+    {
+        if (filecache_init(&own) != 0)
+            return assemble_file(in_name, out_name, opts);
+        o.cache = &own;
+    }
+
+    // a main file that cannot be read is left to assemble_file to report
+    const CachedFile *input;
+    uint64_t result;
+    size_t size;
+    int status = 0;
+    if (filecache_open(o.cache, in_name, &input) == 0 && lookup(bc, o.cache, main_key(bc, input, opts), &result) &&
+        fetch(bc, result, out_name, &size))
+    {
+        *hit_out = true;
+        if (opts->result)
+            *opts->result = (AssembleResult){.bytes = size};
+    }
+    else
+    {
+        status = assemble_file(in_name, out_name, &o);
+        if (status == 0)
+            store(bc, &files, opts, out_name);
+    }
+
+    filelist_free(&files);
+    if (o.cache == &own)
+        filecache_free(&own);
+    return status;
+}
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t lane)
+{
+    return xxh_rotl(acc + lane * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t lane)
+{
+    return (acc ^ xxh_round(0, lane)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t chain(uint64_t h, uint64_t next)
+{
+    uint64_t pair[2] = {h, next};
+    return xxh64(pair, sizeof pair, 0);
+}
+
+// any rebuild of the assembler is a new version; without /proc, the time it was compiled
+static uint64_t hash_executable(void)
+{
+    static const char built[] = __DATE__ " " __TIME__;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return xxh64(built, sizeof built - 1, 0);
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return xxh64(built, sizeof built - 1, 0);
+    uint64_t h = xxh64(data, (size_t)st.st_size, 0);
+    munmap(data, (size_t)st.st_size);
+    return h;
+}
+
+static uint64_t main_key(const BuildCache *bc, const CachedFile *input, const AssembleOptions *opts)
+{
+    uint64_t parts[4] = {bc->base, (uint64_t)opts->optimize | (uint64_t)opts->object << 1,
+                         xxh64(input->path, strlen(input->path), 0), xxh64(input->data, input->size, 0)};
+    return xxh64(parts, sizeof parts, 0);
+}
+
+// the manifest of key, if every include it lists still has the bytes it had and none of the
+// paths an %include tried before it has appeared
+static bool lookup(const BuildCache *bc, FileCache *cache, uint64_t key, uint64_t *result_out)
+{
+    char name[PATH_MAX];
+    snprintf(name, sizeof name, "%s/%016" PRIx64 ".m", bc->dir, key);
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return false;
+
+    uint64_t result = key;
+    bool ok = true;
+    char line[PATH_MAX + 32];
+    while (ok && fgets(line, sizeof line, f))
+    {
+        uint64_t hash;
+        int path_at = 0;
+        size_t len = strlen(line);
+        const CachedFile *file;
+        if (len > 2 && line[0] == '-' && line[1] == ' ' && line[len - 1] == '\n')
+        {
+            line[len - 1] = '\0';
+            ok = access(line + 2, F_OK) != 0;
+            continue;
+        }
+        if (len == 0 || line[len - 1] != '\n' || sscanf(line, "%16" SCNx64 " %n", &hash, &path_at) != 1 || path_at == 0)
+        {
+            ok = false;
+            break;
+        }
+        line[len - 1] = '\0';
+        ok = filecache_open(cache, line + path_at, &file) == 0 && xxh64(file->data, file->size, 0) == hash;
+        result = chain(result, hash);
+    }
+    ok = ok && !ferror(f);
+    fclose(f);
+    *result_out = result;
+    return ok;
+}
+
+static bool fetch(const BuildCache *bc, uint64_t result, const char *out_name, size_t *size_out)
+{
+    char name[PATH_MAX];
+    snprintf(name, sizeof name, "%s/%016" PRIx64 ".o", bc->dir, result);
+    FILE *from = fopen(name, "rb");
+    if (!from)
+        return false;
+
+    // copied rather than linked: --watch and every later assembly rewrite an output in place
+    FILE *to = fopen(out_name, "wb");
+    bool ok = to && copy_stream(from, to, size_out);
+    if (to && fclose(to) != 0)
+        ok = false;
+    fclose(from);
+    return ok;
+}
+
+// the output first, so a manifest never names an output that is not there yet
+static void store(const BuildCache *bc, const FileList *files, const AssembleOptions *opts, const char *out_name)
+{
+    if (files->count == 0)
+        return;
+    uint64_t key = main_key(bc, files->files[0], opts), result = key;
+    for (size_t i = 1; i < files->count; i++)
+    {
+        if (strchr(files->files[i]->path, '\n'))
+            return;
+        result = chain(result, xxh64(files->files[i]->data, files->files[i]->size, 0));
+    }
+    for (size_t i = 0; i < files->missing_count; i++)
+    {
+        if (strchr(files->missing[i], '\n'))
+            return;
+    }
+
+    char tmp[PATH_MAX], name[PATH_MAX];
+    FILE *output = fopen(out_name, "rb");
+    FILE *entry = output ? begin_entry(bc, tmp, sizeof tmp) : NULL;
+    bool ok = false;
+    if (entry)
+    {
+        snprintf(name, sizeof name, "%s/%016" PRIx64 ".o", bc->dir, result);
+        ok = end_entry(entry, tmp, name, copy_stream(output, entry, NULL));
+    }
+    if (output)
+        fclose(output);
+    if (!ok || !(entry = begin_entry(bc, tmp, sizeof tmp)))
+        return;
+
+    for (size_t i = 1; i < files->count; i++)
+        fprintf(entry, "%016" PRIx64 " %s\n", xxh64(files->files[i]->data, files->files[i]->size, 0), files->files[i]->path);
+    for (size_t i = 0; i < files->missing_count; i++)
+        fprintf(entry, "- %s\n", files->missing[i]);
+    snprintf(name, sizeof name, "%s/%016" PRIx64 ".m", bc->dir, key);
+    end_entry(entry, tmp, name, !ferror(entry));
+}
+
+// a temporary file in the cache directory, renamed over the entry once it is complete
+static FILE *begin_entry(const BuildCache *bc, char *tmp, size_t tmp_size)
+{
+    snprintf(tmp, tmp_size, "%s/tmp.XXXXXX", bc->dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return NULL;
+    FILE *f = fdopen(fd, "wb");
+    if (!f)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    return f;
+}
+
+static bool end_entry(FILE *f, const char *tmp, const char *name, bool ok)
+{
+    if (fclose(f) != 0 || !ok || rename(tmp, name) != 0)
+    {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static bool copy_stream(FILE *from, FILE *to, size_t *size_out)
+{
+    char buf[65536];
+    size_t n, size = 0;
+    while ((n = fread(buf, 1, sizeof buf, from)) > 0)
+    {
+        if (fwrite(buf, 1, n, to) != n)
+            return false;
+        size += n;
+    }
+    if (size_out)
+        *size_out = size;
+    return !ferror(from);
+}
@@ -0,0 +1,39 @@
+#ifndef BUILDCACHE_H
+#define BUILDCACHE_H
+
+#include <stdint.h>  // for uint64_t
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+#include "assembler.h" // for AssembleOptions
+
+// The build cache of --cache-dir: outputs kept by a 64-bit XXH64 of everything that decides
+// their bytes, so an unchanged file is never assembled twice. Two kinds of files live in it:
+//
+//   <key>.m     the includes the last assembly of a main file read, a "hash path" line each,
+//               and a "- path" line for each path an %include found missing before those
+//   <result>.o  an output, named by the hash of key and the include hashes
+//
+// key hashes the main file's bytes, its canonical path, the working directory, the running
+// executable's bytes (the assembler version) and the options that change the output. A lookup
+// hashes the main file and each include its manifest lists; every byte is read once and no
+// line is tokenized. Entries are written to a temporary file and renamed into place, so
+// processes sharing a directory only ever see whole ones. Nothing is ever evicted.
+typedef struct
+{
+    const char *dir;
+    uint64_t base; // the key version, the executable and the working directory
+} BuildCache;
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// creates dir if it is missing; prints to stderr and returns 1 if it cannot
+int buildcache_init(BuildCache *bc, const char *dir);
+
+// Copies the cached output to out_name, or runs assemble_file and stores what it wrote.
+// *hit_out tells which. Only for outputs written to out_name: opts->output, source, listing_name,
+// linemap_name and stats must be unset. A cache that cannot be read or written costs a hit,
+// never the build.
+int buildcache_assemble(const BuildCache *bc, const char *in_name, const char *out_name, const AssembleOptions *opts, bool *hit_out);
+
+#endif
@@ -0,0 +1,126 @@
+#define _XOPEN_SOURCE 700 // realpath
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "protocol.c"
+
+// Stands in for my-assembler when a server is running: same arguments and exit status, the
+// server does the work. A relative input is sent as an absolute path since the server has its
+// own working directory; "-" sends standard input as the source instead.
+
+#define CLIENT_SOCKET_DEFAULT "/tmp/my-assembler.sock"
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Correct Usage: my-assembler-client [-s socket] [-O] [--keep-going] input.asm output\n");
+    fprintf(stderr, "               my-assembler-client [-s socket] --stop\n");
+}
+
+static char *read_stdin(size_t *len_out)
+{
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    while (buf)
+    {
+        len += fread(buf + len, 1, cap - len, stdin);
+        if (len < cap)
+            break;
+        cap *= 2;
+        char *tmp = realloc(buf, cap);
+        if (!tmp)
+            free(buf);
+        buf = tmp;
+    }
+    if (!buf)
+        fprintf(stderr, "Error: memory allocation failed (read_stdin)\n");
+    *len_out = len;
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_path = getenv("MY_ASSEMBLER_SOCKET") ? getenv("MY_ASSEMBLER_SOCKET") : CLIENT_SOCKET_DEFAULT;
+    uint32_t flags = 0;
+    const char *files[2];
+    int file_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "-O") == 0)
+            flags |= REQUEST_OPTIMIZE;
+        else if (strcmp(argv[i], "--keep-going") == 0)
+            flags |= REQUEST_KEEP_GOING;
+        else if (strcmp(argv[i], "--stop") == 0)
+            flags |= REQUEST_STOP;
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            print_usage();
+            return 1;
+        }
+        else if (file_count < 2)
+            files[file_count++] = argv[i];
+        else
+            file_count++;
+    }
+
+    if ((flags & REQUEST_STOP) ? file_count != 0 : file_count != 2)
+    {
+        fprintf(stderr, "Error: invalid number of arguments, expected 2\n");
+        print_usage();
+        return 1;
+    }
+
+    int fd = server_connect(socket_path);
+    if (fd < 0)
+        return 1;
+
+    char name[4096 + 2];
+    char *source = NULL;
+    size_t source_len = 0;
+    int status = 1;
+    if (flags & REQUEST_STOP)
+        snprintf(name, sizeof(name), "-");
+    else if (strcmp(files[0], "-") == 0)
+    {
+        // includes are found next to a file called "-" in the current directory
+        if (!getcwd(name, sizeof(name) - 2) || !(source = read_stdin(&source_len)))
+            goto done;
+        strcat(name, "/-");
+    }
+    else if (!realpath(files[0], name))
+    {
+        fprintf(stderr, "Error with input file '%s': %s\n", files[0], strerror(errno));
+        goto done;
+    }
+
+    ServerResult result;
+    if (server_assemble(fd, flags, name, source, source_len, &result) != 0)
+        goto done;
+    fputs(result.diag, stderr);
+    status = result.status;
+
+    if (status == 0 && !(flags & REQUEST_STOP))
+    {
+        FILE *output = fopen(files[1], "wb");
+        if (!output || (result.output_len && fwrite(result.output, 1, result.output_len, output) != result.output_len))
+        {
+            fprintf(stderr, "Error with output file '%s': %s\n", files[1], strerror(errno));
+            status = 1;
+        }
+        if (output && fclose(output) != 0)
+            status = 1;
+    }
+    free(result.output);
+    free(result.diag);
+
+done:
+    free(source);
+    close(fd);
+    return status;
+}
@@ -12,7 +12,7 @@ NASM_DIS="$OUT_DIR/nasm-control.dis"
 PROGRAM="$OUT_DIR/my-program"
 
 # 1. Compile and encode with my program
-gcc main.c -o "$PROGRAM"
+gcc main.c -pthread -o "$PROGRAM"
 "$PROGRAM" "$INPUT" "$MY_OUT"
 
 # 2. encode with NASM
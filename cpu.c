@@ -0,0 +1,851 @@
+#include <stdio.h>  // for fprintf, stderr
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memset, strcmp
+
+#include "cpu.h"
+#include "cycles.h"
+
+static int decode_at(Cpu *cpu, uint16_t ip, DecodedInst *d);
+static inline int decode_modrm(Cpu *cpu, uint16_t ip, size_t *pos, DecodedInst *d, uint8_t *reg_out);
+static inline uint16_t effective_address(const Cpu *cpu, uint8_t mod, uint8_t rm, uint16_t disp);
+static inline uint16_t read_reg(const Cpu *cpu, uint8_t code, uint8_t w);
+static inline void write_reg(Cpu *cpu, uint8_t code, uint8_t w, uint16_t val);
+static inline uint16_t read_mem(const Cpu *cpu, uint16_t addr, uint8_t w);
+static inline void write_mem(Cpu *cpu, uint16_t addr, uint8_t w, uint16_t val);
+static uint16_t alu(Cpu *cpu, MnemonicType mnem, uint16_t a, uint16_t b, uint8_t w);
+static void push_word(Cpu *cpu, uint16_t val);
+static uint16_t pop_word(Cpu *cpu);
+static void flag_instruction(Cpu *cpu, uint8_t opcode);
+static uint16_t control_transfer(Cpu *cpu, const DecodedInst *d, uint16_t addr);
+static inline bool condition_holds(uint16_t flags, uint8_t cond);
+static inline MnemonicType alu_from_ext(uint8_t ext);
+static inline uint8_t address_reg_code(const char *name);
+
+int cpu_init(Cpu *cpu, const uint8_t *code, size_t code_len)
+{
+    memset(cpu, 0, sizeof *cpu);
+    // ip would wrap before it could leave the code, so the program could never end
+    if (code_len >= CPU_MEM_SIZE)
+    {
+        fprintf(stderr, "Error: the binary is %zu bytes, the emulator runs at most %d\n", code_len, CPU_MEM_SIZE - 1);
+        return 1;
+    }
+    cpu->mem = calloc(CPU_MEM_SIZE, 1);
+    cpu->cache = calloc(code_len ? code_len : 1, sizeof *cpu->cache);
+    if (!cpu->mem || !cpu->cache)
+    {
+        fprintf(stderr, "Error: memory allocation failed (cpu_init)\n");
+        cpu_free(cpu);
+        return 1;
+    }
+    cpu->code = code;
+    cpu->code_len = code_len;
+    return 0;
+}
+
+void cpu_free(Cpu *cpu)
+{
+    free(cpu->mem);
+    free(cpu->cache);
+    cpu->mem = NULL;
+    cpu->cache = NULL;
+}
+
+// deterministic, non-zero registers and memory so that differences actually show up
+void cpu_reset(Cpu *cpu, uint32_t seed)
+{
+    uint32_t x = seed ? seed : 1;
+    for (int i = 0; i < 8; i++)
+    {
+        x = x * 1103515245u + 12345u;
+        cpu->regs[i] = (uint16_t)(x >> 16);
+    }
+    for (size_t i = 0; i < CPU_MEM_SIZE; i++)
+    {
+        x = x * 1103515245u + 12345u;
+        cpu->mem[i] = (uint8_t)(x >> 16);
+    }
+    cpu->ip = 0;
+    cpu->flags = 0;
+    cpu->instructions = 0;
+    cpu->cycles = 0;
+}
+
+// Runs from the current IP until it leaves the code, returns CPU_STEP_LIMIT if it is still
+// inside after max_steps instructions. Each IP is decoded once into cpu->cache and replayed
+// from there on later visits.
+int cpu_run(Cpu *cpu, uint64_t max_steps)
+{
+    for (uint64_t step = 0; cpu->ip < cpu->code_len; step++)
+    {
+        if (step == max_steps)
+            return CPU_STEP_LIMIT;
+
+        DecodedInst *d = &cpu->cache[cpu->ip];
+        if (!d->valid && decode_at(cpu, cpu->ip, d) != 0)
+            return 1;
+
+        uint16_t addr = 0;
+        if (d->dst == LOC_MEM || d->src == LOC_MEM)
+            addr = effective_address(cpu, d->mod, d->rm, d->disp);
+
+        if (d->mnem >= T_JMP) // T_JMP and everything after it in MnemonicType transfers control
+        {
+            cpu->ip = control_transfer(cpu, d, addr);
+            cpu->instructions++;
+            continue;
+        }
+
+        uint16_t a = 0, b = 0;
+        switch (d->src)
+        {
+        case LOC_REG:
+            b = read_reg(cpu, d->src_reg, d->w);
+            break;
+        case LOC_MEM:
+            b = read_mem(cpu, addr, d->w);
+            break;
+        case LOC_IMM:
+            b = d->imm;
+            break;
+        }
+
+        if (d->mnem != T_MOV && d->mnem != T_PUSH && d->mnem != T_POP && d->dst != LOC_NONE)
+            a = (d->dst == LOC_REG) ? read_reg(cpu, d->dst_reg, d->w) : read_mem(cpu, addr, d->w);
+
+        // push reads its operand after sp moves, so push sp stores the new sp like the 8086 does
+        uint16_t result;
+        switch (d->mnem)
+        {
+        case T_MOV:
+            result = b;
+            break;
+        case T_PUSH:
+            cpu->regs[4] -= 2;
+            result = (d->dst == LOC_REG) ? read_reg(cpu, d->dst_reg, 1) : read_mem(cpu, addr, 1);
+            write_mem(cpu, cpu->regs[4], 1, result);
+            break;
+        case T_POP:
+            result = pop_word(cpu);
+            break;
+        case T_XCHG:
+            write_reg(cpu, d->src_reg, d->w, a);
+            result = b;
+            break;
+        case T_FLAG:
+            flag_instruction(cpu, d->cond);
+            result = 0;
+            break;
+        default:
+            result = alu(cpu, d->mnem, a, b, d->w);
+            break;
+        }
+
+        if (d->mnem != T_CMP && d->mnem != T_PUSH && d->mnem != T_FLAG)
+        {
+            if (d->dst == LOC_REG)
+                write_reg(cpu, d->dst_reg, d->w, result);
+            else
+                write_mem(cpu, addr, d->w, result);
+        }
+
+        cpu->cycles += d->cycles;
+        if (d->w && (addr & 1) && (d->dst == LOC_MEM || d->src == LOC_MEM))
+            cpu->cycles += 4 * d->transfers;
+
+        cpu->ip += d->len;
+        cpu->instructions++;
+    }
+    return 0;
+}
+
+// Executes one Instruction straight from the IR, the reference for the differential mode.
+int cpu_eval_instruction(Cpu *cpu, const Instruction *inst)
+{
+    uint8_t w = (inst->op1.size == SZ_WORD) ? 1 : 0;
+    const Operand *ops[2] = {&inst->op1, &inst->op2};
+    uint16_t vals[2] = {0, 0};
+    uint16_t addr = 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        const Operand *op = ops[i];
+        switch (op->opType)
+        {
+        case OP_REG:
+            vals[i] = read_reg(cpu, op->reg.reg_code, w);
+            break;
+        case OP_IMM:
+            vals[i] = op->imm.value;
+            break;
+        case OP_MEM:
+        {
+            uint16_t ea = (uint16_t)op->mem.disp_value;
+            if (op->mem.base_reg)
+                ea += cpu->regs[address_reg_code(op->mem.base_reg)];
+            if (op->mem.index_reg)
+                ea += cpu->regs[address_reg_code(op->mem.index_reg)];
+            addr = ea;
+            vals[i] = read_mem(cpu, addr, w);
+            break;
+        }
+        case OP_NONE:
+            break;
+        }
+    }
+
+    uint16_t result;
+    switch (inst->mnem)
+    {
+    case T_MOV:
+        result = vals[1];
+        break;
+    case T_PUSH:
+        // the operand as read after sp moves, for push sp
+        push_word(cpu, inst->op1.opType == OP_REG && inst->op1.reg.reg_code == 4 ? (uint16_t)(vals[0] - 2) : vals[0]);
+        return 0;
+    case T_POP:
+        result = pop_word(cpu);
+        break;
+    case T_XCHG:
+        if (inst->op2.opType == OP_REG)
+            write_reg(cpu, inst->op2.reg.reg_code, w, vals[0]);
+        else
+            write_mem(cpu, addr, w, vals[0]);
+        result = vals[1];
+        break;
+    case T_FLAG:
+        flag_instruction(cpu, inst->cond);
+        return 0;
+    case T_INC:
+    case T_DEC:
+    case T_NEG:
+    case T_NOT:
+    case T_ADD:
+    case T_SUB:
+    case T_CMP:
+    case T_XOR:
+        result = alu(cpu, inst->mnem, vals[0], vals[1], w);
+        break;
+    default:
+        fprintf(stderr, "Error: evaluation of that instruction is not supported for now\n");
+        return 1;
+    }
+
+    if (inst->mnem == T_CMP)
+        return 0;
+    if (inst->op1.opType == OP_REG)
+        write_reg(cpu, inst->op1.reg.reg_code, w, result);
+    else
+        write_mem(cpu, addr, w, result);
+    return 0;
+}
+
+static int decode_at(Cpu *cpu, uint16_t ip, DecodedInst *d)
+{
+    memset(d, 0, sizeof *d);
+    const uint8_t *c = cpu->code;
+    size_t pos = ip;
+    uint8_t op = c[pos++];
+    uint8_t reg = 0;
+    bool acc_form = false;
+
+#define NEED(n)                                                                                      \
+    do                                                                                               \
+    {                                                                                                \
+        if (pos + (n) > cpu->code_len)                                                               \
+        {                                                                                            \
+            fprintf(stderr, "Error: truncated instruction at %04X (opcode 0x%02X)\n", ip, op);        \
+            return 1;                                                                                \
+        }                                                                                            \
+    } while (0)
+
+    // add, sub, xor and cmp sit in opcode rows 0, 5, 6 and 7 (the same numbers as their /digit)
+    uint8_t row = op >> 3;
+    bool alu_row = op < 0x40 && (row == 0 || row == 5 || row == 6 || row == 7);
+
+    if (alu_row && (op & 0x07) <= 0x03)
+    {
+        // add/sub/cmp/xor r/m, reg (d=0) or reg, r/m (d=1)
+        d->mnem = alu_from_ext(row);
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (op & 2)
+        {
+            d->src = d->dst;
+            d->src_reg = d->dst_reg;
+            d->dst = LOC_REG;
+            d->dst_reg = reg;
+        }
+        else
+        {
+            d->src = LOC_REG;
+            d->src_reg = reg;
+        }
+    }
+    else if (alu_row && ((op & 0x07) == 0x04 || (op & 0x07) == 0x05))
+    {
+        // add/sub/cmp/xor al/ax, imm
+        d->mnem = alu_from_ext(row);
+        d->w = op & 1;
+        d->dst = LOC_REG;
+        d->dst_reg = 0;
+        d->src = LOC_IMM;
+        NEED(1 + d->w);
+        d->imm = d->w ? (uint16_t)(c[pos] | (c[pos + 1] << 8)) : c[pos];
+        pos += 1 + d->w;
+    }
+    else if (op >= 0x40 && op <= 0x5F)
+    {
+        // inc/dec/push/pop reg16
+        static const MnemonicType row[4] = {T_INC, T_DEC, T_PUSH, T_POP};
+        d->mnem = row[(op >> 3) & 0x03];
+        d->w = 1;
+        d->dst = LOC_REG;
+        d->dst_reg = op & 0x07;
+    }
+    else if (op == 0x86 || op == 0x87)
+    {
+        // xchg reg, r/m
+        d->mnem = T_XCHG;
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        d->src = LOC_REG;
+        d->src_reg = reg;
+    }
+    else if (op == 0x8F)
+    {
+        // pop r/m16 (/0)
+        d->mnem = T_POP;
+        d->w = 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (reg != 0)
+        {
+            fprintf(stderr, "Error: unsupported pop operation /%u at %04X\n", reg, ip);
+            return 1;
+        }
+    }
+    else if (op >= 0x90 && op <= 0x97)
+    {
+        // xchg ax, reg16, 0x90 is nop
+        d->mnem = T_XCHG;
+        d->w = 1;
+        d->dst = LOC_REG;
+        d->dst_reg = 0;
+        d->src = LOC_REG;
+        d->src_reg = op & 0x07;
+        acc_form = true;
+    }
+    else if ((op >= 0x9C && op <= 0x9F) || op == 0xF5 || (op >= 0xF8 && op <= 0xFD))
+    {
+        // pushf, popf, sahf, lahf, cmc, clc, stc, cli, sti, cld, std
+        d->mnem = T_FLAG;
+        d->cond = op;
+    }
+    else if (op == 0xF6 || op == 0xF7)
+    {
+        // not (/2) and neg (/3) r/m
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (reg != 2 && reg != 3)
+        {
+            fprintf(stderr, "Error: unsupported group-3 operation /%u at %04X\n", reg, ip);
+            return 1;
+        }
+        d->mnem = reg == 2 ? T_NOT : T_NEG;
+    }
+    else if (op >= 0x80 && op <= 0x83 && op != 0x82)
+    {
+        // 80 r/m8, imm8 / 81 r/m16, imm16 / 83 r/m16, sign-extended imm8
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (reg != 0 && reg != 5 && reg != 6 && reg != 7)
+        {
+            fprintf(stderr, "Error: unsupported group-1 operation /%u at %04X\n", reg, ip);
+            return 1;
+        }
+        d->mnem = alu_from_ext(reg);
+        d->src = LOC_IMM;
+        if (op == 0x81)
+        {
+            NEED(2);
+            d->imm = (uint16_t)(c[pos] | (c[pos + 1] << 8));
+            pos += 2;
+        }
+        else
+        {
+            NEED(1);
+            d->imm = (op == 0x83) ? (uint16_t)(int16_t)(int8_t)c[pos] : c[pos];
+            pos += 1;
+        }
+    }
+    else if (op >= 0x88 && op <= 0x8B)
+    {
+        // mov r/m, reg (d=0) or reg, r/m (d=1)
+        d->mnem = T_MOV;
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (op & 2)
+        {
+            d->src = d->dst;
+            d->src_reg = d->dst_reg;
+            d->dst = LOC_REG;
+            d->dst_reg = reg;
+        }
+        else
+        {
+            d->src = LOC_REG;
+            d->src_reg = reg;
+        }
+    }
+    else if (op >= 0xA0 && op <= 0xA3)
+    {
+        // mov al/ax, [addr] and mov [addr], al/ax
+        d->mnem = T_MOV;
+        d->w = op & 1;
+        d->mod = 0x00;
+        d->rm = 0x06;
+        NEED(2);
+        d->disp = (uint16_t)(c[pos] | (c[pos + 1] << 8));
+        pos += 2;
+        if (op & 2)
+        {
+            d->dst = LOC_MEM;
+            d->src = LOC_REG;
+            d->src_reg = 0;
+        }
+        else
+        {
+            d->dst = LOC_REG;
+            d->dst_reg = 0;
+            d->src = LOC_MEM;
+        }
+        acc_form = true;
+    }
+    else if (op >= 0xB0 && op <= 0xBF)
+    {
+        // mov reg, imm
+        d->mnem = T_MOV;
+        d->w = (op >> 3) & 1;
+        d->dst = LOC_REG;
+        d->dst_reg = op & 0x07;
+        d->src = LOC_IMM;
+        NEED(1 + d->w);
+        d->imm = d->w ? (uint16_t)(c[pos] | (c[pos + 1] << 8)) : c[pos];
+        pos += 1 + d->w;
+    }
+    else if (op == 0xC6 || op == 0xC7)
+    {
+        // mov r/m, imm
+        d->mnem = T_MOV;
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        d->src = LOC_IMM;
+        NEED(1 + d->w);
+        d->imm = d->w ? (uint16_t)(c[pos] | (c[pos + 1] << 8)) : c[pos];
+        pos += 1 + d->w;
+    }
+    else if (op == 0xFE || op == 0xFF)
+    {
+        // inc/dec r/m, call r/m16 (/2), jmp r/m16 (/4) and push r/m16 (/6)
+        d->w = op & 1;
+        if (decode_modrm(cpu, ip, &pos, d, &reg) != 0)
+            return 1;
+        if (reg > 1 && !(op == 0xFF && (reg == 2 || reg == 4 || reg == 6)))
+        {
+            fprintf(stderr, "Error: unsupported group-4/5 operation /%u at %04X\n", reg, ip);
+            return 1;
+        }
+        static const MnemonicType group5[8] = {T_INC, T_DEC, T_CALL, T_CALL, T_JMP, T_JMP, T_PUSH, T_PUSH};
+        d->mnem = group5[reg];
+    }
+    else if ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3) || op == 0xEB)
+    {
+        // jcc, loopne, loope, loop, jcxz and jmp short: rel8
+        static const MnemonicType e_row[4] = {T_LOOPNE, T_LOOPE, T_LOOP, T_JCXZ};
+        d->mnem = op < 0x80 ? T_JCC : op == 0xEB ? T_JMP : e_row[op & 0x03];
+        d->cond = op & 0x0F;
+        d->w = 1;
+        d->dst = LOC_IMM;
+        NEED(1);
+        int8_t rel = (int8_t)c[pos++];
+        d->imm = (uint16_t)(pos + rel);
+    }
+    else if (op == 0xE8 || op == 0xE9)
+    {
+        // call near and jmp near: rel16
+        d->mnem = op == 0xE8 ? T_CALL : T_JMP;
+        d->w = 1;
+        d->dst = LOC_IMM;
+        NEED(2);
+        uint16_t rel = (uint16_t)(c[pos] | (c[pos + 1] << 8));
+        pos += 2;
+        d->imm = (uint16_t)(pos + rel);
+    }
+    else if (op == 0xC3)
+    {
+        d->mnem = T_RET;
+        d->w = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Error: unsupported opcode 0x%02X at %04X\n", op, ip);
+        return 1;
+    }
+#undef NEED
+
+    d->len = (uint8_t)(pos - ip);
+
+    OperandType dst = d->dst == LOC_REG ? OP_REG : d->dst == LOC_MEM ? OP_MEM
+                                                   : d->dst == LOC_IMM ? OP_IMM
+                                                                       : OP_NONE;
+    OperandType src = d->src == LOC_REG ? OP_REG : d->src == LOC_MEM ? OP_MEM
+                                                   : d->src == LOC_IMM ? OP_IMM
+                                                                       : OP_NONE;
+    d->cycles = (uint16_t)base_cycles(d->mnem, dst, src, d->w ? SZ_WORD : SZ_BYTE, acc_form);
+    if ((dst == OP_MEM || src == OP_MEM) && !acc_form)
+        d->cycles += (uint16_t)ea_cycles_modrm(d->mod, d->rm);
+    if (d->mnem == T_FLAG)
+        d->cycles = (uint16_t)flag_cycles(op);
+    d->transfers = (uint8_t)word_transfers(d->mnem, dst == OP_MEM);
+    d->valid = 1;
+    return 0;
+}
+
+// fills dst (register or memory) from a ModRM byte and its displacement, returns the REG field
+static inline int decode_modrm(Cpu *cpu, uint16_t ip, size_t *pos, DecodedInst *d, uint8_t *reg_out)
+{
+    const uint8_t *c = cpu->code;
+    if (*pos >= cpu->code_len)
+    {
+        fprintf(stderr, "Error: truncated instruction at %04X (missing ModRM)\n", ip);
+        return 1;
+    }
+
+    uint8_t modrm = c[(*pos)++];
+    uint8_t mod = modrm >> 6;
+    *reg_out = (modrm >> 3) & 0x07;
+    d->rm = modrm & 0x07;
+    d->mod = mod;
+
+    if (mod == 0x03)
+    {
+        d->dst = LOC_REG;
+        d->dst_reg = d->rm;
+        return 0;
+    }
+
+    d->dst = LOC_MEM;
+    size_t disp_len = (mod == 0x01) ? 1 : (mod == 0x02 || (mod == 0x00 && d->rm == 0x06)) ? 2
+                                                                                             : 0;
+    if (*pos + disp_len > cpu->code_len)
+    {
+        fprintf(stderr, "Error: truncated instruction at %04X (missing displacement)\n", ip);
+        return 1;
+    }
+    if (disp_len == 1)
+        d->disp = (uint16_t)(int16_t)(int8_t)c[*pos];
+    else if (disp_len == 2)
+        d->disp = (uint16_t)(c[*pos] | (c[*pos + 1] << 8));
+    *pos += disp_len;
+    return 0;
+}
+
+static inline uint16_t effective_address(const Cpu *cpu, uint8_t mod, uint8_t rm, uint16_t disp)
+{
+    const uint16_t *r = cpu->regs;
+    switch (rm)
+    {
+    case 0x00:
+        return (uint16_t)(r[3] + r[6] + disp); // bx + si
+    case 0x01:
+        return (uint16_t)(r[3] + r[7] + disp); // bx + di
+    case 0x02:
+        return (uint16_t)(r[5] + r[6] + disp); // bp + si
+    case 0x03:
+        return (uint16_t)(r[5] + r[7] + disp); // bp + di
+    case 0x04:
+        return (uint16_t)(r[6] + disp); // si
+    case 0x05:
+        return (uint16_t)(r[7] + disp); // di
+    case 0x06:
+        return mod == 0x00 ? disp : (uint16_t)(r[5] + disp); // direct address or bp
+    default:
+        return (uint16_t)(r[3] + disp); // bx
+    }
+}
+
+// byte register codes 0-3 are the low halves of ax..bx, 4-7 the high halves
+static inline uint16_t read_reg(const Cpu *cpu, uint8_t code, uint8_t w)
+{
+    if (w)
+        return cpu->regs[code];
+    return (code < 4) ? (cpu->regs[code] & 0xFF) : (cpu->regs[code - 4] >> 8);
+}
+
+static inline void write_reg(Cpu *cpu, uint8_t code, uint8_t w, uint16_t val)
+{
+    if (w)
+        cpu->regs[code] = val;
+    else if (code < 4)
+        cpu->regs[code] = (cpu->regs[code] & 0xFF00) | (val & 0xFF);
+    else
+        cpu->regs[code - 4] = (cpu->regs[code - 4] & 0x00FF) | (uint16_t)((val & 0xFF) << 8);
+}
+
+// word accesses wrap around the end of the segment like on the real CPU
+static inline uint16_t read_mem(const Cpu *cpu, uint16_t addr, uint8_t w)
+{
+    if (!w)
+        return cpu->mem[addr];
+    return (uint16_t)(cpu->mem[addr] | (cpu->mem[(uint16_t)(addr + 1)] << 8));
+}
+
+static inline void write_mem(Cpu *cpu, uint16_t addr, uint8_t w, uint16_t val)
+{
+    cpu->mem[addr] = (uint8_t)val;
+    if (w)
+        cpu->mem[(uint16_t)(addr + 1)] = (uint8_t)(val >> 8);
+}
+
+// jumps, calls, loops and ret: returns the next IP and counts the clocks of the path taken
+static uint16_t control_transfer(Cpu *cpu, const DecodedInst *d, uint16_t addr)
+{
+    uint16_t next = (uint16_t)(cpu->ip + d->len);
+    uint16_t target = d->imm;
+    if (d->dst == LOC_REG)
+        target = read_reg(cpu, d->dst_reg, 1);
+    else if (d->dst == LOC_MEM)
+        target = read_mem(cpu, addr, 1);
+
+    uint16_t *cx = &cpu->regs[1];
+    bool taken = true;
+    switch (d->mnem)
+    {
+    case T_JCC:
+        taken = condition_holds(cpu->flags, d->cond);
+        break;
+    case T_LOOP:
+        taken = --*cx != 0;
+        break;
+    case T_LOOPE:
+        taken = --*cx != 0 && (cpu->flags & FLAG_ZF);
+        break;
+    case T_LOOPNE:
+        taken = --*cx != 0 && !(cpu->flags & FLAG_ZF);
+        break;
+    case T_JCXZ:
+        taken = *cx == 0;
+        break;
+    case T_CALL:
+        push_word(cpu, next);
+        break;
+    case T_RET:
+        target = pop_word(cpu);
+        break;
+    default:
+        break;
+    }
+
+    cpu->cycles += taken ? d->cycles : branch_not_taken_cycles(d->mnem);
+    return taken ? target : next;
+}
+
+// the 16 jcc conditions come in pairs, an odd code is the negation of the even one before it
+static inline bool condition_holds(uint16_t flags, uint8_t cond)
+{
+    bool cf = flags & FLAG_CF, zf = flags & FLAG_ZF, sf = flags & FLAG_SF;
+    bool of = flags & FLAG_OF, pf = flags & FLAG_PF;
+    bool holds;
+    switch (cond >> 1)
+    {
+    case 0:
+        holds = of;
+        break;
+    case 1:
+        holds = cf;
+        break;
+    case 2:
+        holds = zf;
+        break;
+    case 3:
+        holds = cf || zf;
+        break;
+    case 4:
+        holds = sf;
+        break;
+    case 5:
+        holds = pf;
+        break;
+    case 6:
+        holds = sf != of;
+        break;
+    default:
+        holds = zf || sf != of;
+        break;
+    }
+    return (cond & 1) ? !holds : holds;
+}
+
+// add/sub/cmp/xor/inc/dec/neg/not with the 8086 flag semantics (AF is cleared by xor, not
+// changes no flag)
+static uint16_t alu(Cpu *cpu, MnemonicType mnem, uint16_t a, uint16_t b, uint8_t w)
+{
+    uint32_t mask = w ? 0xFFFF : 0xFF;
+    uint32_t sign = w ? 0x8000 : 0x80;
+    uint32_t r;
+    uint16_t f = cpu->flags & ~(FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF);
+
+    if (mnem == T_NOT)
+        return (uint16_t)(~a & mask);
+    // neg is 0 - a
+    if (mnem == T_NEG)
+    {
+        b = a;
+        a = 0;
+    }
+    a &= mask;
+    b &= mask;
+
+    switch (mnem)
+    {
+    case T_INC:
+    case T_ADD:
+        if (mnem == T_INC)
+            b = 1;
+        r = (uint32_t)a + b;
+        if (mnem == T_INC)
+            f |= cpu->flags & FLAG_CF; // inc leaves CF alone
+        else if (r > mask)
+            f |= FLAG_CF;
+        if ((a ^ r) & (b ^ r) & sign)
+            f |= FLAG_OF;
+        if ((a ^ b ^ r) & 0x10)
+            f |= FLAG_AF;
+        break;
+    case T_DEC:
+    case T_SUB:
+    case T_CMP:
+    case T_NEG:
+        if (mnem == T_DEC)
+            b = 1;
+        r = (uint32_t)a - b;
+        if (mnem == T_DEC)
+            f |= cpu->flags & FLAG_CF; // dec leaves CF alone
+        else if (a < b)
+            f |= FLAG_CF;
+        if ((a ^ b) & (a ^ r) & sign)
+            f |= FLAG_OF;
+        if ((a ^ b ^ r) & 0x10)
+            f |= FLAG_AF;
+        break;
+    default: // T_XOR
+        r = a ^ b;
+        break;
+    }
+
+    r &= mask;
+    if (r == 0)
+        f |= FLAG_ZF;
+    if (r & sign)
+        f |= FLAG_SF;
+    uint8_t parity = (uint8_t)r;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    if (!(parity & 1))
+        f |= FLAG_PF; // even number of set bits in the low byte
+
+    cpu->flags = f;
+    return (uint16_t)r;
+}
+
+static void push_word(Cpu *cpu, uint16_t val)
+{
+    cpu->regs[4] -= 2;
+    write_mem(cpu, cpu->regs[4], 1, val);
+}
+
+static uint16_t pop_word(Cpu *cpu)
+{
+    uint16_t val = read_mem(cpu, cpu->regs[4], 1);
+    cpu->regs[4] += 2;
+    return val;
+}
+
+// the T_FLAG instructions by opcode; lahf and sahf move SF, ZF, AF, PF and CF through ah
+static void flag_instruction(Cpu *cpu, uint8_t opcode)
+{
+    const uint16_t ah_flags = FLAG_SF | FLAG_ZF | FLAG_AF | FLAG_PF | FLAG_CF;
+    switch (opcode)
+    {
+    case 0x9C: // pushf
+        push_word(cpu, cpu->flags);
+        break;
+    case 0x9D: // popf
+        cpu->flags = pop_word(cpu);
+        break;
+    case 0x9E: // sahf
+        cpu->flags = (cpu->flags & ~ah_flags) | ((cpu->regs[0] >> 8) & ah_flags);
+        break;
+    case 0x9F: // lahf
+        write_reg(cpu, 4, 0, cpu->flags & ah_flags);
+        break;
+    case 0xF5: // cmc
+        cpu->flags ^= FLAG_CF;
+        break;
+    case 0xF8: // clc
+        cpu->flags &= ~FLAG_CF;
+        break;
+    case 0xF9: // stc
+        cpu->flags |= FLAG_CF;
+        break;
+    case 0xFA: // cli
+        cpu->flags &= ~FLAG_IF;
+        break;
+    case 0xFB: // sti
+        cpu->flags |= FLAG_IF;
+        break;
+    case 0xFC: // cld
+        cpu->flags &= ~FLAG_DF;
+        break;
+    default: // 0xFD std
+        cpu->flags |= FLAG_DF;
+        break;
+    }
+}
+
+// the /digit of the 80/81/83 group, also bits 3-5 of the add/sub/cmp/xor opcodes
+static inline MnemonicType alu_from_ext(uint8_t ext)
+{
+    switch (ext)
+    {
+    case 0:
+        return T_ADD;
+    case 5:
+        return T_SUB;
+    case 6:
+        return T_XOR;
+    default:
+        return T_CMP;
+    }
+}
+
+// the registers allowed in a memory operand, by register code
+static inline uint8_t address_reg_code(const char *name)
+{
+    if (strcmp(name, "bx") == 0)
+        return 3;
+    if (strcmp(name, "bp") == 0)
+        return 5;
+    if (strcmp(name, "si") == 0)
+        return 6;
+    return 7; // di
+}
@@ -0,0 +1,73 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>  // for uint8_t, uint16_t, uint64_t
+#include <stddef.h>  // for size_t
+#include <stdbool.h> // for bool
+
+#include "parser.h" // for Instruction, MnemonicType
+
+#define CPU_MEM_SIZE 0x10000 // one 64 KiB data segment, code lives in its own buffer
+#define CPU_STEP_LIMIT 2      // what cpu_run returns when max_steps ran out before IP left the code
+
+// FLAGS register bits
+#define FLAG_CF 0x0001
+#define FLAG_PF 0x0004
+#define FLAG_AF 0x0010
+#define FLAG_ZF 0x0040
+#define FLAG_SF 0x0080
+#define FLAG_IF 0x0200
+#define FLAG_DF 0x0400
+#define FLAG_OF 0x0800
+
+typedef enum
+{
+    LOC_NONE,
+    LOC_REG,
+    LOC_MEM,
+    LOC_IMM
+} OperandLoc;
+
+// one instruction decoded from the binary, cached by the IP it starts at
+// Relative jumps, calls and loops decode with dst == LOC_IMM; indirect jmp/call read their
+// target from dst (LOC_REG or LOC_MEM) instead.
+typedef struct
+{
+    MnemonicType mnem;
+    uint8_t valid;     // 0 until the slot has been decoded
+    uint8_t len;       // instruction length in bytes
+    uint8_t w;         // 0 = byte, 1 = word
+    uint8_t dst, src;  // OperandLoc
+    uint8_t dst_reg;   // register code when dst == LOC_REG
+    uint8_t src_reg;   // register code when src == LOC_REG
+    uint8_t mod, rm;   // addressing mode when either side is LOC_MEM
+    uint16_t disp;     // displacement or direct address
+    uint16_t imm;      // immediate when src == LOC_IMM, the target IP when dst == LOC_IMM
+    uint8_t cond;      // T_JCC condition code, T_FLAG opcode
+    uint16_t cycles;   // base + EA clocks, the odd-address penalty is added at run time
+    uint8_t transfers; // word transfers subject to the odd-address penalty
+} DecodedInst;
+
+typedef struct
+{
+    uint16_t regs[8]; // ax, cx, dx, bx, sp, bp, si, di (register code order)
+    uint16_t ip;
+    uint16_t flags;
+    uint8_t *mem; // CPU_MEM_SIZE bytes
+
+    const uint8_t *code;
+    size_t code_len;
+    DecodedInst *cache; // code_len slots, indexed by IP
+
+    uint64_t instructions; // executed so far
+    uint64_t cycles;       // simulated clocks so far
+} Cpu;
+
+// code_len must leave ip room to step past the code, under CPU_MEM_SIZE
+int cpu_init(Cpu *cpu, const uint8_t *code, size_t code_len);
+void cpu_free(Cpu *cpu);
+void cpu_reset(Cpu *cpu, uint32_t seed);
+int cpu_run(Cpu *cpu, uint64_t max_steps);
+int cpu_eval_instruction(Cpu *cpu, const Instruction *inst);
+
+#endif
@@ -0,0 +1,75 @@
+#define _XOPEN_SOURCE 700 // open_memstream, and realpath for the file cache
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.c"
+#include "cpu.c"
+
+// assembles source in memory, the binary is returned in *code_out
+static size_t assemble_source(const char *source, uint8_t **code_out)
+{
+    char *code = NULL;
+    size_t len = 0;
+    FILE *output = open_memstream(&code, &len);
+    assert(output);
+    AssembleOptions opts = {.source = source, .source_len = strlen(source), .output = output};
+    assert(assemble_file("test.asm", "test.bin", &opts) == 0);
+    fclose(output);
+    *code_out = (uint8_t *)code;
+    return len;
+}
+
+static void test_runs_off_the_end(void)
+{
+    uint8_t *code;
+    size_t len = assemble_source("bits 16\nmov ax, 5\nmov bx, ax\nxchg ax, cx\n", &code);
+    Cpu cpu;
+    assert(cpu_init(&cpu, code, len) == 0);
+    cpu_reset(&cpu, 1);
+    assert(cpu_run(&cpu, 100) == 0);
+    assert(cpu.regs[1] == 5 && cpu.regs[3] == 5 && cpu.instructions == 3);
+    cpu_free(&cpu);
+    free(code);
+}
+
+static void test_step_limit(void)
+{
+    uint8_t *code;
+    size_t len = assemble_source("bits 16\ntop: jmp top\n", &code);
+    Cpu cpu;
+    assert(cpu_init(&cpu, code, len) == 0);
+    cpu_reset(&cpu, 1);
+    assert(cpu_run(&cpu, 1000) == CPU_STEP_LIMIT);
+    assert(cpu.instructions == 1000);
+    cpu_free(&cpu);
+    free(code);
+}
+
+// a 16-bit ip wraps before it can leave a binary of 64 KiB or more
+static void test_too_large(void)
+{
+    uint8_t *code;
+    size_t len = assemble_source("bits 16\ntimes 65537 db 90h\n", &code);
+    assert(len == CPU_MEM_SIZE + 1);
+    Cpu cpu;
+    assert(cpu_init(&cpu, code, len) != 0);
+    assert(cpu_init(&cpu, code, CPU_MEM_SIZE) != 0);
+    assert(cpu_init(&cpu, code, CPU_MEM_SIZE - 1) == 0);
+    cpu_reset(&cpu, 1);
+    assert(cpu_run(&cpu, CPU_MEM_SIZE) == 0);
+    assert(cpu.instructions == CPU_MEM_SIZE - 1);
+    cpu_free(&cpu);
+    free(code);
+}
+
+int main(void)
+{
+    printf("Running cpu tests...\n");
+    test_runs_off_the_end();
+    test_step_limit();
+    test_too_large();
+    printf("All cpu tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include "cycles.h"
+
+// Clock counts from the 8086 user's manual (instruction set reference, table 2-21).
+// Segment overrides and the 8088 bus are not modelled, and the odd-address word
+// penalty can only be applied to numeric direct addresses since register contents
+// (and label addresses, at the time the estimate is made) are unknown.
+
+unsigned estimate_cycles(const Instruction *inst, CycleCount *out)
+{
+    CycleCount c = {0};
+
+    OperandType t1 = inst->op1.opType;
+    OperandType t2 = inst->op2.opType;
+    const Operand *memop = (t1 == OP_MEM) ? &inst->op1 : (t2 == OP_MEM) ? &inst->op2 : NULL;
+
+    // mov between the accumulator and a direct address has its own opcode without an EA calculation
+    bool acc_direct = inst->mnem == T_MOV && memop && memop->mem.base_reg == NULL &&
+                      ((t1 == OP_REG && inst->op1.reg.reg_code == 0) || (t2 == OP_REG && inst->op2.reg.reg_code == 0));
+    // and so has xchg of ax with another word register
+    bool acc_xchg = inst->mnem == T_XCHG && t1 == OP_REG && t2 == OP_REG && inst->op1.size == SZ_WORD &&
+                    (inst->op1.reg.reg_code == 0 || inst->op2.reg.reg_code == 0);
+
+    if (inst->mnem == T_FLAG)
+        c.base = flag_cycles(inst->cond);
+    else
+        c.base = base_cycles(inst->mnem, t1, t2, inst->op1.size, acc_direct || acc_xchg);
+
+    if (memop)
+    {
+        if (!acc_direct)
+            c.ea = ea_cycles(memop);
+
+        if (memop->size == SZ_WORD && memop->mem.base_reg == NULL && !memop->has_symbol && (memop->mem.disp_value & 1))
+            c.penalty = 4 * word_transfers(inst->mnem, memop == &inst->op1);
+    }
+
+    if (out)
+        *out = c;
+    return c.base + c.ea + c.penalty;
+}
+
+unsigned ea_cycles(const Operand *memop)
+{
+    if (memop->mem.base_reg == NULL)
+        return ea_cycles_modrm(0x00, 0x06);
+
+    switch (memop->mem.disp_size)
+    {
+    case SZ_NONE:
+        return ea_cycles_modrm(0x00, memop->mem.rm_code);
+    case SZ_BYTE:
+        return ea_cycles_modrm(0x01, memop->mem.rm_code);
+    default:
+        return ea_cycles_modrm(0x02, memop->mem.rm_code);
+    }
+}
+
+unsigned base_cycles(MnemonicType mnem, OperandType dst, OperandType src, Size size, bool acc_form)
+{
+    switch (mnem)
+    {
+    case T_MOV:
+        if (dst == OP_REG && src == OP_REG)
+            return 2;
+        if (dst == OP_REG && src == OP_IMM)
+            return 4;
+        if (acc_form)
+            return 10;
+        if (dst == OP_REG && src == OP_MEM)
+            return 8;
+        if (dst == OP_MEM && src == OP_REG)
+            return 9;
+        if (dst == OP_MEM && src == OP_IMM)
+            return 10;
+        break;
+    case T_ADD:
+    case T_SUB:
+    case T_CMP:
+    case T_XOR:
+        if (dst == OP_REG && src == OP_REG)
+            return 3;
+        if (dst == OP_REG && src == OP_IMM)
+            return 4;
+        if (dst == OP_REG && src == OP_MEM)
+            return 9;
+        if (dst == OP_MEM && src == OP_REG)
+            return mnem == T_CMP ? 9 : 16; // cmp does not write the result back
+        if (dst == OP_MEM && src == OP_IMM)
+            return mnem == T_CMP ? 10 : 17;
+        break;
+    case T_INC:
+    case T_DEC:
+        if (dst == OP_REG)
+            return size == SZ_WORD ? 2 : 3;
+        if (dst == OP_MEM)
+            return 15;
+        break;
+    case T_NEG:
+    case T_NOT:
+        return dst == OP_REG ? 3 : 16;
+    case T_PUSH:
+        return dst == OP_REG ? 11 : 16;
+    case T_POP:
+        return dst == OP_REG ? 8 : 17;
+    case T_XCHG:
+        if (acc_form)
+            return 3;
+        return dst == OP_REG && src == OP_REG ? 4 : 17;
+    case T_JMP:
+        if (dst == OP_IMM)
+            return 15;
+        return dst == OP_REG ? 11 : 18;
+    case T_CALL:
+        if (dst == OP_IMM)
+            return 19;
+        return dst == OP_REG ? 16 : 21;
+    case T_RET:
+        return 8;
+    default:
+        // conditional branches count as taken here, see branch_not_taken_cycles
+        return branch_taken_cycles(mnem);
+    }
+    return 0;
+}
+
+// clc, stc, cmc, cld, std, cli and sti only flip bits
+unsigned flag_cycles(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case 0x9C: // pushf
+        return 10;
+    case 0x9D: // popf
+        return 8;
+    case 0x9E: // sahf
+    case 0x9F: // lahf
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+unsigned branch_taken_cycles(MnemonicType mnem)
+{
+    switch (mnem)
+    {
+    case T_JCC:
+        return 16;
+    case T_LOOP:
+        return 17;
+    case T_LOOPE:
+    case T_JCXZ:
+        return 18;
+    case T_LOOPNE:
+        return 19;
+    default:
+        return 0;
+    }
+}
+
+unsigned branch_not_taken_cycles(MnemonicType mnem)
+{
+    switch (mnem)
+    {
+    case T_JCC:
+        return 4;
+    case T_LOOP:
+    case T_LOOPNE:
+        return 5;
+    case T_LOOPE:
+    case T_JCXZ:
+        return 6;
+    default:
+        return 0;
+    }
+}
+
+unsigned ea_cycles_modrm(uint8_t mod, uint8_t rm)
+{
+    if (mod == 0x00 && rm == 0x06)
+        return 6; // displacement only
+
+    bool has_disp = mod != 0x00;
+
+    if (rm >= 0x04)
+        return has_disp ? 9 : 5; // base or index (+ displacement)
+
+    // bp+di and bx+si are one clock faster than bp+si and bx+di
+    bool fast_pair = rm == 0x00 || rm == 0x03;
+    if (has_disp)
+        return fast_pair ? 11 : 12;
+    return fast_pair ? 7 : 8;
+}
+
+// read-modify-write forms touch memory twice, everything else once; the stack side of push
+// and pop is not counted, sp is unknown
+unsigned word_transfers(MnemonicType mnem, bool mem_is_dst)
+{
+    if (mnem == T_XCHG)
+        return 2;
+    if (mem_is_dst && mnem != T_MOV && mnem != T_CMP && mnem != T_JMP && mnem != T_CALL && mnem != T_PUSH && mnem != T_POP)
+        return 2;
+    return 1;
+}
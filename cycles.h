@@ -0,0 +1,27 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include "parser.h" // for Instruction, Operand
+
+typedef struct
+{
+    uint16_t base;    // documented clocks of the instruction form
+    uint16_t ea;      // effective-address calculation, 0 without a memory operand
+    uint16_t penalty; // +4 per word transfer to a (statically known) odd address
+} CycleCount;
+
+unsigned estimate_cycles(const Instruction *inst, CycleCount *out);
+unsigned ea_cycles(const Operand *memop);
+
+// building blocks shared with the interpreter, which works from decoded bytes; acc_form is one
+// of the accumulator's own opcodes, mov between al/ax and a direct address or xchg ax, reg16
+unsigned base_cycles(MnemonicType mnem, OperandType dst, OperandType src, Size size, bool acc_form);
+unsigned flag_cycles(uint8_t opcode);
+unsigned ea_cycles_modrm(uint8_t mod, uint8_t rm);
+unsigned word_transfers(MnemonicType mnem, bool mem_is_dst);
+
+// jcc, loop, loope, loopne and jcxz: the clocks when the branch is taken and when it falls through
+unsigned branch_taken_cycles(MnemonicType mnem);
+unsigned branch_not_taken_cycles(MnemonicType mnem);
+
+#endif
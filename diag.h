@@ -0,0 +1,17 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdio.h> // for FILE, stderr
+
+// Where error messages go: stderr, unless the calling thread has pointed diag_stream somewhere
+// else. assemble_file does that for AssembleOptions.diag, so assemblies running on different
+// threads each keep their own messages.
+#ifdef _MSC_VER
+static __declspec(thread) FILE *diag_stream;
+#else
+static _Thread_local FILE *diag_stream;
+#endif
+
+#define DIAG (diag_stream ? diag_stream : stderr)
+
+#endif
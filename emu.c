@@ -0,0 +1,327 @@
+#define _XOPEN_SOURCE 700 // clock_gettime, and realpath for the file cache
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "assembler.c"
+#include "cpu.c"
+
+// Assembles a source file with assemble_file, loads the raw binary and runs it on the
+// in-tree interpreter. --diff also evaluates the parsed Instruction stream directly and
+// compares the final registers, flags and memory of both runs; with -O that also checks
+// the peephole pass, which may only change flags nobody observes. With --line-map the
+// assembler also writes a line map, which names the source line of an instruction that fails.
+
+#define EMU_SEED 0x8086
+#define EMU_MAX_STEPS 100000000ULL
+
+static double sec_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t *read_binary(const char *name, size_t *len_out)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error with binary file '%s': %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    size_t cap = 4096, len = 0;
+    uint8_t *buf = malloc(cap);
+    while (buf)
+    {
+        len += fread(buf + len, 1, cap - len, f);
+        if (len < cap)
+            break;
+        cap *= 2;
+        uint8_t *tmp = realloc(buf, cap);
+        if (!tmp)
+            free(buf);
+        buf = tmp;
+    }
+    fclose(f);
+
+    if (!buf)
+        fprintf(stderr, "Error: memory allocation failed (read_binary)\n");
+    *len_out = len;
+    return buf;
+}
+
+static int load_line_map(const char *name, LineMap *map)
+{
+    size_t len = 0;
+    uint8_t *data = read_binary(name, &len);
+    if (!data)
+        return 1;
+    double t0 = sec_now();
+    int result = linemap_load(data, len, map);
+    double elapsed = sec_now() - t0;
+    free(data);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error with line map file '%s': %s\n", name, strerror(errno));
+        return 1;
+    }
+    printf("line map: %zu lines in %zu files, loaded in %.3f ms\n", map->count, map->file_count, elapsed * 1000.0);
+    return 0;
+}
+
+// the same line loop as assemble_file, but keeping the Instructions instead of encoding them
+static int eval_source(const char *in_name, Cpu *cpu)
+{
+    FILE *input = fopen(in_name, "r");
+    if (!input)
+    {
+        fprintf(stderr, "Error with input file '%s': %s\n", in_name, strerror(errno));
+        return 1;
+    }
+
+    // equ and %define constants, substituted by the tokenizer just like in assemble_file
+    SymbolTable constants;
+    if (symtab_init(&constants) != 0)
+    {
+        fclose(input);
+        return 1;
+    }
+
+    int status = 1;
+    char line[LINE_LEN_MAX];
+    size_t lineno = 0;
+    while (fgets(line, sizeof(line), input))
+    {
+        if (++lineno == 1)
+            continue; // bits 16, already checked by assemble_file
+
+        Token *tokens = NULL;
+        size_t token_count = 0;
+        if (tokenize_line(line, lineno, &constants, &tokens, &token_count) != 0)
+            goto done;
+
+        // labels take no room in the IR; symbol operands are not supported here since
+        // their values only exist inside assemble_file, parse_tokens reports them as undefined
+        if (token_count >= 2 && tokens[0].type == T_IDENT && tokens[1].type == T_COLON)
+        {
+            free(tokens[0].lexeme);
+            free(tokens[1].lexeme);
+            token_count -= 2;
+            memmove(tokens, tokens + 2, token_count * sizeof *tokens);
+        }
+
+        if (token_count == 0)
+        {
+            free(tokens);
+            continue;
+        }
+
+        // constants and align only, macros are not replayed here
+        if (is_directive_line(tokens, token_count))
+        {
+            const Token *dir = (tokens[0].type == T_DIRECTIVE) ? &tokens[0] : &tokens[1];
+            int result = 1;
+            if (strcmp(dir->lexeme, "equ") == 0 || strcmp(dir->lexeme, "%define") == 0)
+                result = define_constant(&constants, tokens, token_count, lineno);
+            else if (strcmp(dir->lexeme, "align") == 0)
+                result = 0; // the padding changes no register, flag or memory
+            else
+                fprintf(stderr, "Error on line %zu: '%s' is not supported by --diff\n", lineno, dir->lexeme);
+            free_tokens(tokens, token_count);
+            if (result != 0)
+                goto done;
+            continue;
+        }
+
+        Instruction inst;
+        if (parse_tokens(tokens, token_count, lineno, NULL, &inst) != 0 || cpu_eval_instruction(cpu, &inst) != 0)
+            goto done;
+    }
+    status = 0;
+
+done:
+    symtab_free(&constants);
+    fclose(input);
+    return status;
+}
+
+static int compare_state(const Cpu *bin, const Cpu *ir)
+{
+    static const char *names[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+    int diffs = 0;
+
+    for (int i = 0; i < 8; i++)
+    {
+        if (bin->regs[i] != ir->regs[i])
+        {
+            printf("  %s: binary %04X, IR %04X\n", names[i], bin->regs[i], ir->regs[i]);
+            diffs++;
+        }
+    }
+    if (bin->flags != ir->flags)
+    {
+        printf("  flags: binary %04X, IR %04X\n", bin->flags, ir->flags);
+        diffs++;
+    }
+    for (size_t a = 0; a < CPU_MEM_SIZE; a++)
+    {
+        if (bin->mem[a] != ir->mem[a])
+        {
+            if (diffs < 32)
+                printf("  [%04zX]: binary %02X, IR %02X\n", a, bin->mem[a], ir->mem[a]);
+            diffs++;
+        }
+    }
+    return diffs;
+}
+
+// why a run stopped before leaving the code, and where if the line map knows
+static void report_stop(const Cpu *cpu, int run, const LineMap *map)
+{
+    if (run == CPU_STEP_LIMIT)
+        fprintf(stderr, "Error: the program did not halt after %llu steps\n", EMU_MAX_STEPS);
+    const LineMapRow *row = linemap_find(map, cpu->ip);
+    if (row)
+        fprintf(stderr, "  at %04X: '%s' line %u\n", cpu->ip, map->files[row->file], row->lineno);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = 1000;
+    bool diff = false;
+    AssembleOptions opts = {0};
+    const char *files[2];
+    int file_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            iterations = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--diff") == 0)
+            diff = true;
+        else if (strcmp(argv[i], "-O") == 0)
+            opts.optimize = true;
+        else if (strcmp(argv[i], "--line-map") == 0 && i + 1 < argc)
+            opts.linemap_name = argv[++i];
+        else if (file_count < 2)
+            files[file_count++] = argv[i];
+        else
+            file_count++;
+    }
+
+    if (file_count != 2 || iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [-n iterations] [-O] [--diff] [--line-map output.map] input.asm output.bin\n", argv[0]);
+        return 1;
+    }
+
+    if (assemble_file(files[0], files[1], &opts) != 0)
+        return 1;
+
+    size_t code_len = 0;
+    uint8_t *code = read_binary(files[1], &code_len);
+    if (!code)
+        return 1;
+
+    LineMap map = {0};
+    if (opts.linemap_name && load_line_map(opts.linemap_name, &map) != 0)
+    {
+        free(code);
+        return 1;
+    }
+
+    Cpu cpu;
+    if (cpu_init(&cpu, code, code_len) != 0)
+    {
+        linemap_free(&map);
+        free(code);
+        return 1;
+    }
+
+    // every run starts from the seeded state, copied back outside the timed part
+    cpu_reset(&cpu, EMU_SEED);
+    uint16_t start_regs[8], start_flags = cpu.flags;
+    uint8_t *start_mem = malloc(CPU_MEM_SIZE);
+    if (!start_mem)
+    {
+        fprintf(stderr, "Error: memory allocation failed (main)\n");
+        linemap_free(&map);
+        cpu_free(&cpu);
+        free(code);
+        return 1;
+    }
+    memcpy(start_regs, cpu.regs, sizeof start_regs);
+    memcpy(start_mem, cpu.mem, CPU_MEM_SIZE);
+
+    // the first run decodes into the cache, the timed runs only replay it; a truncated or
+    // failed run would be timed and compared as if it had finished
+    int run = cpu_run(&cpu, EMU_MAX_STEPS);
+    uint64_t per_run_insts = cpu.instructions;
+    uint64_t per_run_cycles = cpu.cycles;
+
+    uint64_t total = 0;
+    double elapsed = 0;
+    for (long i = 0; i < iterations && run == 0; i++)
+    {
+        memcpy(cpu.regs, start_regs, sizeof start_regs);
+        memcpy(cpu.mem, start_mem, CPU_MEM_SIZE);
+        cpu.flags = start_flags;
+        cpu.ip = 0;
+        cpu.instructions = 0;
+        cpu.cycles = 0;
+        double t0 = sec_now();
+        run = cpu_run(&cpu, EMU_MAX_STEPS);
+        elapsed += sec_now() - t0;
+        total += cpu.instructions;
+    }
+    free(start_mem);
+    if (run != 0)
+    {
+        report_stop(&cpu, run, &map);
+        linemap_free(&map);
+        cpu_free(&cpu);
+        free(code);
+        return 1;
+    }
+    linemap_free(&map);
+
+    printf("%zu bytes, %llu instructions and %llu cycles per run (%.2f ms at 4.77 MHz)\n",
+           code_len, (unsigned long long)per_run_insts, (unsigned long long)per_run_cycles,
+           per_run_cycles / 4770.0);
+    printf("%ld runs, %.3f s  ⇒  %.0f instructions/s\n", iterations, elapsed, total / elapsed);
+
+    int status = 0;
+    if (diff)
+    {
+        Cpu ir;
+        if (cpu_init(&ir, code, code_len) != 0)
+        {
+            cpu_free(&cpu);
+            free(code);
+            return 1;
+        }
+
+        cpu_reset(&cpu, EMU_SEED);
+        cpu_reset(&ir, EMU_SEED);
+        if (cpu_run(&cpu, EMU_MAX_STEPS) != 0 || eval_source(files[0], &ir) != 0)
+            status = 1;
+        else
+        {
+            int diffs = compare_state(&cpu, &ir);
+            if (diffs == 0)
+                printf("differential: binary and IR agree (registers, flags, 64 KiB memory)\n");
+            else
+            {
+                printf("differential: %d differences\n", diffs);
+                status = 1;
+            }
+        }
+        cpu_free(&ir);
+    }
+
+    cpu_free(&cpu);
+    free(code);
+    return status;
+}
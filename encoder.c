@@ -2,10 +2,12 @@
 #include <string.h>
 
 #include "encoder.h"
+#include "diag.h"
 
 static inline uint8_t get_reg_to_reg_opcode(MnemonicType mnemtype);
 static inline uint8_t get_imm_to_acc_opcode(MnemonicType mnemtype);
 static inline uint8_t get_opext(MnemonicType mnemtype);
+static inline void encode_rm(const Operand *op, uint8_t reg, uint8_t *buffer, size_t *out_size);
 
 int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, size_t lineno)
 {
@@ -75,17 +77,10 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
                 }
                 buffer[0] = opcode | wbit;
 
-                if (wbit == 0)
-                {
-                    buffer[1] = (uint8_t)memop->mem.disp_value;
-                    *out_size = 2;
-                }
-                else
-                {
-                    buffer[1] = (uint8_t)memop->mem.disp_value;
-                    buffer[2] = (uint8_t)(memop->mem.disp_value >> 8);
-                    *out_size = 3;
-                }
+                // the address is always 16 bits wide, only the data size depends on wbit
+                buffer[1] = (uint8_t)memop->mem.disp_value;
+                buffer[2] = (uint8_t)(memop->mem.disp_value >> 8);
+                *out_size = 3;
 
                 return 0;
             }
@@ -189,9 +184,11 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
             }
             return 0;
         }
+        break;
     case T_ADD:
     case T_SUB:
     case T_CMP:
+    case T_XOR:
         if (inst->op1.opType == OP_REG && inst->op2.opType == OP_REG)
         {
             uint8_t opcode = get_reg_to_reg_opcode(inst->mnem);
@@ -212,6 +209,13 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
             bool is_accumulator = inst->op1.reg.reg_code == 0 && (inst->op1.size == SZ_BYTE || inst->op1.size == SZ_WORD);
             int16_t imm = inst->op2.imm.value;
 
+            // a symbol's value is patched in later, so it keeps the full-width imm
+            bool fit = !inst->op2.has_symbol && imm >= -128 && imm <= 127;
+
+            // NASM style: AX with an imm that fits in a signed byte takes the shorter 0x83 form below
+            if (is_accumulator && inst->op1.size == SZ_WORD && fit)
+                is_accumulator = false;
+
             if (is_accumulator)
             {
                 uint8_t opcode = get_imm_to_acc_opcode(inst->mnem);
@@ -234,7 +238,6 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
             }
 
             bool w = (inst->op1.size == SZ_WORD);
-            bool fit = (imm >= -128 && imm <= 127);
 
             uint8_t opcode = 0x80;
             uint8_t sbit = (w && fit) ? 1 : 0;
@@ -315,7 +318,7 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
         {
             int16_t imm = inst->op2.imm.value;
             bool w = (inst->op1.size == SZ_WORD);
-            bool fit = (imm >= -128 && imm <= 127);
+            bool fit = !inst->op2.has_symbol && imm >= -128 && imm <= 127;
 
             uint8_t opcode = 0x80;
             uint8_t sbit = (w && fit) ? 1 : 0;
@@ -369,9 +372,92 @@ int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, siz
             }
             return 0;
         }
+        break;
+    case T_INC:
+    case T_DEC:
+    case T_NEG:
+    case T_NOT:
+        if ((inst->op1.opType == OP_REG || inst->op1.opType == OP_MEM) && inst->op2.opType == OP_NONE)
+        {
+            bool incdec = inst->mnem == T_INC || inst->mnem == T_DEC;
+            if (incdec && inst->op1.opType == OP_REG && inst->op1.size == SZ_WORD)
+            {
+                // 1-byte short form: 01000 reg (inc) / 01001 reg (dec)
+                buffer[0] = (inst->mnem == T_INC ? 0x40 : 0x48) | inst->op1.reg.reg_code;
+                *out_size = 1;
+                return 0;
+            }
+
+            // 1111111w inc (/0) and dec (/1), 1111011w not (/2) and neg (/3)
+            static const uint8_t opext[] = {[T_INC] = 0, [T_DEC] = 1, [T_NOT] = 2, [T_NEG] = 3};
+            uint8_t wbit = (inst->op1.size == SZ_WORD) ? 1 : 0;
+            buffer[0] = (incdec ? 0xFE : 0xF6) | wbit;
+            *out_size = 1;
+            encode_rm(&inst->op1, opext[inst->mnem], buffer, out_size);
+            return 0;
+        }
+        break;
+    case T_PUSH:
+    case T_POP:
+        if (inst->op1.opType == OP_REG)
+        {
+            // 1-byte short form: 01010 reg (push) / 01011 reg (pop)
+            buffer[0] = (inst->mnem == T_PUSH ? 0x50 : 0x58) | inst->op1.reg.reg_code;
+            *out_size = 1;
+            return 0;
+        }
+        if (inst->op1.opType == OP_MEM)
+        {
+            buffer[0] = (inst->mnem == T_PUSH) ? 0xFF : 0x8F; // push r/m16 (/6), pop r/m16 (/0)
+            *out_size = 1;
+            encode_rm(&inst->op1, inst->mnem == T_PUSH ? 6 : 0, buffer, out_size);
+            return 0;
+        }
+        break;
+    case T_XCHG:
+        if (inst->op1.opType == OP_REG && inst->op2.opType == OP_REG && inst->op1.size == SZ_WORD &&
+            (inst->op1.reg.reg_code == 0 || inst->op2.reg.reg_code == 0))
+        {
+            // 1-byte short form with ax on either side: 10010 reg, xchg ax, ax is nop
+            buffer[0] = 0x90 | (inst->op1.reg.reg_code | inst->op2.reg.reg_code);
+            *out_size = 1;
+            return 0;
+        }
+        if (inst->op1.opType == OP_REG || inst->op2.opType == OP_REG)
+        {
+            // NASM style: the first register in REG, the other operand in R/M
+            const Operand *regop = (inst->op1.opType == OP_REG) ? &inst->op1 : &inst->op2;
+            const Operand *rmop = (regop == &inst->op1) ? &inst->op2 : &inst->op1;
+            buffer[0] = 0x86 | ((inst->op1.size == SZ_WORD) ? 1 : 0); // 1000011w
+            *out_size = 1;
+            encode_rm(rmop, regop->reg.reg_code, buffer, out_size);
+            return 0;
+        }
+        break;
+    case T_FLAG:
+        buffer[0] = inst->cond;
+        *out_size = 1;
+        return 0;
+    case T_JMP:
+    case T_CALL:
+        // indirect forms only, relative ones go through encode_branch
+        if (inst->op1.opType == OP_REG || inst->op1.opType == OP_MEM)
+        {
+            buffer[0] = 0xFF; // 11111111 jmp r/m16 (/4), call r/m16 (/2)
+            *out_size = 1;
+            encode_rm(&inst->op1, inst->mnem == T_JMP ? 4 : 2, buffer, out_size);
+            return 0;
+        }
+        break;
+    case T_RET:
+        buffer[0] = 0xC3; // 11000011 near return
+        *out_size = 1;
+        return 0;
+    default:
+        break;
     }
 
-    fprintf(stderr, "Error on line %zu: encoding of that instruction is not supported for now\n", lineno);
+    fprintf(DIAG, "Error on line %zu: encoding of that instruction is not supported for now\n", lineno);
     return 1;
 }
 
@@ -385,6 +471,8 @@ static inline uint8_t get_reg_to_reg_opcode(MnemonicType mnemtype)
         return 0x28;
     case T_CMP:
         return 0x38;
+    case T_XOR:
+        return 0x30;
     }
 }
 
@@ -398,6 +486,8 @@ static inline uint8_t get_imm_to_acc_opcode(MnemonicType mnemtype)
         return 0x2C;
     case T_CMP:
         return 0x3C;
+    case T_XOR:
+        return 0x34;
     }
 }
 
@@ -411,5 +501,160 @@ static inline uint8_t get_opext(MnemonicType mnemtype)
         return 0x5;
     case T_CMP:
         return 0x7;
+    case T_XOR:
+        return 0x6;
+    }
+}
+bool is_relative_branch(const Instruction *inst)
+{
+    switch (inst->mnem)
+    {
+    case T_JMP:
+    case T_JCC:
+    case T_LOOP:
+    case T_LOOPE:
+    case T_LOOPNE:
+    case T_JCXZ:
+    case T_CALL:
+        return inst->op1.opType == OP_IMM;
+    default:
+        return false;
     }
-}
\ No newline at end of file
+}
+
+size_t branch_size(MnemonicType mnem, bool near)
+{
+    switch (mnem)
+    {
+    case T_JMP:
+        return near ? 3 : 2; // E9 rel16 / EB rel8
+    case T_CALL:
+        return 3; // E8 rel16, there is no short call
+    case T_JCC:
+        return near ? 5 : 2; // 7x^1 03 E9 rel16 / 7x rel8
+    default:
+        return near ? 7 : 2; // op 02 EB 03 E9 rel16 / op rel8
+    }
+}
+
+void encode_branch(MnemonicType mnem, uint8_t cond, bool near, int32_t rel, uint8_t *buffer, size_t *out_size)
+{
+    size_t n = 0;
+    uint8_t short_op = 0;
+    switch (mnem)
+    {
+    case T_JMP:
+        short_op = 0xEB;
+        break;
+    case T_JCC:
+        short_op = 0x70 | cond;
+        break;
+    case T_LOOP:
+        short_op = 0xE2;
+        break;
+    case T_LOOPE:
+        short_op = 0xE1;
+        break;
+    case T_LOOPNE:
+        short_op = 0xE0;
+        break;
+    case T_JCXZ:
+        short_op = 0xE3;
+        break;
+    default:
+        break;
+    }
+
+    if (mnem == T_CALL || (mnem == T_JMP && near))
+    {
+        buffer[n++] = (mnem == T_CALL) ? 0xE8 : 0xE9;
+    }
+    else if (!near)
+    {
+        buffer[n++] = short_op;
+        buffer[n++] = (uint8_t)rel;
+        *out_size = n;
+        return;
+    }
+    else if (mnem == T_JCC)
+    {
+        // the opposite condition skips the jmp near: odd/even condition codes come in pairs
+        buffer[n++] = 0x70 | (cond ^ 1);
+        buffer[n++] = 0x03;
+        buffer[n++] = 0xE9;
+    }
+    else
+    {
+        // loop/jcxz have no opposite, so they branch to the jmp near and otherwise hop over it
+        buffer[n++] = short_op;
+        buffer[n++] = 0x02;
+        buffer[n++] = 0xEB;
+        buffer[n++] = 0x03;
+        buffer[n++] = 0xE9;
+    }
+    buffer[n++] = (uint8_t)rel;
+    buffer[n++] = (uint8_t)(rel >> 8);
+    *out_size = n;
+}
+
+// The 8086 fetches every filler byte at 4 clocks each, so past 8 bytes a jmp over the gap
+// (15 clocks plus refilling the queue) is cheaper. Below that, mov si, si is 2 bytes in
+// 2 clocks and xchg ax, ax (nop) 1 byte in 3; lea si, [si+0] would take 2 + 9.
+void encode_padding(uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    if (size >= 8)
+    {
+        size_t skip = size - 2;
+        if (skip <= 127)
+        {
+            buffer[n++] = 0xEB;
+            buffer[n++] = (uint8_t)skip;
+        }
+        else
+        {
+            skip--;
+            buffer[n++] = 0xE9;
+            buffer[n++] = (uint8_t)skip;
+            buffer[n++] = (uint8_t)(skip >> 8);
+        }
+        memset(buffer + n, 0x90, size - n);
+        return;
+    }
+
+    if (size & 1)
+        buffer[n++] = 0x90;
+    while (n < size)
+    {
+        buffer[n++] = 0x89; // mov si, si
+        buffer[n++] = 0xF6;
+    }
+}
+
+// ModR/M byte with the given REG field, plus the displacement of a memory operand
+static inline void encode_rm(const Operand *op, uint8_t reg, uint8_t *buffer, size_t *out_size)
+{
+    size_t n = *out_size;
+    if (op->opType == OP_REG)
+    {
+        buffer[n++] = 0xC0 | (reg << 3) | op->reg.reg_code;
+        *out_size = n;
+        return;
+    }
+
+    uint8_t mod = 0;
+    if (op->mem.base_reg != NULL)
+        mod = op->mem.disp_size == SZ_BYTE ? 0x01 : op->mem.disp_size == SZ_WORD ? 0x02 : 0x00;
+    buffer[n++] = (mod << 6) | (reg << 3) | op->mem.rm_code;
+
+    if (op->mem.disp_size == SZ_BYTE)
+    {
+        buffer[n++] = (uint8_t)op->mem.disp_value;
+    }
+    else if (op->mem.disp_size == SZ_WORD)
+    {
+        buffer[n++] = (uint8_t)op->mem.disp_value;
+        buffer[n++] = (uint8_t)(op->mem.disp_value >> 8);
+    }
+    *out_size = n;
+}
@@ -5,4 +5,14 @@
 
 int encode_instruction(Instruction *inst, uint8_t *buffer, size_t *out_size, size_t lineno);
 
+// Relative branches (jmp/jcc/loop/jcxz/call to an immediate or label) are not encoded by
+// encode_instruction, their size depends on a distance the assembler only knows at the end.
+// near picks the rel16 form; jcc and loop have none on the 8086, so theirs is a short
+// branch around (or over) a jmp near. rel is measured from the end of the whole sequence.
+bool is_relative_branch(const Instruction *inst);
+size_t branch_size(MnemonicType mnem, bool near);
+void encode_branch(MnemonicType mnem, uint8_t cond, bool near, int32_t rel, uint8_t *buffer, size_t *out_size);
+// size bytes of padding that execute as fast as possible and change no register or flag
+void encode_padding(uint8_t *buffer, size_t size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,612 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h> // for sysconf
+#include <time.h>
+
+#include "tokenizer.c"
+#include "symtab.c"
+#include "parser.c"
+#include "encoder.c"
+
+// Exhaustive encoder verification.
+//
+// Every supported combination of mnemonic, operand form, register, addressing
+// mode and boundary displacement/immediate is generated as source text, pushed
+// through tokenize_line + parse_tokens + encode_instruction and compared against
+// an independent reference encoder written straight from the 8086 opcode table
+// (with NASM's choices where several encodings exist, so the result agrees with
+// compare.sh). The cases are split across all online cores.
+
+typedef enum
+{
+    F_REG_REG,
+    F_REG_IMM,
+    F_REG_MEM,
+    F_MEM_REG,
+    F_MEM_IMM
+} Form;
+
+typedef struct
+{
+    MnemonicType mnem;
+    Form form;
+    uint8_t w;     // 0 = byte, 1 = word
+    uint8_t reg;   // register code of the REG/dest operand
+    uint8_t reg2;  // source register code for F_REG_REG
+    int8_t ea;     // 0-7 = R/M code of a based form, 8 = direct address
+    int32_t disp;  // displacement or direct address
+    int32_t imm;   // immediate as written in the source
+} Case;
+
+typedef struct
+{
+    char text[64];
+    uint8_t bytes[8];
+    size_t len;
+} Encoding;
+
+static const char *mnem_names[] = {"mov", "add", "sub", "cmp", "xor"};
+static const char *reg_names[2][8] = {
+    {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"}};
+static const char *ea_names[8] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
+
+static const int32_t based_disps[] = {0, 1, -1, 127, -128, 128, -129, 255, 256, 32767, -32768};
+static const int32_t direct_addrs[] = {0, 1, 127, 128, 255, 256, 4834, 32767, 32768, 65535};
+static const int32_t byte_imms[] = {0, 1, 9, 127, 128, 255, -1, -30, -128, -129, -256};
+static const int32_t word_imms[] = {0, 1, -1, 127, -128, 128, -129, 255, 256, 1000, 32767, -32768, 32768, 65535, -65536};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static Case *cases = NULL;
+static size_t case_count = 0, case_cap = 0;
+
+static void push_case(Case c)
+{
+    if (case_count == case_cap)
+    {
+        case_cap = case_cap ? case_cap * 2 : 1024;
+        cases = realloc(cases, case_cap * sizeof *cases);
+        assert(cases != NULL);
+    }
+    cases[case_count++] = c;
+}
+
+// every memory operand: 8 based R/M codes x boundary displacements, plus direct addresses
+static void push_mem_cases(Case c)
+{
+    for (int8_t ea = 0; ea < 8; ea++)
+    {
+        for (size_t d = 0; d < ARRAY_LEN(based_disps); d++)
+        {
+            c.ea = ea;
+            c.disp = based_disps[d];
+            push_case(c);
+        }
+    }
+    for (size_t d = 0; d < ARRAY_LEN(direct_addrs); d++)
+    {
+        c.ea = 8;
+        c.disp = direct_addrs[d];
+        push_case(c);
+    }
+}
+
+static void generate_cases(void)
+{
+    for (MnemonicType m = T_MOV; m <= T_XOR; m++)
+    {
+        for (uint8_t w = 0; w <= 1; w++)
+        {
+            const int32_t *imms = w ? word_imms : byte_imms;
+            size_t imm_count = w ? ARRAY_LEN(word_imms) : ARRAY_LEN(byte_imms);
+
+            for (uint8_t r = 0; r < 8; r++)
+            {
+                for (uint8_t r2 = 0; r2 < 8; r2++)
+                    push_case((Case){.mnem = m, .form = F_REG_REG, .w = w, .reg = r, .reg2 = r2});
+
+                for (size_t i = 0; i < imm_count; i++)
+                    push_case((Case){.mnem = m, .form = F_REG_IMM, .w = w, .reg = r, .imm = imms[i]});
+
+                push_mem_cases((Case){.mnem = m, .form = F_REG_MEM, .w = w, .reg = r});
+                push_mem_cases((Case){.mnem = m, .form = F_MEM_REG, .w = w, .reg = r});
+            }
+
+            for (size_t i = 0; i < imm_count; i++)
+                push_mem_cases((Case){.mnem = m, .form = F_MEM_IMM, .w = w, .imm = imms[i]});
+        }
+    }
+}
+
+static void format_mem(const Case *c, char *out, size_t n)
+{
+    if (c->ea == 8)
+        snprintf(out, n, "[%d]", c->disp);
+    else if (c->disp == 0)
+        snprintf(out, n, "[%s]", ea_names[c->ea]);
+    else
+        snprintf(out, n, "[%s %c %d]", ea_names[c->ea], c->disp < 0 ? '-' : '+', abs(c->disp));
+}
+
+static void format_case(const Case *c, char *out, size_t n)
+{
+    const char *m = mnem_names[c->mnem];
+    const char *r = reg_names[c->w][c->reg];
+    char mem[32];
+
+    switch (c->form)
+    {
+    case F_REG_REG:
+        snprintf(out, n, "%s %s, %s", m, r, reg_names[c->w][c->reg2]);
+        break;
+    case F_REG_IMM:
+        snprintf(out, n, "%s %s, %d", m, r, c->imm);
+        break;
+    case F_REG_MEM:
+        format_mem(c, mem, sizeof(mem));
+        snprintf(out, n, "%s %s, %s", m, r, mem);
+        break;
+    case F_MEM_REG:
+        format_mem(c, mem, sizeof(mem));
+        snprintf(out, n, "%s %s, %s", m, mem, r);
+        break;
+    case F_MEM_IMM:
+        format_mem(c, mem, sizeof(mem));
+        snprintf(out, n, "%s %s %s, %d", m, c->w ? "word" : "byte", mem, c->imm);
+        break;
+    }
+}
+
+// reference encoder, deliberately table driven and independent of encoder.c
+
+static const struct
+{
+    uint8_t rm_base; // 00 /r form, d=0 w=0
+    uint8_t acc_imm; // AL, imm8 form
+    uint8_t ext;     // /digit for the 80/81/83 group
+} alu_table[] = {
+    [T_ADD] = {0x00, 0x04, 0},
+    [T_SUB] = {0x28, 0x2C, 5},
+    [T_CMP] = {0x38, 0x3C, 7},
+    [T_XOR] = {0x30, 0x34, 6},
+};
+
+static void emit(Encoding *e, uint8_t b)
+{
+    e->bytes[e->len++] = b;
+}
+
+static void emit16(Encoding *e, int32_t v)
+{
+    emit(e, (uint8_t)v);
+    emit(e, (uint8_t)((uint32_t)v >> 8));
+}
+
+static bool fits_sbyte(int32_t v, uint8_t w)
+{
+    int32_t s = w ? (int16_t)(uint16_t)v : (int8_t)(uint8_t)v;
+    return s >= -128 && s <= 127;
+}
+
+static void emit_modrm_mem(Encoding *e, const Case *c, uint8_t reg_field)
+{
+    if (c->ea == 8)
+    {
+        emit(e, (uint8_t)(0x00 | (reg_field << 3) | 0x06));
+        emit16(e, c->disp);
+        return;
+    }
+
+    uint8_t mod;
+    if (c->disp == 0 && c->ea != 6)
+        mod = 0;
+    else if (c->disp >= -128 && c->disp <= 127)
+        mod = 1;
+    else
+        mod = 2;
+
+    emit(e, (uint8_t)((mod << 6) | (reg_field << 3) | c->ea));
+    if (mod == 1)
+        emit(e, (uint8_t)c->disp);
+    else if (mod == 2)
+        emit16(e, c->disp);
+}
+
+static void emit_imm(Encoding *e, int32_t imm, uint8_t wide)
+{
+    if (wide)
+        emit16(e, imm);
+    else
+        emit(e, (uint8_t)imm);
+}
+
+static void reference_encode(const Case *c, Encoding *e)
+{
+    e->len = 0;
+
+    if (c->mnem == T_MOV)
+    {
+        switch (c->form)
+        {
+        case F_REG_REG:
+            emit(e, 0x88 | c->w);
+            emit(e, (uint8_t)(0xC0 | (c->reg2 << 3) | c->reg));
+            return;
+        case F_REG_IMM:
+            emit(e, (uint8_t)(0xB0 | (c->w << 3) | c->reg));
+            emit_imm(e, c->imm, c->w);
+            return;
+        case F_REG_MEM:
+        case F_MEM_REG:
+            if (c->reg == 0 && c->ea == 8)
+            {
+                emit(e, (c->form == F_REG_MEM ? 0xA0 : 0xA2) | c->w);
+                emit16(e, c->disp);
+                return;
+            }
+            emit(e, (c->form == F_REG_MEM ? 0x8A : 0x88) | c->w);
+            emit_modrm_mem(e, c, c->reg);
+            return;
+        case F_MEM_IMM:
+            emit(e, 0xC6 | c->w);
+            emit_modrm_mem(e, c, 0);
+            emit_imm(e, c->imm, c->w);
+            return;
+        }
+    }
+
+    uint8_t base = alu_table[c->mnem].rm_base;
+    uint8_t ext = alu_table[c->mnem].ext;
+    bool sx = c->w && fits_sbyte(c->imm, c->w);
+
+    switch (c->form)
+    {
+    case F_REG_REG:
+        emit(e, base | c->w);
+        emit(e, (uint8_t)(0xC0 | (c->reg2 << 3) | c->reg));
+        return;
+    case F_REG_IMM:
+        // NASM prefers the sign-extended imm8 group form over the AX short form
+        if (c->reg == 0 && !sx)
+        {
+            emit(e, alu_table[c->mnem].acc_imm | c->w);
+            emit_imm(e, c->imm, c->w);
+            return;
+        }
+        emit(e, c->w ? (sx ? 0x83 : 0x81) : 0x80);
+        emit(e, (uint8_t)(0xC0 | (ext << 3) | c->reg));
+        emit_imm(e, c->imm, c->w && !sx);
+        return;
+    case F_REG_MEM:
+    case F_MEM_REG:
+        emit(e, base | (c->form == F_REG_MEM ? 0x02 : 0x00) | c->w);
+        emit_modrm_mem(e, c, c->reg);
+        return;
+    case F_MEM_IMM:
+        emit(e, c->w ? (sx ? 0x83 : 0x81) : 0x80);
+        emit_modrm_mem(e, c, ext);
+        emit_imm(e, c->imm, c->w && !sx);
+        return;
+    }
+}
+
+static int assemble_case(const char *text, Encoding *e)
+{
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    if (tokenize_line(text, 1, NULL, &tokens, &token_count) != 0)
+        return 1;
+
+    Instruction inst;
+    if (parse_tokens(tokens, token_count, 1, NULL, &inst) != 0)
+        return 1;
+
+    return encode_instruction(&inst, e->bytes, &e->len, 1);
+}
+
+// Relative branches bypass encode_instruction, so their forms are checked on their own:
+// every mnemonic (and jcc condition) at every rel8 distance short, and a spread of rel16 near.
+static size_t verify_branches(void)
+{
+    static const struct
+    {
+        MnemonicType mnem;
+        uint8_t short_op;
+    } forms[] = {{T_JMP, 0xEB}, {T_LOOP, 0xE2}, {T_LOOPE, 0xE1}, {T_LOOPNE, 0xE0}, {T_JCXZ, 0xE3}, {T_CALL, 0xE8}, {T_JCC, 0x70}};
+    static const int32_t near_rels[] = {0, 1, -1, 127, 128, -128, -129, 300, -300, 32767, -32768};
+
+    size_t bad = 0;
+    for (size_t f = 0; f < sizeof(forms) / sizeof(forms[0]); f++)
+    {
+        for (uint8_t cond = 0; cond < (forms[f].mnem == T_JCC ? 16 : 1); cond++)
+        {
+            MnemonicType m = forms[f].mnem;
+            for (int32_t rel = -128; m != T_CALL && rel <= 127; rel++)
+            {
+                uint8_t buf[8];
+                size_t n = 0;
+                encode_branch(m, cond, false, rel, buf, &n);
+                if (n != 2 || n != branch_size(m, false) || buf[0] != (forms[f].short_op | cond) || (int8_t)buf[1] != rel)
+                    bad++;
+            }
+
+            for (size_t r = 0; r < sizeof(near_rels) / sizeof(near_rels[0]); r++)
+            {
+                Encoding want = {0};
+                if (m == T_JMP || m == T_CALL)
+                    emit(&want, m == T_JMP ? 0xE9 : 0xE8);
+                else if (m == T_JCC)
+                {
+                    emit(&want, 0x70 | (cond ^ 1)); // skip the jmp near when the condition fails
+                    emit(&want, 0x03);
+                    emit(&want, 0xE9);
+                }
+                else
+                {
+                    emit(&want, forms[f].short_op); // taken: onto the jmp near, not taken: jmp short over it
+                    emit(&want, 0x02);
+                    emit(&want, 0xEB);
+                    emit(&want, 0x03);
+                    emit(&want, 0xE9);
+                }
+                emit16(&want, near_rels[r]);
+
+                uint8_t buf[8];
+                size_t n = 0;
+                encode_branch(m, cond, true, near_rels[r], buf, &n);
+                if (n != want.len || n != branch_size(m, true) || memcmp(buf, want.bytes, n) != 0)
+                    bad++;
+            }
+        }
+    }
+    return bad;
+}
+
+// Every padding size must run straight through to its end using only nop, mov si, si and a
+// jmp over the rest; short pads never jump.
+static size_t verify_padding(void)
+{
+    size_t bad = 0;
+    for (size_t size = 0; size <= 300; size++)
+    {
+        uint8_t buf[300];
+        encode_padding(buf, size);
+
+        size_t ip = 0;
+        while (ip < size)
+        {
+            if (buf[ip] == 0x90)
+                ip += 1;
+            else if (buf[ip] == 0x89 && ip + 1 < size && buf[ip + 1] == 0xF6)
+                ip += 2;
+            else if (buf[ip] == 0xEB && ip + 1 < size && size >= 8)
+                ip += 2 + buf[ip + 1];
+            else if (buf[ip] == 0xE9 && ip + 2 < size && size >= 8)
+                ip += 3 + (size_t)(buf[ip + 1] | (buf[ip + 2] << 8));
+            else
+                break;
+        }
+        if (ip != size)
+            bad++;
+    }
+    return bad;
+}
+
+// The one-operand group, xchg and the flag instructions, with their short forms: inc/dec/push/pop
+// reg16 and xchg with ax are one byte, everything else takes a ModRM like NASM writes it.
+static size_t verify_single_operand(void)
+{
+    static const struct
+    {
+        const char *name;
+        MnemonicType mnem;
+        uint8_t short_op; // 0 when there is no reg16 form
+        uint8_t op, ext;  // the r/m form, op | w for the ones with a byte variant
+        bool word_only;
+    } forms[] = {
+        {"inc", T_INC, 0x40, 0xFE, 0, false}, {"dec", T_DEC, 0x48, 0xFE, 1, false}, {"not", T_NOT, 0, 0xF6, 2, false},
+        {"neg", T_NEG, 0, 0xF6, 3, false},    {"push", T_PUSH, 0x50, 0xFF, 6, true}, {"pop", T_POP, 0x58, 0x8F, 0, true},
+    };
+    static const struct
+    {
+        const char *name;
+        uint8_t op;
+    } flag_ops[] = {{"clc", 0xF8}, {"stc", 0xF9}, {"cmc", 0xF5}, {"cld", 0xFC}, {"std", 0xFD}, {"cli", 0xFA},
+                    {"sti", 0xFB}, {"lahf", 0x9F}, {"sahf", 0x9E}, {"pushf", 0x9C}, {"popf", 0x9D}};
+
+    size_t bad = 0;
+    char text[64], mem[40];
+    for (size_t f = 0; f < sizeof(forms) / sizeof(forms[0]); f++)
+    {
+        for (uint8_t w = forms[f].word_only; w <= 1; w++)
+        {
+            for (uint8_t r = 0; r < 8; r++)
+            {
+                Encoding want = {0}, got = {0};
+                if (w && forms[f].short_op)
+                    emit(&want, forms[f].short_op | r);
+                else
+                {
+                    emit(&want, forms[f].op | w);
+                    emit(&want, (uint8_t)(0xC0 | (forms[f].ext << 3) | r));
+                }
+                snprintf(text, sizeof(text), "%s %s", forms[f].name, reg_names[w][r]);
+                if (assemble_case(text, &got) != 0 || got.len != want.len || memcmp(got.bytes, want.bytes, want.len) != 0)
+                    bad++;
+            }
+
+            for (int8_t ea = 0; ea <= 8; ea++)
+            {
+                for (size_t d = 0; d < (ea == 8 ? sizeof(direct_addrs) : sizeof(based_disps)) / sizeof(int32_t); d++)
+                {
+                    Case c = {.mnem = forms[f].mnem, .w = w, .ea = ea, .disp = ea == 8 ? direct_addrs[d] : based_disps[d]};
+                    Encoding want = {0}, got = {0};
+                    emit(&want, forms[f].op | (forms[f].op == 0x8F ? 0 : w));
+                    emit_modrm_mem(&want, &c, forms[f].ext);
+                    format_mem(&c, mem, sizeof(mem));
+                    snprintf(text, sizeof(text), "%s %s %s", forms[f].name, w ? "word" : "byte", mem);
+                    if (assemble_case(text, &got) != 0 || got.len != want.len || memcmp(got.bytes, want.bytes, want.len) != 0)
+                        bad++;
+                }
+            }
+        }
+    }
+
+    // xchg: 90+r when ax is either word register, otherwise 86/87 with the first register in REG
+    for (uint8_t w = 0; w <= 1; w++)
+    {
+        for (uint8_t r1 = 0; r1 < 8; r1++)
+        {
+            for (uint8_t r2 = 0; r2 < 8; r2++)
+            {
+                Encoding want = {0}, got = {0};
+                if (w && (r1 == 0 || r2 == 0))
+                    emit(&want, 0x90 | r1 | r2);
+                else
+                {
+                    emit(&want, 0x86 | w);
+                    emit(&want, (uint8_t)(0xC0 | (r1 << 3) | r2));
+                }
+                snprintf(text, sizeof(text), "xchg %s, %s", reg_names[w][r1], reg_names[w][r2]);
+                if (assemble_case(text, &got) != 0 || got.len != want.len || memcmp(got.bytes, want.bytes, want.len) != 0)
+                    bad++;
+            }
+
+            for (int8_t ea = 0; ea <= 8; ea++)
+            {
+                Case c = {.mnem = T_XCHG, .w = w, .ea = ea, .disp = ea == 8 ? 4834 : -129};
+                Encoding want = {0};
+                emit(&want, 0x86 | w);
+                emit_modrm_mem(&want, &c, r1);
+                format_mem(&c, mem, sizeof(mem));
+                for (int order = 0; order < 2; order++)
+                {
+                    Encoding got = {0};
+                    if (order == 0)
+                        snprintf(text, sizeof(text), "xchg %s, %s", reg_names[w][r1], mem);
+                    else
+                        snprintf(text, sizeof(text), "xchg %s, %s", mem, reg_names[w][r1]);
+                    if (assemble_case(text, &got) != 0 || got.len != want.len || memcmp(got.bytes, want.bytes, want.len) != 0)
+                        bad++;
+                }
+            }
+        }
+    }
+
+    for (size_t f = 0; f < sizeof(flag_ops) / sizeof(flag_ops[0]); f++)
+    {
+        Encoding got = {0};
+        if (assemble_case(flag_ops[f].name, &got) != 0 || got.len != 1 || got.bytes[0] != flag_ops[f].op)
+            bad++;
+    }
+    return bad;
+}
+
+static size_t next_case = 0;
+static size_t mismatches = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CHUNK 256
+#define MAX_REPORTED 20
+
+static void report_mismatch(const char *text, const Encoding *want, const Encoding *got, int failed)
+{
+    pthread_mutex_lock(&lock);
+    if (mismatches++ < MAX_REPORTED)
+    {
+        fprintf(stderr, "MISMATCH '%s'\n  want:", text);
+        for (size_t i = 0; i < want->len; i++)
+            fprintf(stderr, " %02X", want->bytes[i]);
+        if (failed)
+            fprintf(stderr, "\n  got:  (error)\n");
+        else
+        {
+            fprintf(stderr, "\n  got: ");
+            for (size_t i = 0; i < got->len; i++)
+                fprintf(stderr, " %02X", got->bytes[i]);
+            fprintf(stderr, "\n");
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&lock);
+        size_t start = next_case;
+        next_case += CHUNK;
+        pthread_mutex_unlock(&lock);
+
+        if (start >= case_count)
+            return NULL;
+
+        size_t end = start + CHUNK < case_count ? start + CHUNK : case_count;
+        for (size_t i = start; i < end; i++)
+        {
+            Encoding want, got = {0};
+            format_case(&cases[i], want.text, sizeof(want.text));
+            reference_encode(&cases[i], &want);
+
+            int failed = assemble_case(want.text, &got);
+            if (failed || got.len != want.len || memcmp(got.bytes, want.bytes, want.len) != 0)
+                report_mismatch(want.text, &want, &got, failed);
+        }
+    }
+}
+
+static double sec_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    printf("Running exhaustive encoder verification...\n");
+
+    generate_cases();
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > 64)
+        nthreads = 64;
+
+    double t0 = sec_now();
+    pthread_t threads[64];
+    for (long i = 0; i < nthreads; i++)
+        assert(pthread_create(&threads[i], NULL, worker, NULL) == 0);
+    for (long i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    double t1 = sec_now();
+
+    printf("%zu cases on %ld threads in %.3f s, %zu mismatches\n", case_count, nthreads, t1 - t0, mismatches);
+    free(cases);
+
+    size_t branch_mismatches = verify_branches();
+    printf("relative branch forms: %zu mismatches\n", branch_mismatches);
+    mismatches += branch_mismatches;
+
+    size_t padding_mismatches = verify_padding();
+    printf("align padding: %zu mismatches\n", padding_mismatches);
+    mismatches += padding_mismatches;
+
+    size_t single_mismatches = verify_single_operand();
+    printf("single-operand, xchg and flag forms: %zu mismatches\n", single_mismatches);
+    mismatches += single_mismatches;
+
+    if (mismatches != 0)
+        return 1;
+
+    printf("All encoder tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include <stdio.h>    // for fprintf
+#include <stdlib.h>   // for malloc, realloc, free, realpath
+#include <string.h>   // for strlen
+#include <errno.h>    // for errno, EINVAL
+#include <fcntl.h>    // for open, O_RDONLY
+#include <unistd.h>   // for read, close
+#include <sys/mman.h> // for mmap, munmap
+#include <sys/stat.h> // for stat, fstat
+
+#include "filecache.h"
+#include "diag.h"
+
+static int load_file(const char *path, struct stat *st, const char **data_out, bool *mapped_out);
+static void unload_file(const char *data, size_t size, bool mapped);
+static inline int64_t mtime_ns(const struct stat *st);
+
+int filecache_init(FileCache *cache)
+{
+    memset(cache, 0, sizeof *cache);
+    return symtab_init(&cache->index);
+}
+
+void filecache_free(FileCache *cache)
+{
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        CachedFile *f = cache->files[i];
+        unload_file(f->data, f->size, f->mapped);
+        free(f->lines);
+        free(f->path);
+        free(f);
+    }
+    free(cache->files);
+    symtab_free(&cache->index);
+}
+
+int filecache_open(FileCache *cache, const char *path, const CachedFile **file_out)
+{
+    char *canonical = realpath(path, NULL);
+    if (!canonical)
+        return 1;
+
+    struct stat st;
+    bool failed = stat(canonical, &st) != 0;
+    if (!failed && !S_ISREG(st.st_mode))
+    {
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        failed = true;
+    }
+    if (failed)
+    {
+        free(canonical);
+        return 1;
+    }
+
+    // one stat per open is all a hit costs
+    size_t len = strlen(canonical);
+    uint32_t id = symtab_find(&cache->index, canonical, len);
+    if (id != SYMBOL_NONE)
+    {
+        CachedFile *f = cache->files[cache->index.symbols[id].value];
+        if (f->mtime_ns == mtime_ns(&st) && f->size == (size_t)st.st_size)
+        {
+            cache->hits++;
+            free(canonical);
+            *file_out = f;
+            return 0;
+        }
+        f->stale = true;
+    }
+
+    const char *data = NULL;
+    SourceLine *lines = NULL;
+    size_t line_count = 0;
+    CachedFile *f = NULL;
+    bool mapped = false;
+    if (load_file(canonical, &st, &data, &mapped) != 0)
+    {
+        free(canonical);
+        return 1;
+    }
+    if (index_lines(data, (size_t)st.st_size, &lines, &line_count) != 0)
+    {
+        int saved = errno;
+        unload_file(data, (size_t)st.st_size, mapped);
+        free(canonical);
+        errno = saved;
+        return 1;
+    }
+    if (cache->count == cache->cap)
+    {
+        size_t cap = cache->cap ? cache->cap * 2 : 16;
+        CachedFile **tmp = realloc(cache->files, cap * sizeof *tmp);
+        if (tmp)
+        {
+            cache->files = tmp;
+            cache->cap = cap;
+        }
+    }
+    if (cache->count < cache->cap)
+        f = malloc(sizeof *f);
+    if (!f || (id == SYMBOL_NONE && symtab_intern(&cache->index, canonical, len, 0, &id) != 0))
+    {
+        fprintf(DIAG, "Error: memory allocation failed (filecache_open)\n");
+        unload_file(data, (size_t)st.st_size, mapped);
+        free(lines);
+        free(f);
+        free(canonical);
+        errno = ENOMEM;
+        return 1;
+    }
+
+    f->path = canonical;
+    f->data = data;
+    f->size = (size_t)st.st_size;
+    f->mapped = mapped;
+    f->lines = lines;
+    f->line_count = line_count;
+    f->mtime_ns = mtime_ns(&st);
+    f->stale = false;
+    cache->index.symbols[id].value = (int64_t)cache->count;
+    cache->files[cache->count++] = f;
+    cache->misses++;
+    *file_out = f;
+    return 0;
+}
+
+void filecache_drop_stale(FileCache *cache)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        CachedFile *f = cache->files[i];
+        if (f->stale)
+        {
+            unload_file(f->data, f->size, f->mapped);
+            free(f->lines);
+            free(f->path);
+            free(f);
+            continue;
+        }
+        // the index points at the current versions, which move down over the dropped ones
+        cache->index.symbols[symtab_find(&cache->index, f->path, strlen(f->path))].value = (int64_t)kept;
+        cache->files[kept++] = f;
+    }
+    cache->count = kept;
+}
+
+// A copy of a small file, a read-only mapping of a large one; an empty file reads as "".
+// *st is refreshed from the open file and its size is what was read, so a file that changes
+// while it is read is still seen as changed by the next filecache_open.
+static int load_file(const char *path, struct stat *st, const char **data_out, bool *mapped_out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, st) != 0)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return 1;
+    }
+
+    *mapped_out = false;
+    *data_out = "";
+    size_t size = (size_t)st->st_size;
+    if (size > FILECACHE_COPY_MAX)
+    {
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int saved = errno;
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            errno = saved;
+            return 1;
+        }
+        *data_out = data;
+        *mapped_out = true;
+        return 0;
+    }
+
+    char *copy = size > 0 ? malloc(size) : NULL;
+    size_t got = 0;
+    ssize_t n = 1;
+    while (copy && got < size && (n = read(fd, copy + got, size - got)) != 0)
+    {
+        if (n < 0 && errno != EINTR)
+            break;
+        got += n > 0 ? (size_t)n : 0;
+    }
+    int saved = size > 0 && !copy ? ENOMEM : errno;
+    close(fd);
+    if ((size > 0 && !copy) || n < 0)
+    {
+        free(copy);
+        errno = saved;
+        return 1;
+    }
+    st->st_size = (off_t)got;
+    if (got > 0)
+        *data_out = copy;
+    else
+        free(copy);
+    return 0;
+}
+
+static void unload_file(const char *data, size_t size, bool mapped)
+{
+    if (mapped)
+        munmap((void *)data, size);
+    else if (size > 0)
+        free((void *)data);
+}
+
+static inline int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
@@ -0,0 +1,47 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for int64_t
+#include <stdbool.h> // for bool
+
+#include "symtab.h"    // for SymbolTable
+#include "lineindex.h" // for SourceLine
+
+#define FILECACHE_COPY_MAX (1 << 20) // files up to this size are read into memory, larger ones are mapped
+
+// a source file read or mapped read-only, the bytes stay valid until filecache_free
+typedef struct
+{
+    char *path;       // canonical, from realpath
+    const char *data; // a copy or the mapping, not NUL-terminated
+    size_t size;
+    bool mapped;      // data is a mapping, not a copy
+    SourceLine *lines; // from index_lines, built once per mapping
+    size_t line_count;
+    int64_t mtime_ns;
+    bool stale; // a newer version of the file has been mapped since
+} CachedFile;
+
+// Reads and indexes every file once and hands out the same bytes for as long as its modification
+// time and size stay the same. Files are keyed by canonical path, so "a.inc" and "./a.inc" share
+// one version. A changed file gets a new version, the old one is kept for whoever still reads it.
+// Sources up to FILECACHE_COPY_MAX are copied, so an old version never changes under its
+// readers. A larger file is mapped: a write to it in place shows through the mapping, and
+// truncating it while it is read is not supported, reading past the new end raises SIGBUS.
+typedef struct FileCache
+{
+    SymbolTable index; // canonical path, value is the index of the current version in files
+    CachedFile **files;
+    size_t count, cap;
+    size_t hits, misses;
+} FileCache;
+
+int filecache_init(FileCache *cache);
+void filecache_free(FileCache *cache);
+// returns 1 with errno set if the file cannot be read, prints nothing
+int filecache_open(FileCache *cache, const char *path, const CachedFile **file_out);
+// frees the versions that newer ones have replaced, nothing may still be reading them
+void filecache_drop_stale(FileCache *cache);
+
+#endif
@@ -0,0 +1,239 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>       // for opendir, readdir
+#include <sys/stat.h>     // for stat, S_ISDIR
+#include <sys/resource.h> // for getrusage
+#include <time.h>
+
+#include "tokenizer.c"
+#include "symtab.c"
+#include "parser.c"
+
+// In-process fuzz entry points for the front end.
+//
+// With libFuzzer (clang):
+//   clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER fuzz.c -o fuzz-parser
+//   clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER -DFUZZ_TOKENIZER fuzz.c -o fuzz-tokenizer
+//   ./fuzz-parser -close_fd_mask=2 fuzz_corpus
+//
+// Without libFuzzer the same file builds a standalone driver that replays a corpus
+// (files or directories) and reports executions per second and peak memory:
+//   gcc -g -O1 -fsanitize=address,undefined fuzz.c -o fuzz-replay
+//   ./fuzz-replay [-runs=N] fuzz_corpus
+
+#define FUZZ_LINE_MAX 256 // same limit as assemble_file (LINE_LEN_MAX)
+
+// tokenize_line needs a NUL-terminated line, the fuzzer data is not
+static size_t copy_line(const uint8_t *data, size_t size, char *line)
+{
+    if (size > FUZZ_LINE_MAX - 1)
+        size = FUZZ_LINE_MAX - 1;
+    memcpy(line, data, size);
+    line[size] = '\0';
+    return size;
+}
+
+int fuzz_tokenize_line(const uint8_t *data, size_t size)
+{
+    char line[FUZZ_LINE_MAX];
+    copy_line(data, size, line);
+
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    if (tokenize_line(line, 1, NULL, &tokens, &token_count) != 0)
+        return 0;
+
+    for (size_t i = 0; i < token_count; i++)
+        free(tokens[i].lexeme);
+    free(tokens);
+    return 0;
+}
+
+int fuzz_parse_tokens(const uint8_t *data, size_t size)
+{
+    char line[FUZZ_LINE_MAX];
+    copy_line(data, size, line);
+
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    if (tokenize_line(line, 1, NULL, &tokens, &token_count) != 0)
+        return 0;
+
+    // mirrors assemble_file: empty and comment-only lines never reach the parser
+    if (token_count == 0)
+    {
+        free(tokens);
+        return 0;
+    }
+
+    // a fresh table per input keeps runs independent, names get interned as undefined
+    SymbolTable symbols;
+    if (symtab_init(&symbols) != 0)
+    {
+        free_tokens(tokens, token_count);
+        return 0;
+    }
+
+    // parse_tokens frees the tokens on both success and failure
+    Instruction inst;
+    parse_tokens(tokens, token_count, 1, &symbols, &inst);
+    symtab_free(&symbols);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+#ifdef FUZZ_TOKENIZER
+    return fuzz_tokenize_line(data, size);
+#else
+    return fuzz_parse_tokens(data, size);
+#endif
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+typedef struct
+{
+    uint8_t **data;
+    size_t *sizes;
+    size_t count;
+    size_t capacity;
+} Corpus;
+
+static int corpus_add_file(Corpus *c, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return 1;
+    }
+
+    uint8_t buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (c->count == c->capacity)
+    {
+        size_t newcap = c->capacity ? c->capacity * 2 : 64;
+        uint8_t **d = realloc(c->data, newcap * sizeof *d);
+        size_t *s = realloc(c->sizes, newcap * sizeof *s);
+        if (!d || !s)
+        {
+            fprintf(stderr, "Error: memory allocation failed while loading the corpus\n");
+            free(d ? d : c->data);
+            free(s ? s : c->sizes);
+            c->data = NULL;
+            c->sizes = NULL;
+            return 1;
+        }
+        c->data = d;
+        c->sizes = s;
+        c->capacity = newcap;
+    }
+
+    c->data[c->count] = malloc(n ? n : 1);
+    if (!c->data[c->count])
+        return 1;
+    memcpy(c->data[c->count], buf, n);
+    c->sizes[c->count] = n;
+    c->count++;
+    return 0;
+}
+
+static int corpus_add_path(Corpus *c, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+        return corpus_add_file(c, path);
+
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        perror(path);
+        return 1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+        if (corpus_add_path(c, child) != 0)
+        {
+            closedir(dir);
+            return 1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static double sec_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    long runs = 1;
+    Corpus corpus = {0};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            runs = strtol(argv[i] + 6, NULL, 10);
+            if (runs < 1)
+                runs = 1;
+            continue;
+        }
+        if (corpus_add_path(&corpus, argv[i]) != 0)
+            return 1;
+    }
+
+    if (corpus.count == 0)
+    {
+        fprintf(stderr, "usage: %s [-runs=N] <corpus file or dir>...\n", argv[0]);
+        return 1;
+    }
+
+    // the parser reports every rejected input on stderr, which would dominate the run time
+    if (!freopen("/dev/null", "w", stderr))
+        return 1;
+
+    double t0 = sec_now();
+    for (long r = 0; r < runs; r++)
+        for (size_t i = 0; i < corpus.count; i++)
+            LLVMFuzzerTestOneInput(corpus.data[i], corpus.sizes[i]);
+    double t1 = sec_now();
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    double execs = (double)runs * corpus.count;
+    printf("%zu inputs, %.0f execs in %.3f s  ⇒  %.0f exec/s, peak rss %ld KiB\n",
+           corpus.count, execs, t1 - t0, execs / (t1 - t0), ru.ru_maxrss);
+
+    for (size_t i = 0; i < corpus.count; i++)
+        free(corpus.data[i]);
+    free(corpus.data);
+    free(corpus.sizes);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdlib.h> // for malloc, realloc, free
+#include <errno.h>  // for errno, EFBIG, ENOMEM
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h> // for _mm_loadu_si128, _mm_cmpeq_epi8, _mm_movemask_epi8
+#define LINEINDEX_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h> // for _BitScanForward64, __popcnt64
+#endif
+
+#include "lineindex.h"
+
+#define LINEINDEX_BLOCK 64 // bytes per pair of masks, one bit each
+
+static inline void block_masks(const char *p, size_t n, uint64_t *newlines_out, uint64_t *ink_out);
+static inline unsigned lowest_bit(uint64_t mask);
+static inline unsigned bit_count(uint64_t mask);
+static inline uint8_t line_kind(char c);
+
+// Each block gives a mask of its newlines and one of the bytes that are not blank. A line
+// ends at every newline bit, its kind comes from the lowest ink bit since its start; no
+// byte is looked at twice and only the first character of each line is read again. The
+// array starts at a guess from the size and doubles whenever a block might not fit.
+int index_lines(const char *data, size_t size, SourceLine **lines_out, size_t *count_out)
+{
+    *lines_out = NULL;
+    *count_out = 0;
+    if (size > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return 1;
+    }
+
+    if (size == 0)
+        return 0;
+
+    SourceLine *lines = NULL;
+    size_t cap = size / 32 + LINEINDEX_BLOCK + 1, n = 0, start = 0;
+    size_t first = SIZE_MAX; // the first ink of the current line, SIZE_MAX while there is none
+    for (size_t base = 0; base < size; base += LINEINDEX_BLOCK)
+    {
+        // room for a line per byte of the block, and the unterminated last line
+        if (!lines || cap - n < LINEINDEX_BLOCK + 1)
+        {
+            cap = lines ? cap * 2 : cap;
+            SourceLine *tmp = realloc(lines, cap * sizeof *lines);
+            if (!tmp)
+            {
+                free(lines);
+                errno = ENOMEM;
+                return 1;
+            }
+            lines = tmp;
+        }
+
+        uint64_t newlines, ink;
+        block_masks(data + base, size - base < LINEINDEX_BLOCK ? size - base : LINEINDEX_BLOCK, &newlines, &ink);
+
+        while (newlines)
+        {
+            unsigned at = lowest_bit(newlines);
+            uint64_t upto = ((uint64_t)2 << at) - 1; // bits 0 .. at, all of them for 63
+            if (first == SIZE_MAX && (ink & upto))
+                first = base + lowest_bit(ink & upto);
+
+            size_t end = base + at + 1;
+            lines[n++] = (SourceLine){
+                .offset = (uint32_t)start,
+                .len = (uint32_t)(end - start),
+                .kind = first == SIZE_MAX ? SOURCE_BLANK : line_kind(data[first]),
+            };
+            start = end;
+            first = SIZE_MAX;
+            ink &= ~upto;
+            newlines &= newlines - 1;
+        }
+        if (first == SIZE_MAX && ink)
+            first = base + lowest_bit(ink);
+    }
+    if (start < size)
+    {
+        lines[n++] = (SourceLine){
+            .offset = (uint32_t)start,
+            .len = (uint32_t)(size - start),
+            .kind = first == SIZE_MAX ? SOURCE_BLANK : line_kind(data[first]),
+        };
+    }
+
+    // the index lives as long as its file stays cached
+    SourceLine *fit = realloc(lines, n * sizeof *lines);
+    *lines_out = fit ? fit : lines;
+    *count_out = n;
+    return 0;
+}
+
+size_t count_lines(const char *data, size_t size)
+{
+    size_t count = 0;
+    for (size_t base = 0; base < size; base += LINEINDEX_BLOCK)
+    {
+        uint64_t newlines, ink;
+        block_masks(data + base, size - base < LINEINDEX_BLOCK ? size - base : LINEINDEX_BLOCK, &newlines, &ink);
+        count += bit_count(newlines);
+    }
+    // a last line without a newline still counts
+    return count + (size > 0 && data[size - 1] != '\n');
+}
+
+void split_lines(const SourceLine *lines, size_t count, size_t parts, size_t *starts)
+{
+    size_t total = count ? (size_t)lines[count - 1].offset + lines[count - 1].len : 0;
+    for (size_t i = 0; i < parts; i++)
+    {
+        // the first line that starts at or after the i-th share of the bytes
+        size_t target = (size_t)((unsigned long long)total * i / parts);
+        size_t lo = 0, hi = count;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (lines[mid].offset < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        starts[i] = lo;
+    }
+}
+
+// bit i of *newlines_out is set if p[i] is '\n', of *ink_out if it is none of " \t\r\n"
+static inline void block_masks(const char *p, size_t n, uint64_t *newlines_out, uint64_t *ink_out)
+{
+    uint64_t newlines = 0, blank = 0;
+#ifdef LINEINDEX_SSE2
+    if (n == LINEINDEX_BLOCK)
+    {
+        const __m128i nl = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i is_nl = _mm_cmpeq_epi8(v, nl);
+            __m128i is_blank = _mm_or_si128(_mm_or_si128(is_nl, _mm_cmpeq_epi8(v, sp)),
+                                            _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, cr)));
+            newlines |= (uint64_t)(unsigned)_mm_movemask_epi8(is_nl) << (16 * i);
+            blank |= (uint64_t)(unsigned)_mm_movemask_epi8(is_blank) << (16 * i);
+        }
+        *newlines_out = newlines;
+        *ink_out = ~blank;
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+    {
+        char c = p[i];
+        newlines |= (uint64_t)(c == '\n') << i;
+        blank |= (uint64_t)(c == '\n' || c == ' ' || c == '\t' || c == '\r') << i;
+    }
+    *newlines_out = newlines;
+    // past the end of a short block there is no ink either
+    *ink_out = ~blank & (n == LINEINDEX_BLOCK ? UINT64_MAX : ((uint64_t)1 << n) - 1);
+}
+
+static inline unsigned lowest_bit(uint64_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+
+static inline unsigned bit_count(uint64_t mask)
+{
+#ifdef _MSC_VER
+    return (unsigned)__popcnt64(mask);
+#else
+    return (unsigned)__builtin_popcountll(mask);
+#endif
+}
+
+static inline uint8_t line_kind(char c)
+{
+    if (c == ';')
+        return SOURCE_COMMENT;
+    if (c == '%')
+        return SOURCE_DIRECTIVE;
+    return SOURCE_CODE;
+}
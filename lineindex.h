@@ -0,0 +1,35 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint32_t
+
+// what a line starts with, after spaces, tabs and carriage returns
+typedef enum
+{
+    SOURCE_BLANK,     // nothing
+    SOURCE_COMMENT,   // ';'
+    SOURCE_DIRECTIVE, // '%'
+    SOURCE_CODE       // anything else: instructions, labels, data, equ
+} SourceKind;
+
+typedef struct
+{
+    uint32_t offset; // of the first byte in the buffer
+    uint32_t len;    // the newline included, the last line may have none
+    uint8_t kind;    // SourceKind
+} SourceLine;
+
+// Splits a buffer into lines, 64 bytes at a time with SSE2 where it is available.
+// *lines_out is NULL for an empty buffer, the caller frees it. Returns 1 with errno set
+// if the buffer is larger than 4 GiB or memory runs out, prints nothing.
+int index_lines(const char *data, size_t size, SourceLine **lines_out, size_t *count_out);
+
+// the number of lines index_lines would find, without storing them
+size_t count_lines(const char *data, size_t size);
+
+// The first line of each of `parts` chunks with about the same number of bytes, for
+// assembling or scanning them on separate threads. starts[0] is 0, a chunk may be empty.
+void split_lines(const SourceLine *lines, size_t count, size_t parts, size_t *starts);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdlib.h> // for malloc, free
+#include <string.h> // for memcpy, memcmp
+#include <errno.h>  // for errno, EINVAL, ENOMEM
+
+#include "linemap.h"
+
+#define LINEMAP_HEADER 5 // magic and version
+#define LINEMAP_ROW_MIN 3 // bytes, gap, size and delta take one at least
+
+static size_t encode_rows(const LineSpan *spans, size_t count, uint8_t *out, size_t *rows_out);
+static inline size_t varint_size(uint64_t v);
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v);
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v_out);
+
+// Sizes the map first, so it is built in one allocation and the caller writes it at once.
+int linemap_encode(const LineSpan *spans, size_t count, const SymbolTable *names, uint8_t **buf_out, size_t *len_out)
+{
+    *buf_out = NULL;
+    *len_out = 0;
+
+    size_t rows = 0;
+    size_t len = LINEMAP_HEADER + varint_size(names->count);
+    for (uint32_t i = 0; i < names->count; i++)
+        len += varint_size(names->symbols[i].len) + names->symbols[i].len;
+    size_t body = encode_rows(spans, count, NULL, &rows);
+    if (body == SIZE_MAX)
+    {
+        errno = EINVAL;
+        return 1;
+    }
+    len += varint_size(rows) + body;
+
+    uint8_t *buf = malloc(len);
+    if (!buf)
+    {
+        errno = ENOMEM;
+        return 1;
+    }
+    uint8_t *p = buf;
+    memcpy(p, LINEMAP_MAGIC, 4);
+    p[4] = LINEMAP_VERSION;
+    p = put_varint(p + LINEMAP_HEADER, names->count);
+    for (uint32_t i = 0; i < names->count; i++)
+    {
+        p = put_varint(p, names->symbols[i].len);
+        memcpy(p, names->symbols[i].name, names->symbols[i].len);
+        p += names->symbols[i].len;
+    }
+    p = put_varint(p, rows);
+    encode_rows(spans, count, p, &rows);
+
+    *buf_out = buf;
+    *len_out = len;
+    return 0;
+}
+
+int linemap_load(const uint8_t *data, size_t len, LineMap *map)
+{
+    memset(map, 0, sizeof *map);
+    const uint8_t *p = data + LINEMAP_HEADER, *end = data + len;
+    uint64_t file_count, count;
+    if (len < LINEMAP_HEADER || memcmp(data, LINEMAP_MAGIC, 4) != 0 || data[4] != LINEMAP_VERSION ||
+        get_varint(&p, end, &file_count) != 0 || file_count == 0 || file_count > UINT16_MAX + 1ULL ||
+        file_count > (size_t)(end - p))
+    {
+        errno = EINVAL;
+        return 1;
+    }
+
+    // the names are copied with a NUL each, which their length varints make room for
+    map->files = malloc(file_count * sizeof *map->files);
+    map->names = malloc(len);
+    if (!map->files || !map->names)
+    {
+        linemap_free(map);
+        errno = ENOMEM;
+        return 1;
+    }
+    char *names = map->names;
+    for (size_t i = 0; i < file_count; i++)
+    {
+        uint64_t n;
+        if (get_varint(&p, end, &n) != 0 || n > (size_t)(end - p))
+            goto malformed;
+        memcpy(names, p, n);
+        names[n] = '\0';
+        map->files[i] = names;
+        names += n + 1;
+        p += n;
+    }
+    map->file_count = file_count;
+
+    if (get_varint(&p, end, &count) != 0 || count > (size_t)(end - p) / LINEMAP_ROW_MIN)
+        goto malformed;
+    map->rows = malloc(count ? count * sizeof *map->rows : 1);
+    if (!map->rows)
+    {
+        linemap_free(map);
+        errno = ENOMEM;
+        return 1;
+    }
+
+    uint64_t next = 0, lineno = 0, file = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t gap, size, delta;
+        if (get_varint(&p, end, &gap) != 0 || get_varint(&p, end, &size) != 0 || get_varint(&p, end, &delta) != 0 ||
+            ((delta & 1) && get_varint(&p, end, &file) != 0))
+            goto malformed;
+        if (gap > UINT32_MAX || size == 0 || size > UINT32_MAX)
+            goto malformed;
+        uint64_t zigzag = delta >> 1;
+        lineno += (zigzag >> 1) ^ -(zigzag & 1);
+        next += gap;
+        if (next + size > UINT32_MAX + 1ULL || lineno > UINT32_MAX || file >= file_count)
+            goto malformed;
+        map->rows[i] = (LineMapRow){.addr = (uint32_t)next, .size = (uint32_t)size, .lineno = (uint32_t)lineno, .file = (uint16_t)file};
+        next += size;
+    }
+    map->count = count;
+    return 0;
+
+malformed:
+    linemap_free(map);
+    errno = EINVAL;
+    return 1;
+}
+
+void linemap_free(LineMap *map)
+{
+    free(map->files);
+    free(map->names);
+    free(map->rows);
+    memset(map, 0, sizeof *map);
+}
+
+const LineMapRow *linemap_find(const LineMap *map, uint32_t addr)
+{
+    // the first row that starts after addr, the one before it is the candidate
+    size_t lo = 0, hi = map->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->rows[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    const LineMapRow *r = &map->rows[lo - 1];
+    return addr - r->addr < r->size ? r : NULL;
+}
+
+// With out NULL only counts: the bytes of the rows, SIZE_MAX if a span goes back before the
+// previous one ends. Empty spans take no row.
+static size_t encode_rows(const LineSpan *spans, size_t count, uint8_t *out, size_t *rows_out)
+{
+    size_t len = 0, rows = 0;
+    uint64_t next = 0;
+    uint32_t lineno = 0;
+    uint16_t file = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const LineSpan *s = &spans[i];
+        if (s->size == 0)
+            continue;
+        if (s->addr < next)
+            return SIZE_MAX;
+
+        int64_t d = (int64_t)s->lineno - lineno;
+        uint64_t zigzag = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+        uint64_t delta = zigzag << 1 | (s->file != file);
+        len += varint_size(s->addr - next) + varint_size(s->size) + varint_size(delta) + (s->file != file ? varint_size(s->file) : 0);
+        if (out)
+        {
+            out = put_varint(out, s->addr - next);
+            out = put_varint(out, s->size);
+            out = put_varint(out, delta);
+            if (s->file != file)
+                out = put_varint(out, s->file);
+        }
+        next = (uint64_t)s->addr + s->size;
+        lineno = s->lineno;
+        file = s->file;
+        rows++;
+    }
+    *rows_out = rows;
+    return len;
+}
+
+static inline size_t varint_size(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// at most ten bytes, the tenth may only hold the top bit
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v_out)
+{
+    uint64_t v = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *(*p)++;
+        if (shift == 63 && b > 1)
+            return 1;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *v_out = v;
+            return 0;
+        }
+    }
+    return 1;
+}
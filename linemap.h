@@ -0,0 +1,55 @@
+#ifndef LINEMAP_H
+#define LINEMAP_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint16_t, uint32_t
+
+#include "assembler.h" // for LineSpan
+#include "symtab.h"    // for SymbolTable
+
+// The line map written by --line-map: where each line's bytes are in the output, for
+// profilers, emulators and crash reports. Little room per line and one pass to load it:
+//
+//   "L86M", a version byte
+//   varint file count, then per file a varint length and the name, the main file first
+//   varint row count, then per row, in address order:
+//     varint gap     bytes since the end of the previous row, 0 for the usual back-to-back lines
+//     varint size
+//     varint delta   the line minus the previous row's line, zigzag encoded, shifted left once;
+//                    bit 0 set if the file changes, its index follows as a varint
+//
+// Varints are LEB128: seven bits a byte, low bits first, the top bit set on all but the last.
+// A back-to-back line in the same file takes three bytes.
+
+#define LINEMAP_MAGIC "L86M"
+#define LINEMAP_VERSION 1
+
+typedef struct
+{
+    uint32_t addr;
+    uint32_t size;
+    uint32_t lineno;
+    uint16_t file; // in LineMap.files
+} LineMapRow;
+
+typedef struct
+{
+    const char **files; // NUL-terminated, files[0] is the main file
+    size_t file_count;
+    LineMapRow *rows; // by address, none of them empty
+    size_t count;
+    char *names; // the storage of files
+} LineMap;
+
+// Encodes the spans that have bytes, in the order given, which must be by address; names
+// holds the files in id order. *buf_out is malloced. Returns 1 with errno set, prints nothing.
+int linemap_encode(const LineSpan *spans, size_t count, const SymbolTable *names, uint8_t **buf_out, size_t *len_out);
+
+// Decodes a whole map, 1 with errno EINVAL if it is malformed or ENOMEM; prints nothing.
+int linemap_load(const uint8_t *data, size_t len, LineMap *map);
+void linemap_free(LineMap *map);
+
+// the row whose bytes include addr, NULL between and after rows
+const LineMapRow *linemap_find(const LineMap *map, uint32_t addr);
+
+#endif
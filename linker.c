@@ -0,0 +1,284 @@
+#include <stdio.h>    // for fprintf
+#include <stdlib.h>   // for calloc, malloc, free
+#include <string.h>   // for memcpy, strlen, strerror
+#include <stdbool.h>  // for bool
+#include <errno.h>    // for errno
+#include <fcntl.h>    // for open, O_RDONLY, O_RDWR, O_CREAT, O_TRUNC
+#include <unistd.h>   // for close, ftruncate, unlink
+#include <sys/mman.h> // for mmap, munmap
+#include <sys/stat.h> // for fstat
+
+#include "linker.h"
+#include "object.h"
+#include "symtab.h"
+#include "encoder.h"
+
+#define LINK_ALIGN_MAX 0x10000 // the largest boundary align accepts
+
+// an object mapped read-only, its parts point into the mapping
+typedef struct
+{
+    const char *name;
+    const uint8_t *data;
+    size_t size;
+    const ObjHeader *header;
+    const uint8_t *text;
+    const ObjSymbol *symbols;
+    const ObjReloc *relocs;
+    const char *strings;
+    size_t base; // where the text starts in the output
+} LinkObject;
+
+static int map_object(LinkObject *obj);
+static bool check_object(const LinkObject *obj);
+static int define_globals(SymbolTable *globals, const LinkObject *objs, size_t count);
+static int relocate(uint8_t *out, const LinkObject *obj, const SymbolTable *globals, uint32_t *address);
+
+int link_objects(char **names, size_t count, const char *out_name)
+{
+    LinkObject *objs = calloc(count, sizeof *objs);
+    SymbolTable globals;
+    if (!objs || symtab_init(&globals) != 0)
+    {
+        fprintf(stderr, "Error: memory allocation failed (link_objects)\n");
+        free(objs);
+        return 1;
+    }
+
+    int status = 1, fd = -1;
+    uint8_t *out = NULL;
+    uint32_t *address = NULL;
+    size_t size = 0, symbols_max = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        objs[i].name = names[i];
+        if (map_object(&objs[i]) != 0)
+            goto done;
+
+        // every module where its own align directives expect to be, its bss right behind it
+        const ObjHeader *h = objs[i].header;
+        objs[i].base = (size + h->align - 1) & ~(size_t)(h->align - 1);
+        size = objs[i].base + h->text_size + h->bss_size;
+        if (size > UINT32_MAX)
+        {
+            fprintf(stderr, "Error: the linked output would be larger than 4 GiB\n");
+            goto done;
+        }
+        if (h->symbol_count > symbols_max)
+            symbols_max = h->symbol_count;
+    }
+    if (define_globals(&globals, objs, count) != 0)
+        goto done;
+
+    address = malloc(symbols_max * sizeof *address + 1);
+    fd = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (!address)
+    {
+        fprintf(stderr, "Error: memory allocation failed (link_objects)\n");
+        goto done;
+    }
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0 ||
+        (size > 0 && (out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        out = NULL;
+        fprintf(stderr, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        goto done;
+    }
+
+    // the one copy of each section, from one mapping into the other; bss is already zero
+    bool failed = false;
+    size_t end = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const LinkObject *obj = &objs[i];
+        encode_padding(out + end, obj->base - end);
+        memcpy(out + obj->base, obj->text, obj->header->text_size);
+        end = obj->base + obj->header->text_size + obj->header->bss_size;
+        if (relocate(out, obj, &globals, address) != 0)
+            failed = true;
+    }
+    status = failed ? 1 : 0;
+
+done:
+    if (out && munmap(out, size) != 0 && status == 0)
+    {
+        fprintf(stderr, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        status = 1;
+    }
+    if (fd >= 0 && close(fd) != 0 && status == 0)
+    {
+        fprintf(stderr, "Error with output file '%s': %s\n", out_name, strerror(errno));
+        status = 1;
+    }
+    // a half-linked binary would look like a good one
+    if (fd >= 0 && status != 0)
+        unlink(out_name);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (objs[i].data)
+            munmap((void *)objs[i].data, objs[i].size);
+    }
+    free(address);
+    free(objs);
+    symtab_free(&globals);
+    return status;
+}
+
+static int map_object(LinkObject *obj)
+{
+    int fd = open(obj->name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Error with object file '%s': %s\n", obj->name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(ObjHeader))
+    {
+        fprintf(stderr, "Error: '%s' is not an object file\n", obj->name);
+        close(fd);
+        return 1;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error with object file '%s': %s\n", obj->name, strerror(saved));
+        return 1;
+    }
+    obj->data = data;
+    obj->size = (size_t)st.st_size;
+
+    // the mapping is page-aligned and every part starts on a multiple of 4
+    const ObjHeader *h = data;
+    obj->header = h;
+    if (h->magic != OBJECT_MAGIC || h->version != OBJECT_VERSION)
+    {
+        fprintf(stderr, "Error: '%s' is not an object file of this version\n", obj->name);
+        return 1;
+    }
+    uint64_t symbols = sizeof *h + (((uint64_t)h->text_size + 3) & ~(uint64_t)3);
+    uint64_t relocs = symbols + (uint64_t)h->symbol_count * sizeof(ObjSymbol);
+    uint64_t strings = relocs + (uint64_t)h->reloc_count * sizeof(ObjReloc);
+    if (strings + h->strings_size != obj->size)
+    {
+        fprintf(stderr, "Error: object file '%s' is damaged\n", obj->name);
+        return 1;
+    }
+    obj->text = obj->data + sizeof *h;
+    obj->symbols = (const ObjSymbol *)(obj->data + symbols);
+    obj->relocs = (const ObjReloc *)(obj->data + relocs);
+    obj->strings = (const char *)obj->data + strings;
+    if (!check_object(obj))
+    {
+        fprintf(stderr, "Error: object file '%s' is damaged\n", obj->name);
+        return 1;
+    }
+    return 0;
+}
+
+// every index and offset in range, so the rest of the linker can trust them
+static bool check_object(const LinkObject *obj)
+{
+    const ObjHeader *h = obj->header;
+    if (h->align == 0 || h->align > LINK_ALIGN_MAX || (h->align & (h->align - 1)) != 0 ||
+        (h->strings_size > 0 && obj->strings[h->strings_size - 1] != '\0'))
+        return false;
+
+    uint64_t module_size = (uint64_t)h->text_size + h->bss_size;
+    for (uint32_t i = 0; i < h->symbol_count; i++)
+    {
+        const ObjSymbol *s = &obj->symbols[i];
+        if (s->name >= h->strings_size || s->binding > OBJ_EXTERN || (s->binding != OBJ_EXTERN && s->value > module_size))
+            return false;
+    }
+    for (uint32_t i = 0; i < h->reloc_count; i++)
+    {
+        const ObjReloc *r = &obj->relocs[i];
+        if (r->symbol >= h->symbol_count || r->type > OBJ_REL16 || (uint64_t)r->offset + (r->type == OBJ_ABS8 ? 1 : 2) > h->text_size)
+            return false;
+    }
+    return true;
+}
+
+// each global at its output address; lineno is the object that defines it, for the message
+static int define_globals(SymbolTable *globals, const LinkObject *objs, size_t count)
+{
+    int status = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const LinkObject *obj = &objs[i];
+        for (uint32_t j = 0; j < obj->header->symbol_count; j++)
+        {
+            const ObjSymbol *s = &obj->symbols[j];
+            if (s->binding != OBJ_GLOBAL)
+                continue;
+
+            const char *name = obj->strings + s->name;
+            uint32_t id;
+            if (symtab_intern(globals, name, strlen(name), i, &id) != 0)
+                return 1;
+            Symbol *sym = &globals->symbols[id];
+            if (sym->kind != SYM_UNDEFINED)
+            {
+                fprintf(stderr, "Error: symbol '%s' is defined in both '%s' and '%s'\n", name, objs[sym->lineno].name, obj->name);
+                status = 1;
+                continue;
+            }
+            sym->kind = SYM_LABEL;
+            sym->value = (int64_t)(obj->base + s->value);
+        }
+    }
+    return status;
+}
+
+// Resolves the module's symbols once, then patches every relocation in its copy of the text.
+// Goes on past an error so one link reports every undefined symbol of the module.
+static int relocate(uint8_t *out, const LinkObject *obj, const SymbolTable *globals, uint32_t *address)
+{
+    int status = 0;
+    for (uint32_t i = 0; i < obj->header->symbol_count; i++)
+    {
+        const ObjSymbol *s = &obj->symbols[i];
+        address[i] = (uint32_t)(obj->base + s->value);
+        if (s->binding != OBJ_EXTERN)
+            continue;
+
+        const char *name = obj->strings + s->name;
+        uint32_t id = symtab_find(globals, name, strlen(name));
+        if (id == SYMBOL_NONE || globals->symbols[id].kind != SYM_LABEL)
+        {
+            fprintf(stderr, "Error: undefined symbol '%s' in '%s'\n", name, obj->name);
+            status = 1;
+            continue;
+        }
+        address[i] = (uint32_t)globals->symbols[id].value;
+    }
+    if (status != 0)
+        return 1;
+
+    for (uint32_t i = 0; i < obj->header->reloc_count; i++)
+    {
+        const ObjReloc *r = &obj->relocs[i];
+        size_t at = obj->base + r->offset;
+        int64_t value = (int64_t)address[r->symbol] + r->addend;
+        if (r->type == OBJ_REL16)
+            value -= (int64_t)at + 2;
+        else if (r->type == OBJ_ABS8 ? value < -128 || value > 255 : value < -65536 || value > 65535)
+        {
+            fprintf(stderr, "Error: value of '%s' in '%s' does not fit in a %s\n", obj->strings + obj->symbols[r->symbol].name,
+                    obj->name, r->type == OBJ_ABS8 ? "byte" : "word");
+            status = 1;
+            continue;
+        }
+
+        out[at] = (uint8_t)value;
+        if (r->type != OBJ_ABS8)
+            out[at + 1] = (uint8_t)(value >> 8);
+    }
+    return status;
+}
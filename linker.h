@@ -0,0 +1,14 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <stddef.h> // for size_t
+
+// Links objects written by -c into one flat binary, in the order given: the first one starts
+// at address 0. Each module is placed at the next multiple of its align, the gap padded like
+// align does, and its bss follows as zeros. Global symbols are resolved through one hash table;
+// a symbol defined twice or an extern nobody defines is reported and fails the link.
+// The objects are mapped read-only, their sections copied straight into a mapping of the
+// output and relocated there. Returns 1 and removes the output on failure.
+int link_objects(char **names, size_t count, const char *out_name);
+
+#endif
@@ -1,27 +1,290 @@
+#define _XOPEN_SOURCE 700 // clock_gettime and open_memstream for --batch/--server, realpath for the file cache
 #include <stdio.h>
+#include <unistd.h>
 
 #include "assembler.c"
+#include "batch.c"
+#include "protocol.c"
+#include "server.c"
+#include "watch.c"
+#include "linker.c"
+#include "buildcache.c"
 
-int main(int argc, char *argv[])
+static void print_usage(void)
+{
+    fprintf(stderr, "Correct Usage: my-assembler [-O] [-c] [--stats] [-l listing.lst] [--line-map output.map] [--watch] [errors] input.asm output\n");
+    fprintf(stderr, "               my-assembler [-O] [-c] [--cache-dir dir] [errors] input.asm output\n");
+    fprintf(stderr, "               my-assembler [-O] [-c] [-j threads] [--cache-dir dir] [errors] --batch (input.asm output ... | @manifest)\n");
+    fprintf(stderr, "               my-assembler [-O] [errors] --server socket\n");
+    fprintf(stderr, "               my-assembler --link object ... output\n");
+    fprintf(stderr, "  -c: write a relocatable object for --link instead of a flat binary\n");
+    fprintf(stderr, "  --cache-dir: copy the output of an unchanged input from dir instead of assembling it\n");
+    fprintf(stderr, "  errors: --keep-going [--max-errors count], report every error instead of stopping at the first\n");
+}
+
+static bool has_asm_suffix(const char *name)
 {
-    if (argc != 3)
+    size_t len = strlen(name);
+    return len < 4 || strcmp(name + len - 4, ".asm") == 0;
+}
+
+// --batch: input/output pairs from the command line, or from a manifest file given as @name
+static int run_batch(char **names, int name_count, const AssembleOptions *opts, const BuildCache *build_cache, long threads)
+{
+    BatchFile *files = NULL;
+    size_t count = 0;
+    char *text = NULL;
+    if (name_count == 1 && names[0][0] == '@')
     {
-        fprintf(stderr, "Error: invalid number of arguments, expected 2\n");
-        fprintf(stderr, "Correct Usage: my-assembler input.asm output\n");
+        if (read_manifest(names[0] + 1, &files, &count, &text) != 0)
+            return 1;
+    }
+    else if (name_count == 0 || name_count % 2 != 0)
+    {
+        fprintf(stderr, "Error: --batch expects input/output pairs or a single @manifest\n");
+        print_usage();
         return 1;
     }
+    else
+    {
+        count = (size_t)name_count / 2;
+        files = malloc(count * sizeof *files);
+        if (!files)
+        {
+            fprintf(stderr, "Error: memory allocation failed (run_batch)\n");
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++)
+            files[i] = (BatchFile){.in_name = names[2 * i], .out_name = names[2 * i + 1]};
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < count && status == 0; i++)
+    {
+        if (!has_asm_suffix(files[i].in_name))
+        {
+            fprintf(stderr, "Error: input file '%s' does not end with .asm\n", files[i].in_name);
+            status = 1;
+        }
+    }
 
-    // const char *in_name = argv[1];
+    if (threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (status == 0 && assemble_batch(files, count, opts, build_cache, threads < 1 ? 1 : threads > 256 ? 256 : (int)threads) != 0)
+        status = 1;
+    free(files);
+    free(text);
+    return status;
+}
 
-    size_t len = strlen(argv[1]);
-    if (len >= 4 && strcmp(argv[1] + len - 4, ".asm") != 0)
+int main(int argc, char *argv[])
+{
+    AssembleOptions opts = {0};
+    bool batch = false;
+    bool watch = false;
+    bool link = false;
+    const char *socket_path = NULL;
+    const char *cache_dir = NULL;
+    BuildCache build_cache;
+    long threads = 0;
+    char **files = malloc((size_t)argc * sizeof *files);
+    int file_count = 0;
+    if (!files)
     {
-        fprintf(stderr, "Error: input file does not end with .asm\n");
+        fprintf(stderr, "Error: memory allocation failed (main)\n");
         return 1;
     }
 
-    if (assemble_file(argv[1], argv[2]) != 0)
-        return 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                fprintf(stderr, "Error: option '-l' expects a listing file name\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+            opts.listing_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--line-map") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                fprintf(stderr, "Error: option '--line-map' expects a line map file name\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+            opts.linemap_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                fprintf(stderr, "Error: option '--cache-dir' expects a directory\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+            cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            char *end = NULL;
+            if (i + 1 < argc)
+                threads = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || threads < 1)
+            {
+                fprintf(stderr, "Error: option '-j' expects a thread count\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-errors") == 0)
+        {
+            char *end = NULL;
+            long max = 0;
+            if (i + 1 < argc)
+                max = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || max < 1)
+            {
+                fprintf(stderr, "Error: option '--max-errors' expects an error count\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+            opts.max_errors = (size_t)max;
+        }
+        else if (strcmp(argv[i], "--keep-going") == 0)
+        {
+            opts.keep_going = true;
+        }
+        else if (strcmp(argv[i], "-O") == 0)
+        {
+            opts.optimize = true;
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            opts.object = true;
+        }
+        else if (strcmp(argv[i], "--link") == 0)
+        {
+            link = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            opts.stats = true;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else if (strcmp(argv[i], "--watch") == 0)
+        {
+            watch = true;
+        }
+        else if (strcmp(argv[i], "--server") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                fprintf(stderr, "Error: option '--server' expects a socket path\n");
+                print_usage();
+                free(files);
+                return 1;
+            }
+            socket_path = argv[++i];
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            print_usage();
+            free(files);
+            return 1;
+        }
+        else
+        {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    int status = 1;
+    if ((batch || socket_path) && (opts.listing_name || opts.linemap_name || opts.stats))
+    {
+        // per-file listings, line maps and statistics would need a name each and interleave on stdout
+        fprintf(stderr, "Error: options '-l', '--line-map' and '--stats' cannot be used with --batch or --server\n");
+        print_usage();
+    }
+    else if (batch + watch + link + (socket_path != NULL) > 1)
+    {
+        fprintf(stderr, "Error: options '--batch', '--server', '--watch' and '--link' cannot be used together\n");
+        print_usage();
+    }
+    else if (opts.object && (watch || socket_path || link))
+    {
+        // the watcher patches the output at code addresses, the client expects a flat binary
+        fprintf(stderr, "Error: option '-c' cannot be used with --watch, --server or --link\n");
+        print_usage();
+    }
+    else if (cache_dir && (watch || socket_path || link || opts.listing_name || opts.linemap_name || opts.stats))
+    {
+        // a copied output comes without its listing, line map or statistics
+        fprintf(stderr, "Error: option '--cache-dir' cannot be used with --watch, --server, --link, '-l', '--line-map' or '--stats'\n");
+        print_usage();
+    }
+    else if (cache_dir && buildcache_init(&build_cache, cache_dir) != 0)
+    {
+        // it has said why, status stays 1
+    }
+    else if (link)
+    {
+        if (file_count < 2)
+        {
+            fprintf(stderr, "Error: --link expects at least one object and an output file\n");
+            print_usage();
+        }
+        else
+            status = link_objects(files, (size_t)file_count - 1, files[file_count - 1]);
+    }
+    else if (batch)
+    {
+        status = run_batch(files, file_count, &opts, cache_dir ? &build_cache : NULL, threads);
+    }
+    else if (socket_path)
+    {
+        if (file_count != 0)
+        {
+            fprintf(stderr, "Error: --server takes no input or output file\n");
+            print_usage();
+        }
+        else
+            status = run_server(socket_path, &opts);
+    }
+    else if (file_count != 2)
+    {
+        fprintf(stderr, "Error: invalid number of arguments, expected 2\n");
+        print_usage();
+    }
+    else if (!has_asm_suffix(files[0]))
+    {
+        fprintf(stderr, "Error: input file does not end with .asm\n");
+    }
+    else if (watch)
+    {
+        status = run_watch(files[0], files[1], &opts);
+    }
+    else if (cache_dir)
+    {
+        bool hit;
+        status = buildcache_assemble(&build_cache, files[0], files[1], &opts, &hit);
+    }
+    else if (assemble_file(files[0], files[1], &opts) == 0)
+    {
+        status = 0;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    free(files);
+    return status;
+}
@@ -0,0 +1,64 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdint.h> // for uint32_t, int32_t
+
+// The relocatable object written by -c, in host byte order since objects are assembled and
+// linked on one machine. Every part is an array of 32-bit fields, so the linker reads them
+// straight out of its mapping of the file:
+//
+//   ObjHeader
+//   text_size bytes of code and data, padded with zeros to a multiple of 4
+//   symbol_count ObjSymbol
+//   reloc_count ObjReloc
+//   strings_size bytes of NUL-terminated names
+//
+// A module has a text section and, for the resb/resw at its end, a bss section of zeros that
+// directly follows it. Addresses in a module count from the start of its text, numeric branch
+// targets included; the linker moves every module to its place in the output.
+#define OBJECT_MAGIC 0x4A424F38 // "8OBJ"
+#define OBJECT_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t text_size;
+    uint32_t bss_size;
+    uint32_t align; // the largest align boundary in the module, where it may be placed
+    uint32_t symbol_count;
+    uint32_t reloc_count;
+    uint32_t strings_size;
+} ObjHeader;
+
+typedef enum
+{
+    OBJ_LOCAL,  // a label only this module's relocations refer to
+    OBJ_GLOBAL, // a label declared global, other modules may refer to it
+    OBJ_EXTERN  // declared extern and not defined here, value is 0
+} ObjBinding;
+
+typedef struct
+{
+    uint32_t name;    // offset in the strings
+    uint32_t value;   // from the start of the text section
+    uint32_t binding; // ObjBinding
+} ObjSymbol;
+
+typedef enum
+{
+    OBJ_ABS16, // the word at offset becomes S + A
+    OBJ_ABS8,  // the byte at offset becomes S + A, which must fit in a byte
+    OBJ_REL16  // the word at offset becomes S + A - (P + 2), the rel16 of a near branch
+} ObjRelocType;
+
+// S is the symbol's address in the output, A the addend, P the address of the field
+typedef struct
+{
+    uint32_t offset; // in the text section
+    uint32_t symbol; // in the symbol table
+    int32_t addend;
+    uint32_t type; // ObjRelocType
+} ObjReloc;
+
+#endif
@@ -0,0 +1,108 @@
+#include "optimizer.h"
+#include "encoder.h"
+#include "cycles.h"
+
+static inline bool try_candidate(const Instruction *cand, size_t *best_size, unsigned *best_cycles, Instruction *best);
+static inline bool is_imm_value(const Operand *op, int16_t value);
+
+bool optimize_instruction(Instruction *inst, bool flags_live, OptimizerStats *stats)
+{
+    // the size of a relative branch is decided by the assembler's relaxation
+    if (is_relative_branch(inst))
+        return false;
+
+    uint8_t buffer[6];
+    size_t size = 0;
+    if (encode_instruction(inst, buffer, &size, 0) != 0)
+        return false;
+    unsigned cycles = estimate_cycles(inst, NULL);
+
+    // mov reg, reg with the same register does nothing
+    if (inst->mnem == T_MOV && inst->op1.opType == OP_REG && inst->op2.opType == OP_REG &&
+        inst->op1.size == inst->op2.size && inst->op1.reg.reg_code == inst->op2.reg.reg_code)
+    {
+        stats->removed++;
+        stats->bytes_saved += (long)size;
+        stats->cycles_saved += (long)cycles;
+        return true;
+    }
+
+    // everything below changes the flags differently from the original
+    if (flags_live)
+        return false;
+
+    size_t best_size = size;
+    unsigned best_cycles = cycles;
+    Instruction best = *inst;
+    bool improved = false;
+
+    // mov reg, 0 => xor reg, reg
+    if (inst->mnem == T_MOV && inst->op1.opType == OP_REG && is_imm_value(&inst->op2, 0))
+    {
+        Instruction cand = *inst;
+        cand.mnem = T_XOR;
+        cand.op2 = inst->op1;
+        improved |= try_candidate(&cand, &best_size, &best_cycles, &best);
+    }
+
+    // a symbol's value is unknown until the end, so symbol immediates are left alone
+    if ((inst->mnem == T_ADD || inst->mnem == T_SUB) && inst->op2.opType == OP_IMM && !inst->op2.has_symbol)
+    {
+        // add reg, 1 / sub reg, -1 => inc reg and add reg, -1 / sub reg, 1 => dec reg
+        if (inst->op1.opType == OP_REG && (is_imm_value(&inst->op2, 1) || is_imm_value(&inst->op2, -1)))
+        {
+            bool plus_one = is_imm_value(&inst->op2, 1) == (inst->mnem == T_ADD);
+            Instruction cand = *inst;
+            cand.mnem = plus_one ? T_INC : T_DEC;
+            cand.op2 = (Operand){0};
+            improved |= try_candidate(&cand, &best_size, &best_cycles, &best);
+        }
+
+        // sub x, k => add x, -k (and back), which wins when only -k fits the sign-extended imm8
+        Instruction cand = *inst;
+        cand.mnem = (inst->mnem == T_ADD) ? T_SUB : T_ADD;
+        cand.op2.imm.value = (uint16_t)-inst->op2.imm.value;
+        improved |= try_candidate(&cand, &best_size, &best_cycles, &best);
+    }
+
+    // note: [bp + 0] cannot be collapsed, MOD=00 R/M=110 is the direct address form,
+    // and every other zero displacement is already dropped by the parser
+
+    if (!improved)
+        return false;
+
+    *inst = best;
+    stats->rewrites++;
+    stats->bytes_saved += (long)(size - best_size);
+    stats->cycles_saved += (long)cycles - (long)best_cycles;
+    return false;
+}
+
+// keeps cand if it encodes shorter, or as short but in fewer clocks
+static inline bool try_candidate(const Instruction *cand, size_t *best_size, unsigned *best_cycles, Instruction *best)
+{
+    uint8_t buffer[6];
+    size_t size = 0;
+    Instruction tmp = *cand;
+    if (encode_instruction(&tmp, buffer, &size, 0) != 0)
+        return false;
+
+    unsigned cycles = estimate_cycles(cand, NULL);
+    if (size < *best_size || (size == *best_size && cycles < *best_cycles))
+    {
+        *best = *cand;
+        *best_size = size;
+        *best_cycles = cycles;
+        return true;
+    }
+    return false;
+}
+
+static inline bool is_imm_value(const Operand *op, int16_t value)
+{
+    if (op->opType != OP_IMM || op->has_symbol)
+        return false;
+    if (op->size == SZ_BYTE)
+        return (int8_t)op->imm.value == (int8_t)value;
+    return (int16_t)op->imm.value == value;
+}
@@ -0,0 +1,22 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdbool.h> // for bool
+
+#include "parser.h" // for Instruction
+
+typedef struct
+{
+    size_t rewrites;   // instructions replaced by a cheaper equivalent
+    size_t removed;    // instructions dropped because they have no effect
+    long bytes_saved;  // encoded bytes saved in total
+    long cycles_saved; // estimated 8086 clocks saved in total
+} OptimizerStats;
+
+// Rewrites inst in place into a smaller (or equally small but faster) equivalent.
+// flags_live is false only when a later instruction overwrites every arithmetic flag
+// before anything can read them, which is what the flag-changing rewrites require.
+// Returns true if the instruction has no effect at all and should be dropped.
+bool optimize_instruction(Instruction *inst, bool flags_live, OptimizerStats *stats);
+
+#endif
@@ -1,14 +1,39 @@
-#include <stdio.h>  // for fprintf, stderr
-#include <stdlib.h> // for free, exit, strtol
+#include <stdio.h>  // for fprintf, snprintf
+#include <stdlib.h> // for free, exit, malloc
 #include <string.h> // for strcmp
-#include <errno.h>  // for errno
+#include <ctype.h>  // for isspace, isalpha, isalnum, isdigit, isxdigit, tolower
 
 #include "parser.h"
+#include "diag.h"
 
 static inline int validate_syntax(const Token *tokens, size_t token_count, size_t lineno, uint8_t *ops_out, size_t *comma_i_out);
-static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out, size_t lineno);
-static inline MnemonicType classify_mnemonic(const char *mnemonic);
+static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out, size_t lineno, SymbolTable *symbols);
+static inline int reference_symbol(const Token *tok, Operand *op_out, size_t lineno, SymbolTable *symbols);
+static inline MnemonicType classify_mnemonic(const char *mnemonic, uint8_t *cond_out);
 static inline void free_tokens(Token *tokens, size_t token_count);
+static int fold_expressions(Token *tokens, size_t *token_count, size_t lineno);
+static int eval_binary(const Token *tokens, size_t count, size_t *pos, int min_prec, int *lowest, size_t lineno, int64_t *out);
+static int eval_unary(const Token *tokens, size_t count, size_t *pos, size_t lineno, int64_t *out);
+static inline int binary_precedence(TokenType type);
+static inline bool is_expr_token(TokenType type);
+static inline int replace_token(Token *tok, TokenType type, int64_t value);
+static inline const char *canonical_operand(const char *p, Operand *op_out);
+static inline const char *canonical_register(const char *p, Size *size_out, uint8_t *code_out);
+static inline const char *canonical_number(const char *p, int64_t *value_out);
+static inline const char *skip_space(const char *p);
+
+#define CANONICAL_DIGITS_MAX 8 // longer numbers go to the full path, which reports them out of range
+
+// binary operator precedence, loosest first (the same order as NASM)
+#define PREC_LOGOR 1
+#define PREC_LOGAND 2
+#define PREC_CMP 3
+#define PREC_OR 4
+#define PREC_XOR 5
+#define PREC_AND 6
+#define PREC_SHIFT 7
+#define PREC_ADD 8
+#define PREC_MUL 9
 
 static const struct
 {
@@ -50,8 +75,71 @@ static const struct
     {"bx", NULL, 0x07},
     {NULL, NULL, 0}};
 
-int parse_tokens(Token *tokens, size_t token_count, size_t lineno, Instruction *inst_out)
+// every spelling of the 16 conditional jumps, cond is the low nibble of the short opcode 0x70
+static const struct
+{
+    const char *name;
+    uint8_t cond;
+} conditions[] = {
+    {"jo", 0x0},
+    {"jno", 0x1},
+    {"jb", 0x2},
+    {"jc", 0x2},
+    {"jnae", 0x2},
+    {"jnb", 0x3},
+    {"jnc", 0x3},
+    {"jae", 0x3},
+    {"je", 0x4},
+    {"jz", 0x4},
+    {"jne", 0x5},
+    {"jnz", 0x5},
+    {"jbe", 0x6},
+    {"jna", 0x6},
+    {"jnbe", 0x7},
+    {"ja", 0x7},
+    {"js", 0x8},
+    {"jns", 0x9},
+    {"jp", 0xA},
+    {"jpe", 0xA},
+    {"jnp", 0xB},
+    {"jpo", 0xB},
+    {"jl", 0xC},
+    {"jnge", 0xC},
+    {"jnl", 0xD},
+    {"jge", 0xD},
+    {"jle", 0xE},
+    {"jng", 0xE},
+    {"jnle", 0xF},
+    {"jg", 0xF},
+    {NULL, 0}};
+
+// the instructions that only read or write flags, one opcode byte each
+static const struct
+{
+    const char *name;
+    uint8_t opcode;
+} flag_ops[] = {
+    {"clc", 0xF8},
+    {"stc", 0xF9},
+    {"cmc", 0xF5},
+    {"cld", 0xFC},
+    {"std", 0xFD},
+    {"cli", 0xFA},
+    {"sti", 0xFB},
+    {"lahf", 0x9F},
+    {"sahf", 0x9E},
+    {"pushf", 0x9C},
+    {"popf", 0x9D},
+    {NULL, 0}};
+
+int parse_tokens(Token *tokens, size_t token_count, size_t lineno, SymbolTable *symbols, Instruction *inst_out)
 {
+    if (fold_expressions(tokens, &token_count, lineno) != 0)
+    {
+        free_tokens(tokens, token_count);
+        return 1;
+    }
+
     size_t comma_i = 0;
     uint8_t operands = 0;
     int result = validate_syntax(tokens, token_count, lineno, &operands, &comma_i);
@@ -61,7 +149,8 @@ int parse_tokens(Token *tokens, size_t token_count, size_t lineno, Instruction *
         return 1;
     }
 
-    MnemonicType mnemtype = classify_mnemonic(tokens[0].lexeme);
+    uint8_t cond = 0;
+    MnemonicType mnemtype = classify_mnemonic(tokens[0].lexeme, &cond);
 
     switch (mnemtype)
     {
@@ -69,28 +158,37 @@ int parse_tokens(Token *tokens, size_t token_count, size_t lineno, Instruction *
     case T_ADD:
     case T_SUB:
     case T_CMP:
+    case T_XOR:
+    case T_XCHG:
         if (operands != 2)
         {
-            fprintf(stderr, "Error on line %zu: '%s' instruction requires exactly two operands\n", lineno, tokens[0].lexeme);
+            fprintf(DIAG, "Error on line %zu: '%s' instruction requires exactly two operands\n", lineno, tokens[0].lexeme);
             free_tokens(tokens, token_count);
             return 1;
         }
         OperandTokenSpan op1tokens = {.tokens = &tokens[1], .count = comma_i - 1};
         OperandTokenSpan op2tokens = {.tokens = &tokens[comma_i + 1], .count = token_count - (comma_i + 1)};
         Operand op1 = {0}, op2 = {0};
-        result = parse_operand(&op1tokens, &op1, lineno);
+        result = parse_operand(&op1tokens, &op1, lineno, symbols);
         if (result != 0)
         {
             free_tokens(tokens, token_count);
             return 1;
         }
-        result = parse_operand(&op2tokens, &op2, lineno);
+        result = parse_operand(&op2tokens, &op2, lineno, symbols);
         if (result != 0)
         {
             free_tokens(tokens, token_count);
             return 1;
         }
 
+        if (mnemtype == T_XCHG && op2.opType == OP_IMM)
+        {
+            fprintf(DIAG, "Error on line %zu: 'xchg' instruction cannot take an immediate\n", lineno);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
         // if imm-to-reg and imm size is not explicitly set, then infer it from reg
         if (op1.opType == OP_REG && op2.opType == OP_IMM && !op2.has_explicit_size)
             op2.size = op1.size;
@@ -108,28 +206,344 @@ int parse_tokens(Token *tokens, size_t token_count, size_t lineno, Instruction *
 
         if (op1.size == SZ_NONE && op2.size == SZ_NONE)
         {
-            fprintf(stderr, "Error on line %zu: operation size not specified\n", lineno);
+            fprintf(DIAG, "Error on line %zu: operation size not specified\n", lineno);
             free_tokens(tokens, token_count);
             return 1;
         }
 
         if (op1.size != op2.size)
         {
-            fprintf(stderr, "Error on line %zu: operand sizes do not match\n", lineno);
+            fprintf(DIAG, "Error on line %zu: operand sizes do not match\n", lineno);
             free_tokens(tokens, token_count);
             return 1;
         }
 
         inst_out->mnem = mnemtype;
+        inst_out->cond = 0;
         inst_out->op1 = op1;
         inst_out->op2 = op2;
         break;
+    case T_INC:
+    case T_DEC:
+    case T_NEG:
+    case T_NOT:
+    case T_PUSH:
+    case T_POP:
+        if (operands != 1)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' instruction requires exactly one operand\n", lineno, tokens[0].lexeme);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+        OperandTokenSpan operand_tokens = {.tokens = &tokens[1], .count = token_count - 1};
+        Operand operand = {0};
+        result = parse_operand(&operand_tokens, &operand, lineno, symbols);
+        if (result != 0)
+        {
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
+        if (operand.opType == OP_IMM)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' instruction requires a register or a memory operand\n", lineno, tokens[0].lexeme);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
+        // the stack only holds words, so push and pop need no size keyword
+        if (mnemtype == T_PUSH || mnemtype == T_POP)
+        {
+            if (operand.size == SZ_BYTE)
+            {
+                fprintf(DIAG, "Error on line %zu: '%s' instruction requires a word operand\n", lineno, tokens[0].lexeme);
+                free_tokens(tokens, token_count);
+                return 1;
+            }
+            operand.size = SZ_WORD;
+        }
+
+        if (operand.size == SZ_NONE)
+        {
+            fprintf(DIAG, "Error on line %zu: operation size not specified\n", lineno);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
+        inst_out->mnem = mnemtype;
+        inst_out->cond = 0;
+        inst_out->op1 = operand;
+        inst_out->op2 = (Operand){0};
+        break;
+    case T_JMP:
+    case T_JCC:
+    case T_LOOP:
+    case T_LOOPE:
+    case T_LOOPNE:
+    case T_JCXZ:
+    case T_CALL:
+        if (operands != 1)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' instruction requires exactly one operand\n", lineno, tokens[0].lexeme);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+        OperandTokenSpan target_tokens = {.tokens = &tokens[1], .count = token_count - 1};
+        Operand target = {0};
+        result = parse_operand(&target_tokens, &target, lineno, symbols);
+        if (result != 0)
+        {
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
+        // an immediate is the target address, jmp and call can also take it from a register or memory
+        if (target.opType != OP_IMM && mnemtype != T_JMP && mnemtype != T_CALL)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' instruction requires a label or an address\n", lineno, tokens[0].lexeme);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+
+        if (target.size == SZ_BYTE)
+        {
+            fprintf(DIAG, "Error on line %zu: jump target must be a word\n", lineno);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+        target.size = SZ_WORD;
+
+        inst_out->mnem = mnemtype;
+        inst_out->cond = cond;
+        inst_out->op1 = target;
+        inst_out->op2 = (Operand){0};
+        break;
+    case T_RET:
+    case T_FLAG:
+        if (operands != 0)
+        {
+            fprintf(DIAG, "Error on line %zu: '%s' instruction takes no operands\n", lineno, tokens[0].lexeme);
+            free_tokens(tokens, token_count);
+            return 1;
+        }
+        inst_out->mnem = mnemtype;
+        inst_out->cond = cond;
+        inst_out->op1 = (Operand){0};
+        inst_out->op2 = (Operand){0};
+        break;
+    default:
+        fprintf(DIAG, "Error on line %zu: '%s' instruction is not supported for now\n", lineno, tokens[0].lexeme);
+        free_tokens(tokens, token_count);
+        return 1;
     }
 
     free_tokens(tokens, token_count);
     return 0;
 }
 
+// The shapes that make up most code, matched on the characters with no Token array. Whatever
+// the full path would treat differently, a symbol, an expression, a size keyword, a value out
+// of range or an operand pair it rejects, is left to it: false sends the line there.
+bool parse_canonical(const char *line, Instruction *inst_out)
+{
+    const char *p = skip_space(line);
+    char m[3];
+    for (int i = 0; i < 3; i++)
+    {
+        if (!isalpha((unsigned char)p[i]))
+            return false;
+        m[i] = (char)tolower((unsigned char)p[i]);
+    }
+    if (!isspace((unsigned char)p[3]))
+        return false;
+
+    MnemonicType mnem;
+    if (memcmp(m, "mov", 3) == 0)
+        mnem = T_MOV;
+    else if (memcmp(m, "add", 3) == 0)
+        mnem = T_ADD;
+    else if (memcmp(m, "sub", 3) == 0)
+        mnem = T_SUB;
+    else if (memcmp(m, "cmp", 3) == 0)
+        mnem = T_CMP;
+    else if (memcmp(m, "xor", 3) == 0)
+        mnem = T_XOR;
+    else
+        return false;
+
+    Operand op1 = {0}, op2 = {0};
+    p = canonical_operand(skip_space(p + 3), &op1);
+    if (!p || *(p = skip_space(p)) != ',')
+        return false;
+    p = canonical_operand(skip_space(p + 1), &op2);
+    if (!p || (*(p = skip_space(p)) != '\0' && *p != ';'))
+        return false;
+
+    // one side is always a register, it gives the size like in parse_tokens
+    if (op1.opType != OP_REG && op2.opType != OP_REG)
+        return false;
+    if (op1.opType == OP_REG && op2.opType != OP_REG)
+        op2.size = op1.size;
+    else if (op2.opType == OP_REG && op1.opType != OP_REG)
+        op1.size = op2.size;
+    if (op1.opType == OP_IMM || op1.size != op2.size)
+        return false;
+
+    inst_out->mnem = mnem;
+    inst_out->cond = 0;
+    inst_out->op1 = op1;
+    inst_out->op2 = op2;
+    return true;
+}
+
+// a register, a number with an optional '-', or "[base (+ index) (+/- number)]" and "[number]"
+static inline const char *canonical_operand(const char *p, Operand *op_out)
+{
+    if (*p == '[')
+    {
+        op_out->opType = OP_MEM;
+        p = skip_space(p + 1);
+
+        Size size;
+        uint8_t base, index = 0xFF;
+        const char *q = canonical_register(p, &size, &base);
+        int64_t disp = 0;
+        if (!q)
+        {
+            // a direct address
+            bool negative = *p == '-';
+            if (negative)
+                p = skip_space(p + 1);
+            if (!(p = canonical_number(p, &disp)))
+                return NULL;
+            disp = negative ? -disp : disp;
+            if (disp < -65536 || disp > 65535 || *(p = skip_space(p)) != ']')
+                return NULL;
+            op_out->mem.rm_code = 0x06;
+            op_out->mem.disp_size = SZ_WORD;
+            op_out->mem.disp_value = (int16_t)disp;
+            return p + 1;
+        }
+
+        // bx, bp, si or di as the base, si or di as the index after bx or bp
+        if (size != SZ_WORD || base < 3 || base == 4)
+            return NULL;
+        p = skip_space(q);
+        if (*p == '+' && (base == 3 || base == 5))
+        {
+            q = canonical_register(skip_space(p + 1), &size, &index);
+            if (q)
+            {
+                if (index != 6 && index != 7)
+                    return NULL;
+                p = skip_space(q);
+            }
+        }
+        if (*p == '+' || *p == '-')
+        {
+            bool negative = *p == '-';
+            if (!(p = canonical_number(skip_space(p + 1), &disp)))
+                return NULL;
+            disp = negative ? -disp : disp;
+            if (disp < -32768 || disp > 32767)
+                return NULL;
+            p = skip_space(p);
+        }
+        if (*p != ']')
+            return NULL;
+
+        // the same table entries parse_operand points at and takes the R/M from
+        static const char *const names[8] = {NULL, NULL, NULL, "bx", NULL, "bp", "si", "di"};
+        const char *index_name = index == 0xFF ? NULL : names[index];
+        for (int i = 0; address_table[i].base_reg != NULL; i++)
+        {
+            if (strcmp(address_table[i].base_reg, names[base]) != 0)
+                continue;
+            if (!op_out->mem.base_reg)
+                op_out->mem.base_reg = address_table[i].base_reg;
+            if (index_name ? address_table[i].index_reg && strcmp(address_table[i].index_reg, index_name) == 0
+                           : !address_table[i].index_reg)
+            {
+                op_out->mem.rm_code = address_table[i].rm_code;
+                break;
+            }
+        }
+        op_out->mem.index_reg = index_name;
+        op_out->mem.disp_value = (int16_t)disp;
+        if (disp == 0)
+            op_out->mem.disp_size = (base == 5 && index == 0xFF) ? SZ_BYTE : SZ_NONE;
+        else
+            op_out->mem.disp_size = (disp >= -128 && disp <= 127) ? SZ_BYTE : SZ_WORD;
+        return p + 1;
+    }
+
+    const char *q = canonical_register(p, &op_out->size, &op_out->reg.reg_code);
+    if (q)
+    {
+        op_out->opType = OP_REG;
+        return q;
+    }
+
+    bool negative = *p == '-';
+    int64_t value;
+    if (negative)
+        p = skip_space(p + 1);
+    if (!(p = canonical_number(p, &value)))
+        return NULL;
+    value = negative ? -value : value;
+    if (value < -65536 || value > 65535)
+        return NULL;
+    op_out->opType = OP_IMM;
+    op_out->imm.value = (uint16_t)value;
+    return p;
+}
+
+static inline const char *canonical_register(const char *p, Size *size_out, uint8_t *code_out)
+{
+    if (!isalpha((unsigned char)p[0]) || !isalpha((unsigned char)p[1]) ||
+        isalnum((unsigned char)p[2]) || p[2] == '_' || p[2] == '.')
+        return NULL;
+    char name[3] = {(char)tolower((unsigned char)p[0]), (char)tolower((unsigned char)p[1]), '\0'};
+    for (int i = 0; registers[i].name != NULL; i++)
+    {
+        if (strcmp(name, registers[i].name) == 0)
+        {
+            *size_out = registers[i].size;
+            *code_out = registers[i].reg_code;
+            return p + 2;
+        }
+    }
+    return NULL;
+}
+
+// decimal, or hex after 0x, ending where a name could not continue it
+static inline const char *canonical_number(const char *p, int64_t *value_out)
+{
+    int64_t value = 0;
+    size_t digits = 0;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && isxdigit((unsigned char)p[2]))
+    {
+        for (p += 2; isxdigit((unsigned char)*p) && digits < CANONICAL_DIGITS_MAX; p++, digits++)
+            value = value * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+    }
+    else
+    {
+        for (; isdigit((unsigned char)*p) && digits < CANONICAL_DIGITS_MAX; p++, digits++)
+            value = value * 10 + (*p - '0');
+    }
+    if (digits == 0 || isalnum((unsigned char)*p) || *p == '_' || *p == '.')
+        return NULL;
+    *value_out = value;
+    return p;
+}
+
+static inline const char *skip_space(const char *p)
+{
+    while (isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
 // parser_test.c for details
 static inline int validate_syntax(const Token *tokens, size_t token_count, size_t lineno, uint8_t *ops_out, size_t *comma_i_out)
 {
@@ -137,14 +551,14 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
     {
         if (tokens[i].type == T_BAD)
         {
-            fprintf(stderr, "Error on line %zu: invalid token '%s'\n", lineno, tokens[i].lexeme);
+            fprintf(DIAG, "Error on line %zu: invalid token '%s'\n", lineno, tokens[i].lexeme);
             return 1;
         }
     }
 
     if (tokens[0].type != T_MNEMONIC)
     {
-        fprintf(stderr, "Error on line %zu: first token should be a valid mnemonic\n", lineno);
+        fprintf(DIAG, "Error on line %zu: first token should be a valid mnemonic\n", lineno);
         return 1;
     }
 
@@ -161,28 +575,37 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         case T_MNEMONIC:
             mnems++;
             break;
+        case T_COLON:
+            fprintf(DIAG, "Error on line %zu: ':' is only allowed after a label at the start of the line\n", lineno);
+            return 1;
+        case T_DIRECTIVE:
+            fprintf(DIAG, "Error on line %zu: directive '%s' cannot be used inside an instruction\n", lineno, tokens[i].lexeme);
+            return 1;
+        case T_MACRO_ARG:
+            fprintf(DIAG, "Error on line %zu: macro parameter '%s' used outside a macro\n", lineno, tokens[i].lexeme);
+            return 1;
         case T_COMMA:
             if (next == T_EOF)
             {
-                fprintf(stderr, "Error on line %zu: unexpected end of input after ','\n", lineno);
+                fprintf(DIAG, "Error on line %zu: unexpected end of input after ','\n", lineno);
                 return 1;
             }
 
             if (bracket_depth > 0)
             {
-                fprintf(stderr, "Error on line %zu: ',' not allowed inside the memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: ',' not allowed inside the memory operand\n", lineno);
                 return 1;
             }
 
             if (commas == 1)
             {
-                fprintf(stderr, "Error on line %zu: expected exactly one ','\n", lineno);
+                fprintf(DIAG, "Error on line %zu: expected exactly one ','\n", lineno);
                 return 1;
             }
 
-            if (!(prev == T_REG || prev == T_C_BRACK || prev == T_NUMBER))
+            if (!(prev == T_REG || prev == T_C_BRACK || prev == T_NUMBER || prev == T_IDENT))
             {
-                fprintf(stderr, "Error on line %zu: ',' must be between two operands\n", lineno);
+                fprintf(DIAG, "Error on line %zu: ',' must be between two operands\n", lineno);
                 return 1;
             }
             *comma_i_out = i;
@@ -191,7 +614,7 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         case T_O_BRACK:
             if (bracket_depth == 1)
             {
-                fprintf(stderr, "Error on line %zu: nested '[' is not allowed\n", lineno);
+                fprintf(DIAG, "Error on line %zu: nested '[' is not allowed\n", lineno);
                 return 1;
             }
             mem_op_start = i;
@@ -200,7 +623,7 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         case T_C_BRACK:
             if (bracket_depth == 0)
             {
-                fprintf(stderr, "Error on line %zu: closing ']' without an opening '['\n", lineno);
+                fprintf(DIAG, "Error on line %zu: closing ']' without an opening '['\n", lineno);
                 return 1;
             }
             bracket_depth--;
@@ -209,18 +632,18 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         case T_SIZE:
             if (next == T_EOF)
             {
-                fprintf(stderr, "Error on line %zu: unexpected end of input after '%s'\n", lineno, tokens[i].lexeme);
+                fprintf(DIAG, "Error on line %zu: unexpected end of input after '%s'\n", lineno, tokens[i].lexeme);
                 return 1;
             }
 
             if (bracket_depth > 0)
             {
-                fprintf(stderr, "Error on line %zu: size specifier not allowed inside the memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: size specifier not allowed inside the memory operand\n", lineno);
                 return 1;
             }
-            if (next != T_NUMBER && next != T_REG && next != T_PLUS && next != T_MINUS && next != T_O_BRACK)
+            if (next != T_NUMBER && next != T_IDENT && next != T_REG && next != T_PLUS && next != T_MINUS && next != T_O_BRACK)
             {
-                fprintf(stderr, "Error on line %zu: size specifier must be followed by an immediate, register or a memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: size specifier must be followed by an immediate, register or a memory operand\n", lineno);
                 return 1;
             }
             break;
@@ -229,7 +652,22 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
             {
                 if (next != T_C_BRACK && next != T_PLUS && next != T_MINUS)
                 {
-                    fprintf(stderr, "Error on line %zu: number inside memory operand must be followed by '+' or '-' or closing ']'\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: number inside memory operand must be followed by '+' or '-' or closing ']'\n", lineno);
+                    return 1;
+                }
+            }
+            else
+            {
+                imm_ops++;
+            }
+            break;
+        case T_IDENT:
+            // a sign in front of a symbol is already rejected by the T_PLUS/T_MINUS rules
+            if (bracket_depth > 0)
+            {
+                if (next != T_C_BRACK && next != T_PLUS && next != T_MINUS)
+                {
+                    fprintf(DIAG, "Error on line %zu: symbol inside memory operand must be followed by '+' or '-' or closing ']'\n", lineno);
                     return 1;
                 }
             }
@@ -244,12 +682,12 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
             {
                 if (tokens[i].type == T_MINUS && next != T_NUMBER)
                 {
-                    fprintf(stderr, "Error on line %zu: '-' symbol inside the memory operand must be followed by a number\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: '-' symbol inside the memory operand must be followed by a number\n", lineno);
                     return 1;
                 }
-                else if (tokens[i].type == T_PLUS && next != T_NUMBER && next != T_REG)
+                else if (tokens[i].type == T_PLUS && next != T_NUMBER && next != T_REG && next != T_IDENT)
                 {
-                    fprintf(stderr, "Error on line %zu: '+' symbol inside the memory operand must be followed by a number or a register\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: '+' symbol inside the memory operand must be followed by a number, a symbol or a register\n", lineno);
                     return 1;
                 }
             }
@@ -257,7 +695,7 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
             {
                 if (next != T_NUMBER)
                 {
-                    fprintf(stderr, "Error on line %zu: sign symbols outside the memory operand must be followed by a number\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: sign symbols outside the memory operand must be followed by a number\n", lineno);
                     return 1;
                 }
             }
@@ -279,56 +717,56 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
 
     if (mnems > 1)
     {
-        fprintf(stderr, "Error on line %zu: expected exactly one mnemonic\n", lineno);
+        fprintf(DIAG, "Error on line %zu: expected exactly one mnemonic\n", lineno);
         return 1;
     }
 
     if (bracket_depth == 1)
     {
-        fprintf(stderr, "Error on line %zu: opening '[' without a matching ']'\n", lineno);
+        fprintf(DIAG, "Error on line %zu: opening '[' without a matching ']'\n", lineno);
         return 1;
     }
 
     size_t operand_count = mem_ops + reg_ops + imm_ops;
     if (operand_count > 2)
     {
-        fprintf(stderr, "Error on line %zu: too many operands (maximum 2 allowed)\n", lineno);
+        fprintf(DIAG, "Error on line %zu: too many operands (maximum 2 allowed)\n", lineno);
         return 1;
     }
 
     if (operand_count == 2 && commas != 1)
     {
-        fprintf(stderr, "Error on line %zu: operands must be separated by a ','\n", lineno);
+        fprintf(DIAG, "Error on line %zu: operands must be separated by a ','\n", lineno);
         return 1;
     }
 
     if (mem_ops > 1)
     {
-        fprintf(stderr, "Error on line %zu: expected exactly one memory operand\n", lineno);
+        fprintf(DIAG, "Error on line %zu: expected exactly one memory operand\n", lineno);
         return 1;
     }
 
     if (mem_ops == 1 && tokens[mem_op_start + 1].type == T_C_BRACK)
     {
-        fprintf(stderr, "Error on line %zu: empty memory operand\n", lineno);
+        fprintf(DIAG, "Error on line %zu: empty memory operand\n", lineno);
         return 1;
     }
 
     if (imm_ops > 1)
     {
-        fprintf(stderr, "Error on line %zu: expected exactly one immediate operand\n", lineno);
+        fprintf(DIAG, "Error on line %zu: expected exactly one immediate operand\n", lineno);
         return 1;
     }
 
-    if (imm_ops == 1 && tokens[token_count - 1].type != T_NUMBER)
+    if (imm_ops == 1 && tokens[token_count - 1].type != T_NUMBER && tokens[token_count - 1].type != T_IDENT)
     {
-        fprintf(stderr, "Error on line %zu: immediate must be the second operand\n", lineno);
+        fprintf(DIAG, "Error on line %zu: immediate must be the second operand\n", lineno);
         return 1;
     }
 
     if (regs_in > 2)
     {
-        fprintf(stderr, "Error on line %zu: too many registers in the memory operand\n", lineno);
+        fprintf(DIAG, "Error on line %zu: too many registers in the memory operand\n", lineno);
         return 1;
     }
 
@@ -338,14 +776,14 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         {
             if (tokens[mem_op_start + 1].type != T_REG || tokens[mem_op_start + 2].type != T_PLUS || tokens[mem_op_start + 3].type != T_REG)
             {
-                fprintf(stderr, "Error on line %zu: expected '[reg+reg...]' pattern in memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: expected '[reg+reg...]' pattern in memory operand\n", lineno);
                 return 1;
             }
 
             TokenType after = tokens[mem_op_start + 4].type;
             if (after != T_PLUS && after != T_MINUS && after != T_C_BRACK)
             {
-                fprintf(stderr, "Error on line %zu: invalid token after '[reg+reg' in memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: invalid token after '[reg+reg' in memory operand\n", lineno);
                 return 1;
             }
         }
@@ -353,14 +791,14 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
         {
             if (tokens[mem_op_start + 1].type != T_REG)
             {
-                fprintf(stderr, "Error on line %zu: expected register immediately after '[' in memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: expected register immediately after '[' in memory operand\n", lineno);
                 return 1;
             }
 
             TokenType after = tokens[mem_op_start + 2].type;
             if (after != T_PLUS && after != T_MINUS && after != T_C_BRACK)
             {
-                fprintf(stderr, "Error on line %zu: invalid token after '[reg' in memory operand\n", lineno);
+                fprintf(DIAG, "Error on line %zu: invalid token after '[reg' in memory operand\n", lineno);
                 return 1;
             }
         }
@@ -370,7 +808,7 @@ static inline int validate_syntax(const Token *tokens, size_t token_count, size_
     return 0;
 }
 
-static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out, size_t lineno)
+static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out, size_t lineno, SymbolTable *symbols)
 {
     // Check for size specifier 'byte' or 'word'
     size_t op_start = 0;
@@ -393,31 +831,15 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
     {
         op_out->opType = OP_IMM;
 
-        const char *num_str = NULL;
-        int sign = 1;
-
+        int64_t val = 0;
         if (tok0->type == T_NUMBER)
-            num_str = tok0->lexeme;
+            val = tok0->value;
         else
-        {
-            sign = (tok0->type == T_MINUS) ? -1 : 1;
-            num_str = tok1->lexeme;
-        }
-
-        errno = 0;
-        char *end = NULL;
-        long val = strtol(num_str, &end, 10);
-        val *= sign;
-
-        if (errno != 0 || *end != '\0')
-        {
-            fprintf(stderr, "Error on line %zu: immediate value exceeds valid range\n", lineno);
-            return 1;
-        }
+            val = (tok0->type == T_MINUS) ? (int64_t)(0 - (uint64_t)tok1->value) : tok1->value;
 
         if (val < -65536 || val > 65535)
         {
-            fprintf(stderr, "Error on line %zu: immediate value exceeds valid range (-65536 to 65535)\n", lineno);
+            fprintf(DIAG, "Error on line %zu: immediate value exceeds valid range (-65536 to 65535)\n", lineno);
             return 1;
         }
 
@@ -426,13 +848,24 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
             if (op_out->explicit_size == SZ_BYTE)
                 if (val < -256 || val > 255)
                 {
-                    fprintf(stderr, "Error on line %zu: immediate value does not fit in a byte (-256 to 255)\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: immediate value does not fit in a byte (-256 to 255)\n", lineno);
                     return 1;
                 }
             op_out->size = op_out->explicit_size;
         }
         op_out->imm.value = (uint16_t)val;
     }
+    // a symbol as the immediate, its value is only known once the symbol is defined
+    else if (tok0->type == T_IDENT)
+    {
+        op_out->opType = OP_IMM;
+        if (reference_symbol(tok0, op_out, lineno, symbols) != 0)
+            return 1;
+
+        if (op_out->has_explicit_size)
+            op_out->size = op_out->explicit_size;
+        op_out->imm.value = (uint16_t)tok0->value; // addend, e.g. the 2 in "label + 2"
+    }
     // check for register (T_REG)
     else if (tok0->type == T_REG)
     {
@@ -476,14 +909,15 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
                     {
                         if (strcmp(reg_lexeme, address_table[j].base_reg) == 0)
                         {
-                            base_reg = reg_lexeme;
+                            // point at the table, the token lexemes are freed once parsing is done
+                            base_reg = address_table[j].base_reg;
                             break;
                         }
                     }
 
                     if (base_reg == NULL)
                     {
-                        fprintf(stderr, "Error on line %zu: invalid base register '%s' in the memory operand\n", lineno, reg_lexeme);
+                        fprintf(DIAG, "Error on line %zu: invalid base register '%s' in the memory operand\n", lineno, reg_lexeme);
                         return 1;
                     }
 
@@ -496,17 +930,17 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
 
                     if (!(strcmp(base_reg, "bx") == 0 || strcmp(base_reg, "bp") == 0))
                     {
-                        fprintf(stderr, "Error on line %zu: base register '%s' cannot be combined with an index register\n", lineno, base_reg);
+                        fprintf(DIAG, "Error on line %zu: base register '%s' cannot be combined with an index register\n", lineno, base_reg);
                         return 1;
                     }
 
                     if (!(strcmp(reg_lexeme, "si") == 0 || strcmp(reg_lexeme, "di") == 0))
                     {
-                        fprintf(stderr, "Error on line %zu: invalid index register '%s' in the memory operand\n", lineno, reg_lexeme);
+                        fprintf(DIAG, "Error on line %zu: invalid index register '%s' in the memory operand\n", lineno, reg_lexeme);
                         return 1;
                     }
 
-                    index_reg = reg_lexeme;
+                    index_reg = (strcmp(reg_lexeme, "si") == 0) ? "si" : "di";
                     i++;
                     continue;
                 }
@@ -519,30 +953,33 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
                 sign = -1;
                 i++;
                 continue;
-            case T_NUMBER:
-                errno = 0;
-                char *end = NULL;
-                long val = strtol(tspan->tokens[i].lexeme, &end, 10);
-
-                if (errno != 0 || *end != '\0')
+            case T_IDENT:
+                if (op_out->has_symbol)
                 {
-                    fprintf(stderr, "Error on line %zu: number inside the memory operand exceeds valid range\n", lineno);
+                    fprintf(DIAG, "Error on line %zu: only one symbol is allowed in the memory operand\n", lineno);
                     return 1;
                 }
+                if (reference_symbol(&tspan->tokens[i], op_out, lineno, symbols) != 0)
+                    return 1;
+                break;
+            case T_NUMBER:
+            {
+                // apply the sign before range checks so that e.g. [bx - 32768] is accepted
+                int64_t val = tspan->tokens[i].value * sign;
 
                 if (base_reg == NULL)
                 {
                     if (val < -65536 || val > 65535)
                     {
-                        fprintf(stderr, "Error on line %zu: number inside the memory operand exceeds valid range (-65536 to 65535)\n", lineno);
+                        fprintf(DIAG, "Error on line %zu: number inside the memory operand exceeds valid range (-65536 to 65535)\n", lineno);
                         return 1;
                     }
 
-                    disp_total += sign * val;
+                    disp_total += val;
 
                     if (disp_total < -65536 || disp_total > 65535)
                     {
-                        fprintf(stderr, "Error on line %zu: numbers inside the memory operand exceed valid range (-65536 to 65535)\n", lineno);
+                        fprintf(DIAG, "Error on line %zu: numbers inside the memory operand exceed valid range (-65536 to 65535)\n", lineno);
                         return 1;
                     }
                 }
@@ -550,19 +987,20 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
                 {
                     if (val < -32768 || val > 32767)
                     {
-                        fprintf(stderr, "Error on line %zu: number inside the memory operand exceeds valid range (-32768 to 32767)\n", lineno);
+                        fprintf(DIAG, "Error on line %zu: number inside the memory operand exceeds valid range (-32768 to 32767)\n", lineno);
                         return 1;
                     }
 
-                    disp_total += sign * val;
+                    disp_total += val;
 
                     if (disp_total < -32768 || disp_total > 32767)
                     {
-                        fprintf(stderr, "Error on line %zu: numbers inside the memory operand exceed valid range (-32768 to 32767)\n", lineno);
+                        fprintf(DIAG, "Error on line %zu: numbers inside the memory operand exceed valid range (-32768 to 32767)\n", lineno);
                         return 1;
                     }
                 }
                 break;
+            }
             default:
                 break;
             }
@@ -596,8 +1034,12 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
                 }
             }
 
-            // determine disp size
-            if (disp_total == 0)
+            // determine disp size, a symbol always gets the full 16 bits to be patched later
+            if (op_out->has_symbol)
+            {
+                op_out->mem.disp_size = SZ_WORD;
+            }
+            else if (disp_total == 0)
             {
                 if (base_reg && strcmp(base_reg, "bp") == 0 && index_reg == NULL)
                 {
@@ -621,7 +1063,7 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
 
     if (op_out->has_explicit_size && op_out->explicit_size != op_out->size)
     {
-        fprintf(stderr, "Error on line %zu: operand size (%s) does not match specified size (%s)\n", lineno,
+        fprintf(DIAG, "Error on line %zu: operand size (%s) does not match specified size (%s)\n", lineno,
                 op_out->size == SZ_BYTE ? "byte" : "word",
                 op_out->explicit_size == SZ_BYTE ? "byte" : "word");
         return 1;
@@ -630,7 +1072,19 @@ static inline int parse_operand(const OperandTokenSpan *tspan, Operand *op_out,
     return 0;
 }
 
-static inline MnemonicType classify_mnemonic(const char *m)
+static inline int reference_symbol(const Token *tok, Operand *op_out, size_t lineno, SymbolTable *symbols)
+{
+    if (!symbols)
+    {
+        fprintf(DIAG, "Error on line %zu: undefined symbol '%s'\n", lineno, tok->lexeme);
+        return 1;
+    }
+
+    op_out->has_symbol = true;
+    return symtab_intern(symbols, tok->lexeme, strlen(tok->lexeme), lineno, &op_out->symbol_id);
+}
+
+static inline MnemonicType classify_mnemonic(const char *m, uint8_t *cond_out)
 {
     if (strcmp("mov", m) == 0)
         return T_MOV;
@@ -640,8 +1094,54 @@ static inline MnemonicType classify_mnemonic(const char *m)
         return T_SUB;
     if (strcmp("cmp", m) == 0)
         return T_CMP;
+    if (strcmp("xor", m) == 0)
+        return T_XOR;
+    if (strcmp("inc", m) == 0)
+        return T_INC;
+    if (strcmp("dec", m) == 0)
+        return T_DEC;
+    if (strcmp("neg", m) == 0)
+        return T_NEG;
+    if (strcmp("not", m) == 0)
+        return T_NOT;
+    if (strcmp("push", m) == 0)
+        return T_PUSH;
+    if (strcmp("pop", m) == 0)
+        return T_POP;
+    if (strcmp("xchg", m) == 0)
+        return T_XCHG;
+    if (strcmp("jmp", m) == 0)
+        return T_JMP;
+    if (strcmp("call", m) == 0)
+        return T_CALL;
+    if (strcmp("ret", m) == 0)
+        return T_RET;
+    if (strcmp("loop", m) == 0)
+        return T_LOOP;
+    if (strcmp("loope", m) == 0 || strcmp("loopz", m) == 0)
+        return T_LOOPE;
+    if (strcmp("loopne", m) == 0 || strcmp("loopnz", m) == 0)
+        return T_LOOPNE;
+    if (strcmp("jcxz", m) == 0)
+        return T_JCXZ;
+    for (int i = 0; conditions[i].name != NULL; i++)
+    {
+        if (strcmp(conditions[i].name, m) == 0)
+        {
+            *cond_out = conditions[i].cond;
+            return T_JCC;
+        }
+    }
+    for (int i = 0; flag_ops[i].name != NULL; i++)
+    {
+        if (strcmp(flag_ops[i].name, m) == 0)
+        {
+            *cond_out = flag_ops[i].opcode;
+            return T_FLAG;
+        }
+    }
 
-    fprintf(stderr, "Internal error: unhandled mnemonic '%s'\n", m);
+    fprintf(DIAG, "Internal error: unhandled mnemonic '%s'\n", m);
     exit(2);
 }
 
@@ -650,4 +1150,406 @@ static inline void free_tokens(Token *tokens, size_t token_count)
     for (size_t i = 0; i < token_count; i++)
         free(tokens[i].lexeme);
     free(tokens);
-}
\ No newline at end of file
+}
+// Evaluates a whole constant expression (numbers, parentheses, unary + - ~ and the binary
+// operators of binary_precedence), for directives that take a single value.
+int eval_tokens(const Token *tokens, size_t token_count, size_t lineno, int64_t *value_out)
+{
+    size_t pos = 0;
+    int lowest = 0;
+    if (token_count == 0)
+    {
+        fprintf(DIAG, "Error on line %zu: expected an expression\n", lineno);
+        return 1;
+    }
+    if (eval_binary(tokens, token_count, &pos, PREC_LOGOR, &lowest, lineno, value_out) != 0)
+        return 1;
+    if (pos != token_count)
+    {
+        fprintf(DIAG, "Error on line %zu: unexpected '%s' in expression\n", lineno, tokens[pos].lexeme);
+        return 1;
+    }
+    return 0;
+}
+
+// Folds every constant expression of the line into one number so that validate_syntax and
+// parse_operand keep seeing the flat "[reg + reg + n]" grammar and the encoder final values.
+// A run that is only signs and numbers inside brackets is left alone: the displacement
+// checks there report more precise errors. Outside brackets "label + n" and "label - n"
+// collapse into the T_IDENT, with n in its value.
+static int fold_expressions(Token *tokens, size_t *token_count, size_t lineno)
+{
+    size_t count = *token_count;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (tokens[i].type == T_BAD)
+            return 0; // validate_syntax reports it
+    }
+
+    size_t out = 0, i = 0;
+    bool in_brackets = false;
+    while (i < count)
+    {
+        if (!is_expr_token(tokens[i].type))
+        {
+            if (tokens[i].type == T_O_BRACK)
+                in_brackets = true;
+            else if (tokens[i].type == T_C_BRACK)
+                in_brackets = false;
+            tokens[out++] = tokens[i++];
+            continue;
+        }
+
+        size_t start = i, end = i;
+        while (end < count && is_expr_token(tokens[end].type))
+            end++;
+
+        // a sign right before a register or symbol belongs to the address, not to the expression
+        TokenType next = (end < count) ? tokens[end].type : T_EOF;
+        if (end - start > 1 && (next == T_REG || next == T_IDENT) &&
+            (tokens[end - 1].type == T_PLUS || tokens[end - 1].type == T_MINUS))
+            end--;
+
+        bool fold = false;
+        for (size_t k = start; k < end && !fold; k++)
+        {
+            TokenType t = tokens[k].type;
+            if (t != T_NUMBER && t != T_PLUS && t != T_MINUS)
+                fold = true;
+            else if (!in_brackets && k > start && t != T_NUMBER && tokens[k - 1].type == T_NUMBER)
+                fold = true; // "1 + 2" as an immediate, the operand parser takes one number only
+        }
+
+        TokenType prev = (out > 0) ? tokens[out - 1].type : T_INVALID;
+        bool attached = prev == T_REG || prev == T_IDENT;
+        if (!fold && attached && !in_brackets && end - start > 2)
+            fold = true; // "label + 1 + 2"
+
+        if (!fold)
+        {
+            while (i < end)
+                tokens[out++] = tokens[i++];
+            continue;
+        }
+
+        size_t pos = 0;
+        int lowest = 0;
+        int64_t value = 0;
+        int result = eval_binary(tokens + start, end - start, &pos, PREC_LOGOR, &lowest, lineno, &value);
+        if (result == 0 && pos != end - start)
+        {
+            fprintf(DIAG, "Error on line %zu: unexpected '%s' in expression\n", lineno, tokens[start + pos].lexeme);
+            result = 1;
+        }
+        if (result == 0 && attached && lowest < PREC_ADD)
+        {
+            fprintf(DIAG, "Error on line %zu: only '+' and '-' can combine a register or symbol with an expression\n", lineno);
+            result = 1;
+        }
+
+        // a sign token is kept in front when the run started with one or follows a register or
+        // symbol, parse_operand expects the number itself unsigned there
+        Token sign = {0}, number = {0};
+        bool signed_form = attached || tokens[start].type == T_PLUS || tokens[start].type == T_MINUS || value < 0;
+        if (result == 0 && signed_form)
+        {
+            result = replace_token(&sign, value < 0 ? T_MINUS : T_PLUS, 0);
+            if (value < 0)
+                value = (int64_t)(0 - (uint64_t)value);
+        }
+        if (result == 0)
+            result = replace_token(&number, T_NUMBER, value);
+
+        if (result != 0)
+        {
+            free(sign.lexeme);
+            memmove(tokens + out, tokens + start, (count - start) * sizeof *tokens);
+            *token_count = out + (count - start);
+            return 1;
+        }
+
+        // the run is at least as long as what replaces it, so this never overtakes i
+        for (size_t k = start; k < end; k++)
+            free(tokens[k].lexeme);
+        if (signed_form)
+            tokens[out++] = sign;
+        tokens[out++] = number;
+        i = end;
+    }
+    count = out;
+
+    // label +/- n outside brackets: fold n into the symbol token
+    in_brackets = false;
+    out = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        if (tokens[k].type == T_O_BRACK)
+            in_brackets = true;
+        else if (tokens[k].type == T_C_BRACK)
+            in_brackets = false;
+
+        tokens[out++] = tokens[k];
+        if (tokens[k].type != T_IDENT || in_brackets)
+            continue;
+
+        while (k + 2 < count && (tokens[k + 1].type == T_PLUS || tokens[k + 1].type == T_MINUS) &&
+               tokens[k + 2].type == T_NUMBER)
+        {
+            int64_t n = tokens[k + 2].value;
+            Token *sym = &tokens[out - 1];
+            sym->value = (int64_t)((tokens[k + 1].type == T_MINUS) ? (uint64_t)sym->value - (uint64_t)n
+                                                                    : (uint64_t)sym->value + (uint64_t)n);
+            free(tokens[k + 1].lexeme);
+            free(tokens[k + 2].lexeme);
+            k += 2;
+        }
+    }
+
+    *token_count = out;
+    return 0;
+}
+
+// precedence climbing: parses operators binding at least as tightly as min_prec,
+// lowest records the loosest operator applied at the top level
+static int eval_binary(const Token *tokens, size_t count, size_t *pos, int min_prec, int *lowest, size_t lineno, int64_t *out)
+{
+    int64_t lhs = 0;
+    if (eval_unary(tokens, count, pos, lineno, &lhs) != 0)
+        return 1;
+
+    int top = 0;
+    while (*pos < count)
+    {
+        TokenType op = tokens[*pos].type;
+        int prec = binary_precedence(op);
+        if (prec == 0 || prec < min_prec)
+            break;
+        (*pos)++;
+
+        int64_t rhs = 0;
+        int inner = 0;
+        if (eval_binary(tokens, count, pos, prec + 1, &inner, lineno, &rhs) != 0)
+            return 1;
+
+        // wrap around like the 64-bit machine would instead of invoking undefined behaviour
+        uint64_t a = (uint64_t)lhs, b = (uint64_t)rhs;
+        switch (op)
+        {
+        case T_PLUS:
+            lhs = (int64_t)(a + b);
+            break;
+        case T_MINUS:
+            lhs = (int64_t)(a - b);
+            break;
+        case T_STAR:
+            lhs = (int64_t)(a * b);
+            break;
+        case T_SLASH:
+        case T_PERCENT:
+            if (rhs == 0)
+            {
+                fprintf(DIAG, "Error on line %zu: division by zero in expression\n", lineno);
+                return 1;
+            }
+            if (lhs == INT64_MIN && rhs == -1)
+                lhs = (op == T_SLASH) ? INT64_MIN : 0;
+            else
+                lhs = (op == T_SLASH) ? lhs / rhs : lhs % rhs;
+            break;
+        case T_SHL:
+        case T_SHR:
+            if (rhs < 0 || rhs > 63)
+            {
+                fprintf(DIAG, "Error on line %zu: shift count must be between 0 and 63\n", lineno);
+                return 1;
+            }
+            lhs = (op == T_SHL) ? (int64_t)(a << rhs) : (int64_t)(a >> rhs);
+            break;
+        case T_AMP:
+            lhs = (int64_t)(a & b);
+            break;
+        case T_PIPE:
+            lhs = (int64_t)(a | b);
+            break;
+        // comparisons and logical operators give 1 or 0, both sides are always evaluated
+        case T_EQ:
+            lhs = lhs == rhs;
+            break;
+        case T_NE:
+            lhs = lhs != rhs;
+            break;
+        case T_LT:
+            lhs = lhs < rhs;
+            break;
+        case T_LE:
+            lhs = lhs <= rhs;
+            break;
+        case T_GT:
+            lhs = lhs > rhs;
+            break;
+        case T_GE:
+            lhs = lhs >= rhs;
+            break;
+        case T_LOGAND:
+            lhs = lhs && rhs;
+            break;
+        case T_LOGOR:
+            lhs = lhs || rhs;
+            break;
+        default: // T_CARET
+            lhs = (int64_t)(a ^ b);
+            break;
+        }
+
+        if (top == 0 || prec < top)
+            top = prec;
+    }
+
+    *lowest = top;
+    *out = lhs;
+    return 0;
+}
+
+static int eval_unary(const Token *tokens, size_t count, size_t *pos, size_t lineno, int64_t *out)
+{
+    if (*pos >= count)
+    {
+        fprintf(DIAG, "Error on line %zu: expression ends where a number was expected\n", lineno);
+        return 1;
+    }
+
+    const Token *tok = &tokens[(*pos)++];
+    switch (tok->type)
+    {
+    case T_NUMBER:
+        *out = tok->value;
+        return 0;
+    case T_PLUS:
+    case T_MINUS:
+    case T_TILDE:
+    case T_BANG:
+    {
+        int64_t v = 0;
+        if (eval_unary(tokens, count, pos, lineno, &v) != 0)
+            return 1;
+        if (tok->type == T_MINUS)
+            v = (int64_t)(0 - (uint64_t)v);
+        else if (tok->type == T_TILDE)
+            v = ~v;
+        else if (tok->type == T_BANG)
+            v = !v;
+        *out = v;
+        return 0;
+    }
+    case T_O_PAREN:
+    {
+        int lowest = 0;
+        if (eval_binary(tokens, count, pos, PREC_LOGOR, &lowest, lineno, out) != 0)
+            return 1;
+        if (*pos >= count || tokens[*pos].type != T_C_PAREN)
+        {
+            fprintf(DIAG, "Error on line %zu: missing ')' in expression\n", lineno);
+            return 1;
+        }
+        (*pos)++;
+        return 0;
+    }
+    case T_IDENT:
+        fprintf(DIAG, "Error on line %zu: '%s' is not a constant defined before this line\n", lineno, tok->lexeme);
+        return 1;
+    default:
+        fprintf(DIAG, "Error on line %zu: unexpected '%s' in expression\n", lineno, tok->lexeme);
+        return 1;
+    }
+}
+
+static inline int binary_precedence(TokenType type)
+{
+    switch (type)
+    {
+    case T_LOGOR:
+        return PREC_LOGOR;
+    case T_LOGAND:
+        return PREC_LOGAND;
+    case T_EQ:
+    case T_NE:
+    case T_LT:
+    case T_LE:
+    case T_GT:
+    case T_GE:
+        return PREC_CMP;
+    case T_PIPE:
+        return PREC_OR;
+    case T_CARET:
+        return PREC_XOR;
+    case T_AMP:
+        return PREC_AND;
+    case T_SHL:
+    case T_SHR:
+        return PREC_SHIFT;
+    case T_PLUS:
+    case T_MINUS:
+        return PREC_ADD;
+    case T_STAR:
+    case T_SLASH:
+    case T_PERCENT:
+        return PREC_MUL;
+    default:
+        return 0;
+    }
+}
+
+static inline bool is_expr_token(TokenType type)
+{
+    switch (type)
+    {
+    case T_NUMBER:
+    case T_PLUS:
+    case T_MINUS:
+    case T_STAR:
+    case T_SLASH:
+    case T_PERCENT:
+    case T_SHL:
+    case T_SHR:
+    case T_AMP:
+    case T_PIPE:
+    case T_CARET:
+    case T_TILDE:
+    case T_BANG:
+    case T_EQ:
+    case T_NE:
+    case T_LT:
+    case T_LE:
+    case T_GT:
+    case T_GE:
+    case T_LOGAND:
+    case T_LOGOR:
+    case T_O_PAREN:
+    case T_C_PAREN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// fills in a sign or a folded number token, the lexeme is what the number would be written as
+static inline int replace_token(Token *tok, TokenType type, int64_t value)
+{
+    char buf[24];
+    if (type == T_NUMBER)
+        snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    else
+        snprintf(buf, sizeof(buf), "%s", type == T_MINUS ? "-" : "+");
+
+    size_t len = strlen(buf);
+    tok->lexeme = malloc(len + 1);
+    if (!tok->lexeme)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (replace_token)\n");
+        return 1;
+    }
+    memcpy(tok->lexeme, buf, len + 1);
+    tok->type = type;
+    tok->value = value;
+    return 0;
+}
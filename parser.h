@@ -5,6 +5,7 @@
 #include <stdbool.h> // for bool
 
 #include "tokenizer.h" // for Token, TokenType
+#include "symtab.h"    // for SymbolTable
 
 typedef enum
 {
@@ -13,12 +14,31 @@ typedef enum
     SZ_WORD  // 16-bit
 } Size;
 
+// The interpreter goes by the order: from T_PUSH on nothing passes through the ALU, from T_JMP
+// on everything transfers control.
 typedef enum
 {
     T_MOV,
     T_ADD,
     T_SUB,
-    T_CMP
+    T_CMP,
+    T_XOR,
+    T_INC,
+    T_DEC,
+    T_NEG,
+    T_NOT,
+    T_PUSH,
+    T_POP,
+    T_XCHG,
+    T_FLAG, // clc, stc, cmc, cld, std, cli, sti, lahf, sahf, pushf, popf: Instruction.cond holds the opcode
+    T_JMP,
+    T_JCC, // Instruction.cond holds the condition
+    T_LOOP,
+    T_LOOPE,
+    T_LOOPNE,
+    T_JCXZ,
+    T_CALL,
+    T_RET
 } MnemonicType;
 
 typedef enum
@@ -41,6 +61,8 @@ typedef struct
     Size size;
     bool has_explicit_size; // true for OP_REG and OP_IMM and if 'byte' or 'word' written before operand
     Size explicit_size;     // 'byte' (8-bit) or 'word' (16-bit)
+    bool has_symbol;        // OP_IMM value or OP_MEM displacement is symbol_id + the number written
+    uint32_t symbol_id;
 
     union
     {
@@ -66,10 +88,17 @@ typedef struct
 typedef struct
 {
     MnemonicType mnem;
+    uint8_t cond; // T_JCC: the condition code, 0x70 + cond is the short opcode; T_FLAG: the opcode
     Operand op1;
     Operand op2;
 } Instruction;
 
-int parse_tokens(Token *tokens, size_t token_count, size_t lineno, Instruction *inst_out);
+int parse_tokens(Token *tokens, size_t token_count, size_t lineno, SymbolTable *symbols, Instruction *inst_out);
+// Reads "mnem reg, reg", "mnem reg, imm", "mnem reg, [mem]" and "mnem [mem], reg" lines straight
+// from the text, for mov/add/sub/cmp/xor with plain decimal or 0x numbers. Returns false without
+// printing anything for every other line, including those parse_tokens would reject; a true
+// result gives the Instruction tokenize_line and parse_tokens would have.
+bool parse_canonical(const char *line, Instruction *inst_out);
+int eval_tokens(const Token *tokens, size_t token_count, size_t lineno, int64_t *value_out);
 
 #endif
\ No newline at end of file
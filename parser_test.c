@@ -11,6 +11,7 @@
 #endif
 
 #include "tokenizer.c"
+#include "symtab.c"
 #include "parser.c"
 
 static FILE *stderr_tmp;
@@ -64,13 +65,13 @@ static void expect_parse_error(const char *line, const char *want_msg)
     Token *tokens = NULL;
     size_t lineno = 10;
     size_t n = 0;
-    int tr = tokenize_line(line, lineno, &tokens, &n);
+    int tr = tokenize_line(line, lineno, NULL, &tokens, &n);
     assert(tr == 0);
 
     // 2) capture stderr
     begin_capture_stderr();
     Instruction dummy;
-    int pr = parse_tokens(tokens, n, lineno, &dummy);
+    int pr = parse_tokens(tokens, n, lineno, NULL, &dummy);
     char *out = end_capture_stderr();
 
     // 3) assert return != 0 and message contains want_msg
@@ -83,9 +84,61 @@ static void expect_parse_error(const char *line, const char *want_msg)
 
 static void test_bad_tokens(void)
 {
-    expect_parse_error("mov ax, bad", "Error on line 10: invalid token 'bad'");
-    expect_parse_error("bad", "Error on line 10: invalid token 'bad'");
-    expect_parse_error("mov bad bad2 bad3", "Error on line 10: invalid token 'bad'");
+    expect_parse_error("mov ax, @", "Error on line 10: invalid token '@'");
+    expect_parse_error("@", "Error on line 10: invalid token '@'");
+    expect_parse_error("mov @ ! #", "Error on line 10: invalid token '@'");
+}
+
+static void test_branches(void)
+{
+    expect_parse_error("jmp", "Error on line 10: 'jmp' instruction requires exactly one operand");
+    expect_parse_error("jne 1, 2", "Error on line 10: expected exactly one immediate operand");
+    expect_parse_error("jne ax", "Error on line 10: 'jne' instruction requires a label or an address");
+    expect_parse_error("loop [bx]", "Error on line 10: 'loop' instruction requires a label or an address");
+    expect_parse_error("jmp al", "Error on line 10: jump target must be a word");
+    expect_parse_error("call byte [bx]", "Error on line 10: jump target must be a word");
+    expect_parse_error("ret 4", "Error on line 10: 'ret' instruction takes no operands");
+}
+
+static void test_single_operand(void)
+{
+    expect_parse_error("inc", "Error on line 10: 'inc' instruction requires exactly one operand");
+    expect_parse_error("neg ax, bx", "Error on line 10: 'neg' instruction requires exactly one operand");
+    expect_parse_error("inc [bx]", "Error on line 10: operation size not specified");
+    expect_parse_error("push 5", "Error on line 10: 'push' instruction requires a register or a memory operand");
+    expect_parse_error("pop al", "Error on line 10: 'pop' instruction requires a word operand");
+    expect_parse_error("xchg ax, 5", "Error on line 10: 'xchg' instruction cannot take an immediate");
+    expect_parse_error("clc ax", "Error on line 10: 'clc' instruction takes no operands");
+}
+
+static void test_symbols(void)
+{
+    // no symbol table is passed here, so every name is undefined
+    expect_parse_error("mov ax, bad", "Error on line 10: undefined symbol 'bad'");
+    expect_parse_error("mov ax, [bx + bad]", "Error on line 10: undefined symbol 'bad'");
+    expect_parse_error("bad", "Error on line 10: first token should be a valid mnemonic");
+    expect_parse_error("mov ax, -bad", "Error on line 10: sign symbols outside the memory operand must be followed by a number");
+    expect_parse_error("mov ax, [bx - bad]", "Error on line 10: '-' symbol inside the memory operand must be followed by a number");
+    expect_parse_error("mov ax, [bad bx]", "Error on line 10: symbol inside memory operand must be followed by '+' or '-' or closing ']'");
+    expect_parse_error("mov ax, bx:", "Error on line 10: ':' is only allowed after a label at the start of the line");
+    expect_parse_error("mov ax, equ", "Error on line 10: directive 'equ' cannot be used inside an instruction");
+    expect_parse_error("size equ 4", "Error on line 10: first token should be a valid mnemonic");
+    expect_parse_error("mov ax, %1", "Error on line 10: macro parameter '%1' used outside a macro");
+}
+
+static void test_expressions(void)
+{
+    expect_parse_error("mov ax, 1/0", "Error on line 10: division by zero in expression");
+    expect_parse_error("mov ax, 5 % (2-2)", "Error on line 10: division by zero in expression");
+    expect_parse_error("mov ax, 1 << 64", "Error on line 10: shift count must be between 0 and 63");
+    expect_parse_error("mov ax, (1+2", "Error on line 10: missing ')' in expression");
+    expect_parse_error("mov ax, 1 +", "Error on line 10: expression ends where a number was expected");
+    expect_parse_error("mov ax, [bx*2]", "Error on line 10: unexpected '*' in expression");
+    expect_parse_error("mov ax, [bx + (1|2)]", "Error on line 10: only '+' and '-' can combine a register or symbol with an expression");
+    expect_parse_error("mov ax, 256*256", "Error on line 10: immediate value exceeds valid range");
+    expect_parse_error("mov ax, [bx + 200*200]", "Error on line 10: number inside the memory operand exceeds valid range");
+    expect_parse_error("mov ax, 1 == ", "Error on line 10: expression ends where a number was expected");
+    expect_parse_error("mov ax, [bx + (1 < 2)]", "Error on line 10: only '+' and '-' can combine a register or symbol with an expression");
 }
 
 static void test_invalid_instruction_structure(void)
@@ -129,8 +182,8 @@ static void test_memory_operand_syntax(void)
     expect_parse_error("mov ax, [-bx]", "Error on line 10: '-' symbol inside the memory operand must be followed by a number");
     expect_parse_error("mov ax, [bx-cx]", "Error on line 10: '-' symbol inside the memory operand must be followed by a number");
     expect_parse_error("mov ax, [5+10-20-]", "Error on line 10: '-' symbol inside the memory operand must be followed by a number");
-    expect_parse_error("mov ax, [bx+]", "Error on line 10: '+' symbol inside the memory operand must be followed by a number or a register");
-    expect_parse_error("mov ax, [5+10-20+]", "Error on line 10: '+' symbol inside the memory operand must be followed by a number or a register");
+    expect_parse_error("mov ax, [bx+]", "Error on line 10: '+' symbol inside the memory operand must be followed by a number, a symbol or a register");
+    expect_parse_error("mov ax, [5+10-20+]", "Error on line 10: '+' symbol inside the memory operand must be followed by a number, a symbol or a register");
     expect_parse_error("mov ax, [5+10-20 20]", "Error on line 10: number inside memory operand must be followed by '+' or '-' or closing ']'");
     expect_parse_error("mov ax, [5+10-20 bx]", "Error on line 10: number inside memory operand must be followed by '+' or '-' or closing ']'");
     expect_parse_error("mov ax, [5+10-20 byte]", "Error on line 10: number inside memory operand must be followed by '+' or '-' or closing ']'");
@@ -154,10 +207,10 @@ static void test_bad_size_specifiers(void)
 {
     expect_parse_error("mov ax, 5 byte", "Error on line 10: unexpected end of input after 'byte'");
     expect_parse_error("mov ax, 5 word", "Error on line 10: unexpected end of input after 'word'");
-    expect_parse_error("mov byte, ax 5", "Error on line 10: size specifier must be followed by an immediate or a register");
-    expect_parse_error("mov word ax byte, 5", "Error on line 10: size specifier must be followed by an immediate or a register");
-    expect_parse_error("mov word ax byte [100]", "Error on line 10: size specifier must be followed by an immediate or a register");
-    expect_parse_error("mov word ax word word bx", "Error on line 10: size specifier must be followed by an immediate or a register");
+    expect_parse_error("mov byte, ax 5", "Error on line 10: size specifier must be followed by an immediate, register or a memory operand");
+    expect_parse_error("mov word ax byte, 5", "Error on line 10: size specifier must be followed by an immediate, register or a memory operand");
+    expect_parse_error("mov word ax byte [100]", "Error on line 10: operands must be separated by a ','");
+    expect_parse_error("mov word ax word word bx", "Error on line 10: size specifier must be followed by an immediate, register or a memory operand");
 }
 
 static void test_bad_sign_symbols(void)
@@ -175,6 +228,10 @@ static void test_bad_sign_symbols(void)
 static void test_bad_syntax(void)
 {
     test_bad_tokens();
+    test_symbols();
+    test_branches();
+    test_single_operand();
+    test_expressions();
     test_invalid_instruction_structure();
     test_operand_count_and_positioning();
     test_memory_operand_syntax();
@@ -215,11 +272,155 @@ static void test_semantic_mov_errors(void)
     expect_parse_error("mov [100], 5", "Error on line 10: operation size not specified");
 }
 
+static bool same_operand(const Operand *a, const Operand *b)
+{
+    if (a->opType != b->opType || a->size != b->size || a->has_explicit_size != b->has_explicit_size ||
+        a->explicit_size != b->explicit_size || a->has_symbol != b->has_symbol)
+        return false;
+    if (a->opType == OP_IMM)
+        return a->imm.value == b->imm.value;
+    if (a->opType == OP_REG)
+        return a->reg.reg_code == b->reg.reg_code;
+    if (a->opType == OP_MEM)
+        return (a->mem.base_reg ? b->mem.base_reg && strcmp(a->mem.base_reg, b->mem.base_reg) == 0 : !b->mem.base_reg) &&
+               (a->mem.index_reg ? b->mem.index_reg && strcmp(a->mem.index_reg, b->mem.index_reg) == 0 : !b->mem.index_reg) &&
+               a->mem.rm_code == b->mem.rm_code && a->mem.disp_size == b->mem.disp_size && a->mem.disp_value == b->mem.disp_value;
+    return true;
+}
+
+// 0: both paths agree, 1: parse_canonical took a line the full path treats differently,
+// 2: it passed on a plain line the full path accepts, 3: it printed something
+static int compare_paths(const char *line, bool plain)
+{
+    long before = ftell(stderr_tmp);
+    Instruction fast = {0};
+    bool fast_ok = parse_canonical(line, &fast);
+    if (ftell(stderr_tmp) != before)
+        return 3;
+
+    Token *tokens = NULL;
+    size_t n = 0;
+    Instruction full = {0};
+    bool full_ok = false;
+    // the assembler never hands parse_tokens an empty line
+    if (tokenize_line(line, 10, NULL, &tokens, &n) == 0)
+    {
+        if (n > 0)
+            full_ok = parse_tokens(tokens, n, 10, NULL, &full) == 0 && ftell(stderr_tmp) == before;
+        else
+            free(tokens);
+    }
+    if (fast_ok && !(full_ok && fast.mnem == full.mnem && fast.cond == full.cond &&
+                     same_operand(&fast.op1, &full.op1) && same_operand(&fast.op2, &full.op2)))
+        return 1;
+    if (plain && full_ok && !fast_ok)
+        return 2;
+    return 0;
+}
+
+static void test_canonical_forms(void)
+{
+    // plain operands are the ones parse_canonical has to take whenever the full path does
+    static const struct
+    {
+        const char *text;
+        bool plain;
+    } operands[] = {
+        {"al", true}, {"ah", true}, {"ax", true}, {"cl", true}, {"ch", true}, {"cx", true}, {"dl", true}, {"dh", true},
+        {"dx", true}, {"bl", true}, {"bh", true}, {"bx", true}, {"sp", true}, {"bp", true}, {"si", true}, {"di", true},
+        {"AX", true}, {"Bl", true}, {"ip", false}, {"axe", false}, {"es", false}, {"a_", false},
+        {"0", true}, {"1", true}, {"-1", true}, {"127", true}, {"-128", true}, {"255", true}, {"256", true},
+        {"-256", true}, {"65535", true}, {"-65536", true}, {"65536", true}, {"-65537", true}, {"0x10", true},
+        {"0XfF", true}, {"0xFFFF", true}, {"0x10000", true}, {"010", true}, {"99999999", true}, {"123456789", true},
+        {"- 5", true}, {"5h", false}, {"0b101", false}, {"1_0", false}, {"'a'", false}, {"5.", false}, {"0x", false},
+        {"+5", false}, {"1+1", false}, {"byte 5", false}, {"word ax", false}, {"label", false},
+        {"[0]", true}, {"[1234]", true}, {"[65535]", true}, {"[65536]", true}, {"[-1]", true}, {"[-65536]", true},
+        {"[-65537]", true}, {"[ 0x10 ]", true}, {"[bx+si+di]", true}, {"[]", false}, {"[bx", false}, {"[bx*2]", false},
+        {"[si+bx]", true}, {"[bx+label]", false}, {"[bx]+1", false}, {"byte [bx]", false}, {"[+5]", false},
+    };
+    static const char *bases[] = {"bx", "bp", "si", "di", "sp", "ax", "BX", "bl"};
+    static const char *indexes[] = {"", "+si", "+di", "+ DI", "+bx", "+cx"};
+    static const char *disps[] = {"", "+0", "+1", "-1", "+127", "+128", "-128", "-129", "+32767", "+32768",
+                                  "-32768", "-32769", "+0x7F", " - 5", "+99999999", "+5h"};
+    static const char *mnemonics[] = {"mov", "add", "sub", "cmp", "xor", "MOV", "xOr", "jmp", "movs"};
+    static const char *templates[] = {"%s %s, %s", "  %s\t%s ,%s  ; note\n", "%s %s,%s\r\n"};
+
+    size_t op_count = sizeof operands / sizeof *operands;
+    size_t mem_count = sizeof bases / sizeof *bases * (sizeof indexes / sizeof *indexes) * (sizeof disps / sizeof *disps);
+    char (*texts)[32] = malloc((op_count + mem_count) * sizeof *texts);
+    bool *plain = malloc(op_count + mem_count);
+    assert(texts && plain);
+    size_t count = 0;
+    for (size_t i = 0; i < op_count; i++, count++)
+    {
+        snprintf(texts[count], sizeof *texts, "%s", operands[i].text);
+        plain[count] = operands[i].plain;
+    }
+    for (size_t b = 0; b < sizeof bases / sizeof *bases; b++)
+        for (size_t x = 0; x < sizeof indexes / sizeof *indexes; x++)
+            for (size_t d = 0; d < sizeof disps / sizeof *disps; d++, count++)
+            {
+                snprintf(texts[count], sizeof *texts, "[%s%s%s]", bases[b], indexes[x], disps[d]);
+                plain[count] = strcmp(disps[d], "+5h") != 0;
+            }
+
+    static const char *whole_lines[] = {"mov ax, bx extra", "mov ax bx", "mov ax, bx, cx", "start: mov ax, bx",
+                                        "movax, bx", "mov ax, bx ;", "mov\tax,bx", "mov ax,", ", ax", "mov , ax",
+                                        "mov ax, bx\0junk", "   ", "mov", "mov ax, [bx] ; [si]"};
+
+    char line[128], failed[128] = "";
+    int failure = 0;
+    size_t lines = 0, fast = 0;
+    begin_capture_stderr();
+    for (size_t i = 0; i < sizeof whole_lines / sizeof *whole_lines && !failure; i++, lines++)
+    {
+        failure = compare_paths(whole_lines[i], false);
+        snprintf(failed, sizeof failed, "%s", whole_lines[i]);
+    }
+    for (size_t a = 0; a < count && !failure; a++)
+    {
+        for (size_t b = 0; b < count && !failure; b++)
+        {
+            // every pair with a register, the other pairs only as often as it takes to see each operand;
+            // two registers with every mnemonic, the rest with one in turn
+            bool reg_a = a < 18, reg_b = b < 18;
+            if (!reg_a && !reg_b && (a + b) % 17 != 0)
+                continue;
+            size_t mnemonic_count = sizeof mnemonics / sizeof *mnemonics;
+            size_t first = (reg_a && reg_b) ? 0 : (a * 7 + b) % mnemonic_count;
+            size_t last = (reg_a && reg_b) ? mnemonic_count : first + 1;
+            for (size_t m = first; m < last && !failure; m++, lines++)
+            {
+                snprintf(line, sizeof line, templates[(a + b + m) % 3], mnemonics[m], texts[a], texts[b]);
+                failure = compare_paths(line, plain[a] && plain[b] && m < 7);
+                if (failure)
+                    snprintf(failed, sizeof failed, "%s", line);
+                else
+                {
+                    Instruction inst;
+                    fast += parse_canonical(line, &inst);
+                }
+            }
+        }
+    }
+    free(end_capture_stderr());
+    free(texts);
+    free(plain);
+
+    if (failure)
+        fprintf(stderr, "FAIL [%s]: %s\n", failed,
+               failure == 1 ? "parse_canonical differs from parse_tokens" : failure == 2 ? "parse_canonical missed a plain line" : "parse_canonical printed a message");
+    assert(failure == 0);
+    printf("  %zu lines compared, %zu taken by parse_canonical\n", lines, fast);
+}
+
 int main(void)
 {
     printf("Running parser negative tests...\n");
     test_bad_syntax();
     test_semantic_mov_errors();
+    printf("Comparing parse_canonical with tokenize_line and parse_tokens...\n");
+    test_canonical_forms();
     printf("All parser tests passed!\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include <stdio.h>      // for fprintf, snprintf
+#include <stdlib.h>     // for malloc, free
+#include <string.h>     // for strlen, strerror
+#include <errno.h>      // for errno, EINTR
+#include <unistd.h>     // for read, close
+#include <sys/socket.h> // for socket, connect, send
+#include <sys/un.h>     // for sockaddr_un
+
+#include "server.h"
+
+static int read_full(int fd, void *buf, size_t len);
+static int write_full(int fd, const void *buf, size_t len);
+
+int server_connect(const char *socket_path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0)
+    {
+        fprintf(stderr, "Error with server socket '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_assemble(int fd, uint32_t flags, const char *name, const char *source, size_t source_len, ServerResult *result)
+{
+    *result = (ServerResult){.status = 1};
+    ServerRequest req = {.magic = SERVER_MAGIC, .flags = flags | (source ? REQUEST_SOURCE : 0),
+                         .name_len = (uint32_t)strlen(name), .source_len = source ? (uint32_t)source_len : 0};
+    if (req.name_len > SERVER_NAME_MAX || source_len > SERVER_SOURCE_MAX)
+    {
+        fprintf(stderr, "Error: request for '%s' is too large for the server\n", name);
+        return 1;
+    }
+
+    ServerReply reply;
+    if (write_full(fd, &req, sizeof req) != 0 || write_full(fd, name, req.name_len) != 0 ||
+        (source && write_full(fd, source, source_len) != 0) || read_full(fd, &reply, sizeof reply) != 0)
+    {
+        fprintf(stderr, "Error: lost the connection to the server\n");
+        return 1;
+    }
+
+    result->output = malloc((size_t)reply.output_len + 1);
+    result->diag = malloc((size_t)reply.diag_len + 1);
+    if (!result->output || !result->diag || read_full(fd, result->output, reply.output_len) != 0 ||
+        read_full(fd, result->diag, reply.diag_len) != 0)
+    {
+        fprintf(stderr, "Error: lost the connection to the server\n");
+        free(result->output);
+        free(result->diag);
+        *result = (ServerResult){.status = 1};
+        return 1;
+    }
+    result->output[reply.output_len] = 0;
+    result->diag[reply.diag_len] = '\0';
+    result->output_len = reply.output_len;
+    result->diag_len = reply.diag_len;
+    result->status = (int)reply.status;
+    return 0;
+}
+
+// 1 on an error or if the peer closed the connection first
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// MSG_NOSIGNAL: a peer that went away is an error return, not a SIGPIPE
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
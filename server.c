@@ -0,0 +1,199 @@
+#include <stdio.h>      // for fprintf, printf, open_memstream
+#include <stdlib.h>     // for malloc, free
+#include <string.h>     // for strlen, strerror
+#include <errno.h>      // for errno
+#include <unistd.h>     // for close, unlink
+#include <sys/socket.h> // for socket, bind, listen, accept, connect, setsockopt
+#include <sys/stat.h>   // for lstat, S_ISSOCK
+#include <sys/time.h>   // for timeval
+#include <sys/un.h>     // for sockaddr_un
+
+#include "server.h"
+
+static int claim_socket_path(const struct sockaddr_un *addr);
+static int serve_client(int fd, const AssembleOptions *opts, FileCache *cache, bool *stop);
+static int serve_request(int fd, const ServerRequest *req, const AssembleOptions *opts, FileCache *cache);
+
+int run_server(const char *socket_path, const AssembleOptions *opts)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    FileCache cache;
+    if (filecache_init(&cache) != 0)
+        return 1;
+
+    if (claim_socket_path(&addr) != 0)
+    {
+        filecache_free(&cache);
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(listener, 16) != 0)
+    {
+        fprintf(stderr, "Error with server socket '%s': %s\n", socket_path, strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        filecache_free(&cache);
+        return 1;
+    }
+    printf("listening on %s\n", socket_path);
+    fflush(stdout);
+
+    // one client at a time: requests are short and all of them share the one warm cache
+    bool stop = false;
+    size_t clients = 0, requests = 0;
+    while (!stop)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error with server socket '%s': %s\n", socket_path, strerror(errno));
+            break;
+        }
+        clients++;
+
+        // one client at a time, so one that stalls or went away without closing must not hold
+        // up the ones after it: a read or write that waits this long drops it
+        struct timeval timeout = {.tv_sec = SERVER_CLIENT_TIMEOUT};
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) != 0)
+        {
+            fprintf(stderr, "Error with server socket '%s': %s\n", socket_path, strerror(errno));
+            close(fd);
+            continue;
+        }
+        int served = serve_client(fd, opts, &cache, &stop);
+        requests += (size_t)served;
+        close(fd);
+    }
+
+    printf("%zu clients, %zu requests, files: %zu mapped, %zu cache hits\n", clients, requests, cache.misses, cache.hits);
+    close(listener);
+    unlink(socket_path);
+    filecache_free(&cache);
+    return stop ? 0 : 1;
+}
+
+// A socket file left behind by a server that was killed would make bind fail, so one nobody
+// answers on is removed. A live server's socket and any other kind of file are left alone.
+static int claim_socket_path(const struct sockaddr_un *addr)
+{
+    struct stat st;
+    if (lstat(addr->sun_path, &st) != 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Error with server socket '%s': %s\n", addr->sun_path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "Error: '%s' exists and is not a socket\n", addr->sun_path);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error with server socket '%s': %s\n", addr->sun_path, strerror(errno));
+        return 1;
+    }
+    int live = connect(fd, (const struct sockaddr *)addr, sizeof *addr) == 0;
+    close(fd);
+    if (live)
+    {
+        fprintf(stderr, "Error: a server is already listening on '%s'\n", addr->sun_path);
+        return 1;
+    }
+    unlink(addr->sun_path);
+    return 0;
+}
+
+// requests until the client hangs up, returns how many were answered
+static int serve_client(int fd, const AssembleOptions *opts, FileCache *cache, bool *stop)
+{
+    int served = 0;
+    ServerRequest req;
+    errno = 0;
+    while (!*stop && read_full(fd, &req, sizeof req) == 0)
+    {
+        if (req.magic != SERVER_MAGIC || req.name_len == 0 || req.name_len > SERVER_NAME_MAX ||
+            req.source_len > SERVER_SOURCE_MAX || (!(req.flags & REQUEST_SOURCE) && req.source_len != 0))
+            break; // not a client of ours, or out of step with the stream
+        int result = serve_request(fd, &req, opts, cache);
+        // the assembly is over, nothing reads the versions of files edited since
+        filecache_drop_stale(cache);
+        if (result != 0)
+            break;
+        served++;
+        *stop = req.flags & REQUEST_STOP;
+        errno = 0;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        fprintf(stderr, "dropped a client that stalled for %d s\n", SERVER_CLIENT_TIMEOUT);
+    return served;
+}
+
+static int serve_request(int fd, const ServerRequest *req, const AssembleOptions *opts, FileCache *cache)
+{
+    char *name = malloc((size_t)req->name_len + 1);
+    char *source = malloc((size_t)req->source_len + 1);
+    if (!name || !source || read_full(fd, name, req->name_len) != 0 || read_full(fd, source, req->source_len) != 0)
+    {
+        free(name);
+        free(source);
+        return 1;
+    }
+    name[req->name_len] = '\0';
+
+    char *output = NULL, *diag = NULL;
+    size_t output_len = 0, diag_len = 0;
+    FILE *output_stream = open_memstream(&output, &output_len);
+    FILE *diag_out = open_memstream(&diag, &diag_len);
+    int status = 1;
+    if (!output_stream || !diag_out)
+        fprintf(stderr, "Error: memory allocation failed (serve_request)\n");
+    else if (!(req->flags & REQUEST_STOP))
+    {
+        AssembleOptions o = *opts;
+        o.optimize = opts->optimize || (req->flags & REQUEST_OPTIMIZE);
+        o.keep_going = opts->keep_going || (req->flags & REQUEST_KEEP_GOING);
+        o.cache = cache;
+        o.source = (req->flags & REQUEST_SOURCE) ? source : NULL;
+        o.source_len = req->source_len;
+        o.output = output_stream;
+        o.diag = diag_out;
+        AssembleResult result;
+        o.result = &result;
+        status = assemble_file(name, "-", &o);
+        // the client's figures go back to it, not onto the server's stdout
+        if (status == 0 && o.optimize)
+            fprintf(diag_out, "optimizer: %zu rewritten, %zu removed, %ld bytes and %ld cycles saved\n", result.opt.rewrites,
+                    result.opt.removed, result.opt.bytes_saved, result.opt.cycles_saved);
+    }
+    else
+        status = 0;
+    if (output_stream)
+        fclose(output_stream);
+    if (diag_out)
+        fclose(diag_out);
+
+    // a failed assembly sends its messages but none of the partial output
+    ServerReply reply = {.status = (uint32_t)status, .output_len = status == 0 ? (uint32_t)output_len : 0,
+                         .diag_len = (uint32_t)diag_len};
+    int result = write_full(fd, &reply, sizeof reply) != 0 || write_full(fd, output, reply.output_len) != 0 ||
+                 write_full(fd, diag, reply.diag_len) != 0;
+    free(output);
+    free(diag);
+    free(name);
+    free(source);
+    return result;
+}
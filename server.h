@@ -0,0 +1,56 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#include "assembler.h" // for AssembleOptions
+
+// Requests and replies on the server socket, in host byte order since both ends share a machine.
+// A request is the header, name_len bytes of file name, then source_len bytes of source text.
+#define SERVER_MAGIC 0x36383038 // "8086"
+#define SERVER_NAME_MAX 4096
+#define SERVER_SOURCE_MAX (64u << 20)
+#define SERVER_CLIENT_TIMEOUT 10 // seconds a client may leave the server waiting before it is dropped
+
+#define REQUEST_OPTIMIZE 0x1 // -O
+#define REQUEST_SOURCE 0x2   // the source follows, name only places it for %include and messages
+#define REQUEST_STOP 0x4     // reply, then shut the server down
+#define REQUEST_KEEP_GOING 0x8 // --keep-going, with the server's own --max-errors
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t name_len;
+    uint32_t source_len;
+} ServerRequest;
+
+// followed by output_len bytes of binary and diag_len bytes of messages
+typedef struct
+{
+    uint32_t status; // what assemble_file returned
+    uint32_t output_len;
+    uint32_t diag_len;
+} ServerReply;
+
+// a reply with its payloads, each NUL-terminated and freed by the caller
+typedef struct
+{
+    int status;
+    uint8_t *output;
+    size_t output_len;
+    char *diag;
+    size_t diag_len;
+} ServerResult;
+
+// Serves requests on a Unix domain socket until a REQUEST_STOP arrives. The file cache lives as
+// long as the server, so unchanged sources and includes are only stat'ed, never re-read.
+int run_server(const char *socket_path, const AssembleOptions *opts);
+
+// client side, returns -1 and prints why if there is no server at socket_path
+int server_connect(const char *socket_path);
+// source may be NULL to have the server read the file name itself, returns 1 if the connection failed
+int server_assemble(int fd, uint32_t flags, const char *name, const char *source, size_t source_len, ServerResult *result);
+
+#endif
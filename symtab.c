@@ -0,0 +1,180 @@
+#include <stdio.h>  // for fprintf
+#include <stdlib.h> // for malloc, calloc, realloc, free
+#include <string.h> // for memcpy, memcmp
+
+#include "symtab.h"
+#include "diag.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define SYMTAB_INITIAL_SLOTS 1024
+
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static inline uint32_t hash_name(const char *name, size_t len);
+static char *arena_strndup(SymbolTable *st, const char *name, size_t len);
+static int grow_slots(SymbolTable *st);
+
+int symtab_init(SymbolTable *st)
+{
+    memset(st, 0, sizeof *st);
+    st->slots = calloc(SYMTAB_INITIAL_SLOTS, sizeof *st->slots);
+    if (!st->slots)
+    {
+        fprintf(DIAG, "Error: memory allocation failed (symtab_init)\n");
+        return 1;
+    }
+    st->slot_count = SYMTAB_INITIAL_SLOTS;
+    return 0;
+}
+
+void symtab_free(SymbolTable *st)
+{
+    ArenaBlock *b = st->arena;
+    while (b)
+    {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(st->symbols);
+    free(st->slots);
+    memset(st, 0, sizeof *st);
+}
+
+// returns the symbol id, or SYMBOL_NONE
+uint32_t symtab_find(const SymbolTable *st, const char *name, size_t len)
+{
+    uint32_t hash = hash_name(name, len);
+    uint32_t mask = st->slot_count - 1;
+
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t slot = st->slots[i];
+        if (slot == 0)
+            return SYMBOL_NONE;
+
+        const Symbol *sym = &st->symbols[slot - 1];
+        if (sym->hash == hash && sym->len == len && memcmp(sym->name, name, len) == 0)
+            return slot - 1;
+    }
+}
+
+// finds the symbol or adds it as SYM_UNDEFINED
+int symtab_intern(SymbolTable *st, const char *name, size_t len, size_t lineno, uint32_t *id_out)
+{
+    uint32_t id = symtab_find(st, name, len);
+    if (id != SYMBOL_NONE)
+    {
+        *id_out = id;
+        return 0;
+    }
+
+    // keep the load factor at or below 1/2 so probe sequences stay short
+    if ((st->count + 1) * 2 > st->slot_count && grow_slots(st) != 0)
+        return 1;
+
+    if (st->count == st->capacity)
+    {
+        uint32_t newcap = st->capacity ? st->capacity * 2 : 256;
+        Symbol *tmp = realloc(st->symbols, newcap * sizeof *tmp);
+        if (!tmp)
+        {
+            fprintf(DIAG, "Error: memory allocation failed while resizing the symbol table\n");
+            return 1;
+        }
+        st->symbols = tmp;
+        st->capacity = newcap;
+    }
+
+    char *copy = arena_strndup(st, name, len);
+    if (!copy)
+        return 1;
+
+    id = st->count++;
+    Symbol *sym = &st->symbols[id];
+    sym->name = copy;
+    sym->len = (uint32_t)len;
+    sym->hash = hash_name(name, len);
+    sym->kind = SYM_UNDEFINED;
+    sym->flags = 0;
+    sym->value = 0;
+    sym->lineno = lineno;
+
+    uint32_t mask = st->slot_count - 1;
+    uint32_t i = sym->hash & mask;
+    while (st->slots[i] != 0)
+        i = (i + 1) & mask;
+    st->slots[i] = id + 1;
+
+    *id_out = id;
+    return 0;
+}
+
+// FNV-1a
+static inline uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static char *arena_strndup(SymbolTable *st, const char *name, size_t len)
+{
+    ArenaBlock *b = st->arena;
+    if (!b || b->used + len + 1 > b->size)
+    {
+        size_t size = len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof *b + size);
+        if (!b)
+        {
+            fprintf(DIAG, "Error: memory allocation failed while storing a symbol name\n");
+            return NULL;
+        }
+        b->next = st->arena;
+        b->used = 0;
+        b->size = size;
+        st->arena = b;
+    }
+
+    char *out = b->data + b->used;
+    memcpy(out, name, len);
+    out[len] = '\0';
+    b->used += len + 1;
+    return out;
+}
+
+// doubles the index and re-inserts every id, the symbols themselves do not move
+static int grow_slots(SymbolTable *st)
+{
+    uint32_t new_count = st->slot_count * 2;
+    uint32_t *slots = calloc(new_count, sizeof *slots);
+    if (!slots)
+    {
+        fprintf(DIAG, "Error: memory allocation failed while resizing the symbol table\n");
+        return 1;
+    }
+
+    uint32_t mask = new_count - 1;
+    for (uint32_t id = 0; id < st->count; id++)
+    {
+        uint32_t i = st->symbols[id].hash & mask;
+        while (slots[i] != 0)
+            i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+
+    free(st->slots);
+    st->slots = slots;
+    st->slot_count = new_count;
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stdint.h> // for uint8_t, uint32_t, int64_t
+#include <stddef.h> // for size_t
+
+typedef enum
+{
+    SYM_UNDEFINED, // referenced but not (yet) defined
+    SYM_LABEL,     // address in the output
+    SYM_CONSTANT   // equ or %define, substituted by the tokenizer
+} SymbolKind;
+
+typedef struct
+{
+    const char *name; // NUL-terminated, owned by the table's arena
+    uint32_t len;
+    uint32_t hash;
+    SymbolKind kind;
+    uint8_t flags; // SYMBOL_GLOBAL, SYMBOL_EXTERN, from the global and extern directives
+    int64_t value;
+    size_t lineno; // where it was defined, or first referenced while undefined
+} Symbol;
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Symbols live in a dense array so their ids stay valid while the table grows;
+// an open-addressing (linear probing) index of id + 1 sits on top, 0 marks an empty slot.
+typedef struct
+{
+    Symbol *symbols;
+    uint32_t count;
+    uint32_t capacity;
+
+    uint32_t *slots;
+    uint32_t slot_count; // power of two
+
+    ArenaBlock *arena; // name storage, freed all at once
+} SymbolTable;
+
+#define SYMBOL_NONE UINT32_MAX
+
+#define SYMBOL_GLOBAL 0x1 // a label other objects may reference
+#define SYMBOL_EXTERN 0x2 // defined in another object, only the linker knows its address
+
+int symtab_init(SymbolTable *st);
+void symtab_free(SymbolTable *st);
+uint32_t symtab_find(const SymbolTable *st, const char *name, size_t len);
+int symtab_intern(SymbolTable *st, const char *name, size_t len, size_t lineno, uint32_t *id_out);
+
+#endif
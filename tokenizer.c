@@ -1,16 +1,21 @@
-#include <stdio.h>   // for fprintf, stderr
-#include <ctype.h>   // for isspace, isdigit, isalpha, tolower
+#include <stdio.h>   // for fprintf
+#include <ctype.h>   // for isspace, isdigit, isalpha, isalnum, tolower
 #include <string.h>  // for memcpy, strlen, strcmp
 #include <stdlib.h>  // for malloc, realloc, free
 #include <stdbool.h> // for bool
 
 #include "tokenizer.h"
+#include "diag.h"
 
 static int next_token(Tokenizer *tk, Token *t);
 static inline char peek(Tokenizer *tk);
 static inline void advance(Tokenizer *tk);
 static inline bool is_at_end(Tokenizer *tk);
 static inline TokenType classify_identifier(const char *s);
+static inline bool at_line_start(Tokenizer *tk);
+static inline bool number_value(const char *s, size_t len, int64_t *value_out);
+static inline int digit_value(char c);
+static inline TokenType operator_type(char c, char next);
 
 static const struct
 {
@@ -22,6 +27,66 @@ static const struct
     {"add", T_MNEMONIC},
     {"sub", T_MNEMONIC},
     {"cmp", T_MNEMONIC},
+    {"xor", T_MNEMONIC},
+    {"inc", T_MNEMONIC},
+    {"dec", T_MNEMONIC},
+    {"neg", T_MNEMONIC},
+    {"not", T_MNEMONIC},
+    {"push", T_MNEMONIC},
+    {"pop", T_MNEMONIC},
+    {"xchg", T_MNEMONIC},
+    {"jmp", T_MNEMONIC},
+    {"call", T_MNEMONIC},
+    {"ret", T_MNEMONIC},
+    {"loop", T_MNEMONIC},
+    {"loope", T_MNEMONIC},
+    {"loopz", T_MNEMONIC},
+    {"loopne", T_MNEMONIC},
+    {"loopnz", T_MNEMONIC},
+    {"jcxz", T_MNEMONIC},
+    // conditional jumps, every alias of the 16 conditions
+    {"jo", T_MNEMONIC},
+    {"jno", T_MNEMONIC},
+    {"jb", T_MNEMONIC},
+    {"jc", T_MNEMONIC},
+    {"jnae", T_MNEMONIC},
+    {"jnb", T_MNEMONIC},
+    {"jnc", T_MNEMONIC},
+    {"jae", T_MNEMONIC},
+    {"je", T_MNEMONIC},
+    {"jz", T_MNEMONIC},
+    {"jne", T_MNEMONIC},
+    {"jnz", T_MNEMONIC},
+    {"jbe", T_MNEMONIC},
+    {"jna", T_MNEMONIC},
+    {"jnbe", T_MNEMONIC},
+    {"ja", T_MNEMONIC},
+    {"js", T_MNEMONIC},
+    {"jns", T_MNEMONIC},
+    {"jp", T_MNEMONIC},
+    {"jpe", T_MNEMONIC},
+    {"jnp", T_MNEMONIC},
+    {"jpo", T_MNEMONIC},
+    {"jl", T_MNEMONIC},
+    {"jnge", T_MNEMONIC},
+    {"jnl", T_MNEMONIC},
+    {"jge", T_MNEMONIC},
+    {"jle", T_MNEMONIC},
+    {"jng", T_MNEMONIC},
+    {"jnle", T_MNEMONIC},
+    {"jg", T_MNEMONIC},
+    // flag instructions
+    {"clc", T_MNEMONIC},
+    {"stc", T_MNEMONIC},
+    {"cmc", T_MNEMONIC},
+    {"cld", T_MNEMONIC},
+    {"std", T_MNEMONIC},
+    {"cli", T_MNEMONIC},
+    {"sti", T_MNEMONIC},
+    {"lahf", T_MNEMONIC},
+    {"sahf", T_MNEMONIC},
+    {"pushf", T_MNEMONIC},
+    {"popf", T_MNEMONIC},
     // size prefixes
     {"byte", T_SIZE},
     {"word", T_SIZE},
@@ -42,16 +107,27 @@ static const struct
     {"bp", T_REG},
     {"si", T_REG},
     {"di", T_REG},
+    // directives written without '%'
+    {"equ", T_DIRECTIVE},
+    {"times", T_DIRECTIVE},
+    {"db", T_DIRECTIVE},
+    {"dw", T_DIRECTIVE},
+    {"resb", T_DIRECTIVE},
+    {"resw", T_DIRECTIVE},
+    {"align", T_DIRECTIVE},
+    {"global", T_DIRECTIVE},
+    {"extern", T_DIRECTIVE},
     // end marker
     {NULL, T_BAD}};
 
-int tokenize_line(const char *line_src, size_t line_n, Token **tokens_out, size_t *token_count_out)
+int tokenize_line(const char *line_src, size_t line_n, const SymbolTable *constants, Token **tokens_out, size_t *token_count_out)
 {
     Tokenizer tk = {
         .line_src = line_src,
         .pos = 0,
         .line_len = strlen(line_src),
-        .line_n = line_n};
+        .line_n = line_n,
+        .constants = constants};
 
     Token *arr = NULL;
     size_t capacity = 0, t_count = 0;
@@ -63,7 +139,7 @@ int tokenize_line(const char *line_src, size_t line_n, Token **tokens_out, size_
 
         if (result == 1)
         {
-            fprintf(stderr, "Error: memory allocation failed during tokenization (next_token)\n");
+            fprintf(DIAG, "Error: memory allocation failed during tokenization (next_token)\n");
             for (size_t i = 0; i < t_count; i++)
                 free(arr[i].lexeme);
             free(arr);
@@ -82,7 +158,7 @@ int tokenize_line(const char *line_src, size_t line_n, Token **tokens_out, size_
             Token *tmp = realloc(arr, newcap * sizeof *arr);
             if (!tmp)
             {
-                fprintf(stderr, "Error: memory allocation failed while resizing token array (tokenize_line)\n");
+                fprintf(DIAG, "Error: memory allocation failed while resizing token array (tokenize_line)\n");
                 free(t.lexeme);
                 for (size_t i = 0; i < t_count; i++)
                     free(arr[i].lexeme);
@@ -114,17 +190,79 @@ static int next_token(Tokenizer *tk, Token *t_out)
     t_out->line_n = tk->line_n;
     t_out->lexeme = NULL;
     t_out->type = T_BAD;
+    t_out->value = 0;
 
     while (!is_at_end(tk))
     {
         char c = peek(tk);
-        if (isspace(c))
+        if (isspace((unsigned char)c))
         {
             advance(tk);
             continue;
         }
 
-        if (c == '+' || c == '-' || c == '[' || c == ']' || c == ',' || c == ';')
+        TokenType op = operator_type(c, tk->pos + 1 < tk->line_len ? tk->line_src[tk->pos + 1] : '\0');
+        if (op != T_BAD)
+        {
+            // shifts, comparisons and logical operators, the ones of two characters first
+            size_t len = (op == T_BANG || op == T_LT || op == T_GT || (op == T_EQ && tk->line_src[tk->pos + 1] != '=')) ? 1 : 2;
+            t_out->type = op;
+            t_out->lexeme = malloc(len + 1);
+            if (!t_out->lexeme)
+                return 1;
+            memcpy(t_out->lexeme, tk->line_src + tk->pos, len);
+            t_out->lexeme[len] = '\0';
+            advance(tk);
+            if (len == 2)
+                advance(tk);
+            return 0;
+        }
+
+        char c1 = tk->pos + 1 < tk->line_len ? tk->line_src[tk->pos + 1] : '\0';
+        char c2 = tk->pos + 2 < tk->line_len ? tk->line_src[tk->pos + 2] : '\0';
+        if (c == '%' && (isdigit((unsigned char)c1) || (c1 == '%' && (isalpha((unsigned char)c2) || c2 == '_' || c2 == '.'))))
+        {
+            // macro parameter "%1" or macro-local label "%%name", renamed at each expansion
+            size_t start = tk->pos;
+            bool arg = isdigit((unsigned char)c1);
+            advance(tk);
+            advance(tk);
+            while (arg ? isdigit((unsigned char)peek(tk)) : (isalnum((unsigned char)peek(tk)) || peek(tk) == '_' || peek(tk) == '.'))
+                advance(tk);
+
+            size_t len = tk->pos - start;
+            t_out->lexeme = malloc(len + 1);
+            if (!t_out->lexeme)
+                return 1;
+            memcpy(t_out->lexeme, tk->line_src + start, len);
+            t_out->lexeme[len] = '\0';
+            t_out->type = arg ? T_MACRO_ARG : T_IDENT;
+            if (arg)
+                number_value(t_out->lexeme + 1, len - 1, &t_out->value);
+            return 0;
+        }
+
+        if (c == '%' && isalpha((unsigned char)c1) && at_line_start(tk))
+        {
+            // a preprocessor directive, lowercase like the keywords
+            size_t start = tk->pos;
+            do
+            {
+                advance(tk);
+            } while (isalnum((unsigned char)peek(tk)) || peek(tk) == '_');
+
+            size_t len = tk->pos - start;
+            t_out->lexeme = malloc(len + 1);
+            if (!t_out->lexeme)
+                return 1;
+            for (size_t i = 0; i < len; i++)
+                t_out->lexeme[i] = (char)tolower((unsigned char)tk->line_src[start + i]);
+            t_out->lexeme[len] = '\0';
+            t_out->type = T_DIRECTIVE;
+            return 0;
+        }
+
+        if (c != '\0' && strchr("+-[],:;*/%&|^~()", c))
         {
             // 1) classify
             if (c == '+')
@@ -137,6 +275,26 @@ static int next_token(Tokenizer *tk, Token *t_out)
                 t_out->type = T_C_BRACK;
             else if (c == ',')
                 t_out->type = T_COMMA;
+            else if (c == ':')
+                t_out->type = T_COLON;
+            else if (c == '*')
+                t_out->type = T_STAR;
+            else if (c == '/')
+                t_out->type = T_SLASH;
+            else if (c == '%')
+                t_out->type = T_PERCENT;
+            else if (c == '&')
+                t_out->type = T_AMP;
+            else if (c == '|')
+                t_out->type = T_PIPE;
+            else if (c == '^')
+                t_out->type = T_CARET;
+            else if (c == '~')
+                t_out->type = T_TILDE;
+            else if (c == '(')
+                t_out->type = T_O_PAREN;
+            else if (c == ')')
+                t_out->type = T_C_PAREN;
             else
                 t_out->type = T_COMMENT;
 
@@ -153,14 +311,27 @@ static int next_token(Tokenizer *tk, Token *t_out)
             return 0;
         }
 
-        if (isdigit(c))
+        if (isdigit((unsigned char)c) || c == '\'' || c == '"')
         {
-            // 1) consume an entire run of digits
+            // 1) consume the literal: digits with an optional radix prefix or suffix, or a quoted string
             size_t start = tk->pos;
-            do
+            bool closed = true;
+            if (isdigit((unsigned char)c))
+            {
+                do
+                {
+                    advance(tk);
+                } while (isalnum((unsigned char)peek(tk)) || peek(tk) == '_');
+            }
+            else
             {
                 advance(tk);
-            } while (isdigit(peek(tk)));
+                while (!is_at_end(tk) && peek(tk) != c && peek(tk) != '\n' && peek(tk) != '\r')
+                    advance(tk);
+                closed = peek(tk) == c;
+                if (closed)
+                    advance(tk);
+            }
 
             // 2) build and allocate the lexeme
             size_t len = tk->pos - start;
@@ -170,18 +341,30 @@ static int next_token(Tokenizer *tk, Token *t_out)
             memcpy(t_out->lexeme, tk->line_src + start, len);
             t_out->lexeme[len] = '\0';
 
-            // 3) classify
-            t_out->type = T_NUMBER;
+            // 3) classify: the value is computed here, so the parser never converts text
+            if (isdigit((unsigned char)c))
+            {
+                t_out->type = number_value(t_out->lexeme, len, &t_out->value) ? T_NUMBER : T_BAD;
+            }
+            else if (closed)
+            {
+                // NASM style character constant: the first character is the low byte
+                uint64_t v = 0;
+                for (size_t i = len - 2; i > 0; i--)
+                    v = (v << 8) | (uint8_t)t_out->lexeme[i];
+                t_out->value = (int64_t)v;
+                t_out->type = T_NUMBER;
+            }
             return 0;
         }
-        else if (isalpha(c))
+        else if (isalpha((unsigned char)c) || c == '_' || c == '.')
         {
-            // 1) consume an entire run of letters
+            // 1) consume an entire identifier (letters, digits, '_' and '.')
             size_t start = tk->pos;
             do
             {
                 advance(tk);
-            } while (isalpha(peek(tk)));
+            } while (isalnum((unsigned char)peek(tk)) || peek(tk) == '_' || peek(tk) == '.');
 
             // 2) build and allocate the lexeme into a buffer
             size_t len = tk->pos - start;
@@ -191,13 +374,32 @@ static int next_token(Tokenizer *tk, Token *t_out)
             memcpy(buf, tk->line_src + start, len);
             buf[len] = '\0';
 
-            // 3) transform each char to lowercase, then classify
-            for (size_t i = 0; i < len; i++)
+            // 3) classify the lowercase spelling: keywords are case-insensitive,
+            //    other names (labels) keep the case they were written in
+            char lower[8]; // longer than any keyword
+            TokenType type = T_IDENT;
+            if (len < sizeof(lower))
             {
-                buf[i] = (char)tolower((unsigned char)buf[i]);
+                for (size_t i = 0; i <= len; i++)
+                    lower[i] = (char)tolower((unsigned char)buf[i]);
+                type = classify_identifier(lower);
+                if (type != T_IDENT)
+                    memcpy(buf, lower, len);
+            }
+
+            // 4) named constants are replaced by their value here, one hash lookup and no
+            //    re-expansion; the lexeme keeps the name for diagnostics
+            if (type == T_IDENT && tk->constants)
+            {
+                uint32_t id = symtab_find(tk->constants, buf, len);
+                if (id != SYMBOL_NONE && tk->constants->symbols[id].kind == SYM_CONSTANT)
+                {
+                    type = T_NUMBER;
+                    t_out->value = tk->constants->symbols[id].value;
+                }
             }
             t_out->lexeme = buf;
-            t_out->type = classify_identifier(buf);
+            t_out->type = type;
 
             return 0;
         }
@@ -234,7 +436,108 @@ static inline bool is_at_end(Tokenizer *tk)
     return tk->pos >= tk->line_len;
 }
 
-// return T_BAD if no match, otherwise the correct TokenType
+// true if only whitespace comes before the current position
+static inline bool at_line_start(Tokenizer *tk)
+{
+    for (size_t i = 0; i < tk->pos; i++)
+    {
+        if (!isspace((unsigned char)tk->line_src[i]))
+            return false;
+    }
+    return true;
+}
+
+// Decimal by default; 0x/0h prefix or h suffix for hex, 0b/0y prefix or b/y suffix for binary,
+// q/o suffix for octal, d suffix for decimal, '_' separators allowed. Values that do not fit
+// in 63 bits saturate, the range checks in the parser reject them anyway.
+static inline bool number_value(const char *s, size_t len, int64_t *value_out)
+{
+    int base = 10;
+    char last = (char)tolower((unsigned char)s[len - 1]);
+    char second = len > 2 ? (char)tolower((unsigned char)s[1]) : '\0';
+
+    if (s[0] == '0' && (second == 'x' || second == 'h'))
+    {
+        base = 16;
+        s += 2;
+        len -= 2;
+    }
+    else if (last == 'h')
+    {
+        base = 16;
+        len--;
+    }
+    else if (s[0] == '0' && (second == 'b' || second == 'y'))
+    {
+        base = 2;
+        s += 2;
+        len -= 2;
+    }
+    else if (last == 'b' || last == 'y')
+    {
+        base = 2;
+        len--;
+    }
+    else if (last == 'q' || last == 'o')
+    {
+        base = 8;
+        len--;
+    }
+    else if (last == 'd')
+    {
+        len--;
+    }
+
+    uint64_t v = 0;
+    bool any = false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] == '_')
+            continue;
+        int d = digit_value(s[i]);
+        if (d < 0 || d >= base)
+            return false;
+        v = (v > (uint64_t)INT64_MAX / 16) ? (uint64_t)INT64_MAX : v * (uint64_t)base + (uint64_t)d;
+        any = true;
+    }
+
+    *value_out = v > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)v;
+    return any;
+}
+
+static inline int digit_value(char c)
+{
+    if (isdigit((unsigned char)c))
+        return c - '0';
+    c = (char)tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// the operators that start with one of "<>=!&|" and are not plain '&' or '|', T_BAD otherwise
+static inline TokenType operator_type(char c, char next)
+{
+    switch (c)
+    {
+    case '<':
+        return next == '<' ? T_SHL : next == '=' ? T_LE : next == '>' ? T_NE : T_LT;
+    case '>':
+        return next == '>' ? T_SHR : next == '=' ? T_GE : T_GT;
+    case '=':
+        return T_EQ;
+    case '!':
+        return next == '=' ? T_NE : T_BANG;
+    case '&':
+        return next == '&' ? T_LOGAND : T_BAD;
+    case '|':
+        return next == '|' ? T_LOGOR : T_BAD;
+    default:
+        return T_BAD;
+    }
+}
+
+// return T_IDENT if no match, otherwise the correct TokenType
 static inline TokenType classify_identifier(const char *s)
 {
     for (int i = 0; keyword_map[i].lexeme != NULL; i++)
@@ -242,5 +545,5 @@ static inline TokenType classify_identifier(const char *s)
         if (strcmp(s, keyword_map[i].lexeme) == 0)
             return keyword_map[i].type;
     }
-    return T_BAD;
+    return T_IDENT;
 }
\ No newline at end of file
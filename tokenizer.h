@@ -2,39 +2,68 @@
 #define TOKENIZER_H
 
 #include <stddef.h> // for size_t
+#include <stdint.h> // for int64_t
+
+#include "symtab.h" // for SymbolTable
 
 typedef enum
 {
     T_INVALID,
     T_EOF,
     T_BAD,
-    T_MNEMONIC, // mov (and later add, jmp…)
-    T_SIZE,     // byte, word
-    T_REG,      // al, ax, bx…
-    T_NUMBER,   // decimal literal (no binary or hex yet)
-    T_PLUS,     // '+'
-    T_MINUS,    // '-'
-    T_O_BRACK,  // '['
-    T_C_BRACK,  // ']'
-    T_COMMA,    // ','
-    T_COMMENT   // ';'
+    T_MNEMONIC,  // mov, add, jmp…
+    T_IDENT,     // any other name: a label definition or reference, '%%name' for macro-local labels
+    T_SIZE,      // byte, word
+    T_REG,       // al, ax, bx…
+    T_NUMBER,    // decimal, hex (0x1f, 1fh), binary (0b101, 101b), octal (17q) or char ('ab') literal
+    T_PLUS,      // '+'
+    T_MINUS,     // '-'
+    T_STAR,      // '*'
+    T_SLASH,     // '/'
+    T_PERCENT,   // '%'
+    T_SHL,       // '<<'
+    T_SHR,       // '>>'
+    T_AMP,       // '&'
+    T_PIPE,      // '|'
+    T_CARET,     // '^'
+    T_TILDE,     // '~'
+    T_BANG,      // '!'
+    T_EQ,        // '==' or '='
+    T_NE,        // '!=' or '<>'
+    T_LT,        // '<'
+    T_LE,        // '<='
+    T_GT,        // '>'
+    T_GE,        // '>='
+    T_LOGAND,    // '&&'
+    T_LOGOR,     // '||'
+    T_O_PAREN,   // '('
+    T_C_PAREN,   // ')'
+    T_O_BRACK,   // '['
+    T_C_BRACK,   // ']'
+    T_COMMA,     // ','
+    T_COLON,     // ':' after a label definition
+    T_DIRECTIVE, // equ, or '%' and a name at the start of the line (%define…)
+    T_MACRO_ARG, // '%1'… inside a macro body, value is the parameter number
+    T_COMMENT    // ';'
 } TokenType;
 
 typedef struct
 {
     TokenType type;
     char *lexeme;  // null-terminated text, caller must free(), allocated in next_token(), not allocated for T_EOF
+    int64_t value; // T_NUMBER: the literal's or constant's value, saturated; T_IDENT: an addend folded in by the parser
     size_t line_n; // source line number where this token appeared
 } Token;
 
 typedef struct
 {
-    const char *line_src; // the original line buffer (e.g. "mov ax, [bx + 10]\n")
-    size_t pos;           // current index (0 initially)
-    size_t line_len;      // length of the line (via strlen)
-    size_t line_n;        // the line number (for errors)
+    const char *line_src;         // the original line buffer (e.g. "mov ax, [bx + 10]\n")
+    size_t pos;                   // current index (0 initially)
+    size_t line_len;              // length of the line (via strlen)
+    size_t line_n;                // the line number (for errors)
+    const SymbolTable *constants; // names of SYM_CONSTANT symbols become T_NUMBER tokens, may be NULL
 } Tokenizer;
 
-int tokenize_line(const char *line_src, size_t line_n, Token **tokens_out, size_t *token_count_out);
+int tokenize_line(const char *line_src, size_t line_n, const SymbolTable *constants, Token **tokens_out, size_t *token_count_out);
 
 #endif
\ No newline at end of file
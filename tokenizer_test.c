@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "tokenizer.c"
+#include "symtab.c"
 
 void expect_token(const Token *t, TokenType expected_type, const char *expected_lexeme, size_t expected_line)
 {
@@ -17,7 +18,7 @@ void test_mov_simple()
     const char *line = "mov ax, bx";
     Token *tokens = NULL;
     size_t token_count = 0;
-    int result = tokenize_line(line, 1, &tokens, &token_count);
+    int result = tokenize_line(line, 1, NULL, &tokens, &token_count);
     assert(result == 0);
     // expected: mov, ax, ',', bx
     assert(token_count == 4);
@@ -36,7 +37,7 @@ void test_mov_memory()
     const char *line = "mov word, [bp+123] ; comment";
     Token *tokens = NULL;
     size_t token_count = 0;
-    int result = tokenize_line(line, 42, &tokens, &token_count);
+    int result = tokenize_line(line, 42, NULL, &tokens, &token_count);
     assert(result == 0);
     // expected: mov, word, ',', '[', bp, '+', 123, ']'
     // comment should be stripped
@@ -58,30 +59,215 @@ void test_mov_memory()
 
 void test_numbers_and_bad()
 {
-    const char *line = "123 abc 45,gh";
+    const char *line = "123 abc 45,gh @";
     Token *tokens = NULL;
     size_t token_count = 0;
-    int result = tokenize_line(line, 7, &tokens, &token_count);
+    int result = tokenize_line(line, 7, NULL, &tokens, &token_count);
     assert(result == 0);
-    // expected: 123, abc, 45, ',', gh
-    assert(token_count == 5);
+    // expected: 123, abc, 45, ',', gh, @
+    assert(token_count == 6);
     expect_token(&tokens[0], T_NUMBER, "123", 7);
-    expect_token(&tokens[1], T_BAD, "abc", 7);
+    expect_token(&tokens[1], T_IDENT, "abc", 7);
     expect_token(&tokens[2], T_NUMBER, "45", 7);
     expect_token(&tokens[3], T_COMMA, ",", 7);
-    expect_token(&tokens[4], T_BAD, "gh", 7);
+    expect_token(&tokens[4], T_IDENT, "gh", 7);
+    expect_token(&tokens[5], T_BAD, "@", 7);
 
     for (size_t i = 0; i < token_count; i++)
         free(tokens[i].lexeme);
     free(tokens);
 }
 
+void test_label()
+{
+    const char *line = "Loop_1: MOV AX, [.data+2]";
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    int result = tokenize_line(line, 3, NULL, &tokens, &token_count);
+    assert(result == 0);
+    // expected: Loop_1, ':', mov, ax, ',', '[', .data, '+', 2, ']'
+    // keywords are lowercased, label names keep their case
+    assert(token_count == 10);
+    int i = 0;
+    expect_token(&tokens[i++], T_IDENT, "Loop_1", 3);
+    expect_token(&tokens[i++], T_COLON, ":", 3);
+    expect_token(&tokens[i++], T_MNEMONIC, "mov", 3);
+    expect_token(&tokens[i++], T_REG, "ax", 3);
+    expect_token(&tokens[i++], T_COMMA, ",", 3);
+    expect_token(&tokens[i++], T_O_BRACK, "[", 3);
+    expect_token(&tokens[i++], T_IDENT, ".data", 3);
+    expect_token(&tokens[i++], T_PLUS, "+", 3);
+    expect_token(&tokens[i++], T_NUMBER, "2", 3);
+    expect_token(&tokens[i++], T_C_BRACK, "]", 3);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+}
+
+void test_literals_and_operators()
+{
+    const char *line = "0x1F 0FFh 0b101 17q 'AB' 1_000 (1<<4)|~2 0x 'x";
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    int result = tokenize_line(line, 5, NULL, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 16);
+    int i = 0;
+    expect_token(&tokens[i], T_NUMBER, "0x1F", 5);
+    assert(tokens[i++].value == 0x1F);
+    expect_token(&tokens[i], T_NUMBER, "0FFh", 5);
+    assert(tokens[i++].value == 0xFF);
+    expect_token(&tokens[i], T_NUMBER, "0b101", 5);
+    assert(tokens[i++].value == 5);
+    expect_token(&tokens[i], T_NUMBER, "17q", 5);
+    assert(tokens[i++].value == 15);
+    expect_token(&tokens[i], T_NUMBER, "'AB'", 5);
+    assert(tokens[i++].value == 0x4241); // first character is the low byte
+    expect_token(&tokens[i], T_NUMBER, "1_000", 5);
+    assert(tokens[i++].value == 1000);
+    expect_token(&tokens[i++], T_O_PAREN, "(", 5);
+    expect_token(&tokens[i++], T_NUMBER, "1", 5);
+    expect_token(&tokens[i++], T_SHL, "<<", 5);
+    expect_token(&tokens[i++], T_NUMBER, "4", 5);
+    expect_token(&tokens[i++], T_C_PAREN, ")", 5);
+    expect_token(&tokens[i++], T_PIPE, "|", 5);
+    expect_token(&tokens[i++], T_TILDE, "~", 5);
+    expect_token(&tokens[i++], T_NUMBER, "2", 5);
+    expect_token(&tokens[i++], T_BAD, "0x", 5);
+    expect_token(&tokens[i++], T_BAD, "'x", 5);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+}
+
+void test_constants_and_directives()
+{
+    SymbolTable constants;
+    assert(symtab_init(&constants) == 0);
+    uint32_t id;
+    assert(symtab_intern(&constants, "Width", 5, 1, &id) == 0);
+    constants.symbols[id].kind = SYM_CONSTANT;
+    constants.symbols[id].value = 80;
+    assert(symtab_intern(&constants, "start", 5, 1, &id) == 0);
+    constants.symbols[id].kind = SYM_LABEL;
+
+    const char *line = "  %Define x Width*2 width start equ";
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    int result = tokenize_line(line, 9, &constants, &tokens, &token_count);
+    assert(result == 0);
+    // expected: %define, x, Width (80), '*', 2, width, start, equ
+    // constants are looked up case-sensitively like labels, labels stay names
+    assert(token_count == 8);
+    int i = 0;
+    expect_token(&tokens[i++], T_DIRECTIVE, "%define", 9);
+    expect_token(&tokens[i++], T_IDENT, "x", 9);
+    expect_token(&tokens[i], T_NUMBER, "Width", 9);
+    assert(tokens[i++].value == 80);
+    expect_token(&tokens[i++], T_STAR, "*", 9);
+    expect_token(&tokens[i++], T_NUMBER, "2", 9);
+    expect_token(&tokens[i++], T_IDENT, "width", 9);
+    expect_token(&tokens[i++], T_IDENT, "start", 9);
+    expect_token(&tokens[i++], T_DIRECTIVE, "equ", 9);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+
+    // macro parameters and macro-local labels
+    result = tokenize_line("%%loop: add %12, 10%3", 9, &constants, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 7);
+    expect_token(&tokens[0], T_IDENT, "%%loop", 9);
+    expect_token(&tokens[1], T_COLON, ":", 9);
+    expect_token(&tokens[3], T_MACRO_ARG, "%12", 9);
+    assert(tokens[3].value == 12);
+    expect_token(&tokens[5], T_NUMBER, "10", 9);
+    expect_token(&tokens[6], T_MACRO_ARG, "%3", 9);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+
+    // '%' after the start of the line is the modulo operator
+    result = tokenize_line("mov ax, 7 %define", 9, &constants, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 6);
+    expect_token(&tokens[4], T_PERCENT, "%", 9);
+    expect_token(&tokens[5], T_IDENT, "define", 9);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+
+    // data directives in any case, a string keeps its quotes for db
+    result = tokenize_line("msg DB 'hi', Width RESW", 9, &constants, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 6);
+    expect_token(&tokens[0], T_IDENT, "msg", 9);
+    expect_token(&tokens[1], T_DIRECTIVE, "db", 9);
+    expect_token(&tokens[2], T_NUMBER, "'hi'", 9);
+    assert(tokens[2].value == ('i' << 8 | 'h'));
+    expect_token(&tokens[5], T_DIRECTIVE, "resw", 9);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+
+    // symbols shared between objects
+    result = tokenize_line("GLOBAL start, Extern", 9, &constants, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 4);
+    expect_token(&tokens[0], T_DIRECTIVE, "global", 9);
+    expect_token(&tokens[1], T_IDENT, "start", 9);
+    expect_token(&tokens[3], T_DIRECTIVE, "extern", 9);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+    symtab_free(&constants);
+}
+
+void test_comparisons()
+{
+    const char *line = "%if A<=1 && B<>2 || !C == 3 != <4>=> =";
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    int result = tokenize_line(line, 6, NULL, &tokens, &token_count);
+    assert(result == 0);
+    assert(token_count == 19);
+    int i = 2;
+    expect_token(&tokens[i++], T_LE, "<=", 6);
+    i++;
+    expect_token(&tokens[i++], T_LOGAND, "&&", 6);
+    i++;
+    expect_token(&tokens[i++], T_NE, "<>", 6);
+    i++;
+    expect_token(&tokens[i++], T_LOGOR, "||", 6);
+    expect_token(&tokens[i++], T_BANG, "!", 6);
+    i++;
+    expect_token(&tokens[i++], T_EQ, "==", 6);
+    i++;
+    expect_token(&tokens[i++], T_NE, "!=", 6);
+    expect_token(&tokens[i++], T_LT, "<", 6);
+    i++;
+    expect_token(&tokens[i++], T_GE, ">=", 6);
+    expect_token(&tokens[i++], T_GT, ">", 6);
+    expect_token(&tokens[i++], T_EQ, "=", 6);
+
+    for (size_t j = 0; j < token_count; j++)
+        free(tokens[j].lexeme);
+    free(tokens);
+}
+
 void test_empty_line()
 {
     const char *line = "   \t  ";
     Token *tokens = NULL;
     size_t token_count = 0;
-    int result = tokenize_line(line, 100, &tokens, &token_count);
+    int result = tokenize_line(line, 100, NULL, &tokens, &token_count);
     assert(result == 0);
     assert(token_count == 0);
     if (tokens)
@@ -94,6 +280,10 @@ int main(void)
     test_mov_simple();
     test_mov_memory();
     test_numbers_and_bad();
+    test_label();
+    test_literals_and_operators();
+    test_constants_and_directives();
+    test_comparisons();
     test_empty_line();
     printf("All tests passed!\n");
     return 0;
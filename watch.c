@@ -0,0 +1,368 @@
+#include <stdio.h>         // for fprintf, printf, open_memstream
+#include <stdlib.h>        // for free
+#include <string.h>        // for memcmp, memchr, strrchr, strerror
+#include <errno.h>         // for errno, EINTR
+#include <fcntl.h>         // for open, O_WRONLY
+#include <poll.h>          // for poll
+#include <time.h>          // for clock_gettime
+#include <unistd.h>        // for read, pwrite, close
+#include <sys/inotify.h>   // for inotify_init1, inotify_add_watch
+#include <sys/stat.h>      // for stat
+
+#include "watch.h"
+
+// A change confined to lines that were assembled on their own (LineSpan.patchable) and that
+// re-encode to the same sizes is written straight into the output file: no label moves, so no
+// other byte can change. Anything else, or a change to an include, reassembles everything.
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+typedef enum
+{
+    LINE_BLANK, // no tokens, only whitespace or a comment
+    LINE_CODE,  // an instruction that encodes on its own
+    LINE_OTHER,
+} LineKind;
+
+typedef struct
+{
+    uint32_t addr;
+    uint8_t bytes[6];
+    uint8_t size;
+} Patch;
+
+typedef struct
+{
+    uint32_t lineno;
+    uint32_t span; // index in the line table
+} LineIndex;
+
+typedef struct
+{
+    const char *in_name;
+    const char *out_name;
+    AssembleOptions opts; // with the cache and line table below
+    FileCache cache;
+    LineTable lines;
+    LineIndex *by_line; // the main-file spans by line number
+    size_t by_line_count, by_line_cap;
+    // a copy of the source the output was built from: a mapping shows edits made in place
+    char *text;
+    size_t text_len, text_cap;
+    bool built; // false after a failed run, only a full one can follow
+    const CachedFile *seen; // the version of the last run
+    int inotify;
+    Patch *patches;
+    size_t patch_count, patch_cap;
+} Watcher;
+
+static int rebuild(Watcher *w);
+static int try_patch(Watcher *w, const CachedFile *now, size_t *lines_out);
+static LineKind encode_alone(const char *line, size_t len, size_t lineno, Patch *patch);
+static const LineSpan *find_span(const Watcher *w, size_t lineno);
+static int compare_lineno(const void *a, const void *b);
+static size_t common_prefix(const char *a, const char *b, size_t len);
+static size_t common_suffix(const char *a_end, const char *b_end, size_t len);
+static bool include_changed(const Watcher *w, const CachedFile *main);
+static void watch_files(Watcher *w);
+static double watch_now(void);
+
+int run_watch(const char *in_name, const char *out_name, const AssembleOptions *opts)
+{
+    Watcher w = {.in_name = in_name, .out_name = out_name, .opts = *opts};
+    if (filecache_init(&w.cache) != 0)
+        return 1;
+    w.opts.cache = &w.cache;
+    w.opts.lines = &w.lines;
+    w.inotify = inotify_init1(IN_CLOEXEC);
+    if (w.inotify < 0)
+    {
+        fprintf(stderr, "Error: cannot watch '%s': %s\n", in_name, strerror(errno));
+        filecache_free(&w.cache);
+        return 1;
+    }
+
+    rebuild(&w);
+    filecache_open(&w.cache, in_name, &w.seen);
+    watch_files(&w);
+    while (true)
+    {
+        // one wakeup handles every event already queued, the stat calls below decide what changed
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        if (read(w.inotify, events, sizeof(events)) < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Error: cannot watch '%s': %s\n", in_name, strerror(errno));
+            break;
+        }
+        struct pollfd pfd = {.fd = w.inotify, .events = POLLIN};
+        while (poll(&pfd, 1, 0) > 0 && read(w.inotify, events, sizeof(events)) > 0)
+            ;
+
+        double t0 = watch_now();
+        const CachedFile *now = NULL;
+        if (filecache_open(&w.cache, in_name, &now) != 0)
+            continue; // mid-rename, the next event brings it back
+        bool includes = include_changed(&w, now);
+        if (now == w.seen && !includes)
+            continue; // the output file itself, or another file in the same directory
+        w.seen = now;
+
+        size_t patched = 0;
+        if (w.built && !includes && try_patch(&w, now, &patched) == 0)
+        {
+            printf("%s: patched %zu lines in %.3f ms\n", in_name, patched, (watch_now() - t0) * 1000.0);
+        }
+        else if (rebuild(&w) == 0)
+            printf("%s: reassembled in %.3f ms\n", in_name, (watch_now() - t0) * 1000.0);
+        fflush(stdout);
+
+        filecache_drop_stale(&w.cache);
+        watch_files(&w);
+    }
+
+    close(w.inotify);
+    free(w.lines.spans);
+    free(w.by_line);
+    free(w.text);
+    free(w.patches);
+    filecache_free(&w.cache);
+    return 1;
+}
+
+static int rebuild(Watcher *w)
+{
+    w->built = false;
+    const CachedFile *source = NULL;
+    if (assemble_file(w->in_name, w->out_name, &w->opts) != 0 || filecache_open(&w->cache, w->in_name, &source) != 0 ||
+        reserve((void **)&w->text, &w->text_cap, source->size + 1, 1) != 0 ||
+        reserve((void **)&w->by_line, &w->by_line_cap, w->lines.count + 1, sizeof *w->by_line) != 0)
+        return 1;
+    memcpy(w->text, source->data, source->size);
+    w->text_len = source->size;
+
+    // macro bodies replay with the line numbers of their definition, so spans are not in line order
+    w->by_line_count = 0;
+    for (size_t i = 0; i < w->lines.count; i++)
+    {
+        if (w->lines.spans[i].file == 0)
+            w->by_line[w->by_line_count++] = (LineIndex){.lineno = w->lines.spans[i].lineno, .span = (uint32_t)i};
+    }
+    qsort(w->by_line, w->by_line_count, sizeof *w->by_line, compare_lineno);
+    w->built = true;
+    return 0;
+}
+
+// Skips the lines both versions start and end with; what is left must pair up line for line.
+static int try_patch(Watcher *w, const CachedFile *now, size_t *lines_out)
+{
+    if (w->opts.listing_name)
+        return 1; // the listing would go stale
+
+    const char *a = w->text, *b = now->data;
+    size_t a_len = w->text_len, b_len = now->size;
+    size_t min = a_len < b_len ? a_len : b_len;
+
+    size_t head = common_prefix(a, b, min);
+    while (head > 0 && a[head - 1] != '\n')
+        head--;
+    size_t tail = common_suffix(a + a_len, b + b_len, min - head);
+    while (tail > 0 && !((a_len - tail == head || a[a_len - tail - 1] == '\n') &&
+                         (b_len - tail == head || b[b_len - tail - 1] == '\n')))
+        tail--;
+
+    size_t lineno = 1;
+    for (const char *p = a; (p = memchr(p, '\n', (size_t)(a + head - p))) != NULL; p++)
+        lineno++;
+
+    w->patch_count = 0;
+    const char *pa = a + head, *pb = b + head;
+    const char *ea = a + a_len - tail, *eb = b + b_len - tail;
+    size_t lines = 0;
+    for (; pa < ea || pb < eb; lineno++, lines++)
+    {
+        if (pa >= ea || pb >= eb)
+            return 1; // lines were added or removed, everything after them moves
+        const char *na = memchr(pa, '\n', (size_t)(ea - pa));
+        const char *nb = memchr(pb, '\n', (size_t)(eb - pb));
+        na = na ? na + 1 : ea;
+        nb = nb ? nb + 1 : eb;
+
+        // a line that was code must stay code of the same size, any other line must stay blank;
+        // the old text is checked too, a label it defined may still be referred to
+        const LineSpan *span = find_span(w, lineno);
+        Patch p = {0};
+        if (encode_alone(pa, (size_t)(na - pa), lineno, &p) != (span ? LINE_CODE : LINE_BLANK))
+            return 1;
+        LineKind kind = encode_alone(pb, (size_t)(nb - pb), lineno, &p);
+        if (span ? kind != LINE_CODE || p.size != span->size : kind != LINE_BLANK)
+            return 1;
+        if (span)
+        {
+            if (reserve((void **)&w->patches, &w->patch_cap, w->patch_count + 1, sizeof *w->patches) != 0)
+                return 1;
+            p.addr = span->addr;
+            w->patches[w->patch_count++] = p;
+        }
+        pa = na;
+        pb = nb;
+    }
+
+    int fd = open(w->out_name, O_WRONLY);
+    if (fd < 0)
+        return 1;
+    int result = 0;
+    for (size_t i = 0; i < w->patch_count && result == 0; i++)
+    {
+        const Patch *p = &w->patches[i];
+        if (pwrite(fd, p->bytes, p->size, p->addr) != (ssize_t)p->size)
+            result = 1;
+    }
+    if (close(fd) != 0)
+        result = 1;
+    if (result != 0)
+        return 1;
+
+    // the same length only needs the changed lines copied
+    if (a_len != b_len && reserve((void **)&w->text, &w->text_cap, b_len + 1, 1) != 0)
+        return 1;
+    if (a_len == b_len)
+        memcpy(w->text + head, b + head, b_len - tail - head);
+    else
+        memcpy(w->text, b, b_len);
+    w->text_len = b_len;
+    *lines_out = lines;
+    return 0;
+}
+
+// Encodes one line the way assemble_file would if nothing else could affect it: no names, so
+// no label, constant or macro, no directive and no branch. LINE_OTHER for anything more.
+static LineKind encode_alone(const char *line, size_t len, size_t lineno, Patch *patch)
+{
+    char text[LINE_LEN_MAX];
+    if (len >= sizeof(text))
+        return LINE_OTHER;
+    memcpy(text, line, len);
+    text[len] = '\0';
+
+    // a line that does not parse here gets its message from the full run
+    FILE *saved = diag_stream, *sink = fopen("/dev/null", "w");
+    diag_stream = sink;
+    LineKind kind = LINE_OTHER;
+    Token *tokens = NULL;
+    size_t token_count = 0;
+    if (!sink || tokenize_line(text, lineno, NULL, &tokens, &token_count) != 0)
+        goto done;
+    if (token_count == 0)
+    {
+        free(tokens);
+        kind = LINE_BLANK;
+        goto done;
+    }
+    for (size_t i = 0; i < token_count; i++)
+    {
+        if (tokens[i].type == T_IDENT || tokens[i].type == T_DIRECTIVE || tokens[i].type == T_COLON)
+        {
+            free_tokens(tokens, token_count);
+            goto done;
+        }
+    }
+
+    Instruction inst;
+    size_t size = 0;
+    if (parse_tokens(tokens, token_count, lineno, NULL, &inst) == 0 && !is_relative_branch(&inst) &&
+        encode_instruction(&inst, patch->bytes, &size, lineno) == 0)
+    {
+        patch->size = (uint8_t)size;
+        kind = LINE_CODE;
+    }
+
+done:
+    diag_stream = saved;
+    if (sink)
+        fclose(sink);
+    return kind;
+}
+
+// the span of a main-file line that assembled on its own, NULL for any other line
+static const LineSpan *find_span(const Watcher *w, size_t lineno)
+{
+    size_t lo = 0, hi = w->by_line_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->by_line[mid].lineno < lineno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == w->by_line_count || w->by_line[lo].lineno != lineno)
+        return NULL;
+    // a line with two spans was replayed or repeated
+    if (lo + 1 < w->by_line_count && w->by_line[lo + 1].lineno == lineno)
+        return NULL;
+    const LineSpan *s = &w->lines.spans[w->by_line[lo].span];
+    return s->patchable ? s : NULL;
+}
+
+static int compare_lineno(const void *a, const void *b)
+{
+    const LineIndex *x = a, *y = b;
+    return (x->lineno > y->lineno) - (x->lineno < y->lineno);
+}
+
+// memcmp finds a difference in a block far faster than a byte loop, which then places it
+static size_t common_prefix(const char *a, const char *b, size_t len)
+{
+    size_t n = 0;
+    while (n + 4096 <= len && memcmp(a + n, b + n, 4096) == 0)
+        n += 4096;
+    while (n < len && a[n] == b[n])
+        n++;
+    return n;
+}
+
+static size_t common_suffix(const char *a_end, const char *b_end, size_t len)
+{
+    size_t n = 0;
+    while (n + 4096 <= len && memcmp(a_end - n - 4096, b_end - n - 4096, 4096) == 0)
+        n += 4096;
+    while (n < len && *(a_end - n - 1) == *(b_end - n - 1))
+        n++;
+    return n;
+}
+
+static bool include_changed(const Watcher *w, const CachedFile *main)
+{
+    for (size_t i = 0; i < w->cache.count; i++)
+    {
+        const CachedFile *f = w->cache.files[i];
+        struct stat st;
+        if (f->stale || f == main)
+            continue;
+        if (stat(f->path, &st) != 0 || f->size != (size_t)st.st_size ||
+            f->mtime_ns != (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec)
+            return true;
+    }
+    return false;
+}
+
+// Directories rather than files: an editor that saves by renaming a new file over the old one
+// leaves a watch on the file pointing at the old inode.
+static void watch_files(Watcher *w)
+{
+    for (size_t i = 0; i < w->cache.count; i++)
+    {
+        char dir[4096];
+        const char *path = w->cache.files[i]->path;
+        const char *slash = strrchr(path, '/');
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path + (slash == path)) : 1, slash ? path : ".");
+        inotify_add_watch(w->inotify, dir, WATCH_EVENTS); // the same directory again is a no-op
+    }
+}
+
+static double watch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
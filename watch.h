@@ -0,0 +1,9 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "assembler.h" // for AssembleOptions
+
+// Assembles in_name, then reassembles whenever it or one of its includes changes, until killed.
+int run_watch(const char *in_name, const char *out_name, const AssembleOptions *opts);
+
+#endif